@@ -1,25 +1,54 @@
 #include "client.hpp"
 #include <QMessageBox>
 #include <QDateTime>
+#include <QStandardPaths>
 
-Client::Client(QWidget* parent) : QObject(parent), m_networkClient(new NetworkClient(this)), m_widget(new ClientWidget(parent)) {setupConnections();}
+Client::Client(QWidget* parent) : QObject(parent), m_networkClient(new NetworkClient(this)), m_widget(new ClientWidget(parent)),
+                                  m_cacheDirectory(QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/history") {
+    // Indexing runs in slices between events, so it never holds up incoming messages.
+    m_indexTimer.setSingleShot(true);
+    m_indexTimer.setInterval(0);
+    connect(&m_indexTimer, &QTimer::timeout, this, &Client::indexPendingMessages);
 
-Client::~Client() {m_networkClient->disconnectFromServer();}
+    setupConnections();
+}
+
+Client::~Client() {
+    m_networkClient->disconnectFromServer();
+    for (const Conversation& conversation : std::as_const(m_conversations)) {
+        delete conversation.cache;
+    }
+}
 
 void Client::setupConnections() {
     connect(m_widget, &ClientWidget::connectClicked, this, &Client::onConnectClicked);
     connect(m_widget, &ClientWidget::disconnectClicked, this, &Client::onDisconnectClicked);
     connect(m_widget, &ClientWidget::messageSent, this, &Client::onMessageSent);
+    connect(m_widget, &ClientWidget::typing, this, &Client::onTyping);
     connect(m_widget, &ClientWidget::changeInterlocutorRequested, this, &Client::onChangeInterlocutorRequested);
+    connect(m_widget, &ClientWidget::olderMessagesRequested, this, &Client::onOlderMessagesRequested);
+    connect(m_widget, &ClientWidget::searchRequested, this, &Client::onSearchRequested);
+    connect(m_widget, &ClientWidget::conversationRequested, this, &Client::onConversationRequested);
+    connect(m_widget, &ClientWidget::conversationOpened, this, &Client::openConversation);
+    connect(m_widget, &ClientWidget::conversationClosed, this, &Client::onConversationClosed);
 
     connect(m_networkClient, &NetworkClient::connected, this, &Client::onNetworkConnected);
     connect(m_networkClient, &NetworkClient::disconnected, this, &Client::onNetworkDisconnected);
+    connect(m_networkClient, &NetworkClient::reconnecting, this, &Client::onReconnecting);
+    connect(m_networkClient, &NetworkClient::sessionResumed, this, &Client::onSessionResumed);
     connect(m_networkClient, &NetworkClient::authenticationSuccess, this, &Client::onAuthSuccess);
     connect(m_networkClient, &NetworkClient::authenticationError, this, &Client::onAuthError);
     connect(m_networkClient, &NetworkClient::messageReceived, this, &Client::onMessageReceived);
+    connect(m_networkClient, &NetworkClient::messagesAcknowledged, this, &Client::onMessagesAcknowledged);
+    connect(m_networkClient, &NetworkClient::messagesDelivered, this, &Client::onMessagesDelivered);
     connect(m_networkClient, &NetworkClient::interlocutorConnected, this, &Client::onInterlocutorConnected);
     connect(m_networkClient, &NetworkClient::interlocutorDisconnected, this, &Client::onInterlocutorDisconnected);
     connect(m_networkClient, &NetworkClient::interlocutorOffline, this, &Client::onInterlocutorOffline);
+    connect(m_networkClient, &NetworkClient::conversationOffline, this, &Client::onConversationOffline);
+    connect(m_networkClient, &NetworkClient::encryptionEstablished, this, &Client::onEncryptionEstablished);
+    connect(m_networkClient, &NetworkClient::encryptionUnavailable, this, &Client::onEncryptionUnavailable);
+    connect(m_networkClient, &NetworkClient::messagesLost, this, &Client::onMessagesLost);
+    connect(m_networkClient, &NetworkClient::typingReceived, m_widget, &ClientWidget::showTyping);
     connect(m_networkClient, &NetworkClient::interlocutorChanged, this, &Client::onInterlocutorChanged);
     connect(m_networkClient, &NetworkClient::interlocutorChangeError, this, &Client::onInterlocutorChangeError);
     connect(m_networkClient, &NetworkClient::connectionError, this, &Client::onConnectionError);
@@ -34,19 +63,79 @@ void Client::validateInput(const QString& clientName, const QString& interlocuto
     }
 }
 
+void Client::parseServerAddress(const QString& serverAddress, QString& address, quint16& port) {
+    port = kDefaultPort;
+    if (serverAddress.startsWith("unix:")) {
+        address = serverAddress;
+        return;
+    }
+
+    QString prefix = serverAddress.startsWith("tls:") ? QString("tls:") : QString();
+    QString rest = serverAddress.mid(prefix.size());
+    QString host = rest;
+    QString portText;
+
+    if (rest.startsWith('[')) {
+        qsizetype close = rest.indexOf(']');
+        if (close < 0 || (close + 1 < rest.size() && rest[close + 1] != ':')) {
+            throw std::runtime_error("Invalid server address");
+        }
+        host = rest.mid(1, close - 1);
+        portText = rest.mid(close + 2);
+    } else if (rest.count(':') == 1) {
+        // More than one colon is a bare IPv6 address, which takes the default port.
+        host = rest.section(':', 0, 0);
+        portText = rest.section(':', 1);
+    }
+
+    if (host.isEmpty()) {
+        throw std::runtime_error("Invalid server address");
+    }
+    if (!portText.isEmpty() || rest.endsWith(':')) {
+        bool ok = false;
+        uint value = portText.toUInt(&ok);
+        if (!ok || value == 0 || value > 65535) {
+            throw std::runtime_error("Invalid server port");
+        }
+        port = static_cast<quint16>(value);
+    }
+    address = prefix + host;
+}
+
 void Client::onConnectClicked(const QString& serverAddress, const QString& clientName, const QString& interlocutorName) {
     try {
         validateInput(clientName, interlocutorName);
+        QString address;
+        quint16 port = kDefaultPort;
+        parseServerAddress(serverAddress, address, port);
 
         m_clientName = clientName;
         m_interlocutorName = interlocutorName;
 
-        if (m_networkClient->isConnected()) {
+        if (m_networkClient->isConnected() || m_networkClient->isReconnecting()) {
             m_networkClient->disconnectFromServer();
         } else {
-            if (m_networkClient->connectToServer(serverAddress, 5464)) {
+            // Caches belong to the signed-in user, so they are reopened for whoever connects.
+            for (const Conversation& conversation : std::as_const(m_conversations)) {
+                delete conversation.cache;
+            }
+            m_conversations.clear();
+
+            m_widget->setInterlocutorName(interlocutorName);
+            openConversation(interlocutorName);
+
+            m_networkClient->setPassword(m_widget->getPassword());
+            if (m_networkClient->connectToServer(address, port)) {
                 m_widget->setConnectionStatus(true, QString("Connecting to %1...").arg(serverAddress));
-                m_networkClient->sendAuthRequest(clientName, interlocutorName);
+
+                // A session kept from the last run only needs the messages received since then.
+                MessageCache* cache = cacheFor(interlocutorName);
+                QString sessionToken = cache ? cache->sessionToken() : QString();
+                if (!sessionToken.isEmpty()) {
+                    m_networkClient->sendResumeRequest(sessionToken, clientName, interlocutorName, cache->lastSeq());
+                } else {
+                    m_networkClient->sendAuthRequest(clientName, interlocutorName);
+                }
             } else {
                 QMessageBox::warning(m_widget, "Connection Error", "Failed to connect to server");
                 m_widget->setConnectionStatus(false);
@@ -57,16 +146,131 @@ void Client::onConnectClicked(const QString& serverAddress, const QString& clien
     }
 }
 
+MessageCache* Client::cacheFor(const QString& conversation) {
+    if (m_clientName.isEmpty() || conversation.isEmpty()) return nullptr;
+
+    Conversation& entry = m_conversations[conversation];
+    if (!entry.cache) {
+        entry.cache = new MessageCache(m_cacheDirectory);
+    }
+    if (!entry.cache->isOpen() && !entry.cache->open(m_clientName, conversation)) {
+        return nullptr;
+    }
+    return entry.cache;
+}
+
+// Shows the newest page of the cached history straight away; older pages load on scroll.
+void Client::openConversation(const QString& conversation) {
+    m_widget->clearConversation(conversation);
+    m_widget->setHasOlderMessages(conversation, false);
+
+    MessageCache* cache = cacheFor(conversation);
+    if (!cache) return;
+
+    const QList<MessageCache::Entry> entries = cache->page(cache->count());
+    for (const MessageCache::Entry& entry : entries) {
+        m_widget->appendConversationMessage(conversation, formatCachedMessage(entry));
+    }
+    m_conversations[conversation].shownFrom = cache->count() - entries.size();
+    m_widget->setHasOlderMessages(conversation, m_conversations[conversation].shownFrom > 0);
+    m_indexTimer.start();
+}
+
+void Client::onOlderMessagesRequested(const QString& conversation) {
+    MessageCache* cache = cacheFor(conversation);
+    if (!cache) return;
+
+    qint64& shownFrom = m_conversations[conversation].shownFrom;
+    const QList<MessageCache::Entry> entries = cache->page(shownFrom);
+    shownFrom -= entries.size();
+    m_widget->setHasOlderMessages(conversation, shownFrom > 0);
+
+    QStringList messages;
+    for (const MessageCache::Entry& entry : entries) {
+        messages.append(formatCachedMessage(entry));
+    }
+    m_widget->prependChatMessages(conversation, messages);
+}
+
+void Client::onConversationRequested(const QString& conversation) {
+    if (conversation == m_clientName) {
+        QMessageBox::warning(m_widget, "Error", "Cannot open a chat with yourself");
+        return;
+    }
+    m_widget->openConversationTab(conversation);
+}
+
+void Client::onConversationClosed(const QString& conversation) {
+    if (conversation == m_interlocutorName) return;
+    delete m_conversations.take(conversation).cache;
+}
+
+void Client::indexPendingMessages() {
+    bool pending = false;
+    for (const Conversation& conversation : std::as_const(m_conversations)) {
+        if (conversation.cache && conversation.cache->indexPending()) {
+            pending = true;
+        }
+    }
+    if (pending) {
+        m_indexTimer.start();
+    }
+}
+
+void Client::onSearchRequested(const QString& query) {
+    QString conversation = m_widget->currentConversation();
+    MessageCache* cache = cacheFor(conversation);
+    if (!cache) return;
+
+    const QList<MessageCache::SearchResult> results = cache->search(query, 0, kSearchResults);
+    m_widget->appendConversationMessage(conversation, QString("<font color='gray'>Search for \"%1\": %2 result(s)</font>")
+                                                          .arg(query.toHtmlEscaped()).arg(results.size()));
+    for (const MessageCache::SearchResult& result : results) {
+        m_widget->appendConversationMessage(conversation,
+                                            QString("<font color='gray'>%1</font>").arg(formatCachedMessage(result.entry)));
+    }
+}
+
+QString Client::formatCachedMessage(const MessageCache::Entry& entry) const {
+    QString sender = entry.sender == m_clientName ? QString("You") : entry.sender;
+    return QString("[%1] <b>%2:</b> %3").arg(entry.timestamp, sender, entry.text);
+}
+
 void Client::onDisconnectClicked() {
     m_networkClient->disconnectFromServer();
 }
 
 void Client::onMessageSent(const QString& text) {
-    m_networkClient->sendMessage(text);
+    // The paired interlocutor gets plain messages; other conversations name their recipient.
+    QString conversation = m_widget->currentConversation();
+    quint64 id = conversation == m_interlocutorName ? m_networkClient->sendMessage(text)
+                                                    : m_networkClient->sendMessage(text, conversation);
+    m_pendingMessages.insert(id, {conversation, text});
+}
 
+void Client::onTyping(const QString& conversation) {
+    if (conversation.isEmpty()) return;
+    m_networkClient->sendTyping(conversation == m_interlocutorName ? QString() : conversation);
+}
+
+void Client::onMessagesAcknowledged(quint64 upToId) {
     QString timestamp = QDateTime::currentDateTime().toString("hh:mm:ss");
-    QString formattedMessage = QString("[%1] <b>You:</b> %2").arg(timestamp, text);
-    m_widget->appendChatMessage(formattedMessage);
+
+    while (!m_pendingMessages.isEmpty() && m_pendingMessages.firstKey() <= upToId) {
+        const PendingMessage& message = m_pendingMessages.first();
+        QString formattedMessage = QString("[%1] <b>You:</b> %2").arg(timestamp, message.text);
+        m_widget->appendConversationMessage(message.conversation, formattedMessage);
+        if (MessageCache* cache = cacheFor(message.conversation)) {
+            cache->append({m_clientName, message.text, timestamp, m_networkClient->lastSeqFrom(message.conversation)});
+            m_indexTimer.start();
+        }
+        m_pendingMessages.erase(m_pendingMessages.begin());
+    }
+}
+
+void Client::onMessagesDelivered(quint64 upToId) {
+    Q_UNUSED(upToId);
+    m_widget->setDeliveryStatus(QString("Delivered at %1").arg(QDateTime::currentDateTime().toString("hh:mm:ss")));
 }
 
 void Client::onChangeInterlocutorRequested(const QString& newInterlocutor) {
@@ -89,10 +293,35 @@ void Client::onNetworkConnected() {
 void Client::onNetworkDisconnected() {
     m_widget->setConnectionStatus(false);
     m_widget->appendChatMessage("<font color='red'>Disconnected from the server</font>");
+
+    if (!m_pendingMessages.isEmpty()) {
+        m_widget->appendChatMessage(QString("<font color='orange'>%1 message(s) were not sent</font>").arg(m_pendingMessages.size()));
+        m_pendingMessages.clear();
+    }
+}
+
+void Client::onReconnecting(int attempt, int delayMs) {
+    Q_UNUSED(attempt);
+    m_widget->setConnectionStatus(true, QString("Connection lost, reconnecting in %1 s...").arg(qMax(1, delayMs / 1000)));
+}
+
+void Client::onSessionResumed(const QString& interlocutorName, bool interlocutorConnected) {
+    m_widget->setConnectionStatus(true, "Connected");
+    if (MessageCache* cache = cacheFor(m_interlocutorName)) {
+        cache->setSessionToken(m_networkClient->sessionToken());
+    }
+    if (!interlocutorName.isEmpty()) {
+        m_interlocutorName = interlocutorName;
+        m_widget->setInterlocutorName(interlocutorName);
+    }
+    m_widget->setMessageInputEnabled(interlocutorConnected);
 }
 
 void Client::onAuthSuccess(const QString& clientName, const QString& interlocutorName, bool interlocutorConnected) {
     m_widget->setConnectionStatus(true, "Connected");
+    if (MessageCache* cache = cacheFor(m_interlocutorName)) {
+        cache->setSessionToken(m_networkClient->sessionToken());
+    }
     m_widget->setChatEnabled(true);
     m_widget->setInterlocutorName(interlocutorName);
 
@@ -119,7 +348,19 @@ void Client::onAuthError(const QString& error) {
 
 void Client::onMessageReceived(const QString& sender, const QString& text, const QString& timestamp) {
     QString formattedMessage = QString("[%1] <b>%2:</b> %3").arg(timestamp, sender, text);
-    m_widget->appendChatMessage(formattedMessage);
+
+    // Server notices belong to the paired conversation and are not kept in the history.
+    if (sender == "System") {
+        m_widget->appendChatMessage(formattedMessage);
+        return;
+    }
+
+    m_widget->clearTyping(sender);
+    m_widget->appendConversationMessage(sender, formattedMessage);
+    if (MessageCache* cache = cacheFor(sender)) {
+        cache->append({sender, text, timestamp, m_networkClient->lastSeqFrom(sender)});
+        m_indexTimer.start();
+    }
 }
 
 void Client::onInterlocutorConnected(const QString& name) {
@@ -140,9 +381,35 @@ void Client::onInterlocutorOffline() {
     m_widget->appendChatMessage("<font color='blue'>Your message was not delivered</font>");
 }
 
+void Client::onConversationOffline(const QString& conversation) {
+    m_widget->appendConversationMessage(conversation, QString("<font color='orange'>%1 is offline, your message was not delivered</font>")
+                                                          .arg(conversation));
+}
+
+// The key is the same on both ends; reading it to each other over another channel shows that
+// no one swapped keys in between.
+void Client::onEncryptionEstablished(const QString& peer, const QString& fingerprint) {
+    m_widget->appendConversationMessage(peer, QString("<font color='green'>Messages with %1 are end-to-end encrypted (key %2)</font>")
+                                                  .arg(peer, fingerprint));
+}
+
+void Client::onMessagesLost(const QString& peer, quint64 count) {
+    m_widget->appendConversationMessage(peer, QString("<font color='red'>%1 messages from %2 were lost while you were away</font>")
+                                                  .arg(count).arg(peer));
+}
+
+void Client::onEncryptionUnavailable(const QString& peer) {
+    m_widget->appendConversationMessage(peer, QString("<font color='red'>%1 did not answer the key exchange; messages are not end-to-end encrypted</font>")
+                                                  .arg(peer));
+}
+
 void Client::onInterlocutorChanged(const QString& newInterlocutor, bool isConnected) {
     m_interlocutorName = newInterlocutor;
     m_widget->setInterlocutorName(newInterlocutor);
+    openConversation(newInterlocutor);
+    if (MessageCache* cache = cacheFor(newInterlocutor)) {
+        cache->setSessionToken(m_networkClient->sessionToken());
+    }
     m_widget->appendChatMessage(QString("<font color='green'>Interlocutor changed to %1</font>").arg(newInterlocutor));
 
     if (isConnected) {
@@ -1,7 +1,11 @@
 #pragma once
 #include <QObject>
+#include <QMap>
+#include <QHash>
+#include <QTimer>
 #include "network/network_client.hpp"
 #include "ui/client_widget.hpp"
+#include "storage/message_cache.hpp"
 
 class TestableClient;
 
@@ -10,6 +14,9 @@ class Client : public QObject {
     Q_OBJECT
 
 public:
+    static constexpr int kSearchResults = 20;
+    static constexpr quint16 kDefaultPort = 5464;
+
     explicit Client(QWidget* parent = nullptr);
     ~Client();
 
@@ -19,26 +26,60 @@ private slots:
     void onConnectClicked(const QString& serverAddress, const QString& clientName, const QString& interlocutorName);
     void onDisconnectClicked();
     void onMessageSent(const QString& text);
+    void onTyping(const QString& conversation);
     void onChangeInterlocutorRequested(const QString& newInterlocutor);
 
     void onNetworkConnected();
     void onNetworkDisconnected();
+    void onReconnecting(int attempt, int delayMs);
+    void onSessionResumed(const QString& interlocutorName, bool interlocutorConnected);
     void onAuthSuccess(const QString& clientName, const QString& interlocutorName, bool interlocutorConnected);
     void onAuthError(const QString& error);
     void onMessageReceived(const QString& sender, const QString& text, const QString& timestamp);
+    void onMessagesAcknowledged(quint64 upToId);
+    void onMessagesDelivered(quint64 upToId);
     void onInterlocutorConnected(const QString& name);
     void onInterlocutorDisconnected();
     void onInterlocutorOffline();
     void onInterlocutorChanged(const QString& newInterlocutor, bool isConnected);
     void onInterlocutorChangeError(const QString& error);
     void onConnectionError(const QString& error);
+    void onOlderMessagesRequested(const QString& conversation);
+    void onConversationRequested(const QString& conversation);
+    void onConversationClosed(const QString& conversation);
+    void onConversationOffline(const QString& conversation);
+    void onEncryptionEstablished(const QString& peer, const QString& fingerprint);
+    void onEncryptionUnavailable(const QString& peer);
+    void onMessagesLost(const QString& peer, quint64 count);
+    void onSearchRequested(const QString& query);
+    void indexPendingMessages();
 
 private:
     void validateInput(const QString& clientName, const QString& interlocutorName);
+    // Splits "host[:port]" ("[v6]:port" for IPv6); "tls:" and "unix:" prefixes are kept.
+    static void parseServerAddress(const QString& serverAddress, QString& address, quint16& port);
     void setupConnections();
+    void openConversation(const QString& conversation);
+    MessageCache* cacheFor(const QString& conversation);
+    QString formatCachedMessage(const MessageCache::Entry& entry) const;
 
     NetworkClient* m_networkClient;
     ClientWidget* m_widget;
     QString m_clientName;
     QString m_interlocutorName;
+    // Each open conversation keeps its cache, and how far back its tab has been filled from it.
+    struct Conversation {
+        MessageCache* cache = nullptr;
+        qint64 shownFrom = 0;
+    };
+
+    struct PendingMessage {
+        QString conversation;
+        QString text;
+    };
+
+    QMap<quint64, PendingMessage> m_pendingMessages;
+    QString m_cacheDirectory;
+    QHash<QString, Conversation> m_conversations;
+    QTimer m_indexTimer;
 };
@@ -0,0 +1,191 @@
+#include "e2e_session.hpp"
+#include <QCryptographicHash>
+#include <QtEndian>
+#include <cstring>
+
+#ifdef MESSENGER_HAVE_E2E
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+
+static const char kHkdfLabel[] = "messenger-e2e-v1";
+static constexpr int kKeySize = 32;
+static constexpr int kNonceSize = 12;
+
+E2eKeyPair::E2eKeyPair() {
+    EVP_PKEY_CTX* context = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+    if (context && EVP_PKEY_keygen_init(context) == 1) {
+        EVP_PKEY_keygen(context, &m_key);
+    }
+    EVP_PKEY_CTX_free(context);
+}
+
+E2eKeyPair::~E2eKeyPair() {
+    EVP_PKEY_free(m_key);
+}
+
+QByteArray E2eKeyPair::publicKey() const {
+    QByteArray key(kPublicKeySize, Qt::Uninitialized);
+    size_t size = key.size();
+    if (!m_key || EVP_PKEY_get_raw_public_key(m_key, reinterpret_cast<unsigned char*>(key.data()), &size) != 1) {
+        return QByteArray();
+    }
+    key.resize(static_cast<qsizetype>(size));
+    return key;
+}
+
+QByteArray E2eKeyPair::sharedSecret(const QByteArray& peerPublicKey) const {
+    if (!m_key || peerPublicKey.size() != kPublicKeySize) return QByteArray();
+
+    EVP_PKEY* peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr,
+                                                 reinterpret_cast<const unsigned char*>(peerPublicKey.constData()),
+                                                 peerPublicKey.size());
+    EVP_PKEY_CTX* context = EVP_PKEY_CTX_new(m_key, nullptr);
+
+    QByteArray secret(kPublicKeySize, Qt::Uninitialized);
+    size_t size = secret.size();
+    // Derivation fails on low-order peer keys, which would otherwise give an all-zero secret.
+    bool ok = peer && context && EVP_PKEY_derive_init(context) == 1 && EVP_PKEY_derive_set_peer(context, peer) == 1 &&
+              EVP_PKEY_derive(context, reinterpret_cast<unsigned char*>(secret.data()), &size) == 1;
+
+    EVP_PKEY_CTX_free(context);
+    EVP_PKEY_free(peer);
+    return ok ? secret.left(static_cast<qsizetype>(size)) : QByteArray();
+}
+
+static bool hkdf(const QByteArray& secret, const QByteArray& salt, const QByteArray& info, QByteArray& output) {
+    EVP_PKEY_CTX* context = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+    size_t size = output.size();
+    bool ok = context && EVP_PKEY_derive_init(context) == 1 &&
+              EVP_PKEY_CTX_set_hkdf_md(context, EVP_sha256()) == 1 &&
+              EVP_PKEY_CTX_set1_hkdf_salt(context, reinterpret_cast<const unsigned char*>(salt.constData()), salt.size()) == 1 &&
+              EVP_PKEY_CTX_set1_hkdf_key(context, reinterpret_cast<const unsigned char*>(secret.constData()), secret.size()) == 1 &&
+              EVP_PKEY_CTX_add1_hkdf_info(context, reinterpret_cast<const unsigned char*>(info.constData()), info.size()) == 1 &&
+              EVP_PKEY_derive(context, reinterpret_cast<unsigned char*>(output.data()), &size) == 1;
+    EVP_PKEY_CTX_free(context);
+    return ok && size == static_cast<size_t>(output.size());
+}
+
+bool E2eSession::isSupported() {
+    return true;
+}
+
+std::unique_ptr<E2eSession> E2eSession::establish(const E2eKeyPair& ours, const QByteArray& peerPublicKey,
+                                                  const QString& ourName, const QString& peerName) {
+    QByteArray secret = ours.sharedSecret(peerPublicKey);
+    if (secret.isEmpty()) return nullptr;
+
+    // Everything is put in a fixed order so both ends derive the same bytes: the lower key or
+    // name first. The first key then encrypts from the lower name to the higher one.
+    QByteArray ourKey = ours.publicKey();
+    bool weAreLow = ourName < peerName;
+    QByteArray keys = ourKey < peerPublicKey ? ourKey + peerPublicKey : peerPublicKey + ourKey;
+    QByteArray names = weAreLow ? ourName.toUtf8() + '\n' + peerName.toUtf8() : peerName.toUtf8() + '\n' + ourName.toUtf8();
+
+    QByteArray material(2 * kKeySize, Qt::Uninitialized);
+    if (!hkdf(secret, keys, QByteArray(kHkdfLabel) + '\n' + names, material)) return nullptr;
+
+    std::unique_ptr<E2eSession> session(new E2eSession());
+    QByteArray digest = QCryptographicHash::hash(keys, QCryptographicHash::Sha256);
+    session->m_keyId = digest.left(kKeyIdSize);
+    session->m_fingerprint = digest.mid(kKeyIdSize, 8);
+
+    const unsigned char* lowToHigh = reinterpret_cast<const unsigned char*>(material.constData());
+    const unsigned char* highToLow = lowToHigh + kKeySize;
+    session->m_sealContext = EVP_CIPHER_CTX_new();
+    session->m_openContext = EVP_CIPHER_CTX_new();
+    bool ok = session->m_sealContext && session->m_openContext &&
+              EVP_EncryptInit_ex(session->m_sealContext, EVP_aes_256_gcm(), nullptr, weAreLow ? lowToHigh : highToLow, nullptr) == 1 &&
+              EVP_DecryptInit_ex(session->m_openContext, EVP_aes_256_gcm(), nullptr, weAreLow ? highToLow : lowToHigh, nullptr) == 1;
+    std::memset(material.data(), 0, material.size());
+    std::memset(secret.data(), 0, secret.size());
+    if (!ok) return nullptr;
+    return session;
+}
+
+E2eSession::~E2eSession() {
+    EVP_CIPHER_CTX_free(m_sealContext);
+    EVP_CIPHER_CTX_free(m_openContext);
+}
+
+static void makeNonce(quint64 counter, unsigned char* nonce) {
+    std::memset(nonce, 0, kNonceSize - sizeof(quint64));
+    qToBigEndian(counter, nonce + kNonceSize - sizeof(quint64));
+}
+
+QByteArray E2eSession::seal(const QByteArray& plaintext, const QByteArray& associatedData) {
+    quint64 counter = m_sendCounter++;
+    unsigned char nonce[kNonceSize];
+    makeNonce(counter, nonce);
+
+    // One buffer for the whole frame; the cipher writes straight into it.
+    QByteArray sealed(kOverhead + plaintext.size(), Qt::Uninitialized);
+    unsigned char* out = reinterpret_cast<unsigned char*>(sealed.data());
+    std::memcpy(out, m_keyId.constData(), kKeyIdSize);
+    qToBigEndian(counter, out + kKeyIdSize);
+    unsigned char* body = out + kKeyIdSize + kCounterSize;
+
+    int length = 0;
+    bool ok = EVP_EncryptInit_ex(m_sealContext, nullptr, nullptr, nullptr, nonce) == 1 &&
+              EVP_EncryptUpdate(m_sealContext, nullptr, &length,
+                                reinterpret_cast<const unsigned char*>(associatedData.constData()), associatedData.size()) == 1 &&
+              EVP_EncryptUpdate(m_sealContext, body, &length,
+                                reinterpret_cast<const unsigned char*>(plaintext.constData()), plaintext.size()) == 1 &&
+              EVP_EncryptFinal_ex(m_sealContext, body + length, &length) == 1 &&
+              EVP_CIPHER_CTX_ctrl(m_sealContext, EVP_CTRL_GCM_GET_TAG, kTagSize, body + plaintext.size()) == 1;
+    return ok ? sealed : QByteArray();
+}
+
+bool E2eSession::open(const QByteArray& sealed, const QByteArray& associatedData, QByteArray& plaintext) {
+    if (sealed.size() < kOverhead || keyIdOf(sealed) != m_keyId) return false;
+
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(sealed.constData());
+    unsigned char nonce[kNonceSize];
+    makeNonce(qFromBigEndian<quint64>(in + kKeyIdSize), nonce);
+
+    const unsigned char* body = in + kKeyIdSize + kCounterSize;
+    qsizetype bodySize = sealed.size() - kOverhead;
+    plaintext.resize(bodySize);
+    unsigned char* out = reinterpret_cast<unsigned char*>(plaintext.data());
+
+    int length = 0;
+    // The tag is a const input; OpenSSL only takes it through a non-const pointer.
+    bool ok = EVP_DecryptInit_ex(m_openContext, nullptr, nullptr, nullptr, nonce) == 1 &&
+              EVP_DecryptUpdate(m_openContext, nullptr, &length,
+                                reinterpret_cast<const unsigned char*>(associatedData.constData()), associatedData.size()) == 1 &&
+              EVP_DecryptUpdate(m_openContext, out, &length, body, static_cast<int>(bodySize)) == 1 &&
+              EVP_CIPHER_CTX_ctrl(m_openContext, EVP_CTRL_GCM_SET_TAG, kTagSize, const_cast<unsigned char*>(body + bodySize)) == 1 &&
+              EVP_DecryptFinal_ex(m_openContext, out + length, &length) == 1;
+    if (!ok) {
+        plaintext.clear();
+    }
+    return ok;
+}
+
+#else
+
+E2eKeyPair::E2eKeyPair() {}
+E2eKeyPair::~E2eKeyPair() {}
+QByteArray E2eKeyPair::publicKey() const { return QByteArray(); }
+QByteArray E2eKeyPair::sharedSecret(const QByteArray&) const { return QByteArray(); }
+
+bool E2eSession::isSupported() {
+    return false;
+}
+
+std::unique_ptr<E2eSession> E2eSession::establish(const E2eKeyPair&, const QByteArray&, const QString&, const QString&) {
+    return nullptr;
+}
+
+E2eSession::~E2eSession() {}
+QByteArray E2eSession::seal(const QByteArray&, const QByteArray&) { return QByteArray(); }
+bool E2eSession::open(const QByteArray&, const QByteArray&, QByteArray&) { return false; }
+
+#endif
+
+QString E2eSession::fingerprint() const {
+    QString hex = QString::fromLatin1(m_fingerprint.toHex());
+    for (qsizetype i = hex.size() - 4; i > 0; i -= 4) {
+        hex.insert(i, ' ');
+    }
+    return hex;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <QByteArray>
+#include <QString>
+#include <memory>
+
+typedef struct evp_pkey_st EVP_PKEY;
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+// One X25519 key pair, made for a single exchange with a single peer and then thrown away.
+class E2eKeyPair {
+public:
+    static constexpr int kPublicKeySize = 32;
+
+    E2eKeyPair();
+    ~E2eKeyPair();
+    E2eKeyPair(const E2eKeyPair&) = delete;
+    E2eKeyPair& operator=(const E2eKeyPair&) = delete;
+
+    bool isValid() const { return m_key != nullptr; }
+    QByteArray publicKey() const;
+    QByteArray sharedSecret(const QByteArray& peerPublicKey) const;
+
+private:
+    EVP_PKEY* m_key = nullptr;
+};
+
+// AES-256-GCM between two clients, keyed from an X25519 exchange through HKDF-SHA256. Each
+// direction has its own key and counts its own nonces, so both ends can send at once. A sealed
+// message is keyId | counter | ciphertext | tag; the key id lets the receiver pick the session
+// when a new exchange overlaps messages still in flight under the old one. The cipher contexts
+// are keyed once and only re-nonced per message, so a seal costs the AES-NI/CLMUL pass plus a
+// few calls, not a key schedule.
+//
+// The public keys are not signed: this keeps the server from reading what it relays, but a
+// server that swaps keys during the exchange could sit in the middle. The fingerprint, the same
+// on both ends, is there to compare out of band.
+class E2eSession {
+public:
+    static constexpr int kKeyIdSize = 4;
+    static constexpr int kCounterSize = 8;
+    static constexpr int kTagSize = 16;
+    static constexpr int kOverhead = kKeyIdSize + kCounterSize + kTagSize;
+
+    // False when the client was built without libcrypto; peers then talk in plaintext.
+    static bool isSupported();
+
+    // Null if the peer's key is not a usable X25519 public key.
+    static std::unique_ptr<E2eSession> establish(const E2eKeyPair& ours, const QByteArray& peerPublicKey,
+                                                 const QString& ourName, const QString& peerName);
+    ~E2eSession();
+    E2eSession(const E2eSession&) = delete;
+    E2eSession& operator=(const E2eSession&) = delete;
+
+    QByteArray keyId() const { return m_keyId; }
+    QString fingerprint() const;
+    static QByteArray keyIdOf(const QByteArray& sealed) { return sealed.left(kKeyIdSize); }
+
+    // The associated data is authenticated but not sent; the receiver must supply the same bytes.
+    QByteArray seal(const QByteArray& plaintext, const QByteArray& associatedData);
+    bool open(const QByteArray& sealed, const QByteArray& associatedData, QByteArray& plaintext);
+
+private:
+    E2eSession() = default;
+
+    EVP_CIPHER_CTX* m_sealContext = nullptr;
+    EVP_CIPHER_CTX* m_openContext = nullptr;
+    QByteArray m_keyId;
+    QByteArray m_fingerprint;
+    quint64 m_sendCounter = 0;
+};
@@ -1,10 +1,38 @@
 #include "network_client.hpp"
 #include <QDataStream>
+#include <QtEndian>
 #include <QJsonDocument>
 #include <QJsonParseError>
+#include <QRandomGenerator>
+#include <QDateTime>
+#include <QStandardPaths>
+#include <QFileInfo>
+#include <QDir>
+#include <QTemporaryFile>
 #include <QDebug>
 
-NetworkClient::NetworkClient(QObject* parent): QObject(parent), m_socket(nullptr), m_messageSize(0), m_isAuthenticated(false) {}
+#ifndef QT_NO_SSL
+#include <QSslSocket>
+#endif
+
+NetworkClient::NetworkClient(QObject* parent): QObject(parent), m_socket(nullptr), m_messageSize(0), m_isAuthenticated(false),
+                                               m_port(0), m_nextMessageId(0), m_e2eEnabled(E2eSession::isSupported()), m_nextFileRef(0),
+                                               m_reconnectAttempt(0), m_migrateDelayMs(-1), m_ackPending(false), m_tlsEnabled(false),
+                                               m_transport(nullptr) {
+    m_reconnectTimer.setSingleShot(true);
+    connect(&m_reconnectTimer, &QTimer::timeout, this, &NetworkClient::attemptReconnect);
+
+    m_ackTimer.setSingleShot(true);
+    m_ackTimer.setInterval(kAckFlushDelayMs);
+    connect(&m_ackTimer, &QTimer::timeout, this, &NetworkClient::flushAcks);
+
+    // Everything passed to sendMessages during one event loop pass is packed into the same batches.
+    m_batchTimer.setSingleShot(true);
+    m_batchTimer.setInterval(0);
+    connect(&m_batchTimer, &QTimer::timeout, this, &NetworkClient::flushMessageBatch);
+
+    m_downloadDirectory = QStandardPaths::writableLocation(QStandardPaths::DownloadLocation);
+}
 
 NetworkClient::~NetworkClient() {disconnectFromServer();}
 
@@ -13,80 +41,260 @@ bool NetworkClient::connectToServer(const QString& address, quint16 port) {
         disconnectFromServer();
     }
 
-    m_socket = new QTcpSocket(this);
+    // "tls:host" is a shorthand for connecting with TLS against the system CA store. "unix:path"
+    // connects to a server on this host over a Unix domain socket; the port is then ignored.
+    QString host = address;
+    if (host.startsWith("tls:")) {
+        host = host.mid(4);
+#ifndef QT_NO_SSL
+        if (!m_tlsEnabled) {
+            setTlsEnabled(true);
+        }
+#endif
+    }
+
+#ifndef QT_NO_SSL
+    if (host != m_address || port != m_port) {
+        m_tlsSessionTicket.clear();
+    }
+#endif
+    m_address = host;
+    m_port = port;
+    createSocket();
+    openSocket();
+
+#ifndef QT_NO_SSL
+    if (QSslSocket* sslSocket = qobject_cast<QSslSocket*>(m_socket)) {
+        return sslSocket->waitForEncrypted(5000);
+    }
+#endif
+    return m_socket->waitForConnected(5000);
+}
+
+#ifndef QT_NO_SSL
+void NetworkClient::setTlsEnabled(bool enabled, const QList<QSslCertificate>& caCertificates) {
+    m_tlsEnabled = enabled;
+    m_tlsSessionTicket.clear();
+
+    m_tlsConfiguration = QSslConfiguration::defaultConfiguration();
+    m_tlsConfiguration.setProtocol(QSsl::TlsV1_2OrLater);
+    if (!caCertificates.isEmpty()) {
+        m_tlsConfiguration.setCaCertificates(caCertificates);
+    }
+    // Keeps the session ticket available, so reconnects can resume instead of doing a full handshake.
+    m_tlsConfiguration.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+}
+#endif
+
+void NetworkClient::openSocket() {
+#ifndef QT_NO_SSL
+    if (QSslSocket* sslSocket = qobject_cast<QSslSocket*>(m_socket)) {
+        sslSocket->connectToHostEncrypted(m_address, m_port);
+    }
+#endif
+}
+
+void NetworkClient::createSocket() {
+    if (m_socket) {
+        m_socket->disconnect(this);
+        m_socket->abort();
+        m_socket->deleteLater();
+    }
+
     m_messageSize = 0;
     m_isAuthenticated = false;
 
-    connect(m_socket, &QTcpSocket::connected, this, &NetworkClient::onConnected);
+    bool local = m_address.startsWith("unix:");
+
+#ifndef QT_NO_SSL
+    if (m_tlsEnabled && !local) {
+        QSslSocket* sslSocket = new QSslSocket(this);
+        QSslConfiguration configuration = m_tlsConfiguration;
+        if (!m_tlsSessionTicket.isEmpty()) {
+            configuration.setSessionTicket(m_tlsSessionTicket);
+        }
+        sslSocket->setSslConfiguration(configuration);
+
+        // TLS 1.2 hands the ticket out with the handshake, TLS 1.3 sends it afterwards.
+        auto storeTicket = [this, sslSocket]() {
+            QByteArray ticket = sslSocket->sslConfiguration().sessionTicket();
+            if (!ticket.isEmpty()) {
+                m_tlsSessionTicket = ticket;
+            }
+        };
+        connect(sslSocket, &QSslSocket::encrypted, this, storeTicket);
+        connect(sslSocket, &QSslSocket::newSessionTicketReceived, this, storeTicket);
+        connect(sslSocket, &QSslSocket::encrypted, this, &NetworkClient::onConnected);
+        connect(sslSocket, &QSslSocket::sslErrors, this, [](const QList<QSslError>& errors) {
+            qDebug() << "TLS errors:" << errors;
+        });
+        m_socket = sslSocket;
+    } else
+#endif
+    {
+        Transport* transport = m_transport ? m_transport : &m_tcpTransport;
+        if (local && !m_transport) {
+            transport = &m_localTransport;
+        }
+        m_socket = transport->connectTo(local ? m_address.mid(5) : m_address, m_port, this);
+        connect(m_socket, &QTcpSocket::connected, this, &NetworkClient::onConnected);
+    }
+
     connect(m_socket, &QTcpSocket::disconnected, this, &NetworkClient::onDisconnected);
     connect(m_socket, &QTcpSocket::readyRead, this, &NetworkClient::onReadyRead);
     connect(m_socket, &QTcpSocket::errorOccurred, this, &NetworkClient::onErrorOccurred);
-
-    m_socket->connectToHost(address, port);
-    return m_socket->waitForConnected(5000);
 }
 
 void NetworkClient::disconnectFromServer() {
+    bool wasReconnecting = isReconnecting();
+
+    m_reconnectTimer.stop();
+    m_ackTimer.stop();
+    m_batchTimer.stop();
+    m_pendingBatch = QJsonArray();
+    m_reconnectAttempt = 0;
+    m_sessionToken.clear();
+    m_lastSeq.clear();
+    m_lastTypingSent.clear();
+    m_e2ePeers.clear();
+    m_unackedSends.clear();
+    m_heldSends.clear();
+    abortFileTransfers();
+
     if (m_socket) {
+        if (wasReconnecting) {
+            m_socket->disconnect(this);
+        }
+        if (m_isAuthenticated) {
+            QJsonObject logoutObj;
+            logoutObj["type"] = "logout";
+            sendMessageWithSize(logoutObj);
+            m_socket->flush();
+        }
         m_socket->disconnectFromHost();
         m_socket->deleteLater();
         m_socket = nullptr;
     }
     m_isAuthenticated = false;
     m_messageSize = 0;
+
+    if (wasReconnecting) {
+        emit disconnected();
+    }
 }
 
 bool NetworkClient::isConnected() const {
     return m_socket && m_socket->state() == QAbstractSocket::ConnectedState;
 }
 
+bool NetworkClient::isReconnecting() const {
+    return m_reconnectAttempt > 0;
+}
+
+int NetworkClient::reconnectDelay(int attempt) {
+    // Exponential backoff with jitter, so that clients dropped together do not come back together.
+    int cap = kReconnectBaseDelayMs << qBound(0, attempt - 1, 6);
+    cap = qMin(cap, kReconnectMaxDelayMs);
+    return QRandomGenerator::global()->bounded(cap / 2, cap + 1);
+}
+
+void NetworkClient::scheduleReconnect() {
+    if (m_reconnectTimer.isActive()) return;
+
+    ++m_reconnectAttempt;
+    int delay = m_migrateDelayMs >= 0 ? m_migrateDelayMs : reconnectDelay(m_reconnectAttempt);
+    m_migrateDelayMs = -1;
+    qDebug() << "Reconnect attempt" << m_reconnectAttempt << "in" << delay << "ms";
+
+    m_reconnectTimer.start(delay);
+    emit reconnecting(m_reconnectAttempt, delay);
+}
+
+void NetworkClient::attemptReconnect() {
+    createSocket();
+    openSocket();
+}
+
 void NetworkClient::onConnected() {
+    if (isReconnecting() && !m_sessionToken.isEmpty()) {
+        sendResume();
+        return;
+    }
+
     emit connected();
 }
 
+void NetworkClient::sendResume() {
+    QJsonObject resumeObj;
+    resumeObj["type"] = "resume";
+    resumeObj["sessionToken"] = m_sessionToken;
+
+    QJsonObject lastSeq;
+    for (auto it = m_lastSeq.constBegin(); it != m_lastSeq.constEnd(); ++it) {
+        lastSeq[it.key()] = static_cast<qint64>(it.value());
+    }
+    resumeObj["lastSeq"] = lastSeq;
+
+    sendMessageWithSize(resumeObj);
+}
+
 void NetworkClient::onDisconnected() {
     m_isAuthenticated = false;
+
+    if (!m_sessionToken.isEmpty()) {
+        scheduleReconnect();
+        return;
+    }
+
     emit disconnected();
 }
 
 void NetworkClient::onReadyRead() {
-    if (!m_socket) return;
-
-    QDataStream in(m_socket);
-    in.setVersion(QDataStream::Qt_5_15);
+    // Prefix and payload are only consumed once complete, so a partial read never desynchronizes
+    // the stream; processing a frame may replace the socket, which ends the loop.
+    QTcpSocket* socket = m_socket;
+    while (socket && socket == m_socket) {
+        if (m_messageSize == 0) {
+            char prefix[sizeof(quint32)];
+            if (socket->bytesAvailable() < static_cast<qint64>(sizeof(prefix))) {
+                return;
+            }
+            socket->read(prefix, sizeof(prefix));
+            m_messageSize = qFromBigEndian<quint32>(prefix);
+            qDebug() << "Expecting message of size:" << m_messageSize;
+        }
 
-    if (m_messageSize == 0) {
-        if (m_socket->bytesAvailable() < static_cast<qint64>(sizeof(quint32))) {
+        if (m_messageSize > kMaxFrameSize) {
+            qDebug() << "Error: frame of" << m_messageSize << "bytes exceeds the limit, dropping connection";
+            m_messageSize = 0;
+            socket->abort();
             return;
         }
-        in >> m_messageSize;
-        qDebug() << "Expecting message of size:" << m_messageSize;
-    }
 
-    if (m_socket->bytesAvailable() < m_messageSize) {
-        return;
-    }
+        if (socket->bytesAvailable() < m_messageSize) {
+            return;
+        }
 
-    QByteArray data;
-    data.resize(m_messageSize);
-    int bytesRead = in.readRawData(data.data(), m_messageSize);
+        QByteArray data = socket->read(m_messageSize);
+        if (data.size() != static_cast<qsizetype>(m_messageSize)) {
+            qDebug() << "Error: Read" << data.size() << "bytes, expected" << m_messageSize;
+            m_messageSize = 0;
+            socket->abort();
+            return;
+        }
 
-    if (bytesRead != m_messageSize) {
-        qDebug() << "Error: Read" << bytesRead << "bytes, expected" << m_messageSize;
+        qDebug() << "Received message, size:" << m_messageSize;
         m_messageSize = 0;
-        return;
-    }
-
-    qDebug() << "Received message, size:" << m_messageSize;
-    processServerMessage(data);
-    m_messageSize = 0;
-
-    if (m_socket->bytesAvailable() > 0) {
-        onReadyRead();
+        processServerMessage(data);
     }
 }
 
 void NetworkClient::processServerMessage(const QByteArray& data) {
+    if (FileChunk::isChunk(data)) {
+        processFileChunk(data);
+        return;
+    }
+
     QJsonParseError parseError;
     QJsonDocument doc = QJsonDocument::fromJson(data, &parseError);
 
@@ -102,9 +310,34 @@ void NetworkClient::processServerMessage(const QByteArray& data) {
         QString clientName = message["clientName"].toString();
         QString interlocutorName = message["interlocutorName"].toString();
         bool interlocutorConnected = message["interlocutorConnected"].toBool();
+        m_sessionToken = message["sessionToken"].toString();
         m_isAuthenticated = true;
+        m_reconnectAttempt = 0;
+        retransmitUnacked();
         emit authenticationSuccess(clientName, interlocutorName, interlocutorConnected);
     }
+    else if (type == "resume_success") {
+        QString interlocutorName = message["interlocutorName"].toString();
+        bool interlocutorConnected = message["interlocutorConnected"].toBool();
+        m_sessionToken = message["sessionToken"].toString();
+        m_isAuthenticated = true;
+        m_reconnectAttempt = 0;
+
+        // Ids at or below the mark count as duplicates on the server, so new ones go above it even
+        // when the session was stored by an earlier run whose counter started over.
+        quint64 ackedUpTo = static_cast<quint64>(message["ackedUpTo"].toInteger());
+        m_nextMessageId = qMax(m_nextMessageId, ackedUpTo);
+        acknowledgeSends(ackedUpTo);
+        retransmitUnacked();
+
+        emit sessionResumed(interlocutorName, interlocutorConnected);
+    }
+    else if (type == "resume_error") {
+        qDebug() << "Session resume failed:" << message["message"].toString() << "- authenticating again";
+        m_sessionToken.clear();
+        m_lastSeq.clear();
+        sendAuthRequest(m_clientName, m_interlocutorName);
+    }
     else if (type == "auth_error") {
         QString error = message["message"].toString();
         emit authenticationError(error);
@@ -113,27 +346,116 @@ void NetworkClient::processServerMessage(const QByteArray& data) {
         QString sender = message["sender"].toString();
         QString text = message["text"].toString();
         QString timestamp = message["timestamp"].toString();
+        bool encrypted = message["encrypted"].toBool();
+
+        if (message.contains("seq")) {
+            quint64 seq = static_cast<quint64>(message["seq"].toInteger());
+            quint64& lastSeq = m_lastSeq[sender];
+            if (seq <= lastSeq) {
+                qDebug() << "Dropping duplicate message" << seq << "from" << sender;
+                return;
+            }
+            if (seq != lastSeq + 1) {
+                qDebug() << "Gap in messages from" << sender << ": expected" << lastSeq + 1 << "got" << seq;
+            }
+            lastSeq = seq;
+
+            m_ackPending = true;
+            if (!m_ackTimer.isActive()) {
+                m_ackTimer.start();
+            }
+        }
+
+        // Opened only once the seq is known to be new, so a replayed frame is dropped unread.
+        if (encrypted) {
+            text = openText(sender, text);
+        } else if (isEncryptedWith(sender)) {
+            // The peer seals everything now, so this can only have been made up on the way.
+            qDebug() << "Rejected an unencrypted message from" << sender;
+            text = "[Unencrypted message rejected]";
+        }
         emit messageReceived(sender, text, timestamp);
     }
+    else if (type == "gap") {
+        // The server could not keep these for us; the next message continues after them.
+        QString peer = message["peer"].toString();
+        quint64 upTo = static_cast<quint64>(message["upTo"].toInteger());
+        quint64& lastSeq = m_lastSeq[peer];
+        if (upTo > lastSeq) {
+            quint64 lost = upTo - lastSeq;
+            lastSeq = upTo;
+            m_ackPending = true;
+            if (!m_ackTimer.isActive()) {
+                m_ackTimer.start();
+            }
+            qDebug() << lost << "messages from" << peer << "were lost";
+            emit messagesLost(peer, lost);
+        }
+    }
+    else if (type == "migrate") {
+        // The server is draining; it closes the link itself and we come back after the given delay.
+        m_migrateDelayMs = message["retryAfterMs"].toInt();
+        qDebug() << "Server is draining, reconnecting in" << m_migrateDelayMs << "ms";
+    }
+    else if (type == "ack") {
+        acknowledgeSends(static_cast<quint64>(message["upTo"].toInteger()));
+    }
+    else if (type == "delivered") {
+        emit messagesDelivered(static_cast<quint64>(message["upTo"].toInteger()));
+    }
+    else if (type == "batch_rejected") {
+        quint64 batchId = static_cast<quint64>(message["id"].toInteger());
+        if (message.contains("error")) {
+            emit messageBatchRejected(batchId, QString(), message["error"].toString());
+        }
+        const QJsonArray rejected = message["rejected"].toArray();
+        for (const QJsonValue& value : rejected) {
+            QJsonObject rejection = value.toObject();
+            emit messageBatchRejected(batchId, rejection["to"].toString(), rejection["error"].toString());
+        }
+    }
     else if (type == "interlocutor_connected") {
         QString interlocutorName = message["interlocutorName"].toString();
+        if (m_e2eEnabled) {
+            startKeyExchange(interlocutorName);
+        }
         emit interlocutorConnected(interlocutorName);
     }
     else if (type == "interlocutor_disconnected") {
         emit interlocutorDisconnected();
     }
     else if (type == "interlocutor_offline") {
-        emit interlocutorOffline();
+        if (message.contains("conversation")) {
+            emit conversationOffline(message["conversation"].toString());
+        } else {
+            emit interlocutorOffline();
+        }
+    }
+    else if (type == "typing") {
+        emit typingReceived(message["sender"].toString());
+    }
+    else if (type == "key_exchange") {
+        processKeyExchange(message);
     }
     else if (type == "interlocutor_changed") {
         QString newInterlocutor = message["newInterlocutor"].toString();
+        m_interlocutorName = newInterlocutor;
+        if (message.contains("sessionToken")) {
+            m_sessionToken = message["sessionToken"].toString();
+        }
         bool isConnected = message["interlocutorConnected"].toBool();
+        if (isConnected && m_e2eEnabled) {
+            startKeyExchange(newInterlocutor);
+        }
         emit interlocutorChanged(newInterlocutor, isConnected);
     }
     else if (type == "interlocutor_change_error") {
         QString error = message["message"].toString();
         emit interlocutorChangeError(error);
     }
+    else if (type.startsWith("file_")) {
+        processFileMessage(type, message);
+    }
 }
 
 void NetworkClient::sendMessageWithSize(const QJsonObject& jsonObj) {
@@ -154,18 +476,282 @@ void NetworkClient::sendMessageWithSize(const QJsonObject& jsonObj) {
 }
 
 void NetworkClient::sendAuthRequest(const QString& clientName, const QString& interlocutorName) {
+    m_clientName = clientName;
+    m_interlocutorName = interlocutorName;
+
     QJsonObject authObj;
     authObj["type"] = "auth";
     authObj["clientName"] = clientName;
     authObj["interlocutorName"] = interlocutorName;
+    if (!m_password.isEmpty()) {
+        authObj["password"] = m_password;
+    }
     sendRawJson(authObj);
 }
 
-void NetworkClient::sendMessage(const QString& text) {
+void NetworkClient::sendResumeRequest(const QString& sessionToken, const QString& clientName,
+                                      const QString& interlocutorName, quint64 lastSeq) {
+    m_clientName = clientName;
+    m_interlocutorName = interlocutorName;
+    m_sessionToken = sessionToken;
+    m_lastSeq.clear();
+    if (lastSeq > 0) {
+        m_lastSeq[interlocutorName] = lastSeq;
+    }
+    sendResume();
+}
+
+quint64 NetworkClient::sendMessage(const QString& text, const QString& recipient) {
+    quint64 id = ++m_nextMessageId;
+
+    QString peer = recipient.isEmpty() ? m_interlocutorName : recipient;
     QJsonObject messageObj;
     messageObj["type"] = "message";
-    messageObj["text"] = text;
-    sendRawJson(messageObj);
+    messageObj["id"] = static_cast<qint64>(id);
+    if (!recipient.isEmpty()) {
+        messageObj["to"] = recipient;
+    }
+
+    // Everything after a held message waits behind it, so ids still reach the server in order.
+    if (!m_heldSends.isEmpty() || isExchangePending(peer)) {
+        messageObj["text"] = text;
+        m_heldSends.append({peer, messageObj});
+        return id;
+    }
+
+    sealText(peer, text, messageObj);
+    transmit(id, messageObj);
+    return id;
+}
+
+// Kept until the server acks it; while reconnecting it goes out with the retransmission.
+void NetworkClient::transmit(quint64 id, const QJsonObject& json) {
+    m_unackedSends.insert(id, json);
+    if (m_isAuthenticated || !isReconnecting()) {
+        sendRawJson(json);
+    }
+}
+
+void NetworkClient::sendTyping(const QString& recipient) {
+    if (!m_isAuthenticated || !isConnected()) return;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64& lastSent = m_lastTypingSent[recipient];
+    if (now - lastSent < kTypingIntervalMs) return;
+    lastSent = now;
+
+    QJsonObject typingObj;
+    typingObj["type"] = "typing";
+    if (!recipient.isEmpty()) {
+        typingObj["to"] = recipient;
+    }
+    sendMessageWithSize(typingObj);
+}
+
+void NetworkClient::sendMessages(const QList<OutgoingMessage>& messages) {
+    for (const OutgoingMessage& message : messages) {
+        // Sealed when the batch is cut, so an exchange that completes meanwhile still counts.
+        QJsonObject entry;
+        entry["to"] = message.recipient;
+        entry["text"] = message.text;
+        m_pendingBatch.append(entry);
+    }
+
+    if (!m_pendingBatch.isEmpty() && !m_batchTimer.isActive()) {
+        m_batchTimer.start();
+    }
+}
+
+void NetworkClient::flushMessageBatch() {
+    // Waits with the held messages; releaseHeldSends flushes it once they are out.
+    if (!m_heldSends.isEmpty()) return;
+    for (const QJsonValue& entry : std::as_const(m_pendingBatch)) {
+        if (isExchangePending(entry["to"].toString())) return;
+    }
+
+    qsizetype next = 0;
+    while (next < m_pendingBatch.size()) {
+        // A batch ends at kMaxBatchEntries or kMaxBatchBytes, whichever comes first.
+        QJsonArray entries;
+        qsizetype bytes = 0;
+        while (next < m_pendingBatch.size() && entries.size() < kMaxBatchEntries) {
+            QJsonObject entry = m_pendingBatch[next].toObject();
+            sealText(entry["to"].toString(), entry["text"].toString(), entry);
+            qsizetype entryBytes = QJsonDocument(entry).toJson(QJsonDocument::Compact).size() + 1;
+            if (entryBytes > kMaxBatchBytes) {
+                // No frame could carry it: the server drops the connection, and the retransmission would too.
+                emit messageBatchRejected(0, entry["to"].toString(), "Message too large");
+                ++next;
+                continue;
+            }
+            if (bytes + entryBytes > kMaxBatchBytes) break;
+
+            entries.append(entry);
+            bytes += entryBytes;
+            ++next;
+        }
+        if (entries.isEmpty()) continue;
+
+        quint64 id = ++m_nextMessageId;
+        QJsonObject batchObj;
+        batchObj["type"] = "message_batch";
+        batchObj["id"] = static_cast<qint64>(id);
+        batchObj["messages"] = entries;
+
+        // Tracked like a single message, so a batch cut off by a reconnect goes out again as a whole.
+        transmit(id, batchObj);
+    }
+    m_pendingBatch = QJsonArray();
+}
+
+void NetworkClient::acknowledgeSends(quint64 upToId) {
+    bool acknowledged = false;
+    while (!m_unackedSends.isEmpty() && m_unackedSends.firstKey() <= upToId) {
+        m_unackedSends.erase(m_unackedSends.begin());
+        acknowledged = true;
+    }
+
+    if (acknowledged) {
+        emit messagesAcknowledged(upToId);
+    }
+}
+
+void NetworkClient::retransmitUnacked() {
+    if (m_unackedSends.isEmpty()) return;
+
+    qDebug() << "Retransmitting" << m_unackedSends.size() << "unacknowledged messages";
+    for (const QJsonObject& json : std::as_const(m_unackedSends)) {
+        sendRawJson(json);
+    }
+}
+
+void NetworkClient::setEndToEndEnabled(bool enabled) {
+    m_e2eEnabled = enabled && E2eSession::isSupported();
+    if (!m_e2eEnabled) {
+        m_e2ePeers.clear();
+        releaseHeldSends();
+    }
+}
+
+bool NetworkClient::isEncryptedWith(const QString& peer) const {
+    auto it = m_e2ePeers.constFind(peer);
+    return it != m_e2ePeers.constEnd() && it->current;
+}
+
+void NetworkClient::startKeyExchange(const QString& peer) {
+    if (!m_e2eEnabled || peer.isEmpty()) return;
+
+    // The current session keeps sealing until the peer answers, so nothing goes out in the clear.
+    E2ePeer& state = m_e2ePeers[peer];
+    state.keyPair = std::make_shared<E2eKeyPair>();
+    state.peerKey.clear();
+    qint64 offeredAt = QDateTime::currentMSecsSinceEpoch();
+    state.offeredAt = offeredAt;
+    sendPublicKey(peer, state.keyPair->publicKey(), false);
+
+    QTimer::singleShot(kKeyExchangeTimeoutMs, this, [this, peer, offeredAt]() {
+        auto it = m_e2ePeers.find(peer);
+        if (it == m_e2ePeers.end() || it->current || it->offeredAt != offeredAt) return;
+        it->offeredAt = 0;
+        qDebug() << "No answer to the key exchange with" << peer << "- sending in the clear";
+        emit encryptionUnavailable(peer);
+        releaseHeldSends();
+    });
+}
+
+// Only the first exchange holds messages back: on a re-key the current session keeps sealing.
+bool NetworkClient::isExchangePending(const QString& peer) const {
+    auto it = m_e2ePeers.constFind(peer);
+    return m_e2eEnabled && it != m_e2ePeers.constEnd() && !it->current && it->offeredAt > 0;
+}
+
+void NetworkClient::releaseHeldSends() {
+    while (!m_heldSends.isEmpty() && !isExchangePending(m_heldSends.first().peer)) {
+        HeldSend held = m_heldSends.takeFirst();
+        sealText(held.peer, held.json["text"].toString(), held.json);
+        transmit(static_cast<quint64>(held.json["id"].toInteger()), held.json);
+    }
+    if (m_heldSends.isEmpty() && !m_pendingBatch.isEmpty()) {
+        flushMessageBatch();
+    }
+}
+
+// An offer (ack false) means the peer has a fresh key pair; it is answered with ours, made anew
+// unless the one we hold has not been used yet, which is the case when both sides offered at
+// once. An answer (ack true) completes an exchange we started. Either way the same key twice
+// is ignored.
+void NetworkClient::processKeyExchange(const QJsonObject& message) {
+    if (!m_e2eEnabled) return;
+
+    QString sender = message["sender"].toString();
+    QByteArray peerKey = QByteArray::fromBase64(message["publicKey"].toString().toLatin1());
+    bool ack = message["ack"].toBool();
+    if (sender.isEmpty()) return;
+
+    E2ePeer& state = m_e2ePeers[sender];
+    if (peerKey == state.peerKey) return;
+    if (!ack && (!state.keyPair || !state.peerKey.isEmpty())) {
+        state.keyPair = std::make_shared<E2eKeyPair>();
+    }
+    if (!state.keyPair) return;
+
+    std::shared_ptr<E2eSession> session = E2eSession::establish(*state.keyPair, peerKey, m_clientName, sender);
+    if (!session) {
+        qDebug() << "Rejected the public key of" << sender;
+        return;
+    }
+
+    state.peerKey = peerKey;
+    state.previous = state.current;
+    state.current = session;
+    if (!ack) {
+        sendPublicKey(sender, state.keyPair->publicKey(), true);
+    }
+    qDebug() << "End-to-end session with" << sender << "established";
+    emit encryptionEstablished(sender, session->fingerprint());
+    releaseHeldSends();
+}
+
+void NetworkClient::sendPublicKey(const QString& peer, const QByteArray& publicKey, bool ack) {
+    QJsonObject keyObj;
+    keyObj["type"] = "key_exchange";
+    keyObj["to"] = peer;
+    keyObj["publicKey"] = QString::fromLatin1(publicKey.toBase64());
+    keyObj["ack"] = ack;
+    sendMessageWithSize(keyObj);
+}
+
+// The sender and recipient names are bound into the seal, so the server cannot pass a message
+// off as coming from someone else or hand it to another conversation.
+void NetworkClient::sealText(const QString& peer, const QString& text, QJsonObject& messageObj) {
+    auto it = m_e2ePeers.find(peer);
+    if (it == m_e2ePeers.end() || !it->current) {
+        messageObj["text"] = text;
+        return;
+    }
+
+    QByteArray sealed = it->current->seal(text.toUtf8(), m_clientName.toUtf8() + '\n' + peer.toUtf8());
+    messageObj["text"] = QString::fromLatin1(sealed.toBase64());
+    messageObj["encrypted"] = true;
+}
+
+QString NetworkClient::openText(const QString& sender, const QString& text) {
+    QByteArray sealed = QByteArray::fromBase64(text.toLatin1());
+    QByteArray associatedData = sender.toUtf8() + '\n' + m_clientName.toUtf8();
+
+    auto it = m_e2ePeers.constFind(sender);
+    if (it != m_e2ePeers.constEnd()) {
+        QByteArray keyId = E2eSession::keyIdOf(sealed);
+        QByteArray plaintext;
+        for (const std::shared_ptr<E2eSession>& session : {it->current, it->previous}) {
+            if (session && session->keyId() == keyId && session->open(sealed, associatedData, plaintext)) {
+                return QString::fromUtf8(plaintext);
+            }
+        }
+    }
+
+    qDebug() << "Could not decrypt a message from" << sender;
+    return "[Encrypted message could not be decrypted]";
 }
 
 void NetworkClient::changeInterlocutor(const QString& newInterlocutor) {
@@ -179,9 +765,303 @@ void NetworkClient::sendRawJson(const QJsonObject& json) {
     sendMessageWithSize(json);
 }
 
+void NetworkClient::flushAcks() {
+    if (!m_ackPending || !m_isAuthenticated) return;
+
+    QJsonObject acks;
+    for (auto it = m_lastSeq.constBegin(); it != m_lastSeq.constEnd(); ++it) {
+        acks[it.key()] = static_cast<qint64>(it.value());
+    }
+
+    QJsonObject receivedObj;
+    receivedObj["type"] = "received";
+    receivedObj["acks"] = acks;
+    sendRawJson(receivedObj);
+    m_ackPending = false;
+}
+
 void NetworkClient::onErrorOccurred(QAbstractSocket::SocketError error) {
     Q_UNUSED(error);
+    if (!m_sessionToken.isEmpty()) {
+        // The session is resumable: a dropped link is handled in onDisconnected(), and a failed
+        // reconnect attempt never reaches disconnected(), so back off from here instead.
+        if (isReconnecting()) {
+            scheduleReconnect();
+        }
+        return;
+    }
     if (m_socket) {
         emit connectionError(m_socket->errorString());
     }
 }
+
+quint64 NetworkClient::sendFile(const QString& path) {
+    QFile* file = new QFile(path, this);
+    if (!file->open(QIODevice::ReadOnly)) {
+        qDebug() << "Cannot open" << path << "for sending:" << file->errorString();
+        delete file;
+        return 0;
+    }
+
+    quint64 ref = ++m_nextFileRef;
+    OutgoingFile outgoing;
+    outgoing.file = file;
+    outgoing.size = file->size();
+    m_outgoingFiles.insert(ref, outgoing);
+
+    QJsonObject offerObj;
+    offerObj["type"] = "file_offer";
+    offerObj["ref"] = static_cast<qint64>(ref);
+    offerObj["name"] = QFileInfo(path).fileName();
+    offerObj["size"] = outgoing.size;
+    sendRawJson(offerObj);
+    return ref;
+}
+
+void NetworkClient::cancelFile(quint64 ref) {
+    auto it = m_outgoingFiles.constFind(ref);
+    if (it == m_outgoingFiles.constEnd()) return;
+
+    if (it->transferId != 0) {
+        QJsonObject cancelObj;
+        cancelObj["type"] = "file_cancel";
+        cancelObj["transferId"] = static_cast<qint64>(it->transferId);
+        sendRawJson(cancelObj);
+    }
+    dropOutgoingFile(ref);
+}
+
+void NetworkClient::processFileMessage(const QString& type, const QJsonObject& message) {
+    quint64 transferId = static_cast<quint64>(message["transferId"].toInteger());
+    quint64 ref = message.contains("ref") ? static_cast<quint64>(message["ref"].toInteger())
+                                          : m_outgoingRefs.value(transferId);
+
+    if (type == "file_ready") {
+        auto it = m_outgoingFiles.find(ref);
+        if (it == m_outgoingFiles.end()) return;
+
+        // Sent for a new transfer and again after a reconnect, from what the receiver has saved.
+        it->transferId = transferId;
+        it->sent = it->acked = message["offset"].toInteger();
+        m_outgoingRefs[transferId] = ref;
+        pumpFile(ref);
+    }
+    else if (type == "file_progress") {
+        auto it = m_outgoingFiles.find(ref);
+        if (it == m_outgoingFiles.end()) return;
+
+        it->acked = qMax(it->acked, message["offset"].toInteger());
+        emit fileSendProgress(ref, it->acked, it->size);
+        if (it->acked == it->size) {
+            dropOutgoingFile(ref);
+            emit fileSent(ref);
+        } else {
+            pumpFile(ref);
+        }
+    }
+    else if (type == "file_offer") {
+        receiveFileOffer(message);
+    }
+    else if (type == "file_resume") {
+        auto it = m_incomingFiles.find(transferId);
+        if (it == m_incomingFiles.end() || !it->file) return;
+
+        // Whatever arrived after the last confirmed offset is sent again.
+        qint64 offset = qMin(message["offset"].toInteger(), it->received);
+        it->file->resize(offset);
+        it->file->seek(offset);
+        it->received = it->ackedAt = offset;
+    }
+    else if (type == "file_error") {
+        QString error = message["error"].toString();
+        if (m_outgoingFiles.contains(ref)) {
+            dropOutgoingFile(ref);
+            emit fileSendFailed(ref, error);
+        } else if (m_incomingFiles.contains(transferId)) {
+            dropIncomingFile(transferId);
+            emit fileReceiveFailed(transferId, error);
+        }
+    }
+}
+
+// Each chunk is read from the file straight into the frame that goes to the socket. The window
+// caps what is buffered on the way; acknowledgements from the receiver open it again.
+void NetworkClient::pumpFile(quint64 ref) {
+    auto it = m_outgoingFiles.find(ref);
+    if (it == m_outgoingFiles.end() || it->transferId == 0 || !m_isAuthenticated || !isConnected()) return;
+
+    const qsizetype headerSize = static_cast<qsizetype>(sizeof(quint32)) + FileChunk::kHeaderSize;
+    while (it->sent < it->size && it->sent - it->acked < FileChunk::kWindowBytes) {
+        qint64 length = qMin(FileChunk::kMaxDataSize, it->size - it->sent);
+        length = qMin(length, it->acked + FileChunk::kWindowBytes - it->sent);
+
+        QByteArray frame(headerSize + length, Qt::Uninitialized);
+        qToBigEndian(static_cast<quint32>(FileChunk::kHeaderSize + length), frame.data());
+        FileChunk::writeHeader(frame.data() + sizeof(quint32), it->transferId, it->sent);
+
+        if (!it->file->seek(it->sent) || it->file->read(frame.data() + headerSize, length) != length) {
+            QString error = it->file->errorString();
+            cancelFile(ref);
+            emit fileSendFailed(ref, error);
+            return;
+        }
+
+        m_socket->write(frame);
+        it->sent += length;
+    }
+}
+
+void NetworkClient::receiveFileOffer(const QJsonObject& offer) {
+    quint64 transferId = static_cast<quint64>(offer["transferId"].toInteger());
+    // The server offers again what is still unanswered after a resume.
+    if (m_incomingFiles.contains(transferId)) return;
+
+    QString name = QFileInfo(offer["name"].toString()).fileName();
+    qint64 size = offer["size"].toInteger(-1);
+    if (name.isEmpty() || size < 0 || size > m_maxIncomingFileSize) {
+        qDebug() << "Declining incoming file" << name << "of" << size << "bytes";
+        QJsonObject cancelObj;
+        cancelObj["type"] = "file_cancel";
+        cancelObj["transferId"] = static_cast<qint64>(transferId);
+        sendRawJson(cancelObj);
+        emit fileReceiveFailed(transferId, size > m_maxIncomingFileSize ? "File too large" : "Invalid file offer");
+        return;
+    }
+
+    IncomingFile incoming;
+    incoming.name = name;
+    incoming.size = size;
+    m_incomingFiles.insert(transferId, incoming);
+    emit fileOffered(transferId, offer["sender"].toString(), name, size);
+}
+
+bool NetworkClient::acceptFile(quint64 transferId) {
+    auto it = m_incomingFiles.find(transferId);
+    if (it == m_incomingFiles.end() || it->file) return false;
+
+    // Data goes into a fresh file of our own next to the target, never into one that exists;
+    // it takes the offered name once complete.
+    QDir directory(m_downloadDirectory);
+    QTemporaryFile* file = new QTemporaryFile(directory.filePath(it->name + ".XXXXXX.part"), this);
+    file->setAutoRemove(false);
+    if (!file->open()) {
+        qDebug() << "Cannot save incoming file" << it->name << ":" << file->errorString();
+        delete file;
+        declineFile(transferId);
+        emit fileReceiveFailed(transferId, "Cannot save the file");
+        return false;
+    }
+    it->file = file;
+    it->path = directory.filePath(it->name);
+
+    QJsonObject acceptObj;
+    acceptObj["type"] = "file_accept";
+    acceptObj["transferId"] = static_cast<qint64>(transferId);
+    sendRawJson(acceptObj);
+
+    if (it->size == 0) {
+        finishIncomingFile(transferId);
+    }
+    return true;
+}
+
+void NetworkClient::declineFile(quint64 transferId) {
+    if (!m_incomingFiles.contains(transferId)) return;
+
+    QJsonObject cancelObj;
+    cancelObj["type"] = "file_cancel";
+    cancelObj["transferId"] = static_cast<qint64>(transferId);
+    sendRawJson(cancelObj);
+    dropIncomingFile(transferId);
+}
+
+void NetworkClient::processFileChunk(const QByteArray& frame) {
+    FileChunk chunk;
+    if (!FileChunk::parse(frame, chunk)) {
+        qDebug() << "Malformed binary frame, size:" << frame.size();
+        return;
+    }
+
+    auto it = m_incomingFiles.find(chunk.transferId);
+    if (it == m_incomingFiles.end() || !it->file) return;
+
+    // Chunks from before a rewind are skipped; the server sends them again in order.
+    if (chunk.offset != it->received) return;
+
+    if (chunk.offset + chunk.size > it->size ||
+        it->file->write(frame.constData() + FileChunk::kHeaderSize, chunk.size) != chunk.size) {
+        QJsonObject cancelObj;
+        cancelObj["type"] = "file_cancel";
+        cancelObj["transferId"] = static_cast<qint64>(chunk.transferId);
+        sendRawJson(cancelObj);
+
+        dropIncomingFile(chunk.transferId);
+        emit fileReceiveFailed(chunk.transferId, "Cannot write the file");
+        return;
+    }
+    it->received += chunk.size;
+
+    if (it->received == it->size) {
+        finishIncomingFile(chunk.transferId);
+    } else if (it->received - it->ackedAt >= FileChunk::kWindowBytes / 4) {
+        // Data is flushed before it is confirmed, so a resume never skips bytes that were lost.
+        it->file->flush();
+        it->ackedAt = it->received;
+
+        QJsonObject ackObj;
+        ackObj["type"] = "file_ack";
+        ackObj["transferId"] = static_cast<qint64>(chunk.transferId);
+        ackObj["offset"] = it->received;
+        sendRawJson(ackObj);
+    }
+}
+
+void NetworkClient::finishIncomingFile(quint64 transferId) {
+    IncomingFile incoming = m_incomingFiles.take(transferId);
+    incoming.file->close();
+
+    // An existing file of the same name is kept; the new one gets a numbered name instead.
+    QFileInfo target(incoming.path);
+    QString path = incoming.path;
+    for (int i = 1; QFile::exists(path); ++i) {
+        path = target.dir().filePath(QString("%1 (%2)").arg(target.completeBaseName()).arg(i));
+        if (!target.suffix().isEmpty()) {
+            path += "." + target.suffix();
+        }
+    }
+    incoming.file->rename(path);
+    incoming.file->deleteLater();
+
+    QJsonObject ackObj;
+    ackObj["type"] = "file_ack";
+    ackObj["transferId"] = static_cast<qint64>(transferId);
+    ackObj["offset"] = incoming.size;
+    sendRawJson(ackObj);
+
+    emit fileReceived(transferId, path);
+}
+
+void NetworkClient::dropOutgoingFile(quint64 ref) {
+    OutgoingFile outgoing = m_outgoingFiles.take(ref);
+    m_outgoingRefs.remove(outgoing.transferId);
+    delete outgoing.file;
+}
+
+void NetworkClient::dropIncomingFile(quint64 transferId) {
+    IncomingFile incoming = m_incomingFiles.take(transferId);
+    if (incoming.file) {
+        incoming.file->remove();
+        delete incoming.file;
+    }
+}
+
+void NetworkClient::abortFileTransfers() {
+    const QList<quint64> outgoing = m_outgoingFiles.keys();
+    for (quint64 ref : outgoing) {
+        dropOutgoingFile(ref);
+    }
+    const QList<quint64> incoming = m_incomingFiles.keys();
+    for (quint64 transferId : incoming) {
+        dropIncomingFile(transferId);
+    }
+}
@@ -2,47 +2,236 @@
 #include <QTcpSocket>
 #include <QObject>
 #include <QJsonObject>
+#include <QJsonArray>
+#include <QHash>
+#include <QMap>
+#include <QTimer>
+#include <QFile>
+#include "transport.hpp"
+#include "file_chunk.hpp"
+#include "local_transport.hpp"
+#include "e2e_session.hpp"
+#include <memory>
+
+#ifndef QT_NO_SSL
+#include <QSslConfiguration>
+#include <QSslCertificate>
+#endif
 
 class NetworkClient : public QObject {
     Q_OBJECT
 
 public:
+    static constexpr int kReconnectBaseDelayMs = 500;
+    static constexpr int kReconnectMaxDelayMs = 30000;
+    static constexpr int kAckFlushDelayMs = 200;
+    static constexpr quint32 kMaxFrameSize = 1024 * 1024;
+    static constexpr int kMaxBatchEntries = 1000;
+    // Encoded entries per batch; half the frame limit leaves ample room for the envelope.
+    static constexpr qsizetype kMaxBatchBytes = kMaxFrameSize / 2;
+    static constexpr qint64 kTypingIntervalMs = 3000;
+    static constexpr int kKeyExchangeTimeoutMs = 5000;
+    static constexpr qint64 kDefaultMaxIncomingFileSize = 4LL * 1024 * 1024 * 1024;
+
+    struct OutgoingMessage {
+        QString recipient;
+        QString text;
+    };
+
+    // Outgoing files are known by the ref sendFile returns, incoming ones by the server's id.
+    struct OutgoingFile {
+        QFile* file = nullptr;
+        quint64 transferId = 0;
+        qint64 size = 0;
+        qint64 sent = 0;
+        qint64 acked = 0;
+    };
+
+    // End-to-end state with one peer. A new exchange replaces current and keeps the session it
+    // replaced for messages that were sealed before the peer switched.
+    struct E2ePeer {
+        std::shared_ptr<E2eKeyPair> keyPair;
+        QByteArray peerKey;
+        std::shared_ptr<E2eSession> current;
+        std::shared_ptr<E2eSession> previous;
+        qint64 offeredAt = 0;
+    };
+
+    // A message waiting for the first exchange with its peer; its text is sealed on release.
+    struct HeldSend {
+        QString peer;
+        QJsonObject json;
+    };
+
+    // An offer has no file until it is accepted.
+    struct IncomingFile {
+        QFile* file = nullptr;
+        QString name;
+        QString path;
+        qint64 size = 0;
+        qint64 received = 0;
+        qint64 ackedAt = 0;
+    };
+
     explicit NetworkClient(QObject* parent = nullptr);
     ~NetworkClient();
 
     bool connectToServer(const QString& address, quint16 port);
     void disconnectFromServer();
     bool isConnected() const;
+    bool isReconnecting() const;
 
+#ifndef QT_NO_SSL
+    void setTlsEnabled(bool enabled, const QList<QSslCertificate>& caCertificates = QList<QSslCertificate>());
+#endif
+    bool isTlsEnabled() const { return m_tlsEnabled; }
+
+    // Plain connections go through this transport (TCP unless set); TLS always uses its own socket.
+    void setTransport(Transport* transport) { m_transport = transport; }
+
+    // Sent with every auth request, including the one made when a session can no longer be resumed.
+    void setPassword(const QString& password) { m_password = password; }
     void sendAuthRequest(const QString& clientName, const QString& interlocutorName);
-    void sendMessage(const QString& text);
+    // Picks up a session stored by an earlier run; the server then only sends what came after
+    // lastSeq. Falls back to a normal sign-in if the session is gone.
+    void sendResumeRequest(const QString& sessionToken, const QString& clientName, const QString& interlocutorName,
+                           quint64 lastSeq);
+    QString sessionToken() const { return m_sessionToken; }
+    quint64 lastSeqFrom(const QString& peer) const { return m_lastSeq.value(peer); }
+    // Without a recipient the message goes to the paired interlocutor.
+    quint64 sendMessage(const QString& text, const QString& recipient = QString());
+    void sendMessages(const QList<OutgoingMessage>& messages);
+    // Tells the recipient (or the interlocutor) that we are typing. Called on every edit; only
+    // the first call in each interval goes out, and nothing is sent while not signed in.
+    void sendTyping(const QString& recipient = QString());
     void changeInterlocutor(const QString& newInterlocutor);
     void sendRawJson(const QJsonObject& json);
 
+    // Streams a file to the interlocutor once it accepts; returns 0 if it cannot be opened.
+    quint64 sendFile(const QString& path);
+    void cancelFile(quint64 ref);
+    // Incoming files are announced by fileOffered and saved into the download directory, which
+    // defaults to the user's downloads folder, only after acceptFile. Larger offers are declined.
+    bool acceptFile(quint64 transferId);
+    void declineFile(quint64 transferId);
+    void setDownloadDirectory(const QString& directory) { m_downloadDirectory = directory; }
+    QString downloadDirectory() const { return m_downloadDirectory; }
+    void setMaxIncomingFileSize(qint64 size) { m_maxIncomingFileSize = size; }
+    qint64 maxIncomingFileSize() const { return m_maxIncomingFileSize; }
+
+    static int reconnectDelay(int attempt);
+
+    // On by default when built with libcrypto. Messages to a peer are sealed once an exchange
+    // with it has completed. While our first offer to it is unanswered they are held, for up to
+    // kKeyExchangeTimeoutMs; after that, and to peers we never exchanged with, they go in the
+    // clear and encryptionUnavailable tells the user so. Once a peer's messages are sealed,
+    // plaintext claiming to come from it is not shown.
+    void setEndToEndEnabled(bool enabled);
+    bool isEndToEndEnabled() const { return m_e2eEnabled; }
+    bool isEncryptedWith(const QString& peer) const;
+    // Starts a fresh exchange; done automatically when the interlocutor connects.
+    void startKeyExchange(const QString& peer);
+
 signals:
     void connected();
     void disconnected();
+    void reconnecting(int attempt, int delayMs);
+    void sessionResumed(const QString& interlocutorName, bool interlocutorConnected);
     void authenticationSuccess(const QString& clientName, const QString& interlocutorName, bool interlocutorConnected);
     void authenticationError(const QString& error);
     void messageReceived(const QString& sender, const QString& text, const QString& timestamp);
+    // Messages the server dropped while we were away because too many were waiting for us.
+    void messagesLost(const QString& peer, quint64 count);
+    void messagesAcknowledged(quint64 upToId);
+    void messagesDelivered(quint64 upToId);
+    void messageBatchRejected(quint64 batchId, const QString& recipient, const QString& error);
     void interlocutorConnected(const QString& name);
     void interlocutorDisconnected();
     void interlocutorOffline();
+    void conversationOffline(const QString& conversation);
+    void typingReceived(const QString& sender);
+    void encryptionEstablished(const QString& peer, const QString& fingerprint);
+    void encryptionUnavailable(const QString& peer);
     void interlocutorChanged(const QString& newInterlocutor, bool isConnected);
     void interlocutorChangeError(const QString& error);
     void connectionError(const QString& error);
+    void fileSendProgress(quint64 ref, qint64 sent, qint64 size);
+    void fileSent(quint64 ref);
+    void fileSendFailed(quint64 ref, const QString& error);
+    void fileOffered(quint64 transferId, const QString& sender, const QString& name, qint64 size);
+    void fileReceived(quint64 transferId, const QString& path);
+    void fileReceiveFailed(quint64 transferId, const QString& error);
 
 private slots:
     void onConnected();
     void onDisconnected();
     void onReadyRead();
     void onErrorOccurred(QAbstractSocket::SocketError error);
+    void attemptReconnect();
+    void flushAcks();
+    void flushMessageBatch();
 
 private:
+    void createSocket();
+    void openSocket();
+    void scheduleReconnect();
+    void sendResume();
+    void acknowledgeSends(quint64 upToId);
+    void retransmitUnacked();
     void processServerMessage(const QByteArray& data);
     void sendMessageWithSize(const QJsonObject& jsonObj);
+    void processFileMessage(const QString& type, const QJsonObject& message);
+    void processFileChunk(const QByteArray& frame);
+    void receiveFileOffer(const QJsonObject& offer);
+    void pumpFile(quint64 ref);
+    void finishIncomingFile(quint64 transferId);
+    void dropOutgoingFile(quint64 ref);
+    void dropIncomingFile(quint64 transferId);
+    void abortFileTransfers();
+    bool isExchangePending(const QString& peer) const;
+    void transmit(quint64 id, const QJsonObject& json);
+    void releaseHeldSends();
+    void processKeyExchange(const QJsonObject& message);
+    void sendPublicKey(const QString& peer, const QByteArray& publicKey, bool ack);
+    void sealText(const QString& peer, const QString& text, QJsonObject& messageObj);
+    QString openText(const QString& sender, const QString& text);
 
     QTcpSocket* m_socket;
     quint32 m_messageSize;
     bool m_isAuthenticated;
+
+    QString m_address;
+    quint16 m_port;
+    QString m_clientName;
+    QString m_interlocutorName;
+    QString m_password;
+    QString m_sessionToken;
+    QHash<QString, quint64> m_lastSeq;
+    QMap<quint64, QJsonObject> m_unackedSends;
+    QList<HeldSend> m_heldSends;
+    quint64 m_nextMessageId;
+    QTimer m_reconnectTimer;
+    QTimer m_ackTimer;
+    QTimer m_batchTimer;
+    QJsonArray m_pendingBatch;
+    QHash<QString, qint64> m_lastTypingSent;
+    QHash<QString, E2ePeer> m_e2ePeers;
+    bool m_e2eEnabled;
+    QHash<quint64, OutgoingFile> m_outgoingFiles;
+    QHash<quint64, quint64> m_outgoingRefs;
+    QHash<quint64, IncomingFile> m_incomingFiles;
+    quint64 m_nextFileRef;
+    QString m_downloadDirectory;
+    qint64 m_maxIncomingFileSize = kDefaultMaxIncomingFileSize;
+    int m_reconnectAttempt;
+    int m_migrateDelayMs;
+    bool m_ackPending;
+    bool m_tlsEnabled;
+    TcpTransport m_tcpTransport;
+    LocalTransport m_localTransport;
+    Transport* m_transport;
+#ifndef QT_NO_SSL
+    QSslConfiguration m_tlsConfiguration;
+    QByteArray m_tlsSessionTicket;
+#endif
 };
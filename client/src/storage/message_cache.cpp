@@ -0,0 +1,235 @@
+#include "message_cache.hpp"
+#include <QDir>
+#include <QSaveFile>
+#include <QUrl>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QtEndian>
+#include <QDebug>
+
+bool MessageCache::open(const QString& owner, const QString& peer) {
+    close();
+
+    // Names are percent-encoded, so any name maps to a single valid file name. The owner's
+    // directory holds the history and the session token, so only the owner may list or enter it.
+    const QFileDevice::Permissions ownerOnly = QFileDevice::ReadOwner | QFileDevice::WriteOwner | QFileDevice::ExeOwner;
+    QDir dir(m_directory);
+    QString ownerDir = QString::fromLatin1(QUrl::toPercentEncoding(owner));
+    if (m_directory.isEmpty() || !dir.mkpath(".")
+        || !(dir.exists(ownerDir) || dir.mkdir(ownerDir, ownerOnly))
+        || !QFile::setPermissions(dir.filePath(ownerDir), ownerOnly)) {
+        qDebug() << "Cannot create message cache directory in" << m_directory;
+        return false;
+    }
+    m_basePath = dir.filePath(ownerDir + "/" + QString::fromLatin1(QUrl::toPercentEncoding(peer)));
+
+    m_log.setFileName(m_basePath + ".log");
+    m_index.setFileName(m_basePath + ".idx");
+    if (!m_log.open(QIODevice::ReadWrite) || !m_index.open(QIODevice::ReadWrite)) {
+        qDebug() << "Cannot open message cache" << m_basePath << ":" << m_log.errorString();
+        close();
+        return false;
+    }
+
+    m_count = m_index.size() / static_cast<qint64>(sizeof(quint64));
+    recoverTail();
+
+    QList<Entry> last = page(m_count, 1);
+    m_lastSeq = last.isEmpty() ? 0 : last.first().seq;
+    return true;
+}
+
+void MessageCache::close() {
+    if (m_searchDirty) {
+        m_search.save(m_basePath + ".search");
+    }
+    m_search.clear();
+    m_searchLoaded = false;
+    m_searchDirty = false;
+
+    m_log.close();
+    m_index.close();
+    m_count = 0;
+    m_lastSeq = 0;
+}
+
+// The log is written before the index, so after a crash the index may miss the last records
+// or the log may end in a cut-off record. Only the tail is checked, never the whole history.
+void MessageCache::recoverTail() {
+    qint64 logEnd = 0;
+    while (m_count > 0) {
+        qint64 offset = offsetAt(m_count - 1);
+        quint32 length = 0;
+        if (offset >= 0 && readLength(offset, length) && offset + 4 + length <= m_log.size()) {
+            logEnd = offset + 4 + length;
+            break;
+        }
+        --m_count;
+    }
+    m_index.resize(m_count * static_cast<qint64>(sizeof(quint64)));
+
+    quint32 length = 0;
+    while (readLength(logEnd, length) && logEnd + 4 + length <= m_log.size()) {
+        char offset[sizeof(quint64)];
+        qToBigEndian(static_cast<quint64>(logEnd), offset);
+        m_index.seek(m_count * static_cast<qint64>(sizeof(quint64)));
+        m_index.write(offset, sizeof(offset));
+        ++m_count;
+        logEnd += 4 + length;
+    }
+    m_index.flush();
+
+    if (m_log.size() != logEnd) {
+        qDebug() << "Message cache" << m_basePath << "had a cut-off record, dropped" << m_log.size() - logEnd << "bytes";
+        m_log.resize(logEnd);
+    }
+}
+
+qint64 MessageCache::offsetAt(qint64 index) {
+    char offset[sizeof(quint64)];
+    if (!m_index.seek(index * static_cast<qint64>(sizeof(quint64))) ||
+        m_index.read(offset, sizeof(offset)) != static_cast<qint64>(sizeof(offset))) {
+        return -1;
+    }
+    return static_cast<qint64>(qFromBigEndian<quint64>(offset));
+}
+
+bool MessageCache::readLength(qint64 offset, quint32& length) {
+    char prefix[sizeof(quint32)];
+    if (!m_log.seek(offset) || m_log.read(prefix, sizeof(prefix)) != static_cast<qint64>(sizeof(prefix))) {
+        return false;
+    }
+    length = qFromBigEndian<quint32>(prefix);
+    return true;
+}
+
+bool MessageCache::append(const Entry& entry) {
+    if (!isOpen()) return false;
+
+    QJsonObject record;
+    record["sender"] = entry.sender;
+    record["text"] = entry.text;
+    record["timestamp"] = entry.timestamp;
+    record["seq"] = static_cast<qint64>(entry.seq);
+    QByteArray json = QJsonDocument(record).toJson(QJsonDocument::Compact);
+
+    qint64 offset = m_log.size();
+    char prefix[sizeof(quint32)];
+    qToBigEndian(static_cast<quint32>(json.size()), prefix);
+    if (!m_log.seek(offset) || m_log.write(prefix, sizeof(prefix)) == -1 || m_log.write(json) == -1 || !m_log.flush()) {
+        qDebug() << "Cannot append to message cache:" << m_log.errorString();
+        return false;
+    }
+
+    char indexEntry[sizeof(quint64)];
+    qToBigEndian(static_cast<quint64>(offset), indexEntry);
+    if (!m_index.seek(m_count * static_cast<qint64>(sizeof(quint64))) ||
+        m_index.write(indexEntry, sizeof(indexEntry)) == -1 || !m_index.flush()) {
+        qDebug() << "Cannot update message cache index:" << m_index.errorString();
+        return false;
+    }
+
+    ++m_count;
+    m_lastSeq = entry.seq;
+    return true;
+}
+
+QList<MessageCache::Entry> MessageCache::page(qint64 end, int size) {
+    QList<Entry> entries;
+    end = qBound<qint64>(0, end, m_count);
+    qint64 start = qMax<qint64>(0, end - size);
+    if (!isOpen() || start == end) return entries;
+
+    // The records of a page are contiguous in the log, so it takes one read.
+    qint64 from = offsetAt(start);
+    qint64 to = end < m_count ? offsetAt(end) : m_log.size();
+    if (from < 0 || to < from || !m_log.seek(from)) return entries;
+    QByteArray block = m_log.read(to - from);
+
+    entries.reserve(end - start);
+    qsizetype position = 0;
+    while (position + 4 <= block.size()) {
+        quint32 length = qFromBigEndian<quint32>(block.constData() + position);
+        if (position + 4 + static_cast<qsizetype>(length) > block.size()) break;
+
+        QJsonObject record = QJsonDocument::fromJson(block.mid(position + 4, length)).object();
+        Entry entry;
+        entry.sender = record["sender"].toString();
+        entry.text = record["text"].toString();
+        entry.timestamp = record["timestamp"].toString();
+        entry.seq = static_cast<quint64>(record["seq"].toInteger());
+        entries.append(entry);
+        position += 4 + length;
+    }
+    return entries;
+}
+
+void MessageCache::loadSearchIndex() {
+    if (m_searchLoaded) return;
+    m_searchLoaded = true;
+
+    // An index that covers more than the log survived a crash the log did not; start over.
+    if (m_search.load(m_basePath + ".search") && m_search.documentCount() > m_count) {
+        m_search.clear();
+    }
+}
+
+bool MessageCache::indexPending(qint64 maxEntries) {
+    if (!isOpen()) return false;
+    loadSearchIndex();
+
+    qint64 indexed = m_search.documentCount();
+    qint64 end = qMin(m_count, indexed + maxEntries);
+    while (indexed < end) {
+        qint64 sliceEnd = qMin(end, indexed + kPageSize);
+        const QList<Entry> entries = page(sliceEnd, static_cast<int>(sliceEnd - indexed));
+        if (entries.isEmpty()) break;
+
+        for (const Entry& entry : entries) {
+            m_search.add(entry.text);
+        }
+        indexed += entries.size();
+        m_searchDirty = true;
+    }
+    return indexed < m_count;
+}
+
+QList<MessageCache::SearchResult> MessageCache::search(const QString& query, int offset, int limit) {
+    QList<SearchResult> results;
+    if (!isOpen()) return results;
+
+    // Whatever the background indexing has not reached yet is indexed now, so results are complete.
+    indexPending(m_count);
+
+    const QList<SearchIndex::Hit> hits = m_search.search(query, offset, limit);
+    results.reserve(hits.size());
+    for (const SearchIndex::Hit& hit : hits) {
+        QList<Entry> entry = page(hit.document + 1, 1);
+        if (!entry.isEmpty()) {
+            results.append({hit.document, entry.first()});
+        }
+    }
+    return results;
+}
+
+QString MessageCache::sessionToken() const {
+    QFile file(m_basePath + ".session");
+    if (!isOpen() || !file.open(QIODevice::ReadOnly)) return QString();
+    return QString::fromUtf8(file.readAll()).trimmed();
+}
+
+void MessageCache::setSessionToken(const QString& token) {
+    if (!isOpen()) return;
+
+    // The token goes to a temporary file that is made owner-only before anything is written, and
+    // only then replaces the old one, so it is never readable by others, not even briefly.
+    QSaveFile file(m_basePath + ".session");
+    if (!file.open(QIODevice::WriteOnly) || !file.setPermissions(QFileDevice::ReadOwner | QFileDevice::WriteOwner)) {
+        qDebug() << "Cannot store session token:" << file.errorString();
+        return;
+    }
+    file.write(token.toUtf8());
+    if (!file.commit()) {
+        qDebug() << "Cannot store session token:" << file.errorString();
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <QFile>
+#include <QList>
+#include <QString>
+#include "search_index.hpp"
+
+// On-disk history of one conversation, so a chat shows its latest messages before the client
+// has even connected. Messages are appended to a log of length-prefixed JSON records (the same
+// framing as on the wire), and an index file holds the log offset of every record as a
+// big-endian quint64. A page is read by seeking straight to it, so opening a chat costs the
+// same however long its history is.
+//
+// Messages are added to the search index in slices by indexPending(), never by append(), so
+// receiving a message does not wait for indexing. The index is saved next to the log on close
+// and only loaded once it is needed.
+class MessageCache {
+public:
+    static constexpr int kPageSize = 50;
+    static constexpr int kIndexBatch = 500;
+
+    // seq is the highest sequence number received from the peer when the entry was written,
+    // so the last entry tells the server where to resume.
+    struct Entry {
+        QString sender;
+        QString text;
+        QString timestamp;
+        quint64 seq = 0;
+    };
+
+    struct SearchResult {
+        qint64 index;
+        Entry entry;
+    };
+
+    explicit MessageCache(const QString& directory = QString()) : m_directory(directory) {}
+    ~MessageCache() { close(); }
+
+    void setDirectory(const QString& directory) { m_directory = directory; }
+    QString directory() const { return m_directory; }
+
+    bool open(const QString& owner, const QString& peer);
+    void close();
+    bool isOpen() const { return m_log.isOpen(); }
+    qint64 count() const { return m_count; }
+    quint64 lastSeq() const { return m_lastSeq; }
+
+    bool append(const Entry& entry);
+    // Up to size entries that come before index end, oldest first.
+    QList<Entry> page(qint64 end, int size = kPageSize);
+
+    // Indexes up to maxEntries messages; returns true while more are waiting.
+    bool indexPending(qint64 maxEntries = kIndexBatch);
+    qint64 indexedCount() const { return m_searchLoaded ? m_search.documentCount() : 0; }
+    QList<SearchResult> search(const QString& query, int offset = 0, int limit = kPageSize);
+
+    QString sessionToken() const;
+    void setSessionToken(const QString& token);
+
+private:
+    void recoverTail();
+    qint64 offsetAt(qint64 index);
+    bool readLength(qint64 offset, quint32& length);
+    void loadSearchIndex();
+
+    QString m_directory;
+    QString m_basePath;
+    QFile m_log;
+    QFile m_index;
+    qint64 m_count = 0;
+    quint64 m_lastSeq = 0;
+    SearchIndex m_search;
+    bool m_searchLoaded = false;
+    bool m_searchDirty = false;
+};
@@ -0,0 +1,179 @@
+#include "search_index.hpp"
+#include <QDataStream>
+#include <QFile>
+#include <QSaveFile>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static const char kMagic[] = "MSGIDX";
+static constexpr double kTermSaturation = 1.2;
+
+QStringList SearchIndex::tokenize(const QString& text) {
+    QStringList tokens;
+    QString folded = text.toCaseFolded();
+
+    qsizetype start = -1;
+    for (qsizetype i = 0; i <= folded.size(); ++i) {
+        bool wordChar = i < folded.size() && folded[i].isLetterOrNumber();
+        if (wordChar && start < 0) {
+            start = i;
+        } else if (!wordChar && start >= 0) {
+            tokens.append(folded.mid(start, i - start));
+            start = -1;
+        }
+    }
+    return tokens;
+}
+
+quint32 SearchIndex::add(const QString& text) {
+    quint32 document = m_documents++;
+
+    QHash<QString, quint32> frequencies;
+    const QStringList tokens = tokenize(text);
+    for (const QString& token : tokens) {
+        ++frequencies[token];
+    }
+
+    for (auto it = frequencies.constBegin(); it != frequencies.constEnd(); ++it) {
+        Postings& postings = m_terms[it.key()];
+        writeVarint(postings.data, document - (postings.documents ? postings.lastDocument : 0));
+        writeVarint(postings.data, it.value());
+        postings.lastDocument = document;
+        ++postings.documents;
+    }
+    return document;
+}
+
+QList<SearchIndex::Hit> SearchIndex::search(const QString& query, int offset, int limit) const {
+    struct Candidate {
+        quint32 document;
+        int matched;
+        double score;
+    };
+
+    QStringList terms = tokenize(query);
+    terms.removeDuplicates();
+
+    QHash<quint32, qsizetype> positions;
+    QList<Candidate> candidates;
+    for (const QString& term : std::as_const(terms)) {
+        auto it = m_terms.constFind(term);
+        if (it == m_terms.constEnd()) continue;
+
+        double idf = std::log(1.0 + (m_documents - it->documents + 0.5) / (it->documents + 0.5));
+        qsizetype position = 0;
+        quint32 document = 0;
+        quint32 gap = 0;
+        quint32 frequency = 0;
+        while (readVarint(it->data, position, gap) && readVarint(it->data, position, frequency)) {
+            document += gap;
+            double score = idf * frequency * (kTermSaturation + 1) / (frequency + kTermSaturation);
+
+            auto known = positions.constFind(document);
+            if (known == positions.constEnd()) {
+                positions.insert(document, candidates.size());
+                candidates.append({document, 1, score});
+            } else {
+                Candidate& candidate = candidates[*known];
+                ++candidate.matched;
+                candidate.score += score;
+            }
+        }
+    }
+
+    QList<Hit> hits;
+    qsizetype wanted = qMin<qsizetype>(candidates.size(), static_cast<qsizetype>(offset) + limit);
+    if (offset < 0 || limit <= 0 || offset >= wanted) return hits;
+
+    // Only the requested page and what precedes it gets sorted.
+    std::partial_sort(candidates.begin(), candidates.begin() + wanted, candidates.end(),
+                      [](const Candidate& a, const Candidate& b) {
+                          if (a.matched != b.matched) return a.matched > b.matched;
+                          if (a.score != b.score) return a.score > b.score;
+                          return a.document > b.document;
+                      });
+
+    hits.reserve(wanted - offset);
+    for (qsizetype i = offset; i < wanted; ++i) {
+        hits.append({candidates[i].document, candidates[i].score});
+    }
+    return hits;
+}
+
+void SearchIndex::clear() {
+    m_terms.clear();
+    m_documents = 0;
+}
+
+void SearchIndex::writeVarint(QByteArray& out, quint32 value) {
+    while (value >= 0x80) {
+        out.append(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.append(static_cast<char>(value));
+}
+
+bool SearchIndex::readVarint(const QByteArray& in, qsizetype& position, quint32& value) {
+    value = 0;
+    for (int shift = 0; shift < 35 && position < in.size(); shift += 7) {
+        uchar byte = static_cast<uchar>(in[position++]);
+        value |= static_cast<quint32>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// File layout: the magic "MSGIDX", a quint16 version, the document count and the term count,
+// then every term with its document count, last document and encoded postings.
+bool SearchIndex::save(const QString& path) const {
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qDebug() << "Cannot save search index" << path << ":" << file.errorString();
+        return false;
+    }
+
+    QDataStream out(&file);
+    out.writeRawData(kMagic, sizeof(kMagic) - 1);
+    out << kFormatVersion << m_documents << static_cast<quint32>(m_terms.size());
+    for (auto it = m_terms.constBegin(); it != m_terms.constEnd(); ++it) {
+        out << it.key() << it->documents << it->lastDocument << it->data;
+    }
+    return out.status() == QDataStream::Ok && file.commit();
+}
+
+bool SearchIndex::load(const QString& path) {
+    clear();
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    QDataStream in(&file);
+    char magic[sizeof(kMagic) - 1];
+    quint16 version = 0;
+    quint32 documents = 0;
+    quint32 termCount = 0;
+    if (in.readRawData(magic, sizeof(magic)) != static_cast<int>(sizeof(magic)) ||
+        std::memcmp(magic, kMagic, sizeof(magic)) != 0) {
+        return false;
+    }
+    in >> version >> documents >> termCount;
+    if (in.status() != QDataStream::Ok || version != kFormatVersion) return false;
+
+    m_terms.reserve(qMin<quint32>(termCount, 1 << 20));
+    for (quint32 i = 0; i < termCount && in.status() == QDataStream::Ok; ++i) {
+        QString term;
+        Postings postings;
+        in >> term >> postings.documents >> postings.lastDocument >> postings.data;
+        m_terms.insert(term, postings);
+    }
+
+    if (in.status() != QDataStream::Ok) {
+        qDebug() << "Search index" << path << "is damaged, rebuilding";
+        clear();
+        return false;
+    }
+    m_documents = documents;
+    return true;
+}
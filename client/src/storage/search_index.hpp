@@ -0,0 +1,45 @@
+#pragma once
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+// Inverted index over the messages of one conversation. Documents are numbered in the order
+// they are added, so every postings list is sorted and stored as varint-encoded gaps between
+// document numbers, each followed by the term's count in that document. Results are ranked by
+// how many query terms they contain, then by BM25 score, then newest first.
+class SearchIndex {
+public:
+    static constexpr quint16 kFormatVersion = 1;
+
+    struct Hit {
+        quint32 document;
+        double score;
+    };
+
+    static QStringList tokenize(const QString& text);
+
+    // Returns the number given to the document.
+    quint32 add(const QString& text);
+    QList<Hit> search(const QString& query, int offset, int limit) const;
+    quint32 documentCount() const { return m_documents; }
+    qsizetype termCount() const { return m_terms.size(); }
+    void clear();
+
+    bool save(const QString& path) const;
+    bool load(const QString& path);
+
+private:
+    struct Postings {
+        QByteArray data;
+        quint32 lastDocument = 0;
+        quint32 documents = 0;
+    };
+
+    static void writeVarint(QByteArray& out, quint32 value);
+    static bool readVarint(const QByteArray& in, qsizetype& position, quint32& value);
+
+    QHash<QString, Postings> m_terms;
+    quint32 m_documents = 0;
+};
@@ -2,7 +2,10 @@
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QScrollBar>
+#include <QTextCursor>
+#include <QTabBar>
 #include <QMessageBox>
+#include <QDateTime>
 
 ClientWidget::ClientWidget(QWidget* parent): QWidget(parent) {setupUI();}
 
@@ -15,6 +18,11 @@ void ClientWidget::setupUI() {
     QLabel* clientLabel = new QLabel("Your name:", m_authGroup);
     m_clientNameEdit = new QLineEdit(m_authGroup);
 
+    QLabel* passwordLabel = new QLabel("Password:", m_authGroup);
+    m_passwordEdit = new QLineEdit(m_authGroup);
+    m_passwordEdit->setEchoMode(QLineEdit::Password);
+    m_passwordEdit->setPlaceholderText("Only if the server asks for one");
+
     QLabel* interlocutorLabel = new QLabel("Interlocutor:", m_authGroup);
     m_interlocutorNameEdit = new QLineEdit(m_authGroup);
 
@@ -26,6 +34,8 @@ void ClientWidget::setupUI() {
     authLayout->addWidget(m_serverAddressEdit);
     authLayout->addWidget(clientLabel);
     authLayout->addWidget(m_clientNameEdit);
+    authLayout->addWidget(passwordLabel);
+    authLayout->addWidget(m_passwordEdit);
     authLayout->addWidget(interlocutorLabel);
     authLayout->addWidget(m_interlocutorNameEdit);
     authLayout->addWidget(m_connectButton);
@@ -33,12 +43,24 @@ void ClientWidget::setupUI() {
     m_chatGroup = new QGroupBox("Chat", this);
     m_chatGroup->setEnabled(false);
 
-    m_chatDisplay = new QTextEdit(m_chatGroup);
-    m_chatDisplay->setReadOnly(true);
+    m_conversationTabs = new QTabWidget(m_chatGroup);
+    m_conversationTabs->setTabsClosable(true);
+    connect(m_conversationTabs, &QTabWidget::tabCloseRequested, this, &ClientWidget::onConversationTabCloseRequested);
+    connect(m_conversationTabs, &QTabWidget::currentChanged, this, &ClientWidget::updateMessageInput);
+    connect(m_conversationTabs, &QTabWidget::currentChanged, this, &ClientWidget::updateTypingLabel);
+
+    m_chatDisplay = createDisplay(QString());
+    m_conversationTabs->addTab(m_chatDisplay, "Chat");
+    m_conversationTabs->tabBar()->setTabButton(0, QTabBar::RightSide, nullptr);
+
+    m_openConversationEdit = new QLineEdit(m_chatGroup);
+    m_openConversationEdit->setPlaceholderText("Open chat with...");
+    connect(m_openConversationEdit, &QLineEdit::returnPressed, this, &ClientWidget::onOpenConversationSubmitted);
 
     m_messageInput = new QLineEdit(m_chatGroup);
     m_messageInput->setEnabled(false);
     connect(m_messageInput, &QLineEdit::returnPressed, this, &ClientWidget::onSendButtonClicked);
+    connect(m_messageInput, &QLineEdit::textEdited, this, &ClientWidget::onMessageEdited);
 
     m_sendButton = new QPushButton("Send", m_chatGroup);
     m_sendButton->setEnabled(false);
@@ -56,12 +78,32 @@ void ClientWidget::setupUI() {
     changeLayout->addWidget(m_changeInterlocutorEdit);
     changeLayout->addWidget(m_changeInterlocutorButton);
 
+    m_searchEdit = new QLineEdit(m_chatGroup);
+    m_searchEdit->setPlaceholderText("Search history");
+    connect(m_searchEdit, &QLineEdit::returnPressed, this, &ClientWidget::onSearchSubmitted);
+
     QHBoxLayout* inputLayout = new QHBoxLayout();
     inputLayout->addWidget(m_messageInput);
     inputLayout->addWidget(m_sendButton);
 
+    m_deliveryLabel = new QLabel(m_chatGroup);
+    m_deliveryLabel->setStyleSheet("color: gray;");
+
+    m_typingLabel = new QLabel(m_chatGroup);
+    m_typingLabel->setStyleSheet("color: gray; font-style: italic;");
+
+    m_typingTimer.setInterval(1000);
+    connect(&m_typingTimer, &QTimer::timeout, this, &ClientWidget::updateTypingLabel);
+
+    QHBoxLayout* toolsLayout = new QHBoxLayout();
+    toolsLayout->addWidget(m_openConversationEdit);
+    toolsLayout->addWidget(m_searchEdit);
+
     QVBoxLayout* chatLayout = new QVBoxLayout(m_chatGroup);
-    chatLayout->addWidget(m_chatDisplay);
+    chatLayout->addLayout(toolsLayout);
+    chatLayout->addWidget(m_conversationTabs);
+    chatLayout->addWidget(m_typingLabel);
+    chatLayout->addWidget(m_deliveryLabel);
     chatLayout->addLayout(changeLayout);
     chatLayout->addLayout(inputLayout);
 
@@ -76,11 +118,81 @@ void ClientWidget::setupUI() {
     resize(600, 700);
 }
 
-void ClientWidget::setMessageInputEnabled(bool enabled) {
+QTextEdit* ClientWidget::createDisplay(const QString& conversation) {
+    QTextEdit* display = new QTextEdit(m_conversationTabs);
+    display->setReadOnly(true);
+
+    // An empty name stands for the primary tab, whose peer changes with the interlocutor.
+    connect(display->verticalScrollBar(), &QScrollBar::valueChanged, this, [this, display, conversation](int value) {
+        QString name = conversation.isEmpty() ? m_primaryConversation : conversation;
+        if (m_conversationsWithOlder.contains(name) && value == display->verticalScrollBar()->minimum()) {
+            emit olderMessagesRequested(name);
+        }
+    });
+    return display;
+}
+
+QTextEdit* ClientWidget::displayFor(const QString& conversation) {
+    if (conversation.isEmpty() || conversation == m_primaryConversation) {
+        return m_chatDisplay;
+    }
+
+    QTextEdit* display = m_conversationDisplays.value(conversation);
+    if (!display) {
+        display = createDisplay(conversation);
+        m_conversationDisplays.insert(conversation, display);
+        m_conversationTabs->addTab(display, conversation);
+        emit conversationOpened(conversation);
+    }
+    return display;
+}
+
+void ClientWidget::openConversationTab(const QString& conversation) {
+    m_conversationTabs->setCurrentWidget(displayFor(conversation));
+}
+
+bool ClientWidget::hasConversationTab(const QString& conversation) const {
+    return conversation == m_primaryConversation || m_conversationDisplays.contains(conversation);
+}
+
+QString ClientWidget::currentConversation() const {
+    QTextEdit* display = qobject_cast<QTextEdit*>(m_conversationTabs->currentWidget());
+    return display == m_chatDisplay ? m_primaryConversation : m_conversationDisplays.key(display);
+}
+
+void ClientWidget::onOpenConversationSubmitted() {
+    QString conversation = m_openConversationEdit->text().trimmed();
+    if (!conversation.isEmpty()) {
+        emit conversationRequested(conversation);
+        m_openConversationEdit->clear();
+    }
+}
+
+void ClientWidget::onConversationTabCloseRequested(int index) {
+    QTextEdit* display = qobject_cast<QTextEdit*>(m_conversationTabs->widget(index));
+    if (!display || display == m_chatDisplay) return;
+
+    QString conversation = m_conversationDisplays.key(display);
+    m_conversationDisplays.remove(conversation);
+    m_conversationsWithOlder.remove(conversation);
+    m_conversationTabs->removeTab(index);
+    display->deleteLater();
+    emit conversationClosed(conversation);
+}
+
+// The paired conversation can only be written to while the interlocutor is there; the others
+// whenever the client is connected, as the server reports an offline peer per message.
+void ClientWidget::updateMessageInput() {
+    bool enabled = m_conversationTabs->currentWidget() == m_chatDisplay ? m_primaryInputEnabled : m_connected;
     m_messageInput->setEnabled(enabled);
     m_sendButton->setEnabled(enabled);
 }
 
+void ClientWidget::setMessageInputEnabled(bool enabled) {
+    m_primaryInputEnabled = enabled;
+    updateMessageInput();
+}
+
 void ClientWidget::setChatEnabled(bool enabled) {
     m_chatGroup->setEnabled(enabled);
     m_changeInterlocutorEdit->setEnabled(enabled);
@@ -101,6 +213,13 @@ void ClientWidget::onSendButtonClicked() {
     }
 }
 
+// Emitted on every edit; NetworkClient keeps it down to one frame per interval.
+void ClientWidget::onMessageEdited(const QString& text) {
+    if (!text.trimmed().isEmpty()) {
+        emit typing(currentConversation());
+    }
+}
+
 void ClientWidget::onChangeInterlocutorClicked() {
     QString newInterlocutor = m_changeInterlocutorEdit->text().trimmed();
     if (!newInterlocutor.isEmpty()) {
@@ -121,23 +240,83 @@ QString ClientWidget::getInterlocutorName() const {
     return m_interlocutorNameEdit->text().trimmed();
 }
 
+QString ClientWidget::getPassword() const {
+    return m_passwordEdit->text();
+}
+
 void ClientWidget::appendChatMessage(const QString& message) {
-    m_chatDisplay->append(message);
-    QScrollBar* scrollbar = m_chatDisplay->verticalScrollBar();
+    appendConversationMessage(QString(), message);
+}
+
+void ClientWidget::appendConversationMessage(const QString& conversation, const QString& message) {
+    QTextEdit* display = displayFor(conversation);
+    display->append(message);
+    QScrollBar* scrollbar = display->verticalScrollBar();
     scrollbar->setValue(scrollbar->maximum());
 }
 
+void ClientWidget::clearConversation(const QString& conversation) {
+    displayFor(conversation)->clear();
+}
+
+void ClientWidget::setHasOlderMessages(const QString& conversation, bool hasOlder) {
+    if (hasOlder) {
+        m_conversationsWithOlder.insert(conversation);
+    } else {
+        m_conversationsWithOlder.remove(conversation);
+    }
+}
+
+// Older history is inserted above what is shown, keeping the view where the user was reading.
+void ClientWidget::prependChatMessages(const QString& conversation, const QStringList& messages) {
+    if (messages.isEmpty()) return;
+
+    QTextEdit* display = displayFor(conversation);
+    QScrollBar* scrollbar = display->verticalScrollBar();
+    int fromBottom = scrollbar->maximum() - scrollbar->value();
+
+    QTextCursor cursor(display->document());
+    cursor.movePosition(QTextCursor::Start);
+    bool wasEmpty = display->document()->isEmpty();
+    for (qsizetype i = 0; i < messages.size(); ++i) {
+        cursor.insertHtml(messages[i]);
+        if (i + 1 < messages.size() || !wasEmpty) {
+            cursor.insertBlock();
+        }
+    }
+
+    scrollbar->setValue(scrollbar->maximum() - fromBottom);
+}
+
+void ClientWidget::onSearchSubmitted() {
+    QString query = m_searchEdit->text().trimmed();
+    if (!query.isEmpty()) {
+        emit searchRequested(query);
+    }
+}
+
 void ClientWidget::setInterlocutorName(const QString& name) {
     m_interlocutorNameEdit->setText(name);
     m_chatGroup->setTitle(QString("Chat with %1").arg(name));
+
+    // The new interlocutor's conversation moves into the primary tab.
+    if (QTextEdit* display = m_conversationDisplays.take(name)) {
+        m_conversationsWithOlder.remove(name);
+        m_conversationTabs->removeTab(m_conversationTabs->indexOf(display));
+        display->deleteLater();
+    }
+    m_primaryConversation = name;
+    m_conversationTabs->setTabText(0, name);
 }
 
 void ClientWidget::setConnectionStatus(bool connected, const QString& status) {
+    m_connected = connected;
     if (connected) {
         m_statusLabel->setText(status.isEmpty() ? "Connected" : status);
         m_statusLabel->setStyleSheet("color: green;");
         m_connectButton->setText("Disconnect");
         setChatEnabled(true);
+        updateMessageInput();
     } else {
         m_statusLabel->setText("Not connected");
         m_statusLabel->setStyleSheet("color: red;");
@@ -146,6 +325,36 @@ void ClientWidget::setConnectionStatus(bool connected, const QString& status) {
         setMessageInputEnabled(false);
     }
 }
+
+void ClientWidget::setDeliveryStatus(const QString& status) {
+    m_deliveryLabel->setText(status);
+}
+
+void ClientWidget::showTyping(const QString& conversation) {
+    m_typingUntil[conversation] = QDateTime::currentMSecsSinceEpoch() + kTypingShownMs;
+    if (!m_typingTimer.isActive()) {
+        m_typingTimer.start();
+    }
+    updateTypingLabel();
+}
+
+void ClientWidget::clearTyping(const QString& conversation) {
+    if (m_typingUntil.remove(conversation)) {
+        updateTypingLabel();
+    }
+}
+
+void ClientWidget::updateTypingLabel() {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    m_typingUntil.removeIf([now](const QHash<QString, qint64>::iterator it) { return it.value() <= now; });
+    if (m_typingUntil.isEmpty()) {
+        m_typingTimer.stop();
+    }
+
+    QString conversation = currentConversation();
+    m_typingLabel->setText(m_typingUntil.contains(conversation) ? QString("%1 is typing...").arg(conversation) : QString());
+}
+
 void ClientWidget::clearChat() {
     m_chatDisplay->clear();
 }
@@ -5,30 +5,57 @@
 #include <QPushButton>
 #include <QLabel>
 #include <QGroupBox>
+#include <QTabWidget>
+#include <QTimer>
+#include <QHash>
+#include <QSet>
 
 class TestableClient;
 
+// The first tab is the conversation with the paired interlocutor; every other conversation
+// gets a tab of its own, opened by the user or by an incoming message, all over one connection.
+// Conversations are identified by the peer's name.
 class ClientWidget : public QWidget {
     friend class TestableClient;
     Q_OBJECT
 
 public:
+    // A typing notice is refreshed every few seconds while the peer keeps typing.
+    static constexpr qint64 kTypingShownMs = 5000;
+
     explicit ClientWidget(QWidget* parent = nullptr);
 
     QString getServerAddress() const;
     QString getClientName() const;
     QString getInterlocutorName() const;
+    QString getPassword() const;
 
     void setChatEnabled(bool enabled);
     void appendChatMessage(const QString& message);
+    void appendConversationMessage(const QString& conversation, const QString& message);
+    void prependChatMessages(const QString& conversation, const QStringList& messages);
+    void clearConversation(const QString& conversation);
+    void setHasOlderMessages(const QString& conversation, bool hasOlder);
+    void openConversationTab(const QString& conversation);
+    bool hasConversationTab(const QString& conversation) const;
+    QString currentConversation() const;
     void setInterlocutorName(const QString& name);
     void setConnectionStatus(bool connected, const QString& status = QString());
+    void setDeliveryStatus(const QString& status);
+    void showTyping(const QString& conversation);
+    void clearTyping(const QString& conversation);
 
 signals:
     void connectClicked(const QString& serverAddress, const QString& clientName, const QString& interlocutorName);
     void disconnectClicked();
     void messageSent(const QString& text);
+    void typing(const QString& conversation);
     void changeInterlocutorRequested(const QString& newInterlocutor);
+    void olderMessagesRequested(const QString& conversation);
+    void conversationRequested(const QString& conversation);
+    void conversationOpened(const QString& conversation);
+    void conversationClosed(const QString& conversation);
+    void searchRequested(const QString& query);
 
 public slots:
     void clearChat();
@@ -39,20 +66,41 @@ private slots:
     void onConnectButtonClicked();
     void onSendButtonClicked();
     void onChangeInterlocutorClicked();
+    void onOpenConversationSubmitted();
+    void onConversationTabCloseRequested(int index);
+    void updateMessageInput();
+    void onSearchSubmitted();
+    void onMessageEdited(const QString& text);
+    void updateTypingLabel();
 
 private:
     void setupUI();
+    QTextEdit* createDisplay(const QString& conversation);
+    QTextEdit* displayFor(const QString& conversation);
 
     QGroupBox* m_authGroup;
     QGroupBox* m_chatGroup;
     QLineEdit* m_serverAddressEdit;
     QLineEdit* m_clientNameEdit;
     QLineEdit* m_interlocutorNameEdit;
+    QLineEdit* m_passwordEdit;
     QLineEdit* m_changeInterlocutorEdit;
+    QLineEdit* m_searchEdit;
     QTextEdit* m_chatDisplay;
+    QTabWidget* m_conversationTabs;
+    QLineEdit* m_openConversationEdit;
     QLineEdit* m_messageInput;
     QPushButton* m_connectButton;
     QPushButton* m_sendButton;
     QPushButton* m_changeInterlocutorButton;
     QLabel* m_statusLabel;
+    QLabel* m_deliveryLabel;
+    QLabel* m_typingLabel;
+    QHash<QString, qint64> m_typingUntil;
+    QTimer m_typingTimer;
+    QString m_primaryConversation;
+    QHash<QString, QTextEdit*> m_conversationDisplays;
+    QSet<QString> m_conversationsWithOlder;
+    bool m_primaryInputEnabled = false;
+    bool m_connected = false;
 };
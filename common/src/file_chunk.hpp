@@ -0,0 +1,40 @@
+#pragma once
+#include <QByteArray>
+#include <QtEndian>
+
+// Binary frame carrying one piece of a file transfer. JSON frames always start with '{', so a
+// leading zero byte tells the two apart on the same connection. Layout after the usual length
+// prefix: marker (0), kind (1), quint64 transfer id, quint64 offset, then the data itself.
+// The server relays these frames unchanged, so the data is never decoded or re-encoded.
+struct FileChunk {
+    static constexpr char kMarker = '\0';
+    static constexpr char kKind = 1;
+    static constexpr qsizetype kHeaderSize = 2 + 2 * sizeof(quint64);
+    static constexpr qint64 kMaxDataSize = 64 * 1024;
+    // Bytes a sender may have in flight beyond what the receiver has confirmed.
+    static constexpr qint64 kWindowBytes = 1024 * 1024;
+
+    quint64 transferId = 0;
+    qint64 offset = 0;
+    qint64 size = 0;
+
+    static bool isChunk(const QByteArray& frame) {
+        return !frame.isEmpty() && frame[0] == kMarker;
+    }
+
+    static bool parse(const QByteArray& frame, FileChunk& chunk) {
+        if (frame.size() < kHeaderSize || frame[0] != kMarker || frame[1] != kKind) return false;
+
+        chunk.transferId = qFromBigEndian<quint64>(frame.constData() + 2);
+        chunk.offset = static_cast<qint64>(qFromBigEndian<quint64>(frame.constData() + 2 + sizeof(quint64)));
+        chunk.size = frame.size() - kHeaderSize;
+        return chunk.offset >= 0;
+    }
+
+    static void writeHeader(char* frame, quint64 transferId, qint64 offset) {
+        frame[0] = kMarker;
+        frame[1] = kKind;
+        qToBigEndian(transferId, frame + 2);
+        qToBigEndian(static_cast<quint64>(offset), frame + 2 + sizeof(quint64));
+    }
+};
@@ -0,0 +1,49 @@
+#include "local_transport.hpp"
+#include <QFile>
+#include <QMetaObject>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+QTcpSocket* LocalTransport::connectTo(const QString& address, quint16 port, QObject* parent) {
+    Q_UNUSED(port);
+    QTcpSocket* socket = new QTcpSocket(parent);
+
+#ifdef Q_OS_UNIX
+    QByteArray path = QFile::encodeName(address);
+    sockaddr_un socketAddress = {};
+    socketAddress.sun_family = AF_UNIX;
+
+    if (!path.isEmpty() && path.size() < static_cast<qsizetype>(sizeof(socketAddress.sun_path))) {
+        std::memcpy(socketAddress.sun_path, path.constData(), path.size());
+
+        // Connecting to a local socket completes (or fails) immediately, so there is no pending state to track.
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd != -1 && ::connect(fd, reinterpret_cast<sockaddr*>(&socketAddress), sizeof(socketAddress)) == 0 &&
+            socket->setSocketDescriptor(fd)) {
+            QMetaObject::invokeMethod(socket, "connected", Qt::QueuedConnection);
+            return socket;
+        }
+
+        qDebug() << "Cannot connect to Unix socket" << address << ":" << std::strerror(errno);
+        if (fd != -1) {
+            ::close(fd);
+        }
+    } else {
+        qDebug() << "Unix socket path is empty or too long:" << address;
+    }
+#else
+    qDebug() << "Unix domain sockets are not supported on this platform";
+#endif
+
+    QMetaObject::invokeMethod(socket, [socket]() {
+        emit socket->errorOccurred(QAbstractSocket::ConnectionRefusedError);
+    }, Qt::QueuedConnection);
+    return socket;
+}
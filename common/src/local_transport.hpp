@@ -0,0 +1,9 @@
+#pragma once
+#include "transport.hpp"
+
+// Connects over a Unix domain socket; the address is the socket path and the port is ignored.
+// The descriptor is wrapped in a QTcpSocket, so the client code above it does not change.
+class LocalTransport : public Transport {
+public:
+    QTcpSocket* connectTo(const QString& address, quint16 port, QObject* parent) override;
+};
@@ -0,0 +1,177 @@
+#include "pipe_transport.hpp"
+#include <QHostAddress>
+#include <QMetaObject>
+#include <cstring>
+#include <utility>
+
+PipeSocket::PipeSocket(QObject* parent) : QTcpSocket(parent) {
+    setOpenMode(QIODevice::ReadWrite | QIODevice::Unbuffered);
+    setSocketState(QAbstractSocket::ConnectedState);
+    setLocalAddress(QHostAddress::LocalHost);
+    setPeerAddress(QHostAddress::LocalHost);
+}
+
+QPair<PipeSocket*, PipeSocket*> PipeSocket::createPair(QObject* parent) {
+    PipeSocket* local = new PipeSocket(parent);
+    PipeSocket* remote = new PipeSocket(nullptr);
+    local->m_peer = remote;
+    remote->m_peer = local;
+
+    // Both ends are connected from the start; connected() is still delivered asynchronously so
+    // callers can hook up their slots first.
+    QMetaObject::invokeMethod(local, [local]() {local->emitConnected();}, Qt::QueuedConnection);
+    remote->m_connectedEmitted = true;
+    return {local, remote};
+}
+
+PipeSocket::~PipeSocket() {
+    if (m_peer) {
+        PipeSocket* peer = m_peer;
+        m_peer = nullptr;
+        peer->m_peer = nullptr;
+        QMetaObject::invokeMethod(peer, [peer]() {peer->onPeerClosed();}, Qt::QueuedConnection);
+    }
+
+    // Otherwise ~QAbstractSocket() would run its own disconnect on an end that has no socket engine.
+    setSocketState(QAbstractSocket::UnconnectedState);
+}
+
+void PipeSocket::setPeerEndpoint(const QHostAddress& address, quint16 port) {
+    setPeerAddress(address);
+    setPeerPort(port);
+}
+
+void PipeSocket::emitConnected() {
+    if (m_connectedEmitted || state() != QAbstractSocket::ConnectedState) return;
+    m_connectedEmitted = true;
+    emit connected();
+}
+
+qint64 PipeSocket::bytesAvailable() const {
+    return m_inbound.size() - m_readOffset + QIODevice::bytesAvailable();
+}
+
+qint64 PipeSocket::bytesToWrite() const {
+    return m_peer ? m_peer->m_inbound.size() - m_peer->m_readOffset : 0;
+}
+
+qint64 PipeSocket::readData(char* data, qint64 maxSize) {
+    qint64 count = qMin<qint64>(maxSize, m_inbound.size() - m_readOffset);
+    if (count <= 0) {
+        return state() == QAbstractSocket::ConnectedState ? 0 : -1;
+    }
+
+    std::memcpy(data, m_inbound.constData() + m_readOffset, static_cast<size_t>(count));
+    m_readOffset += count;
+    if (m_peer) {
+        m_peer->onPeerRead(count);
+    }
+
+    // Consumed bytes are dropped in bulk rather than shifting the buffer on every read.
+    if (m_readOffset == m_inbound.size()) {
+        m_inbound.resize(0);
+        m_readOffset = 0;
+    } else if (m_readOffset > m_inbound.size() / 2) {
+        m_inbound.remove(0, m_readOffset);
+        m_readOffset = 0;
+    }
+    return count;
+}
+
+qint64 PipeSocket::writeData(const char* data, qint64 size) {
+    if (!m_peer || state() != QAbstractSocket::ConnectedState) {
+        return -1;
+    }
+    m_peer->receive(data, size);
+    return size;
+}
+
+void PipeSocket::receive(const char* data, qint64 size) {
+    m_inbound.append(data, size);
+
+    if (!m_readyReadPending) {
+        m_readyReadPending = true;
+        QMetaObject::invokeMethod(this, [this]() {
+            m_readyReadPending = false;
+            if (bytesAvailable() > 0) {
+                emit readyRead();
+            }
+        }, Qt::QueuedConnection);
+    }
+}
+
+void PipeSocket::onPeerRead(qint64 size) {
+    // Reads in one pass of the event loop are announced together, as the kernel would.
+    if (m_bytesWrittenPending == 0) {
+        QMetaObject::invokeMethod(this, [this]() {
+            qint64 written = std::exchange(m_bytesWrittenPending, 0);
+            if (written > 0 && state() == QAbstractSocket::ConnectedState) {
+                emit bytesWritten(written);
+            }
+        }, Qt::QueuedConnection);
+    }
+    m_bytesWrittenPending += size;
+}
+
+void PipeSocket::close() {
+    bool wasConnected = state() == QAbstractSocket::ConnectedState;
+
+    if (m_peer) {
+        PipeSocket* peer = m_peer;
+        m_peer = nullptr;
+        peer->m_peer = nullptr;
+        QMetaObject::invokeMethod(peer, [peer]() {peer->onPeerClosed();}, Qt::QueuedConnection);
+    }
+
+    setSocketState(QAbstractSocket::UnconnectedState);
+    QIODevice::close();
+    m_inbound.clear();
+    m_readOffset = 0;
+
+    if (wasConnected) {
+        emit stateChanged(QAbstractSocket::UnconnectedState);
+        emit disconnected();
+    }
+}
+
+void PipeSocket::onPeerClosed() {
+    // Whatever the peer wrote before closing is announced first, as with an orderly TCP shutdown.
+    if (bytesAvailable() > 0) {
+        emit readyRead();
+    }
+    close();
+}
+
+void PipeSocket::disconnectFromHost() {
+    close();
+}
+
+bool PipeSocket::waitForConnected(int msecs) {
+    Q_UNUSED(msecs);
+    emitConnected();
+    return state() == QAbstractSocket::ConnectedState;
+}
+
+bool PipeSocket::waitForReadyRead(int msecs) {
+    Q_UNUSED(msecs);
+    return bytesAvailable() > 0;
+}
+
+bool PipeSocket::waitForBytesWritten(int msecs) {
+    Q_UNUSED(msecs);
+    return false;
+}
+
+bool PipeSocket::waitForDisconnected(int msecs) {
+    Q_UNUSED(msecs);
+    return state() == QAbstractSocket::UnconnectedState;
+}
+
+QTcpSocket* PipeTransport::connectTo(const QString& address, quint16 port, QObject* parent) {
+    Q_UNUSED(address);
+    Q_UNUSED(port);
+
+    QPair<PipeSocket*, PipeSocket*> pair = PipeSocket::createPair(parent);
+    m_acceptor(pair.second);
+    return pair.first;
+}
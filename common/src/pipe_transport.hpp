@@ -0,0 +1,60 @@
+#pragma once
+#include "transport.hpp"
+#include <QPointer>
+#include <QPair>
+#include <functional>
+
+// One end of an in-memory connection. Writes are appended to the peer's inbound buffer and
+// announced with a queued readyRead(), so delivery follows event loop order like a real socket
+// would, without the kernel in between. What the peer has not read yet counts as bytesToWrite(),
+// and bytesWritten() follows as it reads, so a slow reader pushes back like a full socket buffer.
+class PipeSocket : public QTcpSocket {
+public:
+    static QPair<PipeSocket*, PipeSocket*> createPair(QObject* parent = nullptr);
+    ~PipeSocket() override;
+
+    // For an end standing in for a real client, so the far side sees the client's address.
+    void setPeerEndpoint(const QHostAddress& address, quint16 port);
+
+    qint64 bytesAvailable() const override;
+    qint64 bytesToWrite() const override;
+    void close() override;
+    void disconnectFromHost() override;
+    bool waitForConnected(int msecs = 30000) override;
+    bool waitForReadyRead(int msecs = 30000) override;
+    bool waitForBytesWritten(int msecs = 30000) override;
+    bool waitForDisconnected(int msecs = 30000) override;
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override;
+    qint64 writeData(const char* data, qint64 size) override;
+
+private:
+    explicit PipeSocket(QObject* parent);
+
+    void emitConnected();
+    void receive(const char* data, qint64 size);
+    void onPeerRead(qint64 size);
+    void onPeerClosed();
+
+    QPointer<PipeSocket> m_peer;
+    QByteArray m_inbound;
+    qsizetype m_readOffset = 0;
+    bool m_readyReadPending = false;
+    qint64 m_bytesWrittenPending = 0;
+    bool m_connectedEmitted = false;
+};
+
+// Connects clients through PipeSockets. The far end of each pair goes to the acceptor, normally
+// Server::acceptConnection.
+class PipeTransport : public Transport {
+public:
+    using Acceptor = std::function<void(QTcpSocket*)>;
+
+    explicit PipeTransport(Acceptor acceptor) : m_acceptor(std::move(acceptor)) {}
+
+    QTcpSocket* connectTo(const QString& address, quint16 port, QObject* parent) override;
+
+private:
+    Acceptor m_acceptor;
+};
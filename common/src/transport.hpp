@@ -0,0 +1,22 @@
+#pragma once
+#include <QTcpSocket>
+#include <QString>
+
+// Supplies the socket a client talks to the server over. QTcpSocket stays the connection type on
+// both sides, so a transport only decides what is behind it and the protocol code is shared.
+class Transport {
+public:
+    virtual ~Transport() = default;
+
+    // Returns a socket that is connecting to address:port; it emits connected() once it is up.
+    virtual QTcpSocket* connectTo(const QString& address, quint16 port, QObject* parent) = 0;
+};
+
+class TcpTransport : public Transport {
+public:
+    QTcpSocket* connectTo(const QString& address, quint16 port, QObject* parent) override {
+        QTcpSocket* socket = new QTcpSocket(parent);
+        socket->connectToHost(address, port);
+        return socket;
+    }
+};
@@ -0,0 +1,71 @@
+#include "replayer.hpp"
+#include "traffic_recorder.hpp"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QJsonDocument>
+#include <QFile>
+#include <QTextStream>
+#include <QDebug>
+
+// Replays a capture written by `server --capture` and prints a JSON report. With --baseline it
+// also prints how throughput and latency changed against a report from an earlier build.
+int main(int argc, char** argv) {
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Replays captured messenger traffic against a server");
+    parser.addHelpOption();
+    parser.addPositionalArgument("capture", "Capture file written by the server.");
+    QCommandLineOption hostOption("host", "Server to replay against.", "host", "127.0.0.1");
+    QCommandLineOption portOption("port", "Server port.", "port", "5464");
+    QCommandLineOption speedOption("speed", "Playback speed factor; 0 sends as fast as possible.", "factor", "1");
+    QCommandLineOption reportOption("report", "Also write the report to this file.", "file");
+    QCommandLineOption baselineOption("baseline", "Report of an earlier run to compare with.", "file");
+    parser.addOptions({hostOption, portOption, speedOption, reportOption, baselineOption});
+    parser.process(a);
+
+    if (parser.positionalArguments().size() != 1) {
+        parser.showHelp(1);
+    }
+
+    QList<TrafficRecorder::Record> records;
+    QString error;
+    if (!TrafficRecorder::readCapture(parser.positionalArguments().first(), records, error)) {
+        qDebug() << "Cannot read capture:" << error;
+        return 1;
+    }
+
+    QJsonObject baseline;
+    if (parser.isSet(baselineOption)) {
+        QFile baselineFile(parser.value(baselineOption));
+        if (!baselineFile.open(QIODevice::ReadOnly)) {
+            qDebug() << "Cannot read baseline:" << baselineFile.errorString();
+            return 1;
+        }
+        baseline = QJsonDocument::fromJson(baselineFile.readAll()).object();
+    }
+
+    Replayer replayer(records, parser.value(hostOption), parser.value(portOption).toUShort(),
+                      qMax(0.0, parser.value(speedOption).toDouble()));
+    QObject::connect(&replayer, &Replayer::finished, &a, &QCoreApplication::quit);
+    replayer.start();
+    a.exec();
+
+    QJsonObject report = replayer.report();
+    if (parser.isSet(reportOption)) {
+        QFile reportFile(parser.value(reportOption));
+        if (!reportFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            qDebug() << "Cannot write report:" << reportFile.errorString();
+            return 1;
+        }
+        reportFile.write(QJsonDocument(report).toJson());
+    }
+
+    QJsonObject output;
+    output["report"] = report;
+    if (!baseline.isEmpty()) {
+        output["comparison"] = Replayer::compare(report, baseline);
+    }
+    QTextStream(stdout) << QJsonDocument(output).toJson();
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include "replayer.hpp"
+#include "frame_reader.hpp"
+#include <QtEndian>
+#include <QDebug>
+#include <algorithm>
+
+Replayer::Replayer(const QList<TrafficRecorder::Record>& records, const QString& host, quint16 port, double speed,
+                   QObject* parent) : QObject(parent), m_records(records), m_host(host), m_port(port), m_speed(speed) {
+    m_dispatchTimer.setSingleShot(true);
+    m_dispatchTimer.setTimerType(Qt::PreciseTimer);
+    connect(&m_dispatchTimer, &QTimer::timeout, this, &Replayer::dispatchDue);
+
+    m_settleTimer.setSingleShot(true);
+    m_settleTimer.setInterval(kSettleMs);
+    connect(&m_settleTimer, &QTimer::timeout, this, &Replayer::finish);
+}
+
+void Replayer::start() {
+    m_clock.start();
+    dispatchDue();
+}
+
+void Replayer::dispatchDue() {
+    qint64 elapsedUs = m_clock.nsecsElapsed() / 1000;
+
+    while (m_next < m_records.size()) {
+        const TrafficRecorder::Record& record = m_records[m_next];
+        qint64 dueUs = m_speed > 0 ? static_cast<qint64>(record.timestampUs / m_speed) : 0;
+        if (dueUs > elapsedUs) {
+            m_dispatchTimer.start(static_cast<int>((dueUs - elapsedUs + 999) / 1000));
+            return;
+        }
+
+        dispatch(record);
+        ++m_next;
+    }
+
+    m_sendFinishedNs = m_clock.nsecsElapsed();
+    m_settleTimer.start();
+}
+
+void Replayer::dispatch(const TrafficRecorder::Record& record) {
+    if (record.kind == TrafficRecorder::Open) {
+        QTcpSocket* socket = new QTcpSocket(this);
+        connect(socket, &QTcpSocket::readyRead, this, &Replayer::onReadyRead);
+        socket->connectToHost(m_host, m_port);
+
+        Connection connection;
+        connection.socket = socket;
+        m_connections[record.connection] = connection;
+        m_socketToConnection[socket] = record.connection;
+        return;
+    }
+
+    auto it = m_connections.find(record.connection);
+    if (it == m_connections.end() || !it->socket) {
+        return;
+    }
+
+    if (record.kind == TrafficRecorder::Close) {
+        it->socket->disconnectFromHost();
+        return;
+    }
+
+    // Writes made while the socket is still connecting are buffered and go out once it is up.
+    QByteArray prefix(sizeof(quint32), Qt::Uninitialized);
+    qToBigEndian(static_cast<quint32>(record.payload.size()), prefix.data());
+    it->socket->write(prefix);
+    it->socket->write(record.payload);
+    it->awaitingResponse.append(m_clock.nsecsElapsed());
+
+    ++m_framesSent;
+    m_bytesSent += prefix.size() + record.payload.size();
+}
+
+void Replayer::onReadyRead() {
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket || !m_socketToConnection.contains(socket)) return;
+
+    Connection& connection = m_connections[m_socketToConnection.value(socket)];
+    while (true) {
+        QByteArray frame;
+        FrameReader::Result result = FrameReader::readFrame(socket, connection.expectedSize,
+                                                            FrameReader::kDefaultMaxFrameSize, frame);
+        if (result != FrameReader::Complete) {
+            if (result != FrameReader::Incomplete) {
+                qDebug() << "Dropping replay connection after unreadable frame";
+                socket->abort();
+            }
+            break;
+        }
+
+        ++m_framesReceived;
+        if (!connection.awaitingResponse.isEmpty()) {
+            m_latenciesNs.append(m_clock.nsecsElapsed() - connection.awaitingResponse.takeFirst());
+        }
+    }
+}
+
+void Replayer::finish() {
+    for (const Connection& connection : std::as_const(m_connections)) {
+        if (connection.socket) {
+            connection.socket->abort();
+        }
+    }
+    emit finished();
+}
+
+static qint64 percentileUs(const QList<qint64>& sortedNs, double fraction) {
+    if (sortedNs.isEmpty()) return 0;
+    qsizetype index = qMin(sortedNs.size() - 1, static_cast<qsizetype>(fraction * sortedNs.size()));
+    return sortedNs[index] / 1000;
+}
+
+QJsonObject Replayer::report() const {
+    QList<qint64> sorted = m_latenciesNs;
+    std::sort(sorted.begin(), sorted.end());
+
+    double seconds = m_sendFinishedNs / 1e9;
+
+    QJsonObject latency;
+    latency["samples"] = static_cast<qint64>(sorted.size());
+    latency["p50Us"] = percentileUs(sorted, 0.50);
+    latency["p90Us"] = percentileUs(sorted, 0.90);
+    latency["p99Us"] = percentileUs(sorted, 0.99);
+    latency["maxUs"] = sorted.isEmpty() ? 0 : sorted.last() / 1000;
+
+    QJsonObject report;
+    report["speed"] = m_speed;
+    report["connections"] = static_cast<qint64>(m_connections.size());
+    report["framesSent"] = m_framesSent;
+    report["bytesSent"] = m_bytesSent;
+    report["framesReceived"] = m_framesReceived;
+    report["durationMs"] = m_sendFinishedNs / 1000000;
+    report["framesPerSec"] = seconds > 0 ? m_framesSent / seconds : 0.0;
+    report["latency"] = latency;
+    return report;
+}
+
+QJsonObject Replayer::compare(const QJsonObject& current, const QJsonObject& baseline) {
+    auto change = [](double now, double before) {
+        QJsonObject entry;
+        entry["baseline"] = before;
+        entry["current"] = now;
+        entry["changePercent"] = before != 0 ? (now - before) * 100.0 / before : 0.0;
+        return entry;
+    };
+
+    QJsonObject diff;
+    diff["framesPerSec"] = change(current["framesPerSec"].toDouble(), baseline["framesPerSec"].toDouble());
+
+    const QJsonObject latency = current["latency"].toObject();
+    const QJsonObject baselineLatency = baseline["latency"].toObject();
+    for (const QString& key : {QStringLiteral("p50Us"), QStringLiteral("p90Us"), QStringLiteral("p99Us"), QStringLiteral("maxUs")}) {
+        diff[key] = change(latency[key].toDouble(), baselineLatency[key].toDouble());
+    }
+    return diff;
+}
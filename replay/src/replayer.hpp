@@ -0,0 +1,60 @@
+#pragma once
+#include <QObject>
+#include <QTcpSocket>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QTimer>
+#include <QJsonObject>
+#include "traffic_recorder.hpp"
+
+// Plays a capture back against a server. Every captured connection gets its own socket, and
+// records are sent at their captured offset divided by the speed factor (speed 0 sends them as
+// fast as possible). Latency is measured from sending a frame to the next frame the server
+// sends back on that connection.
+class Replayer : public QObject {
+    Q_OBJECT
+
+signals:
+    void finished();
+
+private slots:
+    void dispatchDue();
+    void onReadyRead();
+    void finish();
+
+public:
+    static constexpr int kSettleMs = 2000;
+
+    struct Connection {
+        QTcpSocket* socket = nullptr;
+        quint32 expectedSize = 0;
+        QList<qint64> awaitingResponse;
+    };
+
+    Replayer(const QList<TrafficRecorder::Record>& records, const QString& host, quint16 port, double speed,
+             QObject* parent = nullptr);
+    void start();
+    QJsonObject report() const;
+
+    static QJsonObject compare(const QJsonObject& current, const QJsonObject& baseline);
+
+private:
+    void dispatch(const TrafficRecorder::Record& record);
+
+    QList<TrafficRecorder::Record> m_records;
+    QString m_host;
+    quint16 m_port;
+    double m_speed;
+    qsizetype m_next = 0;
+    QHash<quint32, Connection> m_connections;
+    QHash<QTcpSocket*, quint32> m_socketToConnection;
+    QElapsedTimer m_clock;
+    QTimer m_dispatchTimer;
+    QTimer m_settleTimer;
+    qint64 m_sendFinishedNs = 0;
+    qint64 m_framesSent = 0;
+    qint64 m_bytesSent = 0;
+    qint64 m_framesReceived = 0;
+    QList<qint64> m_latenciesNs;
+};
@@ -0,0 +1,353 @@
+#include "admin_channel.hpp"
+#include "server.hpp"
+#include "frame_reader.hpp"
+#include "local_listener.hpp"
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QDateTime>
+#include <QFile>
+#include <QtEndian>
+#include <QDebug>
+
+// Compares every byte whatever the first mismatch, so response timing says nothing about the token.
+static bool tokensMatch(const QByteArray& given, const QByteArray& expected) {
+    if (given.size() != expected.size()) return false;
+
+    uchar difference = 0;
+    for (qsizetype i = 0; i < given.size(); ++i) {
+        difference |= static_cast<uchar>(given[i] ^ expected[i]);
+    }
+    return difference == 0;
+}
+
+AdminChannel::AdminChannel(Server* server, const QByteArray& token, QObject* parent)
+    : QObject(parent), m_server(server), m_token(token), m_listener(nullptr), m_localListener(nullptr) {
+    m_jobTimer.setSingleShot(true);
+    m_jobTimer.setInterval(0);
+    connect(&m_jobTimer, &QTimer::timeout, this, &AdminChannel::runJobs);
+}
+
+AdminChannel::~AdminChannel() {
+    if (m_listener) {
+        m_listener->close();
+    }
+}
+
+bool AdminChannel::listen(const QHostAddress& address, quint16 port) {
+    if (m_token.isEmpty()) {
+        qWarning() << "Admin channel needs a token";
+        return false;
+    }
+    if (!m_listener) {
+        m_listener = new QTcpServer(this);
+        connect(m_listener, &QTcpServer::newConnection, this, &AdminChannel::onNewConnection);
+    }
+
+    if (!m_listener->listen(address, port)) {
+        qWarning() << "Admin channel cannot listen on port" << port << ":" << m_listener->errorString();
+        return false;
+    }
+    qInfo() << "Admin channel listening on port" << m_listener->serverPort();
+    return true;
+}
+
+bool AdminChannel::listenLocal(const QString& path) {
+    if (m_token.isEmpty()) {
+        qWarning() << "Admin channel needs a token";
+        return false;
+    }
+    if (!m_localListener) {
+        m_localListener = new LocalListener(this);
+        connect(m_localListener, &LocalListener::connectionAccepted, this, &AdminChannel::acceptConnection);
+    }
+
+    if (!m_localListener->listen(path)) {
+        return false;
+    }
+    QFile::setPermissions(path, QFile::ReadOwner | QFile::WriteOwner);
+    return true;
+}
+
+// Stops accepting; admins already signed in stay connected.
+void AdminChannel::close() {
+    if (m_listener) {
+        m_listener->close();
+    }
+    if (m_localListener) {
+        m_localListener->close();
+    }
+}
+
+quint16 AdminChannel::serverPort() const {
+    return m_listener ? m_listener->serverPort() : 0;
+}
+
+void AdminChannel::onNewConnection() {
+    while (QTcpSocket* socket = m_listener->nextPendingConnection()) {
+        acceptConnection(socket);
+    }
+}
+
+void AdminChannel::acceptConnection(QTcpSocket* socket) {
+    if (!socket->parent()) {
+        socket->setParent(this);
+    }
+
+    m_connections.insert(socket, Connection());
+    connect(socket, &QTcpSocket::readyRead, this, &AdminChannel::onReadyRead);
+    connect(socket, &QTcpSocket::bytesWritten, this, &AdminChannel::onBytesWritten);
+    connect(socket, &QTcpSocket::disconnected, this, &AdminChannel::onDisconnected);
+}
+
+void AdminChannel::onReadyRead() {
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+
+    // A command may close the connection, so the entry is looked up again for every frame.
+    while (socket && m_connections.contains(socket)) {
+        Connection& connection = m_connections[socket];
+        QByteArray data;
+        FrameReader::Result result = FrameReader::readFrame(socket, connection.expectedSize, kMaxCommandSize, data);
+        if (result == FrameReader::Incomplete) return;
+        if (result != FrameReader::Complete) {
+            qDebug() << "Dropping admin connection after unreadable frame";
+            socket->abort();
+            return;
+        }
+
+        QJsonObject command = QJsonDocument::fromJson(data).object();
+        if (!connection.authenticated) {
+            bool accepted = command["type"].toString() == "admin_auth" &&
+                            tokensMatch(command["token"].toString().toUtf8(), m_token);
+            QJsonObject response;
+            response["type"] = accepted ? "auth_success" : "auth_error";
+            sendFrame(socket, response);
+            if (!accepted) {
+                qWarning() << "Admin authentication failed from" << socket->peerAddress().toString();
+                socket->disconnectFromHost();
+                return;
+            }
+            connection.authenticated = true;
+            continue;
+        }
+
+        processCommand(socket, connection, command);
+    }
+}
+
+void AdminChannel::processCommand(QTcpSocket* socket, Connection& connection, const QJsonObject& command) {
+    QString type = command["type"].toString();
+    QJsonValue id = command["id"];
+    qDebug() << "Admin command:" << type;
+
+    if (type == "list_sessions" || type == "list_connections" || type == "broadcast") {
+        Job job;
+        job.id = id;
+        job.pageSize = qBound(1, command["pageSize"].toInt(kDefaultPageSize), kMaxPageSize);
+        // Copying the keys only bumps reference counts; everything else is read page by page.
+        if (type == "list_sessions") {
+            job.kind = ListSessions;
+            job.names = m_server->m_clients.keys();
+        } else if (type == "list_connections") {
+            job.kind = ListConnections;
+            job.sockets = m_server->m_buffers.keys();
+        } else {
+            job.text = command["text"].toString();
+            if (job.text.isEmpty()) {
+                sendError(socket, id, "Broadcast text is empty");
+                return;
+            }
+            job.kind = Broadcast;
+            job.names = m_server->m_clients.keys();
+        }
+        connection.jobs.append(job);
+        scheduleJobs();
+    }
+    else if (type == "disconnect") {
+        disconnectSession(socket, command);
+    }
+    else if (type == "stats") {
+        QJsonObject response;
+        response["type"] = "stats";
+        response["id"] = id;
+        response["memory"] = m_server->memoryReport();
+        response["outboundQueues"] = m_server->m_outbound.size();
+        response["transfers"] = m_server->m_transfers.size();
+        response["draining"] = m_server->isDraining();
+        sendFrame(socket, response);
+    }
+    else {
+        sendError(socket, id, QString("Unknown command: %1").arg(type));
+    }
+}
+
+void AdminChannel::disconnectSession(QTcpSocket* socket, const QJsonObject& command) {
+    QString name = command["name"].toString();
+    auto it = m_server->m_clients.constFind(name);
+    bool found = it != m_server->m_clients.constEnd();
+
+    if (found) {
+        qInfo() << "Admin disconnecting" << name;
+        QTcpSocket* clientSocket = it->socket;
+        // Without this the client would resume with its token straight away.
+        m_server->revokeSessions(name);
+        m_server->removeClient(name);
+        if (clientSocket) {
+            clientSocket->disconnectFromHost();
+        }
+    }
+
+    QJsonObject response;
+    response["type"] = "disconnected";
+    response["id"] = command["id"];
+    response["name"] = name;
+    response["found"] = found;
+    sendFrame(socket, response);
+}
+
+void AdminChannel::onBytesWritten() {
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    if (socket && !m_connections.value(socket).jobs.isEmpty()) {
+        scheduleJobs();
+    }
+}
+
+void AdminChannel::scheduleJobs() {
+    if (!m_jobTimer.isActive()) {
+        m_jobTimer.start();
+    }
+}
+
+// One page for every connection that can take it, then back to the event loop. Connections
+// whose output is backed up continue from onBytesWritten.
+void AdminChannel::runJobs() {
+    bool more = false;
+    for (auto it = m_connections.begin(); it != m_connections.end(); ++it) {
+        if (it->jobs.isEmpty() || it.key()->bytesToWrite() >= kMaxPendingOutput) continue;
+
+        if (runJobStep(it.key(), it->jobs.first())) {
+            it->jobs.removeFirst();
+        }
+        more = more || !it->jobs.isEmpty();
+    }
+
+    if (more) {
+        scheduleJobs();
+    }
+}
+
+bool AdminChannel::runJobStep(QTcpSocket* socket, Job& job) {
+    qsizetype total = job.kind == ListConnections ? job.sockets.size() : job.names.size();
+    qsizetype end = qMin(total, job.next + job.pageSize);
+
+    if (job.kind == Broadcast) {
+        for (qsizetype i = job.next; i < end; ++i) {
+            auto client = m_server->m_clients.constFind(job.names[i]);
+            if (client != m_server->m_clients.constEnd() && client->socket) {
+                m_server->sendToClient(job.names[i], job.text);
+                ++job.delivered;
+            }
+        }
+        job.next = end;
+        if (job.next < total) return false;
+
+        QJsonObject response;
+        response["type"] = "broadcast_done";
+        response["id"] = job.id;
+        response["delivered"] = job.delivered;
+        sendFrame(socket, response);
+        return true;
+    }
+
+    QJsonArray entries;
+    for (qsizetype i = job.next; i < end; ++i) {
+        QJsonObject entry = job.kind == ListSessions ? sessionEntry(job.names[i]) : connectionEntry(job.sockets[i]);
+        if (!entry.isEmpty()) {
+            entries.append(entry);
+        }
+    }
+
+    QJsonObject page;
+    page["type"] = job.kind == ListSessions ? "sessions" : "connections";
+    page["id"] = job.id;
+    page["offset"] = static_cast<qint64>(job.next);
+    page["total"] = static_cast<qint64>(total);
+    page["entries"] = entries;
+    page["done"] = end == total;
+    sendFrame(socket, page);
+
+    job.next = end;
+    return end == total;
+}
+
+QJsonObject AdminChannel::sessionEntry(const QString& name) const {
+    auto it = m_server->m_clients.constFind(name);
+    if (it == m_server->m_clients.constEnd()) return QJsonObject();
+
+    QJsonObject entry;
+    entry["name"] = name;
+    entry["interlocutor"] = it->interlocutor;
+    entry["attached"] = it->socket != nullptr;
+    entry["unacked"] = static_cast<qint64>(it->unacked.size());
+    if (it->detachedAt != 0) {
+        entry["detachedMs"] = QDateTime::currentMSecsSinceEpoch() - it->detachedAt;
+    }
+
+    if (it->socket) {
+        QJsonObject connection = connectionEntry(it->socket);
+        entry["bytesIn"] = connection["bytesIn"];
+        entry["bytesOut"] = connection["bytesOut"];
+        entry["queuedBytes"] = connection["queuedBytes"];
+    }
+    return entry;
+}
+
+QJsonObject AdminChannel::connectionEntry(QTcpSocket* socket) const {
+    // The snapshot may hold sockets that have since closed; those are not dereferenced.
+    auto it = m_server->m_buffers.constFind(socket);
+    if (it == m_server->m_buffers.constEnd()) return QJsonObject();
+
+    qint64 queuedBytes = socket->bytesToWrite();
+    auto queue = m_server->m_outbound.constFind(socket);
+    if (queue != m_server->m_outbound.constEnd()) {
+        queuedBytes += queue->queuedBytes;
+    }
+
+    QJsonObject entry;
+    entry["peer"] = QString("%1:%2").arg(socket->peerAddress().toString()).arg(socket->peerPort());
+    entry["name"] = m_server->m_socketToName.value(socket);
+    entry["bytesIn"] = it->bytesIn;
+    entry["bytesOut"] = it->bytesOut;
+    entry["framesIn"] = it->framesIn;
+    entry["framesOut"] = it->framesOut;
+    entry["queuedBytes"] = queuedBytes;
+    entry["idleMs"] = QDateTime::currentMSecsSinceEpoch() - it->lastActivity;
+    return entry;
+}
+
+void AdminChannel::sendFrame(QTcpSocket* socket, const QJsonObject& frame) {
+    if (socket->state() != QAbstractSocket::ConnectedState) return;
+
+    QByteArray payload = QJsonDocument(frame).toJson(QJsonDocument::Compact);
+    char prefix[sizeof(quint32)];
+    qToBigEndian(static_cast<quint32>(payload.size()), prefix);
+    socket->write(prefix, sizeof(prefix));
+    socket->write(payload);
+}
+
+void AdminChannel::sendError(QTcpSocket* socket, const QJsonValue& id, const QString& message) {
+    QJsonObject response;
+    response["type"] = "error";
+    response["id"] = id;
+    response["message"] = message;
+    sendFrame(socket, response);
+}
+
+void AdminChannel::onDisconnected() {
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket) return;
+
+    m_connections.remove(socket);
+    socket->deleteLater();
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QStringList>
+#include <QByteArray>
+#include <QHostAddress>
+#include <QJsonObject>
+#include <QTimer>
+
+class QTcpServer;
+class QTcpSocket;
+class LocalListener;
+class Server;
+
+// Operator access to a running server, on a loopback port or a Unix socket. It speaks the same
+// length-prefixed JSON frames as clients; nothing but admin_auth with the shared token is
+// accepted until the connection has signed in. Listings and broadcasts work from a snapshot of
+// names taken when the command arrives and go out one page per event loop pass, so a query
+// over 100k sessions never holds up the relay. Each page looks its entries up live and skips
+// those that went away after the snapshot.
+class AdminChannel : public QObject {
+    Q_OBJECT
+
+public:
+    static constexpr int kDefaultPageSize = 500;
+    static constexpr int kMaxPageSize = 5000;
+    static constexpr quint32 kMaxCommandSize = 64 * 1024;
+    // Pages wait while this much is still unsent to the admin, so a slow reader costs no memory.
+    static constexpr qint64 kMaxPendingOutput = 256 * 1024;
+
+    enum JobKind {
+        ListSessions,
+        ListConnections,
+        Broadcast
+    };
+
+    struct Job {
+        JobKind kind = ListSessions;
+        QJsonValue id;
+        QStringList names;
+        QList<QTcpSocket*> sockets;
+        qsizetype next = 0;
+        int pageSize = kDefaultPageSize;
+        QString text;
+        qint64 delivered = 0;
+    };
+
+    struct Connection {
+        bool authenticated = false;
+        quint32 expectedSize = 0;
+        QList<Job> jobs;
+    };
+
+    AdminChannel(Server* server, const QByteArray& token, QObject* parent = nullptr);
+    ~AdminChannel();
+
+    bool listen(const QHostAddress& address, quint16 port);
+    bool listenLocal(const QString& path);
+    void close();
+    quint16 serverPort() const;
+    void acceptConnection(QTcpSocket* socket);
+    int connectionCount() const { return m_connections.size(); }
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+    void onBytesWritten();
+    void onDisconnected();
+    void runJobs();
+
+private:
+    void processCommand(QTcpSocket* socket, Connection& connection, const QJsonObject& command);
+    void disconnectSession(QTcpSocket* socket, const QJsonObject& command);
+    bool runJobStep(QTcpSocket* socket, Job& job);
+    QJsonObject sessionEntry(const QString& name) const;
+    QJsonObject connectionEntry(QTcpSocket* socket) const;
+    void sendFrame(QTcpSocket* socket, const QJsonObject& frame);
+    void sendError(QTcpSocket* socket, const QJsonValue& id, const QString& message);
+    void scheduleJobs();
+
+    Server* m_server;
+    QByteArray m_token;
+    QTcpServer* m_listener;
+    LocalListener* m_localListener;
+    QHash<QTcpSocket*, Connection> m_connections;
+    QTimer m_jobTimer;
+};
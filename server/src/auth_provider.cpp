@@ -0,0 +1,121 @@
+#include "auth_provider.hpp"
+#include <QFile>
+#include <QStringList>
+#include <QDateTime>
+#include <QCryptographicHash>
+#include <QMessageAuthenticationCode>
+#include <QPasswordDigestor>
+#include <QRandomGenerator>
+
+static const char kPbkdf2Scheme[] = "pbkdf2-sha256";
+
+static bool bytesMatch(const QByteArray& given, const QByteArray& expected) {
+    if (given.size() != expected.size()) return false;
+
+    uchar difference = 0;
+    for (qsizetype i = 0; i < given.size(); ++i) {
+        difference |= static_cast<uchar>(given[i] ^ expected[i]);
+    }
+    return difference == 0;
+}
+
+static QByteArray randomBytes(int size) {
+    QByteArray bytes(size, Qt::Uninitialized);
+    for (int i = 0; i < size; ++i) {
+        bytes[i] = static_cast<char>(QRandomGenerator::system()->bounded(256));
+    }
+    return bytes;
+}
+
+bool PasswordFileProvider::load(const QString& path, QString& error) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        error = QString("Cannot read %1: %2").arg(path, file.errorString());
+        return false;
+    }
+
+    QHash<QString, Entry> entries;
+    int lineNumber = 0;
+    while (!file.atEnd()) {
+        ++lineNumber;
+        QString line = QString::fromUtf8(file.readLine()).trimmed();
+        if (line.isEmpty() || line.startsWith('#')) continue;
+
+        // The hash holds no ':', so the last one separates it from a name that might.
+        qsizetype colon = line.lastIndexOf(':');
+        Entry entry;
+        if (colon <= 0 || !parseHash(line.mid(colon + 1), entry)) {
+            error = QString("%1:%2: expected name:%3$iterations$salt$hash").arg(path).arg(lineNumber).arg(kPbkdf2Scheme);
+            return false;
+        }
+        entries.insert(line.left(colon), entry);
+    }
+
+    m_entries = entries;
+    return true;
+}
+
+bool PasswordFileProvider::parseHash(const QString& text, Entry& entry) {
+    const QStringList parts = text.split('$');
+    if (parts.size() != 4 || parts[0] != kPbkdf2Scheme) return false;
+
+    bool ok = false;
+    entry.iterations = parts[1].toInt(&ok);
+    entry.salt = QByteArray::fromBase64(parts[2].toLatin1());
+    entry.hash = QByteArray::fromBase64(parts[3].toLatin1());
+    return ok && entry.iterations >= kMinIterations && !entry.salt.isEmpty() && entry.hash.size() == kHashSize;
+}
+
+QByteArray PasswordFileProvider::derive(const QString& password, const QByteArray& salt, int iterations) {
+    return QPasswordDigestor::deriveKeyPbkdf2(QCryptographicHash::Sha256, password.toUtf8(), salt, iterations, kHashSize);
+}
+
+bool PasswordFileProvider::verify(const QString& name, const QString& credential) const {
+    static const Entry dummy = {kDefaultIterations, randomBytes(kSaltSize), QByteArray(kHashSize, '\0')};
+
+    auto it = m_entries.constFind(name);
+    const Entry& entry = it != m_entries.constEnd() ? *it : dummy;
+    bool matches = bytesMatch(derive(credential, entry.salt, entry.iterations), entry.hash);
+    return matches && it != m_entries.constEnd();
+}
+
+QByteArray PasswordFileProvider::fingerprint(const QString& name) const {
+    auto it = m_entries.constFind(name);
+    if (it == m_entries.constEnd()) return QByteArray();
+    return QByteArray::number(it->iterations) + '$' + it->salt + '$' + it->hash;
+}
+
+QString PasswordFileProvider::entryFor(const QString& name, const QString& password, int iterations) {
+    QByteArray salt = randomBytes(kSaltSize);
+    return QString("%1:%2$%3$%4$%5")
+        .arg(name, kPbkdf2Scheme)
+        .arg(iterations)
+        .arg(QString::fromLatin1(salt.toBase64()), QString::fromLatin1(derive(password, salt, iterations).toBase64()));
+}
+
+bool TokenProvider::verify(const QString& name, const QString& credential) const {
+    if (m_key.isEmpty()) return false;
+
+    QByteArray raw = credential.toLatin1();
+    qsizetype dot = raw.indexOf('.');
+    if (dot <= 0) return false;
+
+    bool ok = false;
+    qint64 expiresAt = raw.left(dot).toLongLong(&ok);
+    if (!ok || expiresAt <= QDateTime::currentSecsSinceEpoch()) return false;
+
+    QByteArray mac = QByteArray::fromBase64(raw.mid(dot + 1), QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
+    QByteArray expected = QMessageAuthenticationCode::hash(name.toUtf8() + '\n' + raw.left(dot), m_key,
+                                                           QCryptographicHash::Sha256);
+    return bytesMatch(mac, expected);
+}
+
+QByteArray TokenProvider::fingerprint(const QString&) const {
+    return QCryptographicHash::hash(m_key, QCryptographicHash::Sha256);
+}
+
+QString TokenProvider::issue(const QByteArray& key, const QString& name, qint64 expiresAt) {
+    QByteArray expiry = QByteArray::number(expiresAt);
+    QByteArray mac = QMessageAuthenticationCode::hash(name.toUtf8() + '\n' + expiry, key, QCryptographicHash::Sha256);
+    return QString::fromLatin1(expiry + '.' + mac.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals));
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+
+// Checks the credential a client signs in with. verify() runs on a worker thread, possibly on
+// several at once, so a provider must not change after construction; reloading means building
+// a new one and handing it to the Authenticator.
+class AuthProvider {
+public:
+    virtual ~AuthProvider() = default;
+    virtual bool verify(const QString& name, const QString& credential) const = 0;
+    // What the provider holds for the name. Sessions started before it changed cannot be resumed.
+    virtual QByteArray fingerprint(const QString&) const { return QByteArray(); }
+};
+
+// Passwords from a file of "name:pbkdf2-sha256$iterations$salt$hash" lines, salt and hash in
+// base64. Blank lines and lines starting with '#' are skipped. A name missing from the file is
+// checked against a dummy entry, so the time to answer does not tell which names exist.
+class PasswordFileProvider : public AuthProvider {
+public:
+    static constexpr int kDefaultIterations = 100000;
+    static constexpr int kMinIterations = 1000;
+    static constexpr int kSaltSize = 16;
+    static constexpr int kHashSize = 32;
+
+    bool load(const QString& path, QString& error);
+    bool verify(const QString& name, const QString& credential) const override;
+    QByteArray fingerprint(const QString& name) const override;
+    qsizetype size() const { return m_entries.size(); }
+
+    // The line to put in the file for this name and password.
+    static QString entryFor(const QString& name, const QString& password, int iterations = kDefaultIterations);
+
+private:
+    struct Entry {
+        int iterations = kDefaultIterations;
+        QByteArray salt;
+        QByteArray hash;
+    };
+
+    static bool parseHash(const QString& text, Entry& entry);
+    static QByteArray derive(const QString& password, const QByteArray& salt, int iterations);
+
+    QHash<QString, Entry> m_entries;
+};
+
+// Bearer tokens issued by some other service that shares the key: "expiry.mac", where expiry is
+// in seconds since the epoch and mac is the base64url HMAC-SHA256 of "name\nexpiry". Nothing is
+// stored per user, and a token stops working on its own.
+class TokenProvider : public AuthProvider {
+public:
+    explicit TokenProvider(const QByteArray& key) : m_key(key) {}
+
+    bool verify(const QString& name, const QString& credential) const override;
+    // The key, as anyone's token stops working when it is replaced.
+    QByteArray fingerprint(const QString& name) const override;
+    static QString issue(const QByteArray& key, const QString& name, qint64 expiresAt);
+
+private:
+    QByteArray m_key;
+};
@@ -0,0 +1,193 @@
+#include "authenticator.hpp"
+#include "auth_provider.hpp"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QMetaObject>
+#include <QThread>
+#include <QDebug>
+#include <algorithm>
+
+Authenticator::Authenticator(QObject* parent) : QObject(parent) {}
+
+Authenticator::~Authenticator() {
+    // Workers post their result to this object, so none may still be running once it is gone.
+    m_pool.clear();
+    m_pool.waitForDone();
+}
+
+void Authenticator::setProviders(const QList<std::shared_ptr<const AuthProvider>>& providers) {
+    m_providers = providers;
+    m_cache.clear();
+    // A user the reload adds should not wait out an old failure.
+    m_failureCache.clear();
+    ++m_generation;
+}
+
+void Authenticator::setCacheTtl(qint64 ttlMs) {
+    m_cacheTtlMs = ttlMs;
+    if (m_cacheTtlMs <= 0) {
+        m_cache.clear();
+    }
+}
+
+void Authenticator::setMaxThreads(int count) {
+    m_pool.setMaxThreadCount(count > 0 ? count : QThread::idealThreadCount());
+}
+
+QByteArray Authenticator::cacheKey(const QString& name, const QString& credential) {
+    // Only a digest is kept, so the cache holds nothing a memory dump could sign in with.
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(name.toUtf8());
+    hash.addData(QByteArrayView("\0", 1));
+    hash.addData(credential.toUtf8());
+    return hash.result();
+}
+
+QByteArray Authenticator::fingerprint(const QString& name) const {
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    for (const auto& provider : m_providers) {
+        QByteArray part = provider->fingerprint(name);
+        hash.addData(QByteArray::number(part.size()) + ':');
+        hash.addData(part);
+    }
+    return hash.result();
+}
+
+void Authenticator::verify(const QString& name, const QString& credential, const QString& peer,
+                           std::function<void(bool)> done) {
+    if (name.isEmpty() || credential.isEmpty() || m_providers.isEmpty()) {
+        QMetaObject::invokeMethod(this, [done]() { done(false); }, Qt::QueuedConnection);
+        return;
+    }
+
+    QByteArray key = cacheKey(name, credential);
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    auto cached = m_cache.constFind(key);
+    if (cached != m_cache.constEnd()) {
+        if (*cached > now) {
+            ++m_cacheHits;
+            QMetaObject::invokeMethod(this, [done]() { done(true); }, Qt::QueuedConnection);
+            return;
+        }
+        m_cache.erase(cached);
+    }
+
+    // A signed-in user is let back in above even while someone is guessing at the name.
+    auto failed = m_failureCache.constFind(key);
+    if (failed != m_failureCache.constEnd()) {
+        if (*failed > now) {
+            refuse(done);
+            return;
+        }
+        m_failureCache.erase(failed);
+    }
+    const QPair<QString, QString> origin(name, peer);
+    auto failures = m_failures.constFind(origin);
+    if (failures != m_failures.constEnd() && failures->count >= kMaxFailuresPerName &&
+        now - failures->windowStart < kFailureWindowMs) {
+        refuse(done);
+        return;
+    }
+
+    // Checks started before a reload are not shared with those after it.
+    QByteArray flightKey = key + QByteArray::number(m_generation);
+    auto flight = m_inFlight.find(flightKey);
+    if (flight != m_inFlight.end()) {
+        flight->append(done);
+        return;
+    }
+    if (m_inFlight.size() >= kMaxPendingChecks) {
+        qDebug() << "Credential checks backed up; refusing" << name;
+        refuse(done);
+        return;
+    }
+    m_inFlight.insert(flightKey, {done});
+    ++m_verifications;
+
+    const QList<std::shared_ptr<const AuthProvider>> providers = m_providers;
+    quint64 generation = m_generation;
+    m_pool.start([this, providers, origin, credential, key, generation]() {
+        bool accepted = false;
+        for (const auto& provider : providers) {
+            if (provider->verify(origin.first, credential)) {
+                accepted = true;
+                break;
+            }
+        }
+        QMetaObject::invokeMethod(this, [this, origin, key, generation, accepted]() {
+            finish(origin, key, generation, accepted);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void Authenticator::refuse(std::function<void(bool)> done) {
+    ++m_refusals;
+    QMetaObject::invokeMethod(this, [done]() { done(false); }, Qt::QueuedConnection);
+}
+
+void Authenticator::finish(const QPair<QString, QString>& origin, const QByteArray& key, quint64 generation,
+                           bool accepted) {
+    const QList<std::function<void(bool)>> waiting = m_inFlight.take(key + QByteArray::number(generation));
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    if (accepted) {
+        m_failures.remove(origin);
+        if (generation == m_generation && m_cacheTtlMs > 0) {
+            if (m_cache.size() >= kMaxCacheEntries) {
+                pruneCache(m_cache, now);
+            }
+            m_cache.insert(key, now + m_cacheTtlMs);
+        }
+    } else if (generation == m_generation) {
+        if (m_failureCache.size() >= kMaxCacheEntries) {
+            pruneCache(m_failureCache, now);
+        }
+        m_failureCache.insert(key, now + kFailureCacheTtlMs);
+
+        if (m_failures.size() >= m_maxTrackedFailures) {
+            pruneFailures(now);
+        }
+        Failures& failures = m_failures[origin];
+        if (now - failures.windowStart >= kFailureWindowMs) {
+            failures = {0, now};
+        }
+        ++failures.count;
+    }
+
+    for (const auto& done : waiting) {
+        done(accepted);
+    }
+}
+
+// Drops what has expired; if the cache is still full of live entries it starts over, which
+// costs a round of hashing but keeps memory bounded.
+void Authenticator::pruneCache(QHash<QByteArray, qint64>& cache, qint64 now) {
+    for (auto it = cache.begin(); it != cache.end();) {
+        it = *it <= now ? cache.erase(it) : std::next(it);
+    }
+    if (cache.size() >= kMaxCacheEntries) {
+        qWarning() << "Credential cache full; clearing it";
+        cache.clear();
+    }
+}
+
+void Authenticator::pruneFailures(qint64 now) {
+    for (auto it = m_failures.begin(); it != m_failures.end();) {
+        it = now - it->windowStart >= kFailureWindowMs ? m_failures.erase(it) : std::next(it);
+    }
+    if (m_failures.size() < m_maxTrackedFailures) return;
+
+    // Still full of live windows: the oldest quarter is forgotten, so the addresses that failed
+    // most recently stay locked out rather than all being let off at once.
+    QList<qint64> starts;
+    starts.reserve(m_failures.size());
+    for (const Failures& failures : std::as_const(m_failures)) {
+        starts.append(failures.windowStart);
+    }
+    auto cutoff = starts.begin() + (qMax<qsizetype>(starts.size() / 4, 1) - 1);
+    std::nth_element(starts.begin(), cutoff, starts.end());
+    qWarning() << "Too many addresses failing to sign in; forgetting the oldest";
+    for (auto it = m_failures.begin(); it != m_failures.end();) {
+        it = it->windowStart <= *cutoff ? m_failures.erase(it) : std::next(it);
+    }
+}
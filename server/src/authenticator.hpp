@@ -0,0 +1,80 @@
+#pragma once
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QByteArray>
+#include <QString>
+#include <QPair>
+#include <QThreadPool>
+#include <functional>
+#include <memory>
+
+class AuthProvider;
+
+// Runs credential checks off the relay's thread and remembers the ones that passed. Providers
+// are tried in order until one accepts. A success is cached for the TTL under a digest of the
+// name and credential, so a reconnect storm costs one hash per user rather than one per
+// connection, and checks of the same pair that overlap share a single run. A failure is cached
+// briefly, a name that keeps failing from one address is refused there without a check until
+// its window ends, and past kMaxPendingChecks new checks are refused outright, so guessing cannot
+// tie up the pool. The lockout is per address so that a guesser cannot lock the owner out.
+// Callbacks always come later on the owning thread, cache hit or not.
+class Authenticator : public QObject {
+    Q_OBJECT
+
+public:
+    static constexpr qint64 kDefaultCacheTtlMs = 5 * 60 * 1000;
+    static constexpr int kMaxCacheEntries = 100000;
+    static constexpr qint64 kFailureCacheTtlMs = 30 * 1000;
+    static constexpr int kMaxFailuresPerName = 5;
+    static constexpr qint64 kFailureWindowMs = 60 * 1000;
+    static constexpr int kMaxPendingChecks = 1024;
+
+    explicit Authenticator(QObject* parent = nullptr);
+    ~Authenticator();
+
+    // Replacing the providers empties the cache, so removed users are not let in by old entries.
+    void setProviders(const QList<std::shared_ptr<const AuthProvider>>& providers);
+    bool isEnabled() const { return !m_providers.isEmpty(); }
+    void setCacheTtl(qint64 ttlMs);
+    // 0 or less means one thread per core.
+    void setMaxThreads(int count);
+
+    void setMaxTrackedFailures(int count) { m_maxTrackedFailures = count; }
+
+    // The peer is the client's address, which the lockout for repeated failures is keyed on.
+    void verify(const QString& name, const QString& credential, const QString& peer, std::function<void(bool)> done);
+    // A digest of what every provider holds for the name; it changes when a reload changes or
+    // removes the user's entry.
+    QByteArray fingerprint(const QString& name) const;
+
+    qint64 cacheHits() const { return m_cacheHits; }
+    qint64 verifications() const { return m_verifications; }
+    qint64 refusals() const { return m_refusals; }
+    qsizetype cacheSize() const { return m_cache.size(); }
+
+private:
+    struct Failures {
+        int count = 0;
+        qint64 windowStart = 0;
+    };
+
+    static QByteArray cacheKey(const QString& name, const QString& credential);
+    void refuse(std::function<void(bool)> done);
+    void finish(const QPair<QString, QString>& origin, const QByteArray& key, quint64 generation, bool accepted);
+    static void pruneCache(QHash<QByteArray, qint64>& cache, qint64 now);
+    void pruneFailures(qint64 now);
+
+    QList<std::shared_ptr<const AuthProvider>> m_providers;
+    QThreadPool m_pool;
+    QHash<QByteArray, qint64> m_cache;
+    QHash<QByteArray, qint64> m_failureCache;
+    QHash<QPair<QString, QString>, Failures> m_failures;
+    QHash<QByteArray, QList<std::function<void(bool)>>> m_inFlight;
+    qint64 m_cacheTtlMs = kDefaultCacheTtlMs;
+    int m_maxTrackedFailures = kMaxCacheEntries;
+    quint64 m_generation = 0;
+    qint64 m_cacheHits = 0;
+    qint64 m_verifications = 0;
+    qint64 m_refusals = 0;
+};
@@ -0,0 +1,586 @@
+#include "cluster_router.hpp"
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QMessageAuthenticationCode>
+#include <QRandomGenerator>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+#include <utility>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+#ifdef Q_OS_UNIX
+// Whoever can connect to a node socket sees every frame of the cluster, so only processes
+// of our own user may link up that way.
+bool isSameUser(qintptr descriptor) {
+#ifdef SO_PEERCRED
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(static_cast<int>(descriptor), SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) return false;
+    return credentials.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(static_cast<int>(descriptor), &uid, &gid) != 0) return false;
+    return uid == geteuid();
+#endif
+}
+#endif
+
+}
+
+ClusterRouter::ClusterRouter(const QString& nodeId, QObject* parent) : QObject(parent), m_nodeId(nodeId), m_localServer(nullptr),
+                                                                      m_nodeServer(nullptr) {
+    // Everything queued for a peer during one event loop pass goes out as a single batch frame.
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(0);
+    connect(&m_flushTimer, &QTimer::timeout, this, &ClusterRouter::flushPeers);
+}
+
+ClusterRouter::~ClusterRouter() {
+    if (m_localServer) {
+        m_localServer->close();
+    }
+    if (m_nodeServer) {
+        m_nodeServer->close();
+    }
+}
+
+bool ClusterRouter::listenLocal(const QString& directory) {
+    QDir dir(directory);
+    bool existed = dir.exists();
+    if (!dir.mkpath(".")) {
+        qWarning() << "Unable to create cluster directory" << directory;
+        return false;
+    }
+
+#ifdef Q_OS_UNIX
+    // A directory somebody else owns or can write to would let them plant a node socket.
+    const QFileDevice::Permissions ownerOnly = QFileDevice::ReadOwner | QFileDevice::WriteOwner | QFileDevice::ExeOwner
+                                             | QFileDevice::ReadUser | QFileDevice::WriteUser | QFileDevice::ExeUser;
+    if (!existed) {
+        QFile::setPermissions(directory, ownerOnly);
+    }
+    QFileInfo info(directory);
+    if (info.ownerId() != geteuid() || (info.permissions() & ~ownerOnly)) {
+        qWarning() << "Refusing cluster directory" << directory << ": it must belong to this user and be closed to others";
+        return false;
+    }
+#else
+    Q_UNUSED(existed);
+#endif
+
+    QString ownPath = dir.filePath(QString("node-%1.sock").arg(m_nodeId));
+    QLocalServer::removeServer(ownPath);
+
+    m_localServer = new QLocalServer(this);
+    if (!m_localServer->listen(ownPath)) {
+        qWarning() << "Unable to listen on" << ownPath << ":" << m_localServer->errorString();
+        return false;
+    }
+    connect(m_localServer, &QLocalServer::newConnection, this, &ClusterRouter::onNewLocalConnection);
+
+    // Newcomers dial everybody already there; existing nodes only accept.
+    const QStringList entries = dir.entryList({"node-*.sock"}, QDir::System);
+    for (const QString& entry : entries) {
+        QString path = dir.filePath(entry);
+        if (path != ownPath) {
+            connectToLocalPeer(path);
+        }
+    }
+
+    qInfo() << "Cluster node" << m_nodeId << "listening on" << ownPath;
+    return true;
+}
+
+void ClusterRouter::connectToLocalPeer(const QString& path) {
+    QLocalSocket* socket = new QLocalSocket(this);
+
+    connect(socket, &QLocalSocket::connected, this, [this, socket]() {addPeer(socket);});
+    connect(socket, &QLocalSocket::errorOccurred, this, [this, socket, path](QLocalSocket::LocalSocketError error) {
+        if (m_peers.contains(socket)) return;
+        if (error == QLocalSocket::ConnectionRefusedError) {
+            qDebug() << "Removing stale cluster socket" << path;
+            QFile::remove(path);
+        }
+        socket->deleteLater();
+    });
+
+    socket->connectToServer(path);
+}
+
+bool ClusterRouter::listenNodes(const QHostAddress& address, quint16 port) {
+    if (m_nodeKey.isEmpty()) {
+        qWarning() << "Node links need a cluster key";
+        return false;
+    }
+
+    if (!m_nodeServer) {
+        m_nodeServer = new QTcpServer(this);
+        connect(m_nodeServer, &QTcpServer::newConnection, this, &ClusterRouter::onNewNodeConnection);
+    }
+    if (!m_nodeServer->listen(address, port)) {
+        qWarning() << "Unable to accept node links on port" << port << ":" << m_nodeServer->errorString();
+        return false;
+    }
+
+    qInfo() << "Cluster node" << m_nodeId << "accepting node links on port" << m_nodeServer->serverPort();
+    return true;
+}
+
+void ClusterRouter::stopListeningNodes() {
+    if (m_nodeServer) {
+        m_nodeServer->close();
+    }
+}
+
+void ClusterRouter::connectToNode(const QString& host, quint16 port) {
+    if (m_nodeKey.isEmpty()) {
+        qWarning() << "Not linking with" << host << ": node links need a cluster key";
+        return;
+    }
+
+    QTcpSocket* socket = new QTcpSocket(this);
+
+    connect(socket, &QTcpSocket::connected, this, [this, socket, host, port]() {
+        socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+        addPeer(socket, host, port);
+    });
+    connect(socket, &QTcpSocket::errorOccurred, this, [this, socket, host, port](QAbstractSocket::SocketError) {
+        if (m_peers.contains(socket)) return;
+        socket->disconnect(this);
+        socket->deleteLater();
+        QTimer::singleShot(kNodeRetryMs, this, [this, host, port]() {connectToNode(host, port);});
+    });
+
+    socket->connectToHost(host, port);
+}
+
+void ClusterRouter::onNewNodeConnection() {
+    while (QTcpSocket* socket = m_nodeServer->nextPendingConnection()) {
+        socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+        addPeer(socket);
+    }
+}
+
+void ClusterRouter::onNewLocalConnection() {
+    while (QLocalSocket* socket = m_localServer->nextPendingConnection()) {
+        addPeer(socket);
+    }
+}
+
+void ClusterRouter::addPeer(QIODevice* device, const QString& host, quint16 port) {
+#ifdef Q_OS_UNIX
+    QLocalSocket* unixSocket = qobject_cast<QLocalSocket*>(device);
+    if (unixSocket && !isSameUser(unixSocket->socketDescriptor())) {
+        qWarning() << "Refusing cluster peer run by another user";
+        unixSocket->abort();
+        unixSocket->deleteLater();
+        return;
+    }
+#endif
+
+    Peer peer;
+    peer.host = host;
+    peer.port = port;
+    m_peers.insert(device, peer);
+
+    connect(device, &QIODevice::readyRead, this, &ClusterRouter::onPeerReadyRead);
+    if (QLocalSocket* localSocket = qobject_cast<QLocalSocket*>(device)) {
+        connect(localSocket, &QLocalSocket::disconnected, this, &ClusterRouter::onPeerDisconnected);
+
+        // The peer's user was checked above; the directory is as private as the sockets in it.
+        m_peers[device].authenticated = true;
+        sendHello(device);
+        return;
+    }
+
+    QAbstractSocket* tcpSocket = qobject_cast<QAbstractSocket*>(device);
+    connect(tcpSocket, &QAbstractSocket::disconnected, this, &ClusterRouter::onPeerDisconnected);
+
+    // Both ends challenge each other; frames other than the handshake wait until it is done.
+    QByteArray nonce(kNonceSize, Qt::Uninitialized);
+    QRandomGenerator::system()->fillRange(reinterpret_cast<quint32*>(nonce.data()), kNonceSize / sizeof(quint32));
+    m_peers[device].nonce = nonce;
+
+    QJsonObject challenge;
+    challenge["op"] = "challenge";
+    challenge["nonce"] = QString::fromLatin1(nonce.toBase64());
+    writeFrame(device, challenge);
+
+    QTimer::singleShot(kHandshakeTimeoutMs, device, [this, device]() {
+        if (m_peers.contains(device) && !m_peers[device].authenticated) {
+            dropPeer(device, "handshake timed out");
+        }
+    });
+}
+
+void ClusterRouter::handleHandshake(QIODevice* device, const QJsonObject& obj) {
+    Peer& peer = m_peers[device];
+    QString op = obj["op"].toString();
+    bool dialer = !peer.host.isEmpty();
+
+    if (op == "challenge" && !peer.answered) {
+        QByteArray nonce = QByteArray::fromBase64(obj["nonce"].toString().toLatin1());
+        if (nonce.size() != kNonceSize) {
+            dropPeer(device, "malformed challenge");
+            return;
+        }
+
+        QJsonObject answer;
+        answer["op"] = "auth";
+        answer["proof"] = QString::fromLatin1(handshakeProof(nonce, dialer).toBase64());
+        writeFrame(device, answer);
+        peer.answered = true;
+    }
+    else if (op == "auth" && !peer.verified) {
+        // The proof covers the prover's side of the link, so an answer cannot be reflected back.
+        QByteArray proof = QByteArray::fromBase64(obj["proof"].toString().toLatin1());
+        QByteArray expected = handshakeProof(peer.nonce, !dialer);
+        char diff = proof.size() == expected.size() ? 0 : 1;
+        for (qsizetype i = 0; i < proof.size() && i < expected.size(); ++i) {
+            diff |= proof[i] ^ expected[i];
+        }
+        if (diff != 0) {
+            dropPeer(device, "wrong cluster key");
+            return;
+        }
+        peer.verified = true;
+    }
+    else {
+        dropPeer(device, "unexpected " + op + " before the handshake");
+        return;
+    }
+
+    if (peer.answered && peer.verified) {
+        peer.authenticated = true;
+        sendHello(device);
+    }
+}
+
+QByteArray ClusterRouter::handshakeProof(const QByteArray& nonce, bool dialer) const {
+    QByteArray message = (dialer ? "dialer\n" : "listener\n") + nonce;
+    return QMessageAuthenticationCode::hash(message, m_nodeKey, QCryptographicHash::Sha256);
+}
+
+void ClusterRouter::dropPeer(QIODevice* device, const QString& reason) {
+    qWarning() << "Dropping cluster link:" << reason;
+    // Closing emits disconnected, and onPeerDisconnected forgets the peer and redials it if it is ours.
+    m_peers[device].authenticated = false;
+    device->close();
+}
+
+void ClusterRouter::sendHello(QIODevice* device) {
+    QJsonArray users;
+    for (auto it = m_localUsers.constBegin(); it != m_localUsers.constEnd(); ++it) {
+        QJsonObject user;
+        user["name"] = it.key();
+        user["interlocutor"] = it.value();
+        users.append(user);
+    }
+
+    QJsonObject hello;
+    hello["op"] = "hello";
+    hello["node"] = m_nodeId;
+    hello["users"] = users;
+    sendToPeer(device, hello);
+}
+
+void ClusterRouter::onPeerReadyRead() {
+    QIODevice* device = qobject_cast<QIODevice*>(sender());
+    if (!device || !m_peers.contains(device)) return;
+
+    QDataStream in(device);
+    in.setVersion(QDataStream::Qt_5_15);
+
+    while (m_peers.contains(device)) {
+        Peer& peer = m_peers[device];
+        if (peer.expectedSize == 0) {
+            if (device->bytesAvailable() < static_cast<qint64>(sizeof(quint32))) return;
+            in >> peer.expectedSize;
+            if (!peer.authenticated && peer.expectedSize > kMaxHandshakeFrameSize) {
+                dropPeer(device, "oversized handshake frame");
+                return;
+            }
+        }
+        if (device->bytesAvailable() < peer.expectedSize) return;
+
+        QByteArray data = device->read(peer.expectedSize);
+        peer.expectedSize = 0;
+        if (peer.authenticated) {
+            handlePeerMessage(device, QJsonDocument::fromJson(data).object());
+        } else {
+            handleHandshake(device, QJsonDocument::fromJson(data).object());
+        }
+    }
+}
+
+void ClusterRouter::handlePeerMessage(QIODevice* device, const QJsonObject& obj) {
+    QString op = obj["op"].toString();
+    QString node = m_peers.value(device).node;
+
+    if (op == "batch") {
+        const QJsonArray items = obj["items"].toArray();
+        for (const QJsonValue& item : items) {
+            handlePeerMessage(device, item.toObject());
+        }
+    }
+    else if (op == "hello") {
+        node = obj["node"].toString();
+        m_peers[device].node = node;
+        m_peers[device].joined = ++m_helloCount;
+
+        const QJsonArray users = obj["users"].toArray();
+        for (const QJsonValue& value : users) {
+            QJsonObject user = value.toObject();
+            m_remoteUsers[user["name"].toString()] = {node, user["interlocutor"].toString(), false, device};
+        }
+        qInfo() << "Cluster peer" << node << "joined with" << users.size() << "users";
+    }
+    else if (op == "user") {
+        QString name = obj["name"].toString();
+        m_remoteUsers[name] = {node, obj["interlocutor"].toString(), false, device};
+        emit userClaimed(name);
+    }
+    else if (op == "user_gone") {
+        // Only the link that last announced the user may take it back: a node restarted under the
+        // same id still withdraws the sessions it had while its successor announces them anew.
+        QString name = obj["name"].toString();
+        const RemoteUser user = m_remoteUsers.value(name);
+        if (user.node == node && user.via == device) {
+            m_remoteUsers.remove(name);
+            emit remoteUserLeft(name);
+        }
+    }
+    else if (op == "deliver") {
+        emit frameForLocalUser(obj["to"].toString(), obj["frame"].toObject(), obj["from"].toString(),
+                               static_cast<quint64>(obj["messageId"].toInteger()));
+    }
+    else if (op == "pair") {
+        emit pairRequested(obj["user"].toString(), obj["interlocutor"].toString());
+    }
+    else if (op == "session") {
+        emit sessionReceived(obj["name"].toString(), obj["state"].toObject());
+    }
+    else if (op == "revoke") {
+        emit sessionsRevoked(obj["name"].toString(), static_cast<quint32>(obj["generation"].toInteger()));
+    }
+    else {
+        qDebug() << "Unknown cluster op:" << op;
+    }
+}
+
+void ClusterRouter::onPeerDisconnected() {
+    QIODevice* device = qobject_cast<QIODevice*>(sender());
+    if (!device || !m_peers.contains(device)) return;
+
+    Peer peer = m_peers.take(device);
+    device->deleteLater();
+
+    qInfo() << "Cluster peer" << peer.node << "left";
+
+    if (!peer.host.isEmpty()) {
+        QTimer::singleShot(kNodeRetryMs, this, [this, host = peer.host, port = peer.port]() {connectToNode(host, port);});
+    }
+
+    // Two nodes that list each other end up with two links; only losing the last one matters.
+    if (!peer.node.isEmpty() && !peerForNode(peer.node)) {
+        orphanUsersOf(peer.node);
+    }
+}
+
+void ClusterRouter::orphanUsersOf(const QString& node) {
+    // Users of a vanished node usually resume on another node within the resume window,
+    // so their interlocutors are only told once the grace period has passed.
+    for (RemoteUser& user : m_remoteUsers) {
+        if (user.node == node) {
+            user.orphaned = true;
+        }
+    }
+
+    QTimer::singleShot(kOrphanGraceMs, this, [this, node]() {
+        QStringList gone;
+        for (auto it = m_remoteUsers.constBegin(); it != m_remoteUsers.constEnd(); ++it) {
+            if (it->node == node && it->orphaned) {
+                gone.append(it.key());
+            }
+        }
+        for (const QString& name : gone) {
+            m_remoteUsers.remove(name);
+            emit remoteUserLeft(name);
+        }
+    });
+}
+
+int ClusterRouter::peerCount() const {
+    int count = 0;
+    for (const Peer& peer : m_peers) {
+        if (peer.authenticated) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+bool ClusterRouter::isRemote(const QString& name) const {
+    auto it = m_remoteUsers.constFind(name);
+    return it != m_remoteUsers.constEnd() && !it->orphaned;
+}
+
+QString ClusterRouter::remoteInterlocutor(const QString& name) const {
+    return isRemote(name) ? m_remoteUsers.value(name).interlocutor : QString();
+}
+
+void ClusterRouter::announce(const QString& name, const QString& interlocutor) {
+    m_localUsers[name] = interlocutor;
+
+    QJsonObject obj;
+    obj["op"] = "user";
+    obj["name"] = name;
+    obj["interlocutor"] = interlocutor;
+    broadcast(obj);
+}
+
+void ClusterRouter::withdraw(const QString& name) {
+    if (!m_localUsers.remove(name)) return;
+
+    QJsonObject obj;
+    obj["op"] = "user_gone";
+    obj["name"] = name;
+    broadcast(obj);
+}
+
+void ClusterRouter::forward(const QString& name, const QJsonObject& frame, const QString& peer, quint64 messageId) {
+    QIODevice* device = peerForNode(m_remoteUsers.value(name).node);
+    if (!device) {
+        qWarning() << "No route to" << name;
+        return;
+    }
+
+    QJsonObject obj;
+    obj["op"] = "deliver";
+    obj["to"] = name;
+    obj["from"] = peer;
+    obj["messageId"] = static_cast<qint64>(messageId);
+    obj["frame"] = frame;
+    sendToPeer(device, obj);
+}
+
+void ClusterRouter::requestPair(const QString& name, const QString& interlocutor) {
+    QIODevice* device = peerForNode(m_remoteUsers.value(name).node);
+    if (!device) return;
+
+    m_remoteUsers[name].interlocutor = interlocutor;
+
+    QJsonObject obj;
+    obj["op"] = "pair";
+    obj["user"] = name;
+    obj["interlocutor"] = interlocutor;
+    sendToPeer(device, obj);
+}
+
+// Tokens are checked by whichever node a client resumes on, so every node hears of this.
+void ClusterRouter::revoke(const QString& name, quint32 generation) {
+    QJsonObject obj;
+    obj["op"] = "revoke";
+    obj["name"] = name;
+    obj["generation"] = static_cast<qint64>(generation);
+    broadcast(obj);
+}
+
+// Sent to the node that claimed the user, which is where the directory now points.
+void ClusterRouter::handOverSession(const QString& name, const QJsonObject& state) {
+    m_localUsers.remove(name);
+
+    QIODevice* device = peerForNode(m_remoteUsers.value(name).node);
+    if (!device) {
+        qWarning() << "No route to hand the session of" << name << "over";
+        return;
+    }
+
+    QJsonObject obj;
+    obj["op"] = "session";
+    obj["name"] = name;
+    obj["state"] = state;
+    sendToPeer(device, obj);
+}
+
+QIODevice* ClusterRouter::peerForNode(const QString& node) const {
+    if (node.isEmpty()) return nullptr;
+
+    // A node that was hot-restarted under the same id is briefly linked twice; the newer link is
+    // the successor, which is where its users resume.
+    QIODevice* newest = nullptr;
+    quint64 joined = 0;
+    for (auto it = m_peers.constBegin(); it != m_peers.constEnd(); ++it) {
+        if (it->node == node && it->joined > joined) {
+            newest = it.key();
+            joined = it->joined;
+        }
+    }
+    return newest;
+}
+
+void ClusterRouter::sendToPeer(QIODevice* device, const QJsonObject& obj) {
+    auto it = m_peers.find(device);
+    if (it == m_peers.end() || !it->authenticated) return;
+
+    it->outbound.append(obj);
+    if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void ClusterRouter::flushPeers() {
+    for (auto it = m_peers.begin(); it != m_peers.end(); ++it) {
+        const QList<QJsonObject> outbound = std::exchange(it->outbound, {});
+
+        // Walked by index, so a long backlog is cut into batches in one pass.
+        for (qsizetype start = 0; start < outbound.size(); start += kMaxBatchItems) {
+            if (outbound.size() - start == 1) {
+                writeFrame(it.key(), outbound[start]);
+                break;
+            }
+
+            QJsonArray items;
+            qsizetype end = qMin(outbound.size(), start + kMaxBatchItems);
+            for (qsizetype i = start; i < end; ++i) {
+                items.append(outbound[i]);
+            }
+
+            QJsonObject batch;
+            batch["op"] = "batch";
+            batch["items"] = items;
+            writeFrame(it.key(), batch);
+        }
+    }
+}
+
+void ClusterRouter::writeFrame(QIODevice* device, const QJsonObject& obj) {
+    QByteArray jsonData = QJsonDocument(obj).toJson(QJsonDocument::Compact);
+
+    QByteArray block;
+    QDataStream out(&block, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_15);
+    out << static_cast<quint32>(jsonData.size());
+    out.writeRawData(jsonData.constData(), jsonData.size());
+
+    device->write(block);
+}
+
+void ClusterRouter::broadcast(const QJsonObject& obj) {
+    for (auto it = m_peers.constBegin(); it != m_peers.constEnd(); ++it) {
+        sendToPeer(it.key(), obj);
+    }
+}
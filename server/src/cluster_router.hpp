@@ -0,0 +1,113 @@
+#pragma once
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QHostAddress>
+#include <QTimer>
+
+class QIODevice;
+class QLocalServer;
+class QTcpServer;
+
+// Shares the set of connected users between server processes and carries frames for users
+// held by another process. Each process owns its own clients; the router only keeps a
+// directory of who is where and forwards to the owner. Peers are sibling processes on the
+// same host (Unix sockets) or other nodes (TCP); both speak the same framed JSON. A TCP link
+// carries nothing until both ends have shown they know the cluster key.
+class ClusterRouter : public QObject {
+    Q_OBJECT
+
+public:
+    struct RemoteUser {
+        QString node;
+        QString interlocutor;
+        bool orphaned = false;
+        QIODevice* via = nullptr;
+    };
+
+    static constexpr int kOrphanGraceMs = 30000;
+    static constexpr int kNodeRetryMs = 2000;
+    static constexpr int kMaxBatchItems = 256;
+    static constexpr int kHandshakeTimeoutMs = 5000;
+    static constexpr quint32 kMaxHandshakeFrameSize = 4096;
+    static constexpr int kNonceSize = 32;
+
+    explicit ClusterRouter(const QString& nodeId, QObject* parent = nullptr);
+    ~ClusterRouter();
+
+    void setNodeKey(const QByteArray& key) { m_nodeKey = key; }
+    bool listenLocal(const QString& directory);
+    bool listenNodes(const QHostAddress& address, quint16 port);
+    void stopListeningNodes();
+    void connectToNode(const QString& host, quint16 port);
+
+    QString nodeId() const { return m_nodeId; }
+    int peerCount() const;
+
+    bool isRemote(const QString& name) const;
+    QString remoteInterlocutor(const QString& name) const;
+
+    void announce(const QString& name, const QString& interlocutor);
+    void withdraw(const QString& name);
+    void forward(const QString& name, const QJsonObject& frame, const QString& peer = QString(), quint64 messageId = 0);
+    void requestPair(const QString& name, const QString& interlocutor);
+    void revoke(const QString& name, quint32 generation);
+    void handOverSession(const QString& name, const QJsonObject& state);
+
+    void handlePeerMessage(QIODevice* device, const QJsonObject& obj);
+
+signals:
+    void frameForLocalUser(const QString& name, const QJsonObject& frame, const QString& peer, quint64 messageId);
+    void pairRequested(const QString& name, const QString& interlocutor);
+    void remoteUserLeft(const QString& name);
+    void userClaimed(const QString& name);
+    void sessionsRevoked(const QString& name, quint32 generation);
+    void sessionReceived(const QString& name, const QJsonObject& state);
+
+private slots:
+    void onNewLocalConnection();
+    void onNewNodeConnection();
+    void flushPeers();
+    void onPeerReadyRead();
+    void onPeerDisconnected();
+
+private:
+    struct Peer {
+        QString node;
+        quint64 joined = 0;
+        quint32 expectedSize = 0;
+        QString host;
+        quint16 port = 0;
+        QList<QJsonObject> outbound;
+        // Handshake of a TCP link: our challenge, whether we answered theirs and verified their answer.
+        QByteArray nonce;
+        bool answered = false;
+        bool verified = false;
+        bool authenticated = false;
+    };
+
+    void addPeer(QIODevice* device, const QString& host = QString(), quint16 port = 0);
+    void handleHandshake(QIODevice* device, const QJsonObject& obj);
+    QByteArray handshakeProof(const QByteArray& nonce, bool dialer) const;
+    void sendHello(QIODevice* device);
+    void dropPeer(QIODevice* device, const QString& reason);
+    void connectToLocalPeer(const QString& path);
+    void sendToPeer(QIODevice* device, const QJsonObject& obj);
+    void writeFrame(QIODevice* device, const QJsonObject& obj);
+    void broadcast(const QJsonObject& obj);
+    QIODevice* peerForNode(const QString& node) const;
+    void orphanUsersOf(const QString& node);
+
+    QString m_nodeId;
+    QByteArray m_nodeKey;
+    quint64 m_helloCount = 0;
+    QLocalServer* m_localServer;
+    QTcpServer* m_nodeServer;
+    QTimer m_flushTimer;
+    QHash<QIODevice*, Peer> m_peers;
+    QHash<QString, RemoteUser> m_remoteUsers;
+    QHash<QString, QString> m_localUsers;
+};
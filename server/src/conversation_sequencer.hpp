@@ -0,0 +1,124 @@
+#pragma once
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <functional>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Keeps every conversation in order however its messages are processed. admit() hands out the
+// conversation's next sequence number at ingress; complete() takes the processed payload back
+// in any order, from any thread, and release() sees the payloads of one conversation strictly
+// in sequence, never two at once. A payload waits only for earlier ones of its own conversation.
+// A ticket whose message is dropped must be cancel()led, or everything behind it waits.
+//
+// Conversations are spread over kShards locks, so threads working on different ones rarely
+// meet. Release runs on whichever thread fills the gap, outside the lock; a completion that
+// arrives while another thread is releasing the same conversation is left for that thread.
+// A conversation with nothing outstanding is forgotten, and its numbering starts over.
+template <typename Key, typename Payload>
+class ConversationSequencer {
+public:
+    static constexpr int kShards = 16;
+
+    using Release = std::function<void(const Key& conversation, quint64 seq, Payload& payload)>;
+
+    explicit ConversationSequencer(Release release) : m_release(std::move(release)) {}
+
+    quint64 admit(const Key& conversation) {
+        Shard& shard = shardFor(conversation);
+        QMutexLocker locker(&shard.mutex);
+        return shard.streams[conversation].nextAdmit++;
+    }
+
+    void complete(const Key& conversation, quint64 seq, Payload payload) {
+        finish(conversation, seq, std::optional<Payload>(std::move(payload)));
+    }
+
+    void cancel(const Key& conversation, quint64 seq) {
+        finish(conversation, seq, std::nullopt);
+    }
+
+    // Payloads held back behind an earlier one still being processed.
+    qsizetype pendingCount() const {
+        qsizetype count = 0;
+        for (const Shard& shard : m_shards) {
+            QMutexLocker locker(&shard.mutex);
+            for (const Stream& stream : shard.streams) {
+                count += static_cast<qsizetype>(stream.ready.size());
+            }
+        }
+        return count;
+    }
+
+    qsizetype conversationCount() const {
+        qsizetype count = 0;
+        for (const Shard& shard : m_shards) {
+            QMutexLocker locker(&shard.mutex);
+            count += shard.streams.size();
+        }
+        return count;
+    }
+
+private:
+    struct Stream {
+        quint64 nextAdmit = 1;
+        quint64 nextRelease = 1;
+        bool releasing = false;
+        std::map<quint64, std::optional<Payload>> ready;
+    };
+
+    struct Shard {
+        mutable QMutex mutex;
+        QHash<Key, Stream> streams;
+    };
+
+    Shard& shardFor(const Key& conversation) {
+        return m_shards[qHash(conversation) % kShards];
+    }
+
+    void finish(const Key& conversation, quint64 seq, std::optional<Payload> payload) {
+        Shard& shard = shardFor(conversation);
+        QMutexLocker locker(&shard.mutex);
+
+        auto stream = shard.streams.find(conversation);
+        if (stream == shard.streams.end() || seq < stream->nextRelease || seq >= stream->nextAdmit) return;
+        stream->ready.emplace(seq, std::move(payload));
+        if (stream->releasing) return;
+        stream->releasing = true;
+
+        std::vector<std::pair<quint64, Payload>> batch;
+        while (true) {
+            // Whatever is now contiguous goes out in one go; the lock is not held while it does.
+            auto next = stream->ready.begin();
+            while (next != stream->ready.end() && next->first == stream->nextRelease) {
+                if (next->second) {
+                    batch.emplace_back(next->first, std::move(*next->second));
+                }
+                next = stream->ready.erase(next);
+                ++stream->nextRelease;
+            }
+            if (batch.empty()) break;
+
+            locker.unlock();
+            for (auto& entry : batch) {
+                m_release(conversation, entry.first, entry.second);
+            }
+            batch.clear();
+            locker.relock();
+            // Other conversations may have grown the table meanwhile; this one is still there,
+            // as a stream being released is never removed.
+            stream = shard.streams.find(conversation);
+        }
+
+        stream->releasing = false;
+        if (stream->ready.empty() && stream->nextRelease == stream->nextAdmit) {
+            shard.streams.erase(stream);
+        }
+    }
+
+    Release m_release;
+    Shard m_shards[kShards];
+};
@@ -0,0 +1,74 @@
+#include "frame_pool.hpp"
+
+QByteArray FramePool::acquire(qsizetype size) {
+    int sizeClass = sizeClassFor(size);
+    if (sizeClass < 0) {
+        ++m_misses;
+        return QByteArray(size, Qt::Uninitialized);
+    }
+
+    QByteArray buffer;
+    QList<QByteArray>& free = m_free[sizeClass];
+    if (!free.isEmpty()) {
+        buffer = free.takeLast();
+        ++m_hits;
+    } else {
+        buffer.reserve(kSizeClasses[sizeClass]);
+        ++m_misses;
+    }
+
+    buffer.resize(size);
+    return buffer;
+}
+
+void FramePool::release(QByteArray& buffer) {
+    // A buffer somebody else still refers to cannot be reused.
+    if (!buffer.isDetached()) {
+        buffer = QByteArray();
+        return;
+    }
+
+    int sizeClass = -1;
+    for (int i = kClassCount - 1; i >= 0; --i) {
+        if (buffer.capacity() >= kSizeClasses[i]) {
+            sizeClass = i;
+            break;
+        }
+    }
+
+    // Oversized buffers are not kept either, so one huge frame does not pin memory forever.
+    if (sizeClass < 0 || buffer.capacity() > 2 * kSizeClasses[kClassCount - 1] ||
+        m_free[sizeClass].size() >= kMaxBuffersPerClass) {
+        buffer = QByteArray();
+        return;
+    }
+
+    buffer.resize(0);
+    m_free[sizeClass].append(std::move(buffer));
+    buffer = QByteArray();
+}
+
+void FramePool::trim() {
+    for (QList<QByteArray>& free : m_free) {
+        free = QList<QByteArray>();
+    }
+}
+
+qsizetype FramePool::pooledBytes() const {
+    qsizetype total = 0;
+    for (const QList<QByteArray>& free : m_free) {
+        for (const QByteArray& buffer : free) {
+            total += buffer.capacity();
+        }
+    }
+    return total;
+}
+
+int FramePool::sizeClassFor(qsizetype size) {
+    for (int i = 0; i < kClassCount; ++i) {
+        if (size <= kSizeClasses[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
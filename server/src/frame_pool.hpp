@@ -0,0 +1,28 @@
+#pragma once
+#include <QByteArray>
+#include <QList>
+#include <iterator>
+
+// Recycles frame buffers in a few size classes, so steady relay reuses the same storage instead
+// of going through the global allocator for every frame. Single-threaded, like the server.
+class FramePool {
+public:
+    static constexpr qsizetype kSizeClasses[] = {256, 1024, 4096, 16384, 65536};
+    static constexpr int kClassCount = static_cast<int>(std::size(kSizeClasses));
+    static constexpr int kMaxBuffersPerClass = 64;
+
+    QByteArray acquire(qsizetype size);
+    void release(QByteArray& buffer);
+    void trim();
+
+    qint64 hits() const { return m_hits; }
+    qint64 misses() const { return m_misses; }
+    qsizetype pooledBytes() const;
+
+private:
+    static int sizeClassFor(qsizetype size);
+
+    QList<QByteArray> m_free[kClassCount];
+    qint64 m_hits = 0;
+    qint64 m_misses = 0;
+};
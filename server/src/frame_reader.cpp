@@ -0,0 +1,38 @@
+#include "frame_reader.hpp"
+#include "frame_pool.hpp"
+#include <QtEndian>
+
+FrameReader::Result FrameReader::readFrame(QIODevice* device, quint32& expectedSize, quint32 maxFrameSize, QByteArray& frame,
+                                           FramePool* pool) {
+    if (expectedSize == 0) {
+        char prefix[sizeof(quint32)];
+        if (device->bytesAvailable() < static_cast<qint64>(sizeof(prefix))) {
+            return Incomplete;
+        }
+        if (device->read(prefix, sizeof(prefix)) != static_cast<qint64>(sizeof(prefix))) {
+            return ReadError;
+        }
+        expectedSize = qFromBigEndian<quint32>(prefix);
+    }
+
+    if (expectedSize > maxFrameSize) {
+        return Oversized;
+    }
+    if (device->bytesAvailable() < expectedSize) {
+        return Incomplete;
+    }
+
+    frame = pool ? pool->acquire(expectedSize) : QByteArray(expectedSize, Qt::Uninitialized);
+    qint64 bytesRead = device->read(frame.data(), expectedSize);
+    if (bytesRead != expectedSize) {
+        // Part of the payload is gone, so the next prefix cannot be found any more.
+        if (pool) {
+            pool->release(frame);
+        }
+        frame.clear();
+        return ReadError;
+    }
+
+    expectedSize = 0;
+    return Complete;
+}
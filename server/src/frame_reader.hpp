@@ -0,0 +1,23 @@
+#pragma once
+#include <QByteArray>
+#include <QIODevice>
+
+class FramePool;
+
+// Splits a length-prefixed stream into frames. The size prefix and the payload are only consumed
+// once they have fully arrived, so a partial read never loses its place in the stream, and a
+// prefix above the limit is rejected before anything is allocated for it.
+class FrameReader {
+public:
+    static constexpr quint32 kDefaultMaxFrameSize = 1024 * 1024;
+
+    enum Result {
+        Incomplete,
+        Complete,
+        Oversized,
+        ReadError
+    };
+
+    static Result readFrame(QIODevice* device, quint32& expectedSize, quint32 maxFrameSize, QByteArray& frame,
+                            FramePool* pool = nullptr);
+};
@@ -0,0 +1,106 @@
+#include "local_listener.hpp"
+#include <QSocketNotifier>
+#include <QTcpSocket>
+#include <QFile>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+LocalListener::LocalListener(QObject* parent) : QObject(parent), m_fd(-1), m_inode(0), m_notifier(nullptr) {}
+
+LocalListener::~LocalListener() {close();}
+
+bool LocalListener::listen(const QString& path) {
+#ifdef Q_OS_UNIX
+    close();
+
+    QByteArray encodedPath = QFile::encodeName(path);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (encodedPath.isEmpty() || encodedPath.size() >= static_cast<qsizetype>(sizeof(address.sun_path))) {
+        qWarning() << "Unix socket path is empty or too long:" << path;
+        return false;
+    }
+    std::memcpy(address.sun_path, encodedPath.constData(), encodedPath.size());
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        qWarning() << "Unable to create Unix socket:" << std::strerror(errno);
+        return false;
+    }
+
+    // A file left at the path is either stale or belongs to the process being replaced; either way it is taken over.
+    ::unlink(encodedPath.constData());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+        qWarning() << "Unable to listen on Unix socket" << path << ":" << std::strerror(errno);
+        ::close(fd);
+        return false;
+    }
+
+    struct stat info = {};
+    m_inode = ::stat(encodedPath.constData(), &info) == 0 ? static_cast<quint64>(info.st_ino) : 0;
+    m_fd = fd;
+    m_path = path;
+
+    m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &LocalListener::onActivated);
+
+    qInfo() << "Listening on Unix socket" << path;
+    return true;
+#else
+    Q_UNUSED(path);
+    qWarning() << "Unix domain sockets are not supported on this platform";
+    return false;
+#endif
+}
+
+void LocalListener::close() {
+#ifdef Q_OS_UNIX
+    if (m_fd == -1) return;
+
+    delete m_notifier;
+    m_notifier = nullptr;
+    ::close(m_fd);
+    m_fd = -1;
+
+    QByteArray encodedPath = QFile::encodeName(m_path);
+    struct stat info = {};
+    if (::stat(encodedPath.constData(), &info) == 0 && static_cast<quint64>(info.st_ino) == m_inode) {
+        ::unlink(encodedPath.constData());
+    }
+#endif
+}
+
+void LocalListener::onActivated() {
+#ifdef Q_OS_UNIX
+    while (m_fd != -1) {
+        int fd = ::accept(m_fd, nullptr, nullptr);
+        if (fd == -1) {
+            int error = errno;
+            if (error == EINTR) continue;
+            if (error != EAGAIN && error != EWOULDBLOCK) {
+                qWarning() << "Unix socket accept failed:" << std::strerror(error);
+            }
+            return;
+        }
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        QTcpSocket* socket = new QTcpSocket();
+        if (!socket->setSocketDescriptor(fd)) {
+            qWarning() << "Unable to wrap Unix socket connection:" << socket->errorString();
+            ::close(fd);
+            delete socket;
+            continue;
+        }
+        emit connectionAccepted(socket);
+    }
+#endif
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <QObject>
+#include <QString>
+
+class QSocketNotifier;
+class QTcpSocket;
+
+// Listens on a Unix domain socket and hands every accepted connection out as a QTcpSocket, the
+// same way QLocalSocket wraps its descriptor internally on Unix. Local clients therefore share
+// all framing and handler code with TCP clients while skipping the loopback network stack.
+// The socket file is only removed on close if it is still ours, so a successor process that
+// took over the path after a hand-over keeps its listener.
+class LocalListener : public QObject {
+    Q_OBJECT
+
+public:
+    explicit LocalListener(QObject* parent = nullptr);
+    ~LocalListener();
+
+    bool listen(const QString& path);
+    void close();
+    bool isListening() const { return m_fd != -1; }
+    QString path() const { return m_path; }
+
+signals:
+    void connectionAccepted(QTcpSocket* socket);
+
+private slots:
+    void onActivated();
+
+private:
+    int m_fd;
+    quint64 m_inode;
+    QString m_path;
+    QSocketNotifier* m_notifier;
+};
@@ -1,11 +1,379 @@
 #include "server.hpp"
+#include "signal_watcher.hpp"
+#include "cluster_router.hpp"
+#include "websocket_gateway.hpp"
+#include "admin_channel.hpp"
+#include "server_config.hpp"
+#include "authenticator.hpp"
+#include "auth_provider.hpp"
 #include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QRandomGenerator>
+#include <QProcess>
+#include <QDir>
+#include <QStandardPaths>
+#include <QSysInfo>
+#include <QDebug>
+#include <QJsonDocument>
+#include <QTextStream>
+
+#ifdef Q_OS_UNIX
+#include <csignal>
+#endif
 
 int main(int argc, char** argv) {
     QCoreApplication a(argc, argv);
 
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Messenger server");
+    parser.addHelpOption();
+    QCommandLineOption configOption("config", "JSON file of tuning knobs; SIGHUP reloads it.", "file");
+    QCommandLineOption setOption("set", "Override one knob of the config file (repeatable).", "knob=value");
+    QCommandLineOption listenAddressOption("listen-address", "Address to listen on (default: any).", "address");
+    QCommandLineOption logLevelOption("log-level", "debug, info or warning (default: debug).", "level");
+    QCommandLineOption portOption("port", "Port to listen on (default: 5464).", "port");
+    QCommandLineOption reusePortOption("reuse-port", "Bind the port with SO_REUSEPORT.");
+    QCommandLineOption listenFdOption("listen-fd", "Take over an already listening socket.", "fd");
+    QCommandLineOption drainTimeoutOption("drain-timeout", "Milliseconds to wait for clients to leave when draining (default: 10000).", "ms");
+    QCommandLineOption workersOption("workers", "Number of server processes sharing the port (implies --reuse-port).", "count");
+    QCommandLineOption clusterDirOption("cluster-dir", "Private directory where processes on this host find each other.", "dir");
+    QCommandLineOption nodePortOption("node-port", "Port on which other cluster nodes connect to this one (key in MESSENGER_CLUSTER_KEY).", "port");
+    QCommandLineOption nodeAddressOption("node-address", "Address for node links (default: 127.0.0.1).", "address");
+    QCommandLineOption peerOption("peer", "Cluster node to link with, as host:port (repeatable).", "host:port");
+    QCommandLineOption nodeIdOption("node-id", "Name of this node within the cluster.", "id");
+    QCommandLineOption tlsCertOption("tls-cert", "PEM certificate chain; enables TLS for clients.", "file");
+    QCommandLineOption tlsKeyOption("tls-key", "PEM private key for --tls-cert.", "file");
+    QCommandLineOption lowFootprintOption("low-footprint", "Release buffers of idle connections.");
+    QCommandLineOption unixSocketOption("unix-socket", "Also accept clients on this Unix domain socket.", "path");
+    QCommandLineOption wsPortOption("ws-port", "Port for WebSocket clients.", "port");
+    QCommandLineOption captureOption("capture", "Record inbound traffic of this process for messenger_replay; a hot restart carries on in <file>.<pid>.", "file");
+    QCommandLineOption captureRateOption("capture-rate", "Fraction of connections to record (0..1).", "rate", "1");
+    QCommandLineOption adminPortOption("admin-port", "Loopback port for the admin channel (token in MESSENGER_ADMIN_TOKEN).", "port");
+    QCommandLineOption adminSocketOption("admin-socket", "Unix socket for the admin channel (token in MESSENGER_ADMIN_TOKEN).", "path");
+    QCommandLineOption passwordFileOption("password-file", "Require a password listed in this file; SIGHUP reloads it.", "file");
+    QCommandLineOption authTokensOption("auth-tokens", "Accept tokens signed with MESSENGER_AUTH_TOKEN_KEY as passwords.");
+    QCommandLineOption hashPasswordOption("hash-password", "Read a password from stdin, print its --password-file line and exit.", "name");
+    parser.addOptions({configOption, setOption, listenAddressOption, logLevelOption, portOption, reusePortOption, listenFdOption, drainTimeoutOption, workersOption, clusterDirOption,
+                       nodePortOption, nodeAddressOption, peerOption, nodeIdOption, tlsCertOption, tlsKeyOption, lowFootprintOption,
+                       unixSocketOption, wsPortOption, captureOption, captureRateOption, adminPortOption,
+                       adminSocketOption, passwordFileOption, authTokensOption, hashPasswordOption});
+    parser.process(a);
+
+    if (parser.isSet(hashPasswordOption)) {
+        QString password = QTextStream(stdin).readLine();
+        if (password.isEmpty()) {
+            qWarning() << "No password on stdin";
+            return 1;
+        }
+        QTextStream(stdout) << PasswordFileProvider::entryFor(parser.value(hashPasswordOption), password) << Qt::endl;
+        return 0;
+    }
+
+    // Dedicated options are shorthands for --set, and like it they win over the file.
+    QStringList overrides;
+    const QList<QPair<QCommandLineOption, QString>> shorthands = {
+        {listenAddressOption, "listenAddress"}, {portOption, "port"}, {workersOption, "workers"},
+        {drainTimeoutOption, "drainTimeoutMs"}, {logLevelOption, "logLevel"}};
+    for (const auto& shorthand : shorthands) {
+        if (parser.isSet(shorthand.first)) {
+            overrides << shorthand.second + "=" + parser.value(shorthand.first);
+        }
+    }
+    overrides << parser.values(setOption);
+
+    auto loadConfig = [&](ServerConfig& config, QString& error) {
+        if (parser.isSet(configOption) && !config.load(parser.value(configOption), error)) {
+            return false;
+        }
+        for (const QString& assignment : std::as_const(overrides)) {
+            if (!config.set(assignment, error)) return false;
+        }
+        return true;
+    };
+
+    ServerConfig config;
+    QString configError;
+    if (!loadConfig(config, configError)) {
+        qWarning() << "Invalid configuration:" << configError;
+        return 1;
+    }
+    ServerConfig::applyLogLevel(config.logLevel);
+
+    // Built afresh on every load, as workers may still be reading the previous providers.
+    auto loadProviders = [&](QList<std::shared_ptr<const AuthProvider>>& providers, QString& error) {
+        if (parser.isSet(passwordFileOption)) {
+            auto passwords = std::make_shared<PasswordFileProvider>();
+            if (!passwords->load(parser.value(passwordFileOption), error)) return false;
+            providers.append(passwords);
+        }
+        if (parser.isSet(authTokensOption)) {
+            QByteArray key = qgetenv("MESSENGER_AUTH_TOKEN_KEY");
+            if (key.isEmpty()) {
+                error = "--auth-tokens needs MESSENGER_AUTH_TOKEN_KEY";
+                return false;
+            }
+            providers.append(std::make_shared<TokenProvider>(key));
+        }
+        return true;
+    };
+
+    QList<std::shared_ptr<const AuthProvider>> providers;
+    if (!loadProviders(providers, configError)) {
+        qWarning() << "Invalid authentication setup:" << configError;
+        return 1;
+    }
+
+    bool reusePort = parser.isSet(reusePortOption) || config.workers > 1;
+    QString clusterDir = parser.value(clusterDirOption);
+    if (clusterDir.isEmpty() && config.workers > 1) {
+        // The runtime directory is private to the user (XDG_RUNTIME_DIR, or a 0700 fallback).
+        clusterDir = QDir(QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation)).filePath("messenger-" + config.port);
+    }
+
+    // The session key must survive a hot restart, otherwise clients could not resume on the new process.
+    if (qEnvironmentVariableIsEmpty("MESSENGER_SESSION_KEY")) {
+        QByteArray key;
+        for (int i = 0; i < 4; ++i) {
+            key += QByteArray::number(QRandomGenerator::system()->generate64(), 16);
+        }
+        qputenv("MESSENGER_SESSION_KEY", key);
+    }
+
+    // Options every process of this server runs with: siblings and the successor of a hand-over.
+    QStringList inheritedArguments;
+    if (parser.isSet(tlsCertOption)) {
+        inheritedArguments << "--tls-cert" << parser.value(tlsCertOption) << "--tls-key" << parser.value(tlsKeyOption);
+    }
+    if (parser.isSet(lowFootprintOption)) {
+        inheritedArguments << "--low-footprint";
+    }
+    if (parser.isSet(configOption)) {
+        inheritedArguments << "--config" << parser.value(configOption);
+    }
+    if (parser.isSet(passwordFileOption)) {
+        inheritedArguments << "--password-file" << parser.value(passwordFileOption);
+    }
+    if (parser.isSet(authTokensOption)) {
+        inheritedArguments << "--auth-tokens";
+    }
+    // The worker count is not inherited: siblings run with one, a successor with ours.
+    for (const QString& assignment : std::as_const(overrides)) {
+        if (assignment.section('=', 0, 0).trimmed() != "workers") {
+            inheritedArguments << "--set" << assignment;
+        }
+    }
+
     Server s;
-    s.open("5464");
+    s.applyConfig(config);
+
+    Authenticator authenticator;
+    authenticator.setProviders(providers);
+    authenticator.setCacheTtl(config.authCacheTtlMs);
+    authenticator.setMaxThreads(config.authThreads);
+    s.setAuthenticator(&authenticator);
+    if (parser.isSet(tlsCertOption) && !s.enableTls(parser.value(tlsCertOption), parser.value(tlsKeyOption))) {
+        return 1;
+    }
+    s.setLowFootprint(parser.isSet(lowFootprintOption));
+    // A successor runs alongside the process it replaces while that one drains, so each writes its own file.
+    if (parser.isSet(captureOption)) {
+        QString capturePath = parser.value(captureOption);
+        if (parser.isSet(listenFdOption)) {
+            capturePath += "." + QString::number(QCoreApplication::applicationPid());
+        }
+        if (!s.startCapture(capturePath, parser.value(captureRateOption).toDouble())) {
+            return 1;
+        }
+    }
+
+    bool opened = parser.isSet(listenFdOption) ? s.openDescriptor(parser.value(listenFdOption).toLongLong())
+                                               : s.open(config.port, reusePort, config.hostAddress());
+    if (!opened) {
+        return 1;
+    }
+
+    if (parser.isSet(unixSocketOption) && !s.openLocal(parser.value(unixSocketOption))) {
+        return 1;
+    }
+
+    // The gateway binds its port exclusively, so only this process serves WebSocket clients.
+    WebSocketGateway* gateway = nullptr;
+    quint16 wsPort = parser.value(wsPortOption).toUShort();
+    if (parser.isSet(wsPortOption)) {
+        gateway = new WebSocketGateway(&s, &s);
+        if (!gateway->listen(QHostAddress::Any, wsPort)) {
+            return 1;
+        }
+    }
+
+    // Like the gateway, the admin channel belongs to this process only; siblings are reached through their own.
+    AdminChannel* admin = nullptr;
+    quint16 adminPort = parser.value(adminPortOption).toUShort();
+    if (parser.isSet(adminPortOption) || parser.isSet(adminSocketOption)) {
+        admin = new AdminChannel(&s, qgetenv("MESSENGER_ADMIN_TOKEN"), &s);
+        if (parser.isSet(adminPortOption) && !admin->listen(QHostAddress::LocalHost, adminPort)) {
+            return 1;
+        }
+        if (parser.isSet(adminSocketOption) && !admin->listenLocal(parser.value(adminSocketOption))) {
+            return 1;
+        }
+    }
+
+    const QStringList peers = parser.values(peerOption);
+    QHostAddress nodeAddress(parser.isSet(nodeAddressOption) ? parser.value(nodeAddressOption) : QString("127.0.0.1"));
+    quint16 nodePort = parser.value(nodePortOption).toUShort();
+    ClusterRouter* router = nullptr;
+    if (!clusterDir.isEmpty() || parser.isSet(nodePortOption) || !peers.isEmpty()) {
+        QString nodeId = parser.value(nodeIdOption);
+        if (nodeId.isEmpty()) {
+            nodeId = QSysInfo::machineHostName() + "-" + QString::number(QCoreApplication::applicationPid());
+        }
+
+        router = new ClusterRouter(nodeId, &s);
+        router->setNodeKey(qgetenv("MESSENGER_CLUSTER_KEY"));
+        if ((parser.isSet(nodePortOption) || !peers.isEmpty()) && qEnvironmentVariableIsEmpty("MESSENGER_CLUSTER_KEY")) {
+            qWarning() << "--node-port and --peer need MESSENGER_CLUSTER_KEY";
+            return 1;
+        }
+        if (!clusterDir.isEmpty() && !router->listenLocal(clusterDir)) {
+            return 1;
+        }
+        if (parser.isSet(nodePortOption) && !router->listenNodes(nodeAddress, nodePort)) {
+            return 1;
+        }
+        for (const QString& peer : peers) {
+            int colon = peer.lastIndexOf(':');
+            if (colon <= 0) {
+                qWarning() << "Ignoring malformed peer address" << peer;
+                continue;
+            }
+            router->connectToNode(peer.left(colon), peer.mid(colon + 1).toUShort());
+        }
+        s.setRouter(router);
+    }
+
+    // Siblings are plain copies of this process; the kernel balances accepts between them.
+    QList<QProcess*> siblings;
+    for (int i = 1; i < config.workers; ++i) {
+        QProcess* sibling = new QProcess(&a);
+        sibling->setProcessChannelMode(QProcess::ForwardedChannels);
+        sibling->start(QCoreApplication::applicationFilePath(),
+                       QStringList{"--reuse-port", "--cluster-dir", clusterDir, "--workers", "1"} + inheritedArguments);
+        siblings.append(sibling);
+    }
+
+    QObject::connect(&s, &Server::drained, &a, [&]() {
+        for (QProcess* sibling : siblings) {
+            sibling->waitForFinished(config.drainTimeoutMs + 1000);
+        }
+        a.quit();
+    });
+
+#ifdef Q_OS_UNIX
+    // SIGTERM/SIGINT drain and exit; SIGUSR2 hands the listening socket to a fresh process first;
+    // SIGUSR1 only logs the memory report; SIGHUP reloads the configuration in place.
+    SignalWatcher watcher({SIGTERM, SIGINT, SIGUSR1, SIGUSR2, SIGHUP});
+    QObject::connect(&watcher, &SignalWatcher::signalReceived, &s, [&](int signalNumber) {
+        if (signalNumber == SIGUSR1) {
+            qInfo().noquote() << "Memory report:" << QJsonDocument(s.memoryReport()).toJson(QJsonDocument::Compact);
+            return;
+        }
+        if (signalNumber == SIGHUP) {
+            ServerConfig reloaded;
+            QString error;
+            if (!loadConfig(reloaded, error)) {
+                qWarning() << "Keeping the current configuration:" << error;
+                return;
+            }
+            if (!reloaded.sameBinding(config)) {
+                qWarning() << "Listen address, port and workers only change on restart";
+                reloaded.listenAddress = config.listenAddress;
+                reloaded.port = config.port;
+                reloaded.workers = config.workers;
+            }
+
+            QList<std::shared_ptr<const AuthProvider>> reloadedProviders;
+            if (!loadProviders(reloadedProviders, error)) {
+                qWarning() << "Keeping the current configuration:" << error;
+                return;
+            }
+
+            config = reloaded;
+            s.applyConfig(config);
+            authenticator.setProviders(reloadedProviders);
+            authenticator.setCacheTtl(config.authCacheTtlMs);
+            authenticator.setMaxThreads(config.authThreads);
+            ServerConfig::applyLogLevel(config.logLevel);
+            for (QProcess* sibling : siblings) {
+                ::kill(static_cast<pid_t>(sibling->processId()), SIGHUP);
+            }
+            qInfo().noquote() << "Configuration reloaded:" << QJsonDocument(config.toJson()).toJson(QJsonDocument::Compact);
+            return;
+        }
+        if (signalNumber == SIGUSR2) {
+            // The successor starts a fresh set of siblings, so the current ones drain alongside us.
+            QStringList arguments;
+            arguments << inheritedArguments << "--workers" << QString::number(config.workers);
+            if (!clusterDir.isEmpty()) {
+                arguments << "--cluster-dir" << clusterDir;
+            }
+            for (const QString& peer : peers) {
+                arguments << "--peer" << peer;
+            }
+            // The successor binds the path afresh; the inode check keeps this process from removing its socket.
+            if (parser.isSet(unixSocketOption)) {
+                arguments << "--unix-socket" << parser.value(unixSocketOption);
+            }
+            // Should both processes be linked to the same node, peers route to the newer one.
+            if (parser.isSet(nodeIdOption)) {
+                arguments << "--node-id" << parser.value(nodeIdOption);
+            }
+            // The successor binds the node port afresh; links this process has stay up while it drains.
+            if (parser.isSet(nodePortOption)) {
+                arguments << "--node-port" << parser.value(nodePortOption) << "--node-address" << nodeAddress.toString();
+                router->stopListeningNodes();
+            }
+            // Capture carries on in the successor's own file.
+            if (parser.isSet(captureOption)) {
+                arguments << "--capture" << parser.value(captureOption) << "--capture-rate" << parser.value(captureRateOption);
+            }
+            // The WebSocket port cannot be shared either, so the successor binds it afresh too.
+            if (gateway) {
+                arguments << "--ws-port" << QString::number(wsPort);
+                gateway->close();
+            }
+            // The successor takes over the admin channel as well; admins signed in here can watch this process drain.
+            if (admin) {
+                if (parser.isSet(adminPortOption)) {
+                    arguments << "--admin-port" << QString::number(adminPort);
+                }
+                if (parser.isSet(adminSocketOption)) {
+                    arguments << "--admin-socket" << parser.value(adminSocketOption);
+                }
+                admin->close();
+            }
+            if (!s.handOver(arguments)) {
+                if (parser.isSet(nodePortOption)) {
+                    router->listenNodes(nodeAddress, nodePort);
+                }
+                if (gateway) {
+                    gateway->listen(QHostAddress::Any, wsPort);
+                }
+                if (admin && parser.isSet(adminPortOption)) {
+                    admin->listen(QHostAddress::LocalHost, adminPort);
+                }
+                if (admin && parser.isSet(adminSocketOption)) {
+                    admin->listenLocal(parser.value(adminSocketOption));
+                }
+                return;
+            }
+        }
+        for (QProcess* sibling : siblings) {
+            sibling->terminate();
+        }
+        s.drain(config.drainTimeoutMs);
+    });
+#endif
 
     return a.exec();
 }
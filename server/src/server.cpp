@@ -1,37 +1,472 @@
 #include "server.hpp"
+#include "cluster_router.hpp"
+#include "local_listener.hpp"
+#include "server_config.hpp"
+#include "authenticator.hpp"
 #include <QDebug>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QJsonArray>
 #include <QDateTime>
+#include <QPointer>
+#include <QMessageAuthenticationCode>
+#include <QRandomGenerator>
+#include <QCoreApplication>
+#include <QThread>
+#include <QProcess>
+#include <QtEndian>
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryFile>
+#include <QDir>
+#include <cstring>
+
+#ifndef QT_NO_SSL
+#include <QSslSocket>
+#include <QSslCertificate>
+#include <QSslKey>
+#endif
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+#ifdef Q_OS_UNIX
+// QTcpServer::listen() cannot set SO_REUSEPORT, so the listening socket is built by hand.
+int createReusePortSocket(const QHostAddress& host, quint16 port) {
+    int fd = ::socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    int enable = 1;
+    int disable = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable));
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    // IPv4 addresses become IPv4-mapped ones, which the dual-stack socket accepts as well.
+    if (host == QHostAddress::Any || host == QHostAddress::AnyIPv6) {
+        address.sin6_addr = in6addr_any;
+    } else {
+        Q_IPV6ADDR bytes = host.toIPv6Address();
+        std::memcpy(&address.sin6_addr, bytes.c, sizeof(bytes.c));
+    }
+    address.sin6_port = htons(port);
+
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+}
+
+Server::Server(QObject* parent)
+    : QTcpServer(parent), m_sequencer([this](const ConversationKey&, quint64, SequencedDelivery& delivery) {
+          releaseDelivery(delivery);
+      }) {
+    connect(this, &QTcpServer::newConnection, this, &Server::onNewConnection);
+
+    m_sessionKey = qgetenv("MESSENGER_SESSION_KEY");
+    if (m_sessionKey.isEmpty()) {
+        m_sessionKey.resize(32);
+        QRandomGenerator::system()->generate(reinterpret_cast<quint32*>(m_sessionKey.data()),
+                                             reinterpret_cast<quint32*>(m_sessionKey.data() + m_sessionKey.size()));
+    }
+
+    // Left by the process this one took over from; see handOver().
+    QString tokenStatePath = qEnvironmentVariable("MESSENGER_TOKEN_STATE");
+    if (!tokenStatePath.isEmpty()) {
+        QFile tokenState(tokenStatePath);
+        if (tokenState.open(QIODevice::ReadOnly)) {
+            loadTokenState(tokenState.readAll());
+        }
+        tokenState.remove();
+        qunsetenv("MESSENGER_TOKEN_STATE");
+    }
+
+    m_sessionSweepTimer.setInterval(kSessionSweepIntervalMs);
+    connect(&m_sessionSweepTimer, &QTimer::timeout, this, &Server::expireDetachedSessions);
+
+    // Acks are flushed once per event loop pass, so a burst of pipelined messages costs one ack frame.
+    m_ackFlushTimer.setSingleShot(true);
+    m_ackFlushTimer.setInterval(0);
+    connect(&m_ackFlushTimer, &QTimer::timeout, this, &Server::flushAcks);
+
+    // Typing events only go out from this timer, after whatever messages the same reads produced.
+    m_typingTimer.setInterval(kTypingFlushMs);
+    connect(&m_typingTimer, &QTimer::timeout, this, &Server::flushTyping);
+
+    m_drainTimer.setSingleShot(true);
+    connect(&m_drainTimer, &QTimer::timeout, this, &Server::finishDrain);
+
+    m_idleSweepTimer.setInterval(kIdleSweepIntervalMs);
+    connect(&m_idleSweepTimer, &QTimer::timeout, this, &Server::releaseIdleBuffers);
+}
+
+bool Server::open(const QString& port, bool reusePort, const QHostAddress& address) {
+    bool listening = false;
+
+    if (reusePort) {
+#ifdef Q_OS_UNIX
+        int fd = createReusePortSocket(address, port.toUShort());
+        listening = fd != -1 && setSocketDescriptor(fd);
+#else
+        qWarning() << "SO_REUSEPORT is not supported on this platform";
+#endif
+    } else {
+        listening = listen(address, port.toInt());
+    }
+
+    if (!listening) {
+        qWarning() << "Unable to start server";
+        return false;
+    }
+
+    qInfo() << "Server successfully started on" << address.toString() << "port" << port << (reusePort ? "(SO_REUSEPORT)" : "");
+    return true;
+}
+
+bool Server::openDescriptor(qintptr socketDescriptor) {
+    if (!setSocketDescriptor(socketDescriptor)) {
+        qWarning() << "Unable to take over listening socket" << socketDescriptor;
+        return false;
+    }
+
+    qInfo() << "Server took over listening socket" << socketDescriptor << "on port" << serverPort();
+    return true;
+}
+
+void Server::applyConfig(const ServerConfig& config) {
+    m_maxFrameSize = config.maxFrameSize;
+    m_socketHighWater = config.socketHighWater;
+    m_maxBatchEntries = config.maxBatchEntries;
+    m_maxUnackedPerClient = config.maxUnackedPerClient;
+    m_resumeWindowMs = config.resumeWindowMs;
+    m_idleReleaseMs = config.idleReleaseMs;
+    m_typingIntervalMs = config.typingIntervalMs;
+
+    // Nothing is cut short: retained queues over a lowered limit are trimmed on their next
+    // delivery, and outbound queues drain against the new high-water mark as sockets free up.
+    qInfo() << "Server configuration applied";
+}
+
+void Server::setLowFootprint(bool enabled) {
+    m_lowFootprint = enabled;
+
+    if (enabled) {
+        m_spareQueues.clear();
+        m_framePool.trim();
+        m_idleSweepTimer.start();
+    } else {
+        m_idleSweepTimer.stop();
+    }
+}
+
+bool Server::startCapture(const QString& path, double sampleRate) {
+    // Connections that are already open are left out: their earlier frames were never recorded.
+    for (ClientBuffer& buffer : m_buffers) {
+        buffer.captureId = 0;
+    }
+    return m_recorder.start(path, sampleRate);
+}
+
+void Server::stopCapture() {
+    m_recorder.stop();
+}
+
+void Server::releaseIdleBuffers() {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    int released = 0;
+
+    for (auto it = m_buffers.cbegin(); it != m_buffers.cend(); ++it) {
+        if (now - it->lastActivity < m_idleReleaseMs || it->expectedSize != 0) continue;
+
+        auto client = m_clients.find(m_socketToName.value(it.key()));
+        if (client == m_clients.end()) continue;
+
+        // Whatever is still unacknowledged has to stay; only spare capacity goes.
+        if (client->unacked.isEmpty() && client->unacked.capacity() > 0) {
+            client->unacked = QList<PendingDelivery>();
+            ++released;
+        } else {
+            client->unacked.squeeze();
+        }
+        client->nextSeq.squeeze();
+    }
+
+    // Detached sessions have no socket to go idle on, so they are trimmed on every pass.
+    for (ClientInfo& info : m_clients) {
+        if (info.detachedAt != 0) {
+            info.unacked.squeeze();
+            info.nextSeq.squeeze();
+        }
+    }
+
+    m_framePool.trim();
+    if (released > 0) {
+        qInfo() << "Released buffers of" << released << "idle sessions";
+    }
+}
+
+QJsonObject Server::memoryReport() const {
+    // Estimates of what the server itself holds. Qt's own QTcpSocket internals are not visible
+    // from here and are reported only as a connection count.
+    auto stringBytes = [](const QString& string) -> qint64 {
+        return string.isDetached() ? string.capacity() * static_cast<qint64>(sizeof(QChar)) : 0;
+    };
+    auto hashBytes = [](qsizetype buckets, qsizetype nodeSize) -> qint64 {
+        // One offset byte per bucket, and entry storage for at least three eighths of them.
+        return buckets + buckets * 3 / 8 * nodeSize;
+    };
+
+    qint64 sessionBytes = hashBytes(m_clients.capacity(), sizeof(QString) + sizeof(ClientInfo));
+    qint64 pendingBytes = 0;
+    int detachedSessions = 0;
+
+    for (auto it = m_clients.constBegin(); it != m_clients.constEnd(); ++it) {
+        sessionBytes += it.key().capacity() * static_cast<qint64>(sizeof(QChar));
+        sessionBytes += stringBytes(it->interlocutor);
+        sessionBytes += it->nextSeq.capacity() * static_cast<qint64>(sizeof(PeerSeq));
+        for (const PeerSeq& entry : it->nextSeq) {
+            sessionBytes += stringBytes(entry.peer);
+        }
+        pendingBytes += it->unacked.capacity() * static_cast<qint64>(sizeof(PendingDelivery));
+        if (it->detachedAt != 0) {
+            ++detachedSessions;
+        }
+    }
+
+    qint64 connectionBytes = hashBytes(m_buffers.capacity(), sizeof(QTcpSocket*) + sizeof(ClientBuffer)) +
+                             hashBytes(m_socketToName.capacity(), sizeof(QTcpSocket*) + sizeof(QString));
+    qint64 socketBufferBytes = 0;
+    for (QTcpSocket* socket : m_buffers.keys()) {
+        socketBufferBytes += socket->bytesAvailable() + socket->bytesToWrite();
+    }
+    qint64 outboundBytes = 0;
+    for (const OutboundQueue& queue : m_outbound) {
+        outboundBytes += queue.queuedBytes;
+    }
+
+    qint64 pooledBytes = m_framePool.pooledBytes();
+    for (const QList<PendingDelivery>& queue : m_spareQueues) {
+        pooledBytes += queue.capacity() * static_cast<qint64>(sizeof(PendingDelivery));
+    }
+
+    QJsonObject report;
+    report["connections"] = m_buffers.size();
+    report["sessions"] = m_clients.size();
+    report["detachedSessions"] = detachedSessions;
+    report["sessionBytes"] = sessionBytes;
+    report["connectionBytes"] = connectionBytes;
+    report["socketBufferBytes"] = socketBufferBytes;
+    report["outboundQueuedBytes"] = outboundBytes;
+    report["pendingBytes"] = pendingBytes;
+    report["pooledBytes"] = pooledBytes;
+    qint64 totalBytes = sessionBytes + connectionBytes + socketBufferBytes + outboundBytes + pendingBytes;
+    report["bytesPerSession"] = m_clients.isEmpty() ? 0 : totalBytes / m_clients.size();
+    report["lowFootprint"] = m_lowFootprint;
+    return report;
+}
+
+bool Server::openLocal(const QString& path) {
+    if (!m_localListener) {
+        m_localListener = new LocalListener(this);
+        connect(m_localListener, &LocalListener::connectionAccepted, this, &Server::acceptConnection);
+    }
+    return m_localListener->listen(path);
+}
+
+bool Server::enableTls(const QString& certificatePath, const QString& keyPath) {
+#ifndef QT_NO_SSL
+    QFile certificateFile(certificatePath);
+    QFile keyFile(keyPath);
+    if (!certificateFile.open(QIODevice::ReadOnly) || !keyFile.open(QIODevice::ReadOnly)) {
+        qWarning() << "Unable to read TLS certificate" << certificatePath << "or key" << keyPath;
+        return false;
+    }
 
-Server::Server(QObject* parent) : QTcpServer(parent) {connect(this, &QTcpServer::newConnection, this, &Server::onNewConnection);}
+    QList<QSslCertificate> chain = QSslCertificate::fromDevice(&certificateFile, QSsl::Pem);
+    QByteArray keyData = keyFile.readAll();
+    QSslKey key(keyData, QSsl::Rsa, QSsl::Pem);
+    if (key.isNull()) {
+        key = QSslKey(keyData, QSsl::Ec, QSsl::Pem);
+    }
+    if (chain.isEmpty() || key.isNull()) {
+        qWarning() << "Invalid TLS certificate or key";
+        return false;
+    }
+
+    m_tlsConfiguration = QSslConfiguration::defaultConfiguration();
+    m_tlsConfiguration.setLocalCertificateChain(chain);
+    m_tlsConfiguration.setPrivateKey(key);
+    m_tlsConfiguration.setProtocol(QSsl::TlsV1_2OrLater);
+    m_tlsConfiguration.setPeerVerifyMode(QSslSocket::VerifyNone);
+    // Session tickets let a reconnect storm resume sessions instead of paying for full handshakes.
+    m_tlsConfiguration.setSslOption(QSsl::SslOptionDisableSessionTickets, false);
+    m_tlsEnabled = true;
+
+    qInfo() << "TLS enabled with the" << QSslSocket::activeBackend() << "backend";
+    return true;
+#else
+    Q_UNUSED(certificatePath);
+    Q_UNUSED(keyPath);
+    qWarning() << "TLS is not supported by this Qt build";
+    return false;
+#endif
+}
+
+void Server::incomingConnection(qintptr socketDescriptor) {
+#ifndef QT_NO_SSL
+    if (m_tlsEnabled) {
+        QSslSocket* socket = new QSslSocket(this);
+        if (!socket->setSocketDescriptor(socketDescriptor)) {
+            qWarning() << "Unable to accept connection:" << socket->errorString();
+            delete socket;
+            return;
+        }
+        socket->setSslConfiguration(m_tlsConfiguration);
+
+        connect(socket, &QSslSocket::sslErrors, this, [socket](const QList<QSslError>& errors) {
+            qWarning() << "TLS handshake with" << socket->peerAddress().toString() << "failed:" << errors;
+        });
+
+        // Frames are only read once the handshake is done; anything written before is queued by QSslSocket.
+        addPendingConnection(socket);
+        socket->startServerEncryption();
+        return;
+    }
+#endif
+    QTcpServer::incomingConnection(socketDescriptor);
+}
 
-bool Server::open(const QString& port) {
-    if (!listen(QHostAddress::Any, port.toInt())) {
-        qDebug() << "Unable to start server";
+bool Server::handOver(const QStringList& arguments) {
+#ifdef Q_OS_UNIX
+    qintptr fd = socketDescriptor();
+    if (fd == -1) return false;
+
+    // The listening socket is inherited by the new process, so no connection attempt is refused
+    // while the two overlap.
+    int flags = ::fcntl(fd, F_GETFD);
+    if (flags == -1 || ::fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) == -1) {
+        qWarning() << "Unable to share listening socket with the new process";
         return false;
     }
 
-    qDebug() << "Server successfully started on port" << port;
+    QStringList childArguments = arguments;
+    childArguments << "--listen-fd" << QString::number(fd);
+
+    // Revoked tokens must stay revoked in the new process, and clients that rebuild their session
+    // there must not have messages relayed twice. This goes in a file only we can read, which the
+    // new process removes once loaded.
+    QTemporaryFile tokenState(QDir::temp().filePath("messenger-tokens-XXXXXX"));
+    tokenState.setAutoRemove(false);
+    if (!tokenState.open() || tokenState.write(saveTokenState()) == -1) {
+        qWarning() << "Unable to pass session state to the new process";
+        tokenState.remove();
+        ::fcntl(fd, F_SETFD, flags);
+        return false;
+    }
+    QString tokenStatePath = tokenState.fileName();
+    tokenState.close();
+    qputenv("MESSENGER_TOKEN_STATE", QFile::encodeName(tokenStatePath));
+
+    qint64 pid = 0;
+    bool started = QProcess::startDetached(QCoreApplication::applicationFilePath(), childArguments, QString(), &pid);
+    qunsetenv("MESSENGER_TOKEN_STATE");
+    if (!started) {
+        qWarning() << "Unable to start the new server process";
+        QFile::remove(tokenStatePath);
+        ::fcntl(fd, F_SETFD, flags);
+        return false;
+    }
+
+    qInfo() << "Handed listening socket over to process" << pid;
     return true;
+#else
+    Q_UNUSED(arguments);
+    return false;
+#endif
+}
+
+void Server::drain(int timeoutMs) {
+    if (m_draining) return;
+    m_draining = true;
+
+    close();
+    if (m_localListener) {
+        m_localListener->close();
+    }
+    emit drainStarted();
+    qInfo() << "Draining" << m_buffers.size() << "connections";
+
+    // Each client gets its own reconnect delay, so they do not all come back at the same moment.
+    for (QTcpSocket* socket : m_buffers.keys()) {
+        QJsonObject migrate;
+        migrate["type"] = "migrate";
+        migrate["retryAfterMs"] = QRandomGenerator::global()->bounded(kMigrateSpreadMs);
+        sendMessageWithSize(socket, migrate);
+        socket->disconnectFromHost();
+    }
+
+    if (m_buffers.isEmpty()) {
+        finishDrain();
+        return;
+    }
+    m_drainTimer.start(timeoutMs);
+}
+
+void Server::finishDrain() {
+    m_drainTimer.stop();
+
+    for (QTcpSocket* socket : m_buffers.keys()) {
+        qWarning() << "Drain timeout, aborting connection with" << socket->bytesToWrite() << "unsent bytes";
+        socket->abort();
+    }
+
+    qInfo() << "Server drained";
+    emit drained();
 }
 
 void Server::onNewConnection() {
-    QTcpSocket* clientSocket = nextPendingConnection();
-    qDebug() << "New connection from" << clientSocket->peerAddress().toString();
+    while (QTcpSocket* clientSocket = nextPendingConnection()) {
+        acceptConnection(clientSocket);
+    }
+}
 
+void Server::acceptConnection(QTcpSocket* clientSocket) {
     if (!clientSocket) {
-        qDebug() << "Error: clientSocket is null!";
+        qWarning() << "Error: clientSocket is null!";
         return;
     }
+    qDebug() << "New connection from" << clientSocket->peerAddress().toString();
+
+    // Sockets from other transports arrive without a parent.
+    if (!clientSocket->parent()) {
+        clientSocket->setParent(this);
+    }
 
     ClientBuffer buffer;
     buffer.expectedSize = 0;
     buffer.socket = clientSocket;
+    buffer.lastActivity = QDateTime::currentMSecsSinceEpoch();
+    buffer.captureId = m_recorder.openConnection();
     m_buffers[clientSocket] = buffer;
 
     connect(clientSocket, &QTcpSocket::disconnected, this, &Server::onClientDisconnected);
     connect(clientSocket, &QTcpSocket::readyRead, this, &Server::onReadyRead);
+    connect(clientSocket, &QTcpSocket::bytesWritten, this, &Server::onBytesWritten);
 }
 
 void Server::onClientDisconnected() {
@@ -40,52 +475,60 @@ void Server::onClientDisconnected() {
 
     QString clientName = m_socketToName.value(clientSocket);
 
-    if (!clientName.isEmpty()) {removeClient(clientName);}
+    if (!clientName.isEmpty()) {detachClient(clientName);}
 
+    m_recorder.recordClose(m_buffers.value(clientSocket).captureId);
+    m_pendingAcks.remove(clientSocket);
+    m_outbound.remove(clientSocket);
     m_buffers.remove(clientSocket);
     clientSocket->deleteLater();
+
+    if (m_draining && m_buffers.isEmpty() && m_drainTimer.isActive()) {
+        finishDrain();
+    }
 }
 
 void Server::onReadyRead() {
     QTcpSocket* clientSocket = qobject_cast<QTcpSocket*>(sender());
-    if (!clientSocket) return;
+    if (!clientSocket || !m_buffers.contains(clientSocket)) return;
 
-    ClientBuffer& buffer = m_buffers[clientSocket];
-    QDataStream in(clientSocket);
-    in.setVersion(QDataStream::Qt_5_15);
+    m_buffers[clientSocket].lastActivity = QDateTime::currentMSecsSinceEpoch();
+    readFrames(clientSocket);
+}
+
+void Server::readFrames(QTcpSocket* clientSocket) {
+    // Processing a frame may drop the connection, so the entry is looked up again for every frame.
+    while (m_buffers.contains(clientSocket) && !m_buffers[clientSocket].holdFrames) {
+        quint32& expectedSize = m_buffers[clientSocket].expectedSize;
+        QByteArray data;
 
-    if (buffer.expectedSize == 0) {
-        if (clientSocket->bytesAvailable() < static_cast<qint64>(sizeof(quint32))) {
+        FrameReader::Result result = FrameReader::readFrame(clientSocket, expectedSize, m_maxFrameSize, data, &m_framePool);
+        if (result == FrameReader::Incomplete) {
+            return;
+        }
+        if (result != FrameReader::Complete) {
+            qDebug() << "Dropping connection from" << clientSocket->peerAddress().toString() << ":"
+                     << (result == FrameReader::Oversized ? "frame of" : "short read of") << expectedSize << "bytes";
+            clientSocket->abort();
             return;
         }
-        in >> buffer.expectedSize;
-        qDebug() << "Expecting message of size:" << buffer.expectedSize << "from socket";
-    }
 
-    if (clientSocket->bytesAvailable() < buffer.expectedSize) {
-        return;
+        qDebug() << "Server received full message, size:" << data.size();
+        ClientBuffer& buffer = m_buffers[clientSocket];
+        buffer.bytesIn += static_cast<qint64>(sizeof(quint32)) + data.size();
+        ++buffer.framesIn;
+        m_recorder.recordFrame(buffer.captureId, data);
+        processClientMessage(clientSocket, data);
+        m_framePool.release(data);
     }
+}
 
-    QByteArray data;
-    data.resize(buffer.expectedSize);
-    int bytesRead = in.readRawData(data.data(), buffer.expectedSize);
-
-    if (bytesRead != buffer.expectedSize) {
-        qDebug() << "Error: Read" << bytesRead << "bytes, expected" << buffer.expectedSize;
-        buffer.expectedSize = 0;
+void Server::processClientMessage(QTcpSocket* clientSocket, const QByteArray& data) {
+    if (FileChunk::isChunk(data)) {
+        processFileChunk(clientSocket, data);
         return;
     }
 
-    qDebug() << "Server received full message, size:" << buffer.expectedSize;
-    processClientMessage(clientSocket, data);
-    buffer.expectedSize = 0;
-
-    if (clientSocket->bytesAvailable() > 0) {
-        onReadyRead();
-    }
-}
-
-void Server::processClientMessage(QTcpSocket* clientSocket, const QByteArray& data) {
     QJsonParseError parseError;
     QJsonDocument doc = QJsonDocument::fromJson(data, &parseError);
 
@@ -107,151 +550,881 @@ void Server::processClientMessage(QTcpSocket* clientSocket, const QByteArray& da
     if (type == "auth") {
         processAuth(clientSocket, obj);
     }
+    else if (type == "resume") {
+        processResume(clientSocket, obj);
+    }
     else if (type == "message") {
         processMessage(clientSocket, obj);
     }
+    else if (type == "message_batch") {
+        processMessageBatch(clientSocket, obj);
+    }
+    else if (type == "received") {
+        processReceived(clientSocket, obj);
+    }
+    else if (type == "logout") {
+        processLogout(clientSocket);
+    }
     else if (type == "change_interlocutor") {
         processChangeInterlocutor(clientSocket, obj);
     }
+    else if (type == "typing") {
+        processTyping(clientSocket, obj);
+    }
+    else if (type == "key_exchange") {
+        processKeyExchange(clientSocket, obj);
+    }
+    else if (type == "file_offer") {
+        processFileOffer(clientSocket, obj);
+    }
+    else if (type == "file_accept") {
+        processFileAccept(clientSocket, obj);
+    }
+    else if (type == "file_ack") {
+        processFileAck(clientSocket, obj);
+    }
+    else if (type == "file_cancel") {
+        processFileCancel(clientSocket, obj);
+    }
     else {
         qDebug() << "Unknown message type:" << type;
     }
 }
 
 void Server::sendMessageWithSize(QTcpSocket* socket, const QJsonObject& jsonObj) {
+    sendMessageWithSize(socket, jsonObj, laneFor(jsonObj));
+}
+
+void Server::sendMessageWithSize(QTcpSocket* socket, const QJsonObject& jsonObj, Lane lane) {
     if (!socket || socket->state() != QAbstractSocket::ConnectedState) {
         return;
     }
 
     QByteArray jsonData = QJsonDocument(jsonObj).toJson(QJsonDocument::Compact);
-    quint32 messageSize = static_cast<quint32>(jsonData.size());
+    // Only the type is logged; message text may be a client's plaintext.
+    qDebug() << "Sending" << jsonObj["type"].toString() << "to socket, size:" << jsonData.size();
+    sendRawFrame(socket, jsonData, lane);
+}
+
+Server::Lane Server::laneFor(const QJsonObject& frame) {
+    QString type = frame["type"].toString();
+    return type == "message" || type == "typing" || type == "key_exchange" ? InteractiveLane : ControlLane;
+}
+
+void Server::sendRawFrame(QTcpSocket* socket, const QByteArray& payload, Lane lane) {
+    if (!socket || socket->state() != QAbstractSocket::ConnectedState) {
+        return;
+    }
+
+    // QDataStream writes the size big-endian; so does this.
+    char prefix[sizeof(quint32)];
+    qToBigEndian(static_cast<quint32>(payload.size()), prefix);
+    qint64 frameSize = static_cast<qint64>(sizeof(prefix)) + payload.size();
+
+    auto buffer = m_buffers.find(socket);
+    if (buffer != m_buffers.end()) {
+        buffer->bytesOut += frameSize;
+        ++buffer->framesOut;
+    }
+
+    auto queue = m_outbound.find(socket);
+    if (queue == m_outbound.end() && socket->bytesToWrite() + frameSize <= m_socketHighWater) {
+        // Nothing is waiting, so the socket copies both parts into its own write buffer directly.
+        qint64 bytesWritten = socket->write(prefix, sizeof(prefix));
+        if (bytesWritten != -1) {
+            bytesWritten += socket->write(payload);
+        }
+        if (bytesWritten == -1) {
+            qWarning() << "Failed to send message to socket:" << socket->errorString();
+        } else if (bytesWritten != frameSize) {
+            qWarning() << "Warning: Only" << bytesWritten << "of" << frameSize << "bytes written";
+        }
+        return;
+    }
+
+    if (queue == m_outbound.end()) {
+        queue = m_outbound.insert(socket, OutboundQueue());
+    }
+
+    QByteArray frame;
+    frame.reserve(frameSize);
+    frame.append(prefix, sizeof(prefix));
+    frame.append(payload);
+    queue->lanes[lane].append(std::move(frame));
+    queue->queuedBytes += frameSize;
+    pumpOutbound(socket);
+}
+
+int Server::nextLane(OutboundQueue& queue) {
+    if (!queue.lanes[ControlLane].isEmpty()) {
+        return ControlLane;
+    }
+
+    bool bulkWaiting = !queue.lanes[BulkLane].isEmpty();
+    if (!queue.lanes[InteractiveLane].isEmpty() && (!bulkWaiting || queue.interactiveRun < kInteractiveBurst)) {
+        ++queue.interactiveRun;
+        return InteractiveLane;
+    }
+    if (bulkWaiting) {
+        queue.interactiveRun = 0;
+        return BulkLane;
+    }
+    return -1;
+}
+
+void Server::pumpOutbound(QTcpSocket* socket) {
+    auto it = m_outbound.find(socket);
+    if (it == m_outbound.end()) return;
+
+    OutboundQueue& queue = *it;
+    while (socket->bytesToWrite() < m_socketHighWater) {
+        if (queue.writing < 0) {
+            queue.writing = nextLane(queue);
+            if (queue.writing < 0) break;
+        }
+
+        QList<QByteArray>& lane = queue.lanes[queue.writing];
+        qsizetype slice = qMin(kSliceBytes, lane.first().size() - queue.headOffset);
+        if (socket->write(lane.first().constData() + queue.headOffset, slice) != slice) {
+            qWarning() << "Failed to send message to socket:" << socket->errorString();
+            m_outbound.erase(it);
+            return;
+        }
+
+        queue.headOffset += slice;
+        queue.queuedBytes -= slice;
+        if (queue.headOffset == lane.first().size()) {
+            lane.removeFirst();
+            queue.headOffset = 0;
+            queue.writing = -1;
+        }
+    }
+
+    if (queue.queuedBytes == 0) {
+        m_outbound.erase(it);
+    }
+}
+
+void Server::onBytesWritten() {
+    pumpOutbound(qobject_cast<QTcpSocket*>(sender()));
+}
+
+bool Server::hasQueued(QTcpSocket* socket, Lane lane) const {
+    auto it = m_outbound.constFind(socket);
+    return it != m_outbound.constEnd() && !it->lanes[lane].isEmpty();
+}
+
+void Server::processAuth(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    if (!m_authenticator || !m_authenticator->isEnabled()) {
+        completeAuth(clientSocket, obj);
+        return;
+    }
+
+    // Frames after this one stay unread until the answer, so a message sent right behind the
+    // request is not taken for one from a client that never signed in.
+    m_buffers[clientSocket].holdFrames = true;
+    QPointer<QTcpSocket> socket(clientSocket);
+    QString peer = clientSocket->peerAddress().toString();
+    m_authenticator->verify(obj["clientName"].toString(), obj["password"].toString(), peer, [this, socket, obj](bool accepted) {
+        if (!socket || !m_buffers.contains(socket)) return;
+        m_buffers[socket].holdFrames = false;
+
+        if (accepted) {
+            completeAuth(socket, obj);
+        } else {
+            qDebug() << "Authentication failed: bad credentials for" << obj["clientName"].toString();
+            QJsonObject response;
+            response["type"] = "auth_error";
+            response["message"] = "Invalid name or password";
+            sendMessageWithSize(socket, response);
+            socket->disconnectFromHost();
+            return;
+        }
+        readFrames(socket);
+    });
+}
+
+void Server::completeAuth(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    QString clientName = obj["clientName"].toString();
+    QString interlocutorName = obj["interlocutorName"].toString();
+
+    qDebug() << "Auth request from:" << clientName << "to interlocutor:" << interlocutorName;
+
+    QString error;
+    if (validateConnection(clientName, interlocutorName, error)) {
+        registerClient(clientSocket, clientName, interlocutorName, "auth_success");
+    } else {
+        qDebug() << "Authentication failed:" << error;
+        QJsonObject response;
+        response["type"] = "auth_error";
+        response["message"] = error;
+
+        sendMessageWithSize(clientSocket, response);
+        clientSocket->disconnectFromHost();
+    }
+}
+
+void Server::setRouter(ClusterRouter* router) {
+    m_router = router;
+
+    connect(m_router, &ClusterRouter::frameForLocalUser, this, &Server::onRemoteFrame);
+    connect(m_router, &ClusterRouter::pairRequested, this, &Server::onPairRequested);
+    connect(m_router, &ClusterRouter::remoteUserLeft, this, &Server::onRemoteUserLeft);
+    connect(m_router, &ClusterRouter::userClaimed, this, &Server::onUserClaimed);
+    connect(m_router, &ClusterRouter::sessionReceived, this, &Server::onSessionReceived);
+    connect(m_router, &ClusterRouter::sessionsRevoked, this, &Server::onSessionsRevoked);
+
+    for (auto it = m_clients.constBegin(); it != m_clients.constEnd(); ++it) {
+        m_router->announce(it.key(), it->interlocutor);
+    }
+}
+
+bool Server::isOnline(const QString& name) const {
+    return m_clients.contains(name) || (m_router && m_router->isRemote(name));
+}
+
+QString Server::interlocutorOf(const QString& name) const {
+    auto it = m_clients.constFind(name);
+    if (it != m_clients.constEnd()) {
+        return it->interlocutor;
+    }
+    return m_router ? m_router->remoteInterlocutor(name) : QString();
+}
+
+void Server::sendToUser(const QString& name, const QJsonObject& frame) {
+    if (m_clients.contains(name)) {
+        sendMessageWithSize(m_clients[name].socket, frame);
+    } else if (m_router && m_router->isRemote(name)) {
+        m_router->forward(name, frame);
+    }
+}
+
+void Server::setInterlocutor(const QString& name, const QString& interlocutor) {
+    if (m_clients.contains(name)) {
+        m_clients[name].interlocutor = internName(interlocutor);
+        announceClient(name);
+    } else if (m_router && m_router->isRemote(name)) {
+        m_router->requestPair(name, interlocutor);
+    }
+}
+
+void Server::announceClient(const QString& name) {
+    if (m_router && m_clients.contains(name)) {
+        m_router->announce(name, m_clients[name].interlocutor);
+    }
+}
+
+void Server::onRemoteFrame(const QString& name, const QJsonObject& frame, const QString& peer, quint64 messageId) {
+    if (!m_clients.contains(name)) {
+        qDebug() << "Frame routed to" << name << "but the user is not here";
+        return;
+    }
+
+    if (peer.isEmpty()) {
+        sendMessageWithSize(m_clients[name].socket, frame);
+    } else {
+        relayInOrder(name, peer, frame, messageId);
+    }
+}
+
+void Server::onPairRequested(const QString& name, const QString& interlocutor) {
+    if (m_clients.contains(name)) {
+        m_clients[name].interlocutor = internName(interlocutor);
+        announceClient(name);
+    }
+}
+
+void Server::onRemoteUserLeft(const QString& name) {
+    QStringList partners;
+    for (auto it = m_clients.constBegin(); it != m_clients.constEnd(); ++it) {
+        if (it->interlocutor == name) {
+            partners.append(it.key());
+        }
+    }
+
+    for (const QString& partner : partners) {
+        m_clients[partner].interlocutor = "";
+        announceClient(partner);
+
+        QJsonObject notification;
+        notification["type"] = "interlocutor_disconnected";
+        notification["message"] = "Interlocutor disconnected";
+        sendMessageWithSize(m_clients[partner].socket, notification);
+    }
+}
+
+void Server::onUserClaimed(const QString& name) {
+    if (!m_clients.contains(name)) return;
+
+    if (m_clients[name].detachedAt == 0) {
+        qDebug() << "User" << name << "is announced by another node while connected here";
+        return;
+    }
+
+    // The detached session was resumed on another node. It gets what the client has not
+    // acknowledged and the id of the last message relayed for it; our copy goes without telling anyone.
+    ClientInfo& info = m_clients[name];
+    QJsonArray unacked;
+    for (const PendingDelivery& pending : std::as_const(info.unacked)) {
+        QJsonObject entry;
+        entry["seq"] = static_cast<qint64>(pending.seq);
+        entry["peer"] = pending.peer;
+        entry["messageId"] = static_cast<qint64>(pending.messageId);
+        entry["frame"] = pending.frame;
+        unacked.append(entry);
+    }
+
+    QJsonObject dropped;
+    for (const PeerSeq& entry : std::as_const(info.droppedUpTo)) {
+        dropped[entry.peer] = static_cast<qint64>(entry.seq);
+    }
+
+    QJsonObject state;
+    state["lastClientMessageId"] = static_cast<qint64>(info.lastClientMessageId);
+    state["unacked"] = unacked;
+    state["droppedUpTo"] = dropped;
+    m_router->handOverSession(name, state);
+
+    qDebug() << "Session of" << name << "moved to another node with" << unacked.size() << "unacknowledged messages";
+    recycleDeliveryQueue(info.unacked);
+    m_clients.remove(name);
+}
+
+void Server::onSessionReceived(const QString& name, const QJsonObject& state) {
+    auto pending = m_pendingResumes.constFind(name);
+    if (pending == m_pendingResumes.constEnd() || !m_clients.contains(name)) {
+        qDebug() << "Session of" << name << "handed over after its resume went ahead without it";
+        return;
+    }
+
+    const QJsonObject lastSeq = pending->lastSeq;
+    ClientInfo& info = m_clients[name];
+    info.lastClientMessageId = qMax(info.lastClientMessageId, static_cast<quint64>(state["lastClientMessageId"].toInteger()));
+
+    // Messages routed here while waiting are newer than the handed-over ones, so all of them are
+    // numbered again in that order. The client has seen none yet; seq picks up after its lastSeq.
+    QList<PendingDelivery> arrived = info.unacked;
+    info.unacked.clear();
+    info.nextSeq.clear();
+    for (auto it = lastSeq.constBegin(); it != lastSeq.constEnd(); ++it) {
+        nextSeqFor(info, it.key()) = static_cast<quint64>(it.value().toInteger());
+    }
+    // Messages the other node had to drop keep their numbers, so the client is told of the gap.
+    const QJsonObject dropped = state["droppedUpTo"].toObject();
+    for (auto it = dropped.constBegin(); it != dropped.constEnd(); ++it) {
+        quint64& nextSeq = nextSeqFor(info, it.key());
+        if (static_cast<quint64>(it.value().toInteger()) > nextSeq) {
+            nextSeq = static_cast<quint64>(it.value().toInteger());
+            droppedUpToFor(info, it.key()) = nextSeq;
+        }
+    }
+
+    const QJsonArray unacked = state["unacked"].toArray();
+    for (const QJsonValue& value : unacked) {
+        QJsonObject entry = value.toObject();
+        QString peer = entry["peer"].toString();
+        if (lastSeq.contains(peer) && entry["seq"].toInteger() <= lastSeq[peer].toInteger()) continue;
+        deliverToClient(name, peer, entry["frame"].toObject(), static_cast<quint64>(entry["messageId"].toInteger()));
+    }
+    for (const PendingDelivery& delivery : std::as_const(arrived)) {
+        deliverToClient(name, delivery.peer, delivery.frame, delivery.messageId);
+    }
+
+    completeResume(name);
+}
+
+void Server::registerClient(QTcpSocket* clientSocket, const QString& clientName, const QString& interlocutorName, const QString& responseType,
+                            quint64 lastClientMessageId) {
+    ClientInfo info;
+    info.socket = clientSocket;
+    info.interlocutor = internName(interlocutorName);
+    info.isAuthenticated = true;
+    info.lastClientMessageId = lastClientMessageId;
+    info.unacked = takeDeliveryQueue();
+    m_retiredSessions.remove(clientName);
+
+    m_clients[clientName] = info;
+    m_socketToName[clientSocket] = clientName;
+    announceClient(clientName);
+
+    QJsonObject response;
+    response["type"] = responseType;
+    response["message"] = "Authentication successful";
+    response["clientName"] = clientName;
+    response["interlocutorName"] = interlocutorName;
+    response["sessionToken"] = issueSessionToken(clientName, interlocutorName);
+    if (responseType == "resume_success") {
+        response["ackedUpTo"] = static_cast<qint64>(lastClientMessageId);
+    }
+
+    bool interlocutorConnected = isOnline(interlocutorName);
+    response["interlocutorConnected"] = interlocutorConnected;
+
+    qDebug() << "Sending" << responseType << "to" << clientName;
+    sendMessageWithSize(clientSocket, response);
+
+    qDebug() << "Client" << clientName << "authorized. Interlocutor:" << interlocutorName;
+
+    if (isOnline(interlocutorName)) {
+        setInterlocutor(interlocutorName, clientName);
+        m_clients[clientName].interlocutor = internName(interlocutorName);
+
+        QJsonObject interlocutorOnline;
+        interlocutorOnline["type"] = "interlocutor_connected";
+        interlocutorOnline["interlocutorName"] = clientName;
+        sendToUser(interlocutorName, interlocutorOnline);
+
+        QJsonObject youAreOnline;
+        youAreOnline["type"] = "interlocutor_connected";
+        youAreOnline["interlocutorName"] = interlocutorName;
+        sendMessageWithSize(clientSocket, youAreOnline);
+
+        qDebug() << "Both clients are now connected and notified";
+    } else {
+        QJsonObject waitingMsg;
+        waitingMsg["type"] = "message";
+        waitingMsg["sender"] = "System";
+        waitingMsg["text"] = QString("Waiting for %1 to connect...").arg(interlocutorName);
+        waitingMsg["timestamp"] = QDateTime::currentDateTime().toString("hh:mm:ss");
+        sendMessageWithSize(clientSocket, waitingMsg);
+    }
+}
+
+void Server::processResume(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    QString clientName;
+    QString interlocutorName;
+    QJsonObject lastSeq = obj["lastSeq"].toObject();
+
+    if (!verifySessionToken(obj["sessionToken"].toString(), clientName, interlocutorName)) {
+        qDebug() << "Resume rejected: invalid or expired session token";
+        QJsonObject response;
+        response["type"] = "resume_error";
+        response["message"] = "Session expired";
+        sendMessageWithSize(clientSocket, response);
+        return;
+    }
+
+    auto pending = m_pendingResumes.find(clientName);
+    if (pending != m_pendingResumes.end()) {
+        // A retry while the first attempt still waits for the other node takes its place.
+        if (pending->socket && pending->socket != clientSocket) {
+            pending->socket->disconnectFromHost();
+        }
+        pending->socket = clientSocket;
+        m_buffers[clientSocket].holdFrames = true;
+        return;
+    }
+
+    if (!m_clients.contains(clientName)) {
+        // The session is gone (expired or the server restarted); rebuild it from the token.
+        QString error;
+        if (!validateConnection(clientName, interlocutorName, error, true)) {
+            qDebug() << "Resume rejected for" << clientName << ":" << error;
+            QJsonObject response;
+            response["type"] = "resume_error";
+            response["message"] = error;
+            sendMessageWithSize(clientSocket, response);
+            return;
+        }
+
+        if (m_router && m_router->isRemote(clientName)) {
+            awaitSessionHandOver(clientSocket, clientName, interlocutorName, lastSeq);
+            return;
+        }
+
+        // If the session expired here, its client's retransmission is trimmed to what it did not get through.
+        quint64 ackedUpTo = m_retiredSessions.value(clientName).lastClientMessageId;
+        registerClient(clientSocket, clientName, interlocutorName, "resume_success", ackedUpTo);
+
+        ClientInfo& info = m_clients[clientName];
+        for (auto it = lastSeq.constBegin(); it != lastSeq.constEnd(); ++it) {
+            nextSeqFor(info, it.key()) = static_cast<quint64>(it.value().toInteger());
+        }
+        qDebug() << "Session of" << clientName << "restored from token";
+        return;
+    }
+
+    ClientInfo& info = m_clients[clientName];
+    if (info.socket && info.socket != clientSocket) {
+        m_socketToName.remove(info.socket);
+        info.socket->disconnectFromHost();
+    }
+
+    info.socket = clientSocket;
+    info.detachedAt = 0;
+    m_socketToName[clientSocket] = clientName;
+
+    QJsonObject response;
+    response["type"] = "resume_success";
+    response["clientName"] = clientName;
+    response["interlocutorName"] = info.interlocutor;
+    response["sessionToken"] = issueSessionToken(clientName, info.interlocutor);
+    response["interlocutorConnected"] = !info.interlocutor.isEmpty() && isOnline(info.interlocutor);
+    response["ackedUpTo"] = static_cast<qint64>(info.lastClientMessageId);
+    sendMessageWithSize(clientSocket, response);
+
+    qDebug() << "Session of" << clientName << "resumed";
+    replayUnacked(clientName, lastSeq);
+    rewindTransfers(clientName);
+}
+
+void Server::awaitSessionHandOver(QTcpSocket* clientSocket, const QString& clientName, const QString& interlocutorName,
+                                  const QJsonObject& lastSeq) {
+    // The session lives on another node, which hands it over once we announce the user. Until
+    // then it is held here without a socket, so messages routed to it queue up, and the client's
+    // own frames stay unread: a retransmission must not beat the dedup mark it brings.
+    ClientInfo info;
+    info.socket = nullptr;
+    info.interlocutor = internName(interlocutorName);
+    info.isAuthenticated = true;
+    info.detachedAt = QDateTime::currentMSecsSinceEpoch();
+    info.unacked = takeDeliveryQueue();
+    for (auto it = lastSeq.constBegin(); it != lastSeq.constEnd(); ++it) {
+        nextSeqFor(info, it.key()) = static_cast<quint64>(it.value().toInteger());
+    }
+
+    m_clients[clientName] = info;
+    m_pendingResumes[clientName] = {clientSocket, interlocutorName, lastSeq};
+    m_buffers[clientSocket].holdFrames = true;
+    announceClient(clientName);
+
+    if (!m_sessionSweepTimer.isActive()) {
+        m_sessionSweepTimer.start();
+    }
+
+    // A node that is gone or too slow to answer does not keep the client waiting.
+    QTimer::singleShot(kSessionHandOverWaitMs, this, [this, clientName]() {completeResume(clientName);});
+    qDebug() << "Session of" << clientName << "is claimed from another node";
+}
+
+void Server::completeResume(const QString& clientName) {
+    if (!m_pendingResumes.contains(clientName)) return;
+
+    PendingResume pending = m_pendingResumes.take(clientName);
+    if (!pending.socket || !m_buffers.contains(pending.socket) || !m_clients.contains(clientName)) {
+        // The client left while waiting; what was gathered stays as a detached session.
+        return;
+    }
+
+    ClientInfo held = m_clients.take(clientName);
+    quint64 ackedUpTo = qMax(held.lastClientMessageId, m_retiredSessions.value(clientName).lastClientMessageId);
+    registerClient(pending.socket, clientName, pending.interlocutor, "resume_success", ackedUpTo);
+
+    ClientInfo& info = m_clients[clientName];
+    recycleDeliveryQueue(info.unacked);
+    info.nextSeq = held.nextSeq;
+    info.unacked = held.unacked;
+    info.droppedUpTo = held.droppedUpTo;
+    qDebug() << "Session of" << clientName << "restored from token";
+
+    replayUnacked(clientName, pending.lastSeq);
+    m_buffers[pending.socket].holdFrames = false;
+    readFrames(pending.socket);
+}
+
+void Server::processReceived(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    QString clientName = m_socketToName.value(clientSocket);
+    if (clientName.isEmpty() || !m_clients.contains(clientName)) {
+        return;
+    }
+
+    QJsonObject acks = obj["acks"].toObject();
+    QList<PendingDelivery>& unacked = m_clients[clientName].unacked;
+    QHash<QString, quint64> deliveredUpTo;
+
+    unacked.removeIf([&acks, &deliveredUpTo](const PendingDelivery& pending) {
+        if (!acks.contains(pending.peer) || pending.seq > static_cast<quint64>(acks[pending.peer].toInteger())) {
+            return false;
+        }
+        if (pending.messageId > deliveredUpTo.value(pending.peer)) {
+            deliveredUpTo[pending.peer] = pending.messageId;
+        }
+        return true;
+    });
+    m_clients[clientName].droppedUpTo.removeIf([&acks](const PeerSeq& dropped) {
+        return acks.contains(dropped.peer) && dropped.seq <= static_cast<quint64>(acks[dropped.peer].toInteger());
+    });
+
+    for (auto it = deliveredUpTo.constBegin(); it != deliveredUpTo.constEnd(); ++it) {
+        if (it.value() == 0) continue;
+
+        QJsonObject receipt;
+        receipt["type"] = "delivered";
+        receipt["peer"] = clientName;
+        receipt["upTo"] = static_cast<qint64>(it.value());
+        sendToUser(it.key(), receipt);
+    }
+}
+
+void Server::processLogout(QTcpSocket* clientSocket) {
+    QString clientName = m_socketToName.value(clientSocket);
+    if (!clientName.isEmpty()) {
+        // A token taken from the logged-out client must not bring the session back.
+        revokeSessions(clientName);
+        removeClient(clientName);
+    }
+}
+
+void Server::processMessage(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    QString senderName = m_socketToName.value(clientSocket);
+    if (senderName.isEmpty() || !m_clients.contains(senderName)) {
+        qDebug() << "Unauthorized client trying to send message";
+        return;
+    }
+
+    quint64 messageId = static_cast<quint64>(obj["id"].toInteger());
+    if (isDuplicateMessage(clientSocket, senderName, messageId)) {
+        return;
+    }
+
+    QString text = obj["text"].toString();
+    bool encrypted = obj["encrypted"].toBool();
+    QString recipient = obj["to"].toString();
+    if (!recipient.isEmpty()) {
+        processConversationMessage(clientSocket, senderName, recipient, text, messageId, encrypted);
+        return;
+    }
+
+    QString interlocutorName = m_clients[senderName].interlocutor;
+
+    if (interlocutorName.isEmpty()) {
+        qDebug() << "Interlocutor not set for client" << senderName;
+
+        QJsonObject notification;
+        notification["type"] = "message";
+        notification["sender"] = "System";
+        notification["text"] = "Your interlocutor is not connected yet. Please wait for them to connect.";
+        notification["timestamp"] = QDateTime::currentDateTime().toString("hh:mm:ss");
+        sendMessageWithSize(clientSocket, notification);
+        return;
+    }
+
+    if (!isOnline(interlocutorName)) {
+        qDebug() << "Interlocutor" << interlocutorName << "is not online. Message from" << senderName << "cannot be delivered.";
+
+        QJsonObject notification;
+        notification["type"] = "interlocutor_offline";
+        notification["message"] = QString("Interlocutor %1 is offline. Message not delivered.").arg(interlocutorName);
+        sendMessageWithSize(clientSocket, notification);
+        return;
+    }
+
+    if (interlocutorOf(interlocutorName) != senderName) {
+        qDebug() << "Interlocutor" << interlocutorName << "is not paired with" << senderName;
+        return;
+    }
+
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["sender"] = senderName;
+    messageObj["text"] = text;
+    messageObj["timestamp"] = QDateTime::currentDateTime().toString("hh:mm:ss");
+    if (encrypted) {
+        messageObj["encrypted"] = true;
+    }
+
+    relayInOrder(interlocutorName, senderName, messageObj, messageId);
+    qDebug() << "Message from" << senderName << "to" << interlocutorName << "delivered";
+}
+
+// A message that names its recipient belongs to a conversation of its own, next to the paired
+// one; the recipient's name is the conversation id on both ends, as sequence numbers already
+// are per peer. No pairing is needed, so a client can hold any number of these at once.
+void Server::processConversationMessage(QTcpSocket* clientSocket, const QString& senderName, const QString& recipient,
+                                        const QString& text, quint64 messageId, bool encrypted) {
+    if (recipient == senderName) {
+        qDebug() << "Client" << senderName << "tried to send a message to itself";
+        return;
+    }
+
+    if (!isOnline(recipient)) {
+        QJsonObject notification;
+        notification["type"] = "interlocutor_offline";
+        notification["conversation"] = recipient;
+        notification["message"] = QString("%1 is offline. Message not delivered.").arg(recipient);
+        sendMessageWithSize(clientSocket, notification);
+        return;
+    }
 
-    QByteArray block;
-    QDataStream out(&block, QIODevice::WriteOnly);
-    out.setVersion(QDataStream::Qt_5_15);
-    out << messageSize;
-    out.writeRawData(jsonData.constData(), jsonData.size());
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["sender"] = senderName;
+    messageObj["text"] = text;
+    messageObj["timestamp"] = QDateTime::currentDateTime().toString("hh:mm:ss");
+    if (encrypted) {
+        messageObj["encrypted"] = true;
+    }
+
+    relayInOrder(recipient, senderName, messageObj, messageId);
+    qDebug() << "Message from" << senderName << "to" << recipient << "delivered";
+}
 
-    qDebug() << "Sending to socket, size:" << messageSize << "content:" << jsonData;
+// Typing is a hint, not a message: it carries no id or seq, is never retained or replayed,
+// and a lost one only means the indicator goes away a little early.
+void Server::processTyping(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    QString senderName = m_socketToName.value(clientSocket);
+    if (senderName.isEmpty() || !m_clients.contains(senderName)) return;
+
+    QString recipient = obj["to"].toString();
+    if (recipient.isEmpty()) {
+        recipient = m_clients[senderName].interlocutor;
+    }
+    if (recipient.isEmpty() || recipient == senderName) return;
 
-    qint64 bytesWritten = socket->write(block);
-    if (bytesWritten == -1) {
-        qDebug() << "Failed to send message to socket:" << socket->errorString();
-    } else if (bytesWritten != block.size()) {
-        qDebug() << "Warning: Only" << bytesWritten << "of" << block.size() << "bytes written";
+    m_typing[qMakePair(internName(senderName), internName(recipient))].pending = true;
+    if (!m_typingTimer.isActive()) {
+        m_typingTimer.start();
     }
 }
 
-void Server::processAuth(QTcpSocket* clientSocket, const QJsonObject& obj) {
-    QString clientName = obj["clientName"].toString();
-    QString interlocutorName = obj["interlocutorName"].toString();
-
-    qDebug() << "Auth request from:" << clientName << "to interlocutor:" << interlocutorName;
-
-    QString error;
-    if (validateConnection(clientName, interlocutorName, error)) {
-        ClientInfo info;
-        info.socket = clientSocket;
-        info.interlocutor = interlocutorName;
-        info.isAuthenticated = true;
-
-        m_clients[clientName] = info;
-        m_socketToName[clientSocket] = clientName;
+void Server::flushTyping() {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (auto it = m_typing.begin(); it != m_typing.end();) {
+        if (now - it->lastForwarded < m_typingIntervalMs) {
+            ++it;
+        } else if (it->pending) {
+            forwardTyping(it.key().first, it.key().second);
+            it->pending = false;
+            it->lastForwarded = now;
+            ++it;
+        } else {
+            it = m_typing.erase(it);
+        }
+    }
 
-        QJsonObject response;
-        response["type"] = "auth_success";
-        response["message"] = "Authentication successful";
-        response["interlocutorName"] = interlocutorName;
+    if (m_typing.isEmpty()) {
+        m_typingTimer.stop();
+    }
+}
 
-        bool interlocutorConnected = m_clients.contains(interlocutorName);
-        response["interlocutorConnected"] = interlocutorConnected;
+void Server::forwardTyping(const QString& senderName, const QString& recipient) {
+    QJsonObject frame;
+    frame["type"] = "typing";
+    frame["sender"] = senderName;
 
-        qDebug() << "Sending auth_success to" << clientName;
-        sendMessageWithSize(clientSocket, response);
+    auto it = m_clients.constFind(recipient);
+    if (it == m_clients.constEnd()) {
+        if (m_router && m_router->isRemote(recipient)) {
+            m_router->forward(recipient, frame);
+        }
+        return;
+    }
 
-        qDebug() << "Client" << clientName << "authorized. Interlocutor:" << interlocutorName;
+    // Skipped while the receiver is detached or still has messages queued, so typing never
+    // sits in front of them.
+    if (!it->socket || hasQueued(it->socket, InteractiveLane)) return;
+    sendMessageWithSize(it->socket, frame);
+}
 
-        if (m_clients.contains(interlocutorName)) {
-            m_clients[interlocutorName].interlocutor = clientName;
-            m_clients[clientName].interlocutor = interlocutorName;
+// The public key of an end-to-end exchange goes through as it is. The sender is stamped by the
+// server, so a client cannot pose as someone else, and the frame takes the messages' lane so a
+// new key never overtakes messages sealed with the old one.
+void Server::processKeyExchange(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    QString senderName = m_socketToName.value(clientSocket);
+    if (senderName.isEmpty() || !m_clients.contains(senderName)) return;
 
-            QJsonObject interlocutorOnline;
-            interlocutorOnline["type"] = "interlocutor_connected";
-            interlocutorOnline["interlocutorName"] = clientName;
-            sendMessageWithSize(m_clients[interlocutorName].socket, interlocutorOnline);
+    QString recipient = obj["to"].toString();
+    if (recipient.isEmpty()) {
+        recipient = m_clients[senderName].interlocutor;
+    }
+    QString publicKey = obj["publicKey"].toString();
+    if (recipient.isEmpty() || recipient == senderName || publicKey.isEmpty() || publicKey.size() > kMaxPublicKeySize) {
+        qDebug() << "Ignoring malformed key exchange from" << senderName;
+        return;
+    }
 
-            QJsonObject youAreOnline;
-            youAreOnline["type"] = "interlocutor_connected";
-            youAreOnline["interlocutorName"] = interlocutorName;
-            sendMessageWithSize(clientSocket, youAreOnline);
+    QJsonObject frame;
+    frame["type"] = "key_exchange";
+    frame["sender"] = senderName;
+    frame["publicKey"] = publicKey;
+    frame["ack"] = obj["ack"].toBool();
+    sendToUser(recipient, frame);
+}
 
-            qDebug() << "Both clients are now connected and notified";
-        } else {
-            QJsonObject waitingMsg;
-            waitingMsg["type"] = "message";
-            waitingMsg["sender"] = "System";
-            waitingMsg["text"] = QString("Waiting for %1 to connect...").arg(interlocutorName);
-            waitingMsg["timestamp"] = QDateTime::currentDateTime().toString("hh:mm:ss");
-            sendMessageWithSize(clientSocket, waitingMsg);
-        }
-    } else {
-        qDebug() << "Authentication failed:" << error;
-        QJsonObject response;
-        response["type"] = "auth_error";
-        response["message"] = error;
+bool Server::isDuplicateMessage(QTcpSocket* clientSocket, const QString& senderName, quint64 messageId) {
+    if (messageId == 0) return false;
 
-        sendMessageWithSize(clientSocket, response);
-        clientSocket->disconnectFromHost();
+    ClientInfo& sender = m_clients[senderName];
+    queueAck(clientSocket);
+    if (messageId <= sender.lastClientMessageId) {
+        qDebug() << "Duplicate message" << messageId << "from" << senderName << "ignored";
+        return true;
     }
+    sender.lastClientMessageId = messageId;
+    return false;
 }
 
-void Server::processMessage(QTcpSocket* clientSocket, const QJsonObject& obj) {
+void Server::processMessageBatch(QTcpSocket* clientSocket, const QJsonObject& obj) {
     QString senderName = m_socketToName.value(clientSocket);
     if (senderName.isEmpty() || !m_clients.contains(senderName)) {
-        qDebug() << "Unauthorized client trying to send message";
+        qDebug() << "Unauthorized client trying to send message batch";
         return;
     }
 
-    QString text = obj["text"].toString();
-    QString interlocutorName = m_clients[senderName].interlocutor;
-
-    if (interlocutorName.isEmpty()) {
-        qDebug() << "Interlocutor not set for client" << senderName;
-
-        QJsonObject notification;
-        notification["type"] = "message";
-        notification["sender"] = "System";
-        notification["text"] = "Your interlocutor is not connected yet. Please wait for them to connect.";
-        notification["timestamp"] = QDateTime::currentDateTime().toString("hh:mm:ss");
-        sendMessageWithSize(clientSocket, notification);
+    // The batch is one client message: one id, one ack, and a retransmitted batch is dropped as a whole.
+    quint64 batchId = static_cast<quint64>(obj["id"].toInteger());
+    if (isDuplicateMessage(clientSocket, senderName, batchId)) {
         return;
     }
 
-    if (!m_clients.contains(interlocutorName)) {
-        qDebug() << "Interlocutor" << interlocutorName << "is not online. Message from" << senderName << "cannot be delivered.";
-
-        QJsonObject notification;
-        notification["type"] = "interlocutor_offline";
-        notification["message"] = QString("Interlocutor %1 is offline. Message not delivered.").arg(interlocutorName);
-        sendMessageWithSize(clientSocket, notification);
-        return;
-    }
+    QJsonObject response;
+    response["type"] = "batch_rejected";
+    response["id"] = static_cast<qint64>(batchId);
 
-    if (m_clients[interlocutorName].interlocutor != senderName) {
-        qDebug() << "Interlocutor" << interlocutorName << "is not paired with" << senderName;
+    const QJsonArray entries = obj["messages"].toArray();
+    if (entries.size() > m_maxBatchEntries) {
+        qDebug() << "Batch of" << entries.size() << "messages from" << senderName << "exceeds the limit";
+        response["error"] = QString("A batch may carry at most %1 messages").arg(m_maxBatchEntries);
+        sendMessageWithSize(clientSocket, response);
         return;
     }
 
+    // Everything but the recipient and text is shared by the whole batch.
     QJsonObject messageObj;
     messageObj["type"] = "message";
     messageObj["sender"] = senderName;
-    messageObj["text"] = text;
     messageObj["timestamp"] = QDateTime::currentDateTime().toString("hh:mm:ss");
 
-    QTcpSocket* interlocutorSocket = m_clients[interlocutorName].socket;
-    if (interlocutorSocket && interlocutorSocket->state() == QAbstractSocket::ConnectedState) {
-        sendMessageWithSize(interlocutorSocket, messageObj);
-        qDebug() << "Message from" << senderName << "to" << interlocutorName << "delivered";
+    QJsonArray rejected;
+    int delivered = 0;
+    for (qsizetype i = 0; i < entries.size(); ++i) {
+        const QJsonObject entry = entries[i].toObject();
+        QString recipient = entry["to"].toString();
+        QString text = entry["text"].toString();
+
+        QString error;
+        if (recipient.isEmpty() || text.isEmpty()) {
+            error = "Missing recipient or text";
+        } else if (recipient == senderName) {
+            error = "Cannot send a message to yourself";
+        } else if (!isOnline(recipient)) {
+            error = "Recipient is offline";
+        }
+
+        if (!error.isEmpty()) {
+            QJsonObject rejection;
+            rejection["index"] = static_cast<qint64>(i);
+            rejection["to"] = recipient;
+            rejection["error"] = error;
+            rejected.append(rejection);
+            continue;
+        }
+
+        messageObj["text"] = text;
+        if (entry["encrypted"].toBool()) {
+            messageObj["encrypted"] = true;
+        } else {
+            messageObj.remove("encrypted");
+        }
+        relayInOrder(recipient, senderName, messageObj, batchId);
+        ++delivered;
+    }
+
+    qDebug() << "Batch" << batchId << "from" << senderName << ":" << delivered << "delivered," << rejected.size() << "rejected";
+
+    if (!rejected.isEmpty()) {
+        response["rejected"] = rejected;
+        sendMessageWithSize(clientSocket, response);
     }
 }
 
@@ -267,34 +1440,37 @@ void Server::processChangeInterlocutor(QTcpSocket* clientSocket, const QJsonObje
 
     if (validateInterlocutorChange(clientName, newInterlocutor, error)) {
         QString oldInterlocutor = m_clients[clientName].interlocutor;
+        failTransfersOf(clientName, "Interlocutor changed");
 
-        if (!oldInterlocutor.isEmpty() && m_clients.contains(oldInterlocutor)) {
-            m_clients[oldInterlocutor].interlocutor = "";
+        if (!oldInterlocutor.isEmpty() && isOnline(oldInterlocutor)) {
+            setInterlocutor(oldInterlocutor, "");
 
             QJsonObject oldInterlocutorMsg;
             oldInterlocutorMsg["type"] = "interlocutor_disconnected";
             oldInterlocutorMsg["message"] = QString("%1 changed interlocutor").arg(clientName);
-            sendMessageWithSize(m_clients[oldInterlocutor].socket, oldInterlocutorMsg);
+            sendToUser(oldInterlocutor, oldInterlocutorMsg);
         }
 
-        m_clients[clientName].interlocutor = newInterlocutor;
+        m_clients[clientName].interlocutor = internName(newInterlocutor);
+        announceClient(clientName);
 
         QJsonObject response;
         response["type"] = "interlocutor_changed";
         response["newInterlocutor"] = newInterlocutor;
+        response["sessionToken"] = issueSessionToken(clientName, newInterlocutor);
 
-        bool newInterlocutorConnected = m_clients.contains(newInterlocutor);
+        bool newInterlocutorConnected = isOnline(newInterlocutor);
         response["interlocutorConnected"] = newInterlocutorConnected;
 
         sendMessageWithSize(clientSocket, response);
 
         if (newInterlocutorConnected) {
-            m_clients[newInterlocutor].interlocutor = clientName;
+            setInterlocutor(newInterlocutor, clientName);
 
             QJsonObject newInterlocutorMsg;
             newInterlocutorMsg["type"] = "interlocutor_connected";
             newInterlocutorMsg["interlocutorName"] = clientName;
-            sendMessageWithSize(m_clients[newInterlocutor].socket, newInterlocutorMsg);
+            sendToUser(newInterlocutor, newInterlocutorMsg);
 
             qDebug() << "Client" << clientName << "changed interlocutor to" << newInterlocutor << "(connected)";
         } else {
@@ -308,7 +1484,217 @@ void Server::processChangeInterlocutor(QTcpSocket* clientSocket, const QJsonObje
     }
 }
 
-bool Server::validateConnection(const QString& clientName, const QString& interlocutorName, QString& error) {
+void Server::processFileOffer(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    QString senderName = m_socketToName.value(clientSocket);
+    if (senderName.isEmpty() || !m_clients.contains(senderName)) {
+        qDebug() << "Unauthorized client trying to offer a file";
+        return;
+    }
+
+    QString fileName = QFileInfo(obj["name"].toString()).fileName();
+    qint64 size = obj["size"].toInteger(-1);
+    QString receiverName = m_clients[senderName].interlocutor;
+
+    QString error;
+    if (fileName.isEmpty() || size < 0) {
+        error = "Invalid file offer";
+    } else if (receiverName.isEmpty() || interlocutorOf(receiverName) != senderName) {
+        error = "No interlocutor to send the file to";
+    } else if (!m_clients.contains(receiverName) || !m_clients[receiverName].socket) {
+        error = "Interlocutor is not connected to this server";
+    }
+    if (!error.isEmpty()) {
+        QJsonObject errorResponse;
+        errorResponse["type"] = "file_error";
+        errorResponse["ref"] = obj["ref"];
+        errorResponse["error"] = error;
+        sendMessageWithSize(clientSocket, errorResponse);
+        return;
+    }
+
+    quint64 transferId = m_nextTransferId++;
+    FileTransfer transfer;
+    transfer.sender = senderName;
+    transfer.receiver = receiverName;
+    transfer.name = fileName;
+    transfer.ref = obj["ref"].toInteger();
+    transfer.size = size;
+    m_transfers.insert(transferId, transfer);
+
+    QJsonObject offer;
+    offer["type"] = "file_offer";
+    offer["transferId"] = static_cast<qint64>(transferId);
+    offer["sender"] = senderName;
+    offer["name"] = fileName;
+    offer["size"] = size;
+    sendMessageWithSize(m_clients[receiverName].socket, offer);
+
+    qDebug() << "File transfer" << transferId << "of" << fileName << "(" << size << "bytes) offered by"
+             << senderName << "to" << receiverName;
+}
+
+void Server::processFileAccept(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    QString receiverName = m_socketToName.value(clientSocket);
+    quint64 transferId = static_cast<quint64>(obj["transferId"].toInteger());
+    auto it = m_transfers.find(transferId);
+    if (receiverName.isEmpty() || it == m_transfers.end() || it->receiver != receiverName || it->accepted) {
+        return;
+    }
+    it->accepted = true;
+
+    QJsonObject ready;
+    ready["type"] = "file_ready";
+    ready["ref"] = it->ref;
+    ready["transferId"] = static_cast<qint64>(transferId);
+    ready["offset"] = 0;
+    ready["window"] = FileChunk::kWindowBytes;
+    sendToUser(it->sender, ready);
+
+    qDebug() << "File transfer" << transferId << "accepted by" << receiverName;
+}
+
+// The frame goes to the receiver unchanged; nothing is buffered here beyond the socket's own
+// write buffer, which the window keeps below kWindowBytes per transfer.
+void Server::processFileChunk(QTcpSocket* clientSocket, const QByteArray& frame) {
+    FileChunk chunk;
+    if (!FileChunk::parse(frame, chunk)) {
+        qDebug() << "Malformed binary frame, size:" << frame.size();
+        return;
+    }
+
+    QString senderName = m_socketToName.value(clientSocket);
+    auto it = m_transfers.find(chunk.transferId);
+    if (senderName.isEmpty() || it == m_transfers.end() || it->sender != senderName) {
+        qDebug() << "Chunk for unknown transfer" << chunk.transferId;
+        return;
+    }
+
+    if (!it->accepted) {
+        failTransfer(chunk.transferId, "Chunk before the receiver accepted the file");
+        return;
+    }
+    if (chunk.size > FileChunk::kMaxDataSize || chunk.offset + chunk.size > it->size ||
+        chunk.offset + chunk.size > it->acked + FileChunk::kWindowBytes) {
+        failTransfer(chunk.transferId, "Chunk outside the file or the flow control window");
+        return;
+    }
+
+    // Chunks that were in flight when the transfer was rewound arrive out of order; the sender
+    // sends them again from the new offset.
+    if (chunk.offset != it->relayed) return;
+
+    // A detached receiver gets nothing; the transfer is rewound when it resumes.
+    auto receiver = m_clients.constFind(it->receiver);
+    if (receiver == m_clients.constEnd() || !receiver->socket ||
+        receiver->socket->state() != QAbstractSocket::ConnectedState) {
+        return;
+    }
+
+    sendRawFrame(receiver->socket, frame, BulkLane);
+    it->relayed += chunk.size;
+}
+
+void Server::processFileAck(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    QString receiverName = m_socketToName.value(clientSocket);
+    quint64 transferId = static_cast<quint64>(obj["transferId"].toInteger());
+    auto it = m_transfers.find(transferId);
+    if (receiverName.isEmpty() || it == m_transfers.end() || it->receiver != receiverName) {
+        return;
+    }
+
+    // An empty file is confirmed with offset 0, so a repeated offset only counts at the end.
+    qint64 offset = qBound(it->acked, obj["offset"].toInteger(), it->relayed);
+    if (offset == it->acked && offset != it->size) return;
+    it->acked = offset;
+
+    QJsonObject progress;
+    progress["type"] = "file_progress";
+    progress["transferId"] = static_cast<qint64>(transferId);
+    progress["offset"] = offset;
+    sendToUser(it->sender, progress);
+
+    if (offset == it->size) {
+        qDebug() << "File transfer" << transferId << "completed";
+        m_transfers.erase(it);
+    }
+}
+
+void Server::processFileCancel(QTcpSocket* clientSocket, const QJsonObject& obj) {
+    QString clientName = m_socketToName.value(clientSocket);
+    quint64 transferId = static_cast<quint64>(obj["transferId"].toInteger());
+    auto it = m_transfers.constFind(transferId);
+    if (clientName.isEmpty() || it == m_transfers.constEnd() ||
+        (it->sender != clientName && it->receiver != clientName)) {
+        return;
+    }
+
+    failTransfer(transferId, QString("Transfer cancelled by %1").arg(clientName));
+}
+
+// After a reconnect either side may have lost chunks in flight, so every transfer the client
+// takes part in restarts from the last offset the receiver confirmed.
+void Server::rewindTransfers(const QString& clientName) {
+    for (auto it = m_transfers.begin(); it != m_transfers.end(); ++it) {
+        if (it->sender != clientName && it->receiver != clientName) continue;
+
+        // An offer the receiver has not answered yet is put to it again; the sender keeps waiting.
+        if (!it->accepted) {
+            if (it->receiver == clientName) {
+                QJsonObject offer;
+                offer["type"] = "file_offer";
+                offer["transferId"] = static_cast<qint64>(it.key());
+                offer["sender"] = it->sender;
+                offer["name"] = it->name;
+                offer["size"] = it->size;
+                sendToUser(it->receiver, offer);
+            }
+            continue;
+        }
+
+        it->relayed = it->acked;
+
+        QJsonObject resume;
+        resume["type"] = "file_resume";
+        resume["transferId"] = static_cast<qint64>(it.key());
+        resume["offset"] = it->acked;
+        sendToUser(it->receiver, resume);
+
+        QJsonObject ready;
+        ready["type"] = "file_ready";
+        ready["transferId"] = static_cast<qint64>(it.key());
+        ready["offset"] = it->acked;
+        ready["window"] = FileChunk::kWindowBytes;
+        sendToUser(it->sender, ready);
+    }
+}
+
+void Server::failTransfer(quint64 transferId, const QString& error) {
+    FileTransfer transfer = m_transfers.take(transferId);
+
+    QJsonObject notification;
+    notification["type"] = "file_error";
+    notification["transferId"] = static_cast<qint64>(transferId);
+    notification["error"] = error;
+    sendToUser(transfer.sender, notification);
+    sendToUser(transfer.receiver, notification);
+
+    qDebug() << "File transfer" << transferId << "failed:" << error;
+}
+
+void Server::failTransfersOf(const QString& clientName, const QString& error) {
+    QList<quint64> affected;
+    for (auto it = m_transfers.constBegin(); it != m_transfers.constEnd(); ++it) {
+        if (it->sender == clientName || it->receiver == clientName) {
+            affected.append(it.key());
+        }
+    }
+
+    for (quint64 transferId : affected) {
+        failTransfer(transferId, error);
+    }
+}
+
+bool Server::validateConnection(const QString& clientName, const QString& interlocutorName, QString& error, bool resuming) {
     if (clientName.isEmpty() || interlocutorName.isEmpty()) {
         error = "Client and interlocutor names cannot be empty";
         return false;
@@ -319,13 +1705,14 @@ bool Server::validateConnection(const QString& clientName, const QString& interl
         return false;
     }
 
-    if (m_clients.contains(clientName)) {
+    // A resumed session may take over its own copy held by another node.
+    if (resuming ? m_clients.contains(clientName) : isOnline(clientName)) {
         error = "Username '" + clientName + "' is already taken";
         return false;
     }
 
-    if (m_clients.contains(interlocutorName)) {
-        QString existingInterlocutor = m_clients[interlocutorName].interlocutor;
+    if (isOnline(interlocutorName)) {
+        QString existingInterlocutor = interlocutorOf(interlocutorName);
         if (!existingInterlocutor.isEmpty() && existingInterlocutor != clientName) {
             error = "Selected interlocutor is already communicating with another user";
             return false;
@@ -350,8 +1737,8 @@ bool Server::validateInterlocutorChange(const QString& clientName, const QString
         return false;
     }
 
-    if (m_clients.contains(newInterlocutor)) {
-        QString existingInterlocutor = m_clients[newInterlocutor].interlocutor;
+    if (isOnline(newInterlocutor)) {
+        QString existingInterlocutor = interlocutorOf(newInterlocutor);
         if (!existingInterlocutor.isEmpty() && existingInterlocutor != clientName) {
             error = "Selected interlocutor is already communicating with another user";
             return false;
@@ -361,6 +1748,300 @@ bool Server::validateInterlocutorChange(const QString& clientName, const QString
     return true;
 }
 
+// Ingress for everything one user sends another. The conversation's place in line is taken here,
+// and deliverToClient, which numbers the frame for the receiver, only sees it once everything
+// admitted before it has gone through. Processing between the two is on the event loop today,
+// so a message is released at once; the sequencer is what lets that stage run in parallel, and
+// releaseDelivery brings the result back to the event loop.
+void Server::relayInOrder(const QString& receiverName, const QString& peerName, const QJsonObject& frame, quint64 messageId) {
+    ConversationKey conversation = conversationKey(receiverName, peerName);
+    quint64 ticket = m_sequencer.admit(conversation);
+    m_sequencer.complete(conversation, ticket, {receiverName, peerName, frame, messageId});
+}
+
+// The sequencer releases on whichever thread filled the gap, but sessions belong to the server's
+// thread. A release from elsewhere is posted back to it; one on it goes straight through unless
+// posted ones are still queued, which it would otherwise overtake.
+void Server::releaseDelivery(SequencedDelivery& delivery) {
+    if (QThread::currentThread() == thread() && m_queuedDeliveries.loadAcquire() == 0) {
+        deliverToClient(delivery.receiver, delivery.peer, std::move(delivery.frame), delivery.messageId);
+        return;
+    }
+
+    m_queuedDeliveries.ref();
+    QMetaObject::invokeMethod(this, [this, delivery = std::move(delivery)]() mutable {
+        m_queuedDeliveries.deref();
+        deliverToClient(delivery.receiver, delivery.peer, std::move(delivery.frame), delivery.messageId);
+    }, Qt::QueuedConnection);
+}
+
+Server::ConversationKey Server::conversationKey(const QString& first, const QString& second) {
+    return first < second ? qMakePair(first, second) : qMakePair(second, first);
+}
+
+void Server::deliverToClient(const QString& receiverName, const QString& peerName, QJsonObject frame, quint64 messageId) {
+    if (!m_clients.contains(receiverName)) {
+        // Sequencing and retention happen on the node that owns the receiver.
+        if (m_router && m_router->isRemote(receiverName)) {
+            m_router->forward(receiverName, frame, peerName, messageId);
+        }
+        return;
+    }
+
+    // The message answers any typing still waiting to go out, so that would only be stale.
+    auto typing = m_typing.find(qMakePair(peerName, receiverName));
+    if (typing != m_typing.end()) {
+        typing->pending = false;
+    }
+
+    ClientInfo& info = m_clients[receiverName];
+    quint64 seq = ++nextSeqFor(info, peerName);
+    frame["seq"] = static_cast<qint64>(seq);
+
+    info.unacked.append({seq, internName(peerName), frame, messageId});
+    if (info.unacked.size() > m_maxUnackedPerClient) {
+        qsizetype excess = info.unacked.size() - m_maxUnackedPerClient;
+        for (qsizetype i = 0; i < excess; ++i) {
+            quint64& droppedUpTo = droppedUpToFor(info, info.unacked[i].peer);
+            droppedUpTo = qMax(droppedUpTo, info.unacked[i].seq);
+        }
+        qDebug() << "Unacknowledged messages of" << receiverName << "over the limit; dropped" << excess;
+        info.unacked.remove(0, excess);
+    }
+
+    if (info.socket && info.socket->state() == QAbstractSocket::ConnectedState) {
+        sendMessageWithSize(info.socket, frame);
+    }
+}
+
+void Server::queueAck(QTcpSocket* clientSocket) {
+    m_pendingAcks.insert(clientSocket);
+    if (!m_ackFlushTimer.isActive()) {
+        m_ackFlushTimer.start();
+    }
+}
+
+void Server::flushAcks() {
+    for (QTcpSocket* socket : std::as_const(m_pendingAcks)) {
+        QString clientName = m_socketToName.value(socket);
+        if (clientName.isEmpty() || !m_clients.contains(clientName)) continue;
+
+        QJsonObject ack;
+        ack["type"] = "ack";
+        ack["upTo"] = static_cast<qint64>(m_clients[clientName].lastClientMessageId);
+        sendMessageWithSize(socket, ack);
+    }
+    m_pendingAcks.clear();
+}
+
+void Server::replayUnacked(const QString& clientName, const QJsonObject& lastSeq) {
+    if (!m_clients.contains(clientName)) return;
+
+    ClientInfo& info = m_clients[clientName];
+    info.unacked.removeIf([&lastSeq](const PendingDelivery& pending) {
+        return lastSeq.contains(pending.peer) && pending.seq <= static_cast<quint64>(lastSeq[pending.peer].toInteger());
+    });
+
+    // Goes ahead of the replay, so the client skips the hole knowingly rather than finding it.
+    for (const PeerSeq& dropped : std::as_const(info.droppedUpTo)) {
+        if (dropped.seq <= static_cast<quint64>(lastSeq[dropped.peer].toInteger())) continue;
+        QJsonObject gap;
+        gap["type"] = "gap";
+        gap["peer"] = dropped.peer;
+        gap["upTo"] = static_cast<qint64>(dropped.seq);
+        sendMessageWithSize(info.socket, gap);
+    }
+
+    qDebug() << "Replaying" << info.unacked.size() << "unacknowledged messages to" << clientName;
+    for (const PendingDelivery& pending : std::as_const(info.unacked)) {
+        sendMessageWithSize(info.socket, pending.frame);
+    }
+}
+
+void Server::detachClient(const QString& clientName) {
+    if (!m_clients.contains(clientName)) return;
+
+    ClientInfo& info = m_clients[clientName];
+    m_socketToName.remove(info.socket);
+    info.socket = nullptr;
+    info.detachedAt = QDateTime::currentMSecsSinceEpoch();
+
+    qDebug() << "Client" << clientName << "detached, session kept for" << m_resumeWindowMs << "ms";
+
+    if (!m_sessionSweepTimer.isActive()) {
+        m_sessionSweepTimer.start();
+    }
+}
+
+void Server::expireDetachedSessions() {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QStringList expired;
+    bool anyDetached = false;
+
+    for (auto it = m_clients.constBegin(); it != m_clients.constEnd(); ++it) {
+        if (it->detachedAt == 0) continue;
+        if (now - it->detachedAt >= m_resumeWindowMs) {
+            expired.append(it.key());
+        } else {
+            anyDetached = true;
+        }
+    }
+
+    for (const QString& clientName : expired) {
+        qDebug() << "Session of" << clientName << "expired";
+        pruneTokenState(now);
+        m_retiredSessions.insert(clientName, {m_clients[clientName].lastClientMessageId, now});
+        removeClient(clientName);
+    }
+
+    if (!anyDetached) {
+        m_sessionSweepTimer.stop();
+    }
+}
+
+QString Server::issueSessionToken(const QString& clientName, const QString& interlocutorName) const {
+    QJsonObject payload;
+    payload["name"] = clientName;
+    payload["interlocutor"] = interlocutorName;
+    payload["issued"] = QDateTime::currentMSecsSinceEpoch();
+    payload["generation"] = static_cast<qint64>(m_revocations.value(clientName).generation);
+    QString stamp = credentialStamp(clientName);
+    if (!stamp.isEmpty()) {
+        payload["auth"] = stamp;
+    }
+
+    const auto encoding = QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals;
+    QByteArray body = QJsonDocument(payload).toJson(QJsonDocument::Compact).toBase64(encoding);
+    QByteArray mac = QMessageAuthenticationCode::hash(body, m_sessionKey, QCryptographicHash::Sha256).toBase64(encoding);
+
+    return QString::fromLatin1(body + '.' + mac);
+}
+
+bool Server::verifySessionToken(const QString& token, QString& clientName, QString& interlocutorName) const {
+    QByteArray raw = token.toLatin1();
+    qsizetype dot = raw.indexOf('.');
+    if (dot <= 0) return false;
+
+    const auto encoding = QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals;
+    QByteArray body = raw.left(dot);
+    QByteArray mac = QByteArray::fromBase64(raw.mid(dot + 1), encoding);
+    QByteArray expected = QMessageAuthenticationCode::hash(body, m_sessionKey, QCryptographicHash::Sha256);
+
+    if (mac.size() != expected.size()) return false;
+    char diff = 0;
+    for (qsizetype i = 0; i < mac.size(); ++i) {
+        diff |= mac[i] ^ expected[i];
+    }
+    if (diff != 0) return false;
+
+    QJsonObject payload = QJsonDocument::fromJson(QByteArray::fromBase64(body, encoding)).object();
+    if (QDateTime::currentMSecsSinceEpoch() - payload["issued"].toInteger() > kSessionTokenLifetimeSecs * 1000) {
+        return false;
+    }
+
+    clientName = payload["name"].toString();
+    interlocutorName = payload["interlocutor"].toString();
+    if (payload["generation"].toInteger() < m_revocations.value(clientName).generation) {
+        qDebug() << "Session token of" << clientName << "was revoked";
+        return false;
+    }
+    if (payload["auth"].toString() != credentialStamp(clientName)) {
+        qDebug() << "Credentials of" << clientName << "changed since the session token was issued";
+        return false;
+    }
+    return !clientName.isEmpty();
+}
+
+// Ties a token to the user's entry in the auth providers, so a resume is refused once a reload
+// has removed the user or changed the password. Keyed, as the token payload is readable.
+QString Server::credentialStamp(const QString& clientName) const {
+    if (!m_authenticator || !m_authenticator->isEnabled()) return QString();
+
+    QByteArray stamp = QMessageAuthenticationCode::hash("auth\n" + m_authenticator->fingerprint(clientName), m_sessionKey,
+                                                        QCryptographicHash::Sha256).left(16);
+    return QString::fromLatin1(stamp.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals));
+}
+
+// Every token the user holds stops working, here and on the other nodes. Tokens issued from now
+// on carry the new generation.
+void Server::revokeSessions(const QString& clientName) {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    pruneTokenState(now);
+    m_retiredSessions.remove(clientName);
+
+    TokenRevocation& revocation = m_revocations[clientName];
+    ++revocation.generation;
+    revocation.revokedAt = now;
+    if (m_router) {
+        m_router->revoke(clientName, revocation.generation);
+    }
+    qDebug() << "Session tokens of" << clientName << "revoked";
+}
+
+void Server::onSessionsRevoked(const QString& name, quint32 generation) {
+    TokenRevocation& revocation = m_revocations[name];
+    if (generation <= revocation.generation) return;
+
+    revocation.generation = generation;
+    revocation.revokedAt = QDateTime::currentMSecsSinceEpoch();
+}
+
+// Once the lifetime has passed, every token issued before a revocation or expiry has expired too,
+// so the entry has nothing left to guard.
+void Server::pruneTokenState(qint64 now) {
+    if (now - m_tokenStatePrunedAt < kSessionSweepIntervalMs) return;
+    m_tokenStatePrunedAt = now;
+
+    const qint64 lifetimeMs = kSessionTokenLifetimeSecs * 1000;
+    for (auto it = m_revocations.begin(); it != m_revocations.end();) {
+        it = now - it->revokedAt > lifetimeMs ? m_revocations.erase(it) : std::next(it);
+    }
+    for (auto it = m_retiredSessions.begin(); it != m_retiredSessions.end();) {
+        it = now - it->retiredAt > lifetimeMs ? m_retiredSessions.erase(it) : std::next(it);
+    }
+}
+
+// Sessions still held here are saved as retired: the new process rebuilds them from their tokens.
+QByteArray Server::saveTokenState() const {
+    QJsonObject revoked;
+    for (auto it = m_revocations.constBegin(); it != m_revocations.constEnd(); ++it) {
+        revoked[it.key()] = QJsonArray{static_cast<qint64>(it->generation), it->revokedAt};
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QJsonObject retired;
+    for (auto it = m_retiredSessions.constBegin(); it != m_retiredSessions.constEnd(); ++it) {
+        retired[it.key()] = QJsonArray{static_cast<qint64>(it->lastClientMessageId), it->retiredAt};
+    }
+    for (auto it = m_clients.constBegin(); it != m_clients.constEnd(); ++it) {
+        retired[it.key()] = QJsonArray{static_cast<qint64>(it->lastClientMessageId), now};
+    }
+
+    QJsonObject state;
+    state["revoked"] = revoked;
+    state["retired"] = retired;
+    return QJsonDocument(state).toJson(QJsonDocument::Compact);
+}
+
+void Server::loadTokenState(const QByteArray& json) {
+    QJsonObject state = QJsonDocument::fromJson(json).object();
+
+    const QJsonObject revoked = state["revoked"].toObject();
+    for (auto it = revoked.constBegin(); it != revoked.constEnd(); ++it) {
+        QJsonArray entry = it.value().toArray();
+        TokenRevocation& revocation = m_revocations[it.key()];
+        revocation.generation = qMax(revocation.generation, static_cast<quint32>(entry[0].toInteger()));
+        revocation.revokedAt = qMax(revocation.revokedAt, entry[1].toInteger());
+    }
+
+    const QJsonObject retired = state["retired"].toObject();
+    for (auto it = retired.constBegin(); it != retired.constEnd(); ++it) {
+        QJsonArray entry = it.value().toArray();
+        m_retiredSessions.insert(it.key(), {static_cast<quint64>(entry[0].toInteger()), entry[1].toInteger()});
+    }
+    qInfo() << "Loaded" << revoked.size() << "revoked and" << retired.size() << "retired sessions";
+}
+
 void Server::sendToClient(const QString& receiverName, const QString& message) {
     if (!m_clients.contains(receiverName)) {
         qDebug() << "Receiver" << receiverName << "not found";
@@ -385,11 +2066,17 @@ void Server::removeClient(const QString& clientName) {
 
     qDebug() << "Client" << clientName << "disconnected";
 
+    failTransfersOf(clientName, QString("%1 disconnected").arg(clientName));
     m_socketToName.remove(m_clients[clientName].socket);
+    recycleDeliveryQueue(m_clients[clientName].unacked);
     m_clients.remove(clientName);
+    if (m_router) {
+        m_router->withdraw(clientName);
+    }
 
     if (!interlocutorName.isEmpty() && m_clients.contains(interlocutorName)) {
         m_clients[interlocutorName].interlocutor = "";
+        announceClient(interlocutorName);
 
         QJsonObject notification;
         notification["type"] = "interlocutor_disconnected";
@@ -401,6 +2088,47 @@ void Server::removeClient(const QString& clientName) {
     }
 }
 
+quint64& Server::nextSeqFor(ClientInfo& info, const QString& peer) {
+    for (PeerSeq& entry : info.nextSeq) {
+        if (entry.peer == peer) {
+            return entry.seq;
+        }
+    }
+    info.nextSeq.append({peer, 0});
+    return info.nextSeq.last().seq;
+}
+
+quint64& Server::droppedUpToFor(ClientInfo& info, const QString& peer) {
+    for (PeerSeq& entry : info.droppedUpTo) {
+        if (entry.peer == peer) {
+            return entry.seq;
+        }
+    }
+    info.droppedUpTo.append({peer, 0});
+    return info.droppedUpTo.last().seq;
+}
+
+QString Server::internName(const QString& name) const {
+    // Reuses the storage of the session key, so a name is held once however often it is referenced.
+    auto it = m_clients.constFind(name);
+    return it != m_clients.constEnd() ? it.key() : name;
+}
+
+QList<Server::PendingDelivery> Server::takeDeliveryQueue() {
+    if (m_spareQueues.isEmpty()) {
+        return QList<PendingDelivery>();
+    }
+    return m_spareQueues.takeLast();
+}
+
+void Server::recycleDeliveryQueue(QList<PendingDelivery>& queue) {
+    // Clearing keeps the capacity, so the next session starts with storage already grown.
+    if (m_lowFootprint || queue.capacity() == 0 || m_spareQueues.size() >= kMaxSpareQueues) return;
+
+    queue.clear();
+    m_spareQueues.append(std::move(queue));
+}
+
 void Server::notifyInterlocutorDisconnected(const QString& clientName) {
     if (m_clients.contains(clientName)) {
         QJsonObject notification;
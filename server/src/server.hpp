@@ -1,8 +1,31 @@
+#pragma once
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QHostAddress>
 #include <QMap>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QPair>
 #include <QString>
 #include <QJsonObject>
+#include <QTimer>
+#include <QPointer>
+#include <QAtomicInt>
+#include "frame_pool.hpp"
+#include "frame_reader.hpp"
+#include "traffic_recorder.hpp"
+#include "file_chunk.hpp"
+#include "conversation_sequencer.hpp"
+
+#ifndef QT_NO_SSL
+#include <QSslConfiguration>
+#endif
+
+class ClusterRouter;
+class LocalListener;
+class Authenticator;
+struct ServerConfig;
 
 class Server : public QTcpServer {
     Q_OBJECT
@@ -11,35 +34,290 @@ private slots:
     void onNewConnection();
     void onClientDisconnected();
     void onReadyRead();
+    void onBytesWritten();
+    void expireDetachedSessions();
+    void finishDrain();
+    void onRemoteFrame(const QString& name, const QJsonObject& frame, const QString& peer, quint64 messageId);
+    void onPairRequested(const QString& name, const QString& interlocutor);
+    void onRemoteUserLeft(const QString& name);
+    void onUserClaimed(const QString& name);
+    void onSessionReceived(const QString& name, const QJsonObject& state);
+    void onSessionsRevoked(const QString& name, quint32 generation);
+
+public slots:
+    void flushAcks();
+    void flushTyping();
+    void releaseIdleBuffers();
+
+signals:
+    void drainStarted();
+    void drained();
+
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
 
 public:
 
+    static constexpr qint64 kResumeWindowMs = 30000;
+    static constexpr int kSessionSweepIntervalMs = 5000;
+    static constexpr int kSessionHandOverWaitMs = 2000;
+    static constexpr qint64 kSessionTokenLifetimeSecs = 24 * 60 * 60;
+    static constexpr int kMaxUnackedPerClient = 1000;
+    static constexpr int kMigrateSpreadMs = 5000;
+    static constexpr int kMaxSpareQueues = 256;
+    static constexpr qint64 kIdleReleaseMs = 30000;
+    static constexpr int kIdleSweepIntervalMs = 10000;
+    static constexpr int kMaxBatchEntries = 1000;
+    static constexpr qint64 kTypingIntervalMs = 2000;
+    static constexpr int kTypingFlushMs = 250;
+    static constexpr qint64 kSocketHighWater = 64 * 1024;
+    static constexpr qsizetype kSliceBytes = 16 * 1024;
+    static constexpr int kInteractiveBurst = 4;
+    // Base64 of an end-to-end public key; generous for X25519, which needs 44 characters.
+    static constexpr int kMaxPublicKeySize = 256;
+
+    // Outbound traffic classes. Sequenced messages all share the interactive lane, as a client
+    // drops any seq that arrives after a higher one from the same peer.
+    enum Lane {
+        ControlLane,
+        InteractiveLane,
+        BulkLane,
+        LaneCount
+    };
+
+    struct PendingDelivery {
+        quint64 seq;
+        QString peer;
+        QJsonObject frame;
+        quint64 messageId;
+    };
+
+    // A message between two users on its way through the sequencer.
+    struct SequencedDelivery {
+        QString receiver;
+        QString peer;
+        QJsonObject frame;
+        quint64 messageId = 0;
+    };
+
+    // Both directions of a conversation share one key, the lower name first.
+    using ConversationKey = QPair<QString, QString>;
+
+    // Tokens of a user that carry an older generation are refused. An entry is dropped once the
+    // tokens it refuses have expired anyway.
+    struct TokenRevocation {
+        quint32 generation = 0;
+        qint64 revokedAt = 0;
+    };
+
+    // What is kept of a session that expired: the id of the last message its client sent, so a
+    // client that rebuilds the session from its token does not have those relayed a second time.
+    struct RetiredSession {
+        quint64 lastClientMessageId = 0;
+        qint64 retiredAt = 0;
+    };
+
+    // A resume held back until the node that had the session hands over what is left of it.
+    struct PendingResume {
+        QPointer<QTcpSocket> socket;
+        QString interlocutor;
+        QJsonObject lastSeq;
+    };
+
+    struct PeerSeq {
+        QString peer;
+        quint64 seq;
+    };
+
+    // The session token is not kept: tokens are self-verifying, so a fresh one is issued when needed.
+    // Per-peer counters are a flat list, as a session rarely talks to more than one or two peers.
+    // droppedUpTo is the last seq per peer that fell out of a full unacked list; a client that
+    // resumes from before it is told with a gap frame instead of finding a hole in the replay.
     struct ClientInfo {
         QTcpSocket* socket;
         QString interlocutor;
         bool isAuthenticated;
+        qint64 detachedAt = 0;
+        quint64 lastClientMessageId = 0;
+        QList<PeerSeq> nextSeq;
+        QList<PendingDelivery> unacked;
+        QList<PeerSeq> droppedUpTo;
+    };
+
+    // A file being streamed between two local clients. Chunks are forwarded as they arrive, so
+    // only the offsets are kept here: relayed is what went to the receiver, acked what it saved.
+    // The sender is told to start once the receiver accepts; ref is how the sender knows the file.
+    struct FileTransfer {
+        QString sender;
+        QString receiver;
+        QString name;
+        qint64 ref = 0;
+        bool accepted = false;
+        qint64 size = 0;
+        qint64 relayed = 0;
+        qint64 acked = 0;
+    };
+
+    // Typing events from one sender to one recipient. Any number that arrive within an interval
+    // collapse into a single pending flag, so a pair costs at most one frame per interval.
+    struct TypingState {
+        qint64 lastForwarded = 0;
+        bool pending = false;
+    };
+
+    // Frames held back while the socket already has kSocketHighWater bytes to write. Control
+    // goes first; interactive and bulk take turns, bulk getting one frame per kInteractiveBurst.
+    // A frame is written in kSliceBytes pieces and has to finish before another lane can start,
+    // so a control frame waits for at most the rest of one frame plus the high-water mark.
+    struct OutboundQueue {
+        QList<QByteArray> lanes[LaneCount];
+        int writing = -1;
+        qsizetype headOffset = 0;
+        int interactiveRun = 0;
+        qint64 queuedBytes = 0;
     };
 
     struct ClientBuffer {
         QTcpSocket* socket;
         quint32 expectedSize;
+        qint64 lastActivity = 0;
+        quint32 captureId = 0;
+        qint64 bytesIn = 0;
+        qint64 bytesOut = 0;
+        qint64 framesIn = 0;
+        qint64 framesOut = 0;
+        // Set while the credentials of an auth request are checked or a resumed session is fetched
+        // from another node; later frames wait in the socket.
+        bool holdFrames = false;
     };
 
     explicit Server(QObject* parent = nullptr);
-    bool open(const QString& port);
+    bool open(const QString& port, bool reusePort = false, const QHostAddress& address = QHostAddress::Any);
+    bool openDescriptor(qintptr socketDescriptor);
+    bool openLocal(const QString& path);
+    bool handOver(const QStringList& arguments);
+    void acceptConnection(QTcpSocket* clientSocket);
+    bool enableTls(const QString& certificatePath, const QString& keyPath);
+    bool isTlsEnabled() const { return m_tlsEnabled; }
+    void setLowFootprint(bool enabled);
+    bool isLowFootprint() const { return m_lowFootprint; }
+    QJsonObject memoryReport() const;
+    void setMaxFrameSize(quint32 maxFrameSize) { m_maxFrameSize = maxFrameSize; }
+    quint32 maxFrameSize() const { return m_maxFrameSize; }
+    qint64 socketHighWater() const { return m_socketHighWater; }
+    void applyConfig(const ServerConfig& config);
+    bool startCapture(const QString& path, double sampleRate = 1.0);
+    void stopCapture();
+    void drain(int timeoutMs);
+    bool isDraining() const { return m_draining; }
+    void setRouter(ClusterRouter* router);
+    void setAuthenticator(Authenticator* authenticator) { m_authenticator = authenticator; }
 
+    void readFrames(QTcpSocket* clientSocket);
     void processClientMessage(QTcpSocket* clientSocket, const QByteArray& data);
     void processAuth(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void completeAuth(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void processResume(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void processReceived(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void processLogout(QTcpSocket* clientSocket);
     void processMessage(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void processMessageBatch(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void processConversationMessage(QTcpSocket* clientSocket, const QString& senderName, const QString& recipient,
+                                    const QString& text, quint64 messageId, bool encrypted = false);
+    bool isDuplicateMessage(QTcpSocket* clientSocket, const QString& senderName, quint64 messageId);
     void processChangeInterlocutor(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void processTyping(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void forwardTyping(const QString& senderName, const QString& recipient);
+    void processKeyExchange(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void processFileOffer(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void processFileChunk(QTcpSocket* clientSocket, const QByteArray& frame);
+    void processFileAccept(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void processFileAck(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void processFileCancel(QTcpSocket* clientSocket, const QJsonObject& obj);
+    void rewindTransfers(const QString& clientName);
+    void failTransfer(quint64 transferId, const QString& error);
+    void failTransfersOf(const QString& clientName, const QString& error);
     void sendMessageWithSize(QTcpSocket* socket, const QJsonObject& jsonObj);
-    bool validateConnection(const QString& clientName, const QString& interlocutorName, QString& error);
+    void sendMessageWithSize(QTcpSocket* socket, const QJsonObject& jsonObj, Lane lane);
+    void sendRawFrame(QTcpSocket* socket, const QByteArray& payload, Lane lane);
+    void pumpOutbound(QTcpSocket* socket);
+    bool hasQueued(QTcpSocket* socket, Lane lane) const;
+    static Lane laneFor(const QJsonObject& frame);
+    static int nextLane(OutboundQueue& queue);
+    bool validateConnection(const QString& clientName, const QString& interlocutorName, QString& error, bool resuming = false);
     bool validateInterlocutorChange(const QString& clientName, const QString& newInterlocutor, QString& error);
+    bool isOnline(const QString& name) const;
+    QString interlocutorOf(const QString& name) const;
+    void sendToUser(const QString& name, const QJsonObject& frame);
+    void setInterlocutor(const QString& name, const QString& interlocutor);
+    void announceClient(const QString& name);
+    void registerClient(QTcpSocket* clientSocket, const QString& clientName, const QString& interlocutorName, const QString& responseType,
+                        quint64 lastClientMessageId = 0);
+    void awaitSessionHandOver(QTcpSocket* clientSocket, const QString& clientName, const QString& interlocutorName,
+                              const QJsonObject& lastSeq);
+    void completeResume(const QString& clientName);
+    void relayInOrder(const QString& receiverName, const QString& peerName, const QJsonObject& frame, quint64 messageId = 0);
+    void releaseDelivery(SequencedDelivery& delivery);
+    static ConversationKey conversationKey(const QString& first, const QString& second);
+    void deliverToClient(const QString& receiverName, const QString& peerName, QJsonObject frame, quint64 messageId = 0);
+    void queueAck(QTcpSocket* clientSocket);
+    void replayUnacked(const QString& clientName, const QJsonObject& lastSeq);
+    void detachClient(const QString& clientName);
+    QString issueSessionToken(const QString& clientName, const QString& interlocutorName) const;
+    bool verifySessionToken(const QString& token, QString& clientName, QString& interlocutorName) const;
+    QString credentialStamp(const QString& clientName) const;
+    void revokeSessions(const QString& clientName);
+    void pruneTokenState(qint64 now);
+    QByteArray saveTokenState() const;
+    void loadTokenState(const QByteArray& json);
     void sendToClient(const QString& receiverName, const QString& message);
     void removeClient(const QString& clientName);
     void notifyInterlocutorDisconnected(const QString& clientName);
+    static quint64& nextSeqFor(ClientInfo& info, const QString& peer);
+    static quint64& droppedUpToFor(ClientInfo& info, const QString& peer);
+    QString internName(const QString& name) const;
+    QList<PendingDelivery> takeDeliveryQueue();
+    void recycleDeliveryQueue(QList<PendingDelivery>& queue);
 
-    QMap<QString, ClientInfo> m_clients;
-    QMap<QTcpSocket*, QString> m_socketToName;
-    QMap<QTcpSocket*, ClientBuffer> m_buffers;
+    // QHash keeps its entries in shared spans, so connection churn does not allocate per entry.
+    QHash<QString, ClientInfo> m_clients;
+    QHash<QTcpSocket*, QString> m_socketToName;
+    QHash<QTcpSocket*, ClientBuffer> m_buffers;
+    QHash<QTcpSocket*, OutboundQueue> m_outbound;
+    FramePool m_framePool;
+    QList<QList<PendingDelivery>> m_spareQueues;
+    quint32 m_maxFrameSize = FrameReader::kDefaultMaxFrameSize;
+    qint64 m_socketHighWater = kSocketHighWater;
+    int m_maxBatchEntries = kMaxBatchEntries;
+    int m_maxUnackedPerClient = kMaxUnackedPerClient;
+    qint64 m_resumeWindowMs = kResumeWindowMs;
+    qint64 m_idleReleaseMs = kIdleReleaseMs;
+    qint64 m_typingIntervalMs = kTypingIntervalMs;
+    bool m_lowFootprint = false;
+    QTimer m_idleSweepTimer;
+    TrafficRecorder m_recorder;
+    QByteArray m_sessionKey;
+    QHash<QString, TokenRevocation> m_revocations;
+    QHash<QString, RetiredSession> m_retiredSessions;
+    QHash<QString, PendingResume> m_pendingResumes;
+    qint64 m_tokenStatePrunedAt = 0;
+    QTimer m_sessionSweepTimer;
+    QHash<quint64, FileTransfer> m_transfers;
+    quint64 m_nextTransferId = 1;
+    QSet<QTcpSocket*> m_pendingAcks;
+    QTimer m_ackFlushTimer;
+    QHash<QPair<QString, QString>, TypingState> m_typing;
+    QTimer m_typingTimer;
+    ConversationSequencer<ConversationKey, SequencedDelivery> m_sequencer;
+    // Deliveries posted to this thread and not yet run.
+    QAtomicInt m_queuedDeliveries;
+    bool m_draining = false;
+    QTimer m_drainTimer;
+    ClusterRouter* m_router = nullptr;
+    Authenticator* m_authenticator = nullptr;
+    LocalListener* m_localListener = nullptr;
+    bool m_tlsEnabled = false;
+#ifndef QT_NO_SSL
+    QSslConfiguration m_tlsConfiguration;
+#endif
 };
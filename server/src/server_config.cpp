@@ -0,0 +1,163 @@
+#include "server_config.hpp"
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonParseError>
+#include <QLoggingCategory>
+#include <cmath>
+#include <type_traits>
+
+static bool readInteger(const QJsonValue& value, qint64 minimum, qint64 maximum, qint64& result) {
+    bool ok = false;
+    if (value.isDouble()) {
+        double number = value.toDouble();
+        ok = number == std::floor(number) && std::abs(number) < 9e15;
+        result = static_cast<qint64>(number);
+    } else if (value.isString()) {
+        result = value.toString().trimmed().toLongLong(&ok);
+    }
+    return ok && result >= minimum && result <= maximum;
+}
+
+bool ServerConfig::merge(const QJsonObject& values, QString& error) {
+    ServerConfig merged = *this;
+
+    for (auto it = values.constBegin(); it != values.constEnd(); ++it) {
+        const QString& key = it.key();
+        const QJsonValue value = it.value();
+
+        auto integer = [&](qint64 minimum, qint64 maximum, auto& field) {
+            qint64 number = 0;
+            if (!readInteger(value, minimum, maximum, number)) {
+                error = QString("%1 must be an integer from %2 to %3").arg(key).arg(minimum).arg(maximum);
+                return false;
+            }
+            field = static_cast<std::remove_reference_t<decltype(field)>>(number);
+            return true;
+        };
+
+        bool ok = true;
+        if (key == "listenAddress") {
+            merged.listenAddress = value.toString().trimmed();
+            ok = value.isString() && !merged.hostAddress().isNull();
+            if (!ok) {
+                error = QString("listenAddress must be \"any\" or an IP address");
+            }
+        } else if (key == "port") {
+            qint64 port = 0;
+            ok = integer(0, 65535, port);
+            merged.port = QString::number(port);
+        } else if (key == "workers") {
+            ok = integer(1, 256, merged.workers);
+        } else if (key == "maxFrameSize") {
+            ok = integer(1024, FrameReader::kDefaultMaxFrameSize, merged.maxFrameSize);
+        } else if (key == "socketHighWater") {
+            ok = integer(4096, qint64(64) << 20, merged.socketHighWater);
+        } else if (key == "maxBatchEntries") {
+            ok = integer(1, 100000, merged.maxBatchEntries);
+        } else if (key == "maxUnackedPerClient") {
+            ok = integer(1, 1000000, merged.maxUnackedPerClient);
+        } else if (key == "resumeWindowMs") {
+            ok = integer(0, 24 * 60 * 60 * 1000, merged.resumeWindowMs);
+        } else if (key == "idleReleaseMs") {
+            ok = integer(1000, 24 * 60 * 60 * 1000, merged.idleReleaseMs);
+        } else if (key == "typingIntervalMs") {
+            ok = integer(0, 60000, merged.typingIntervalMs);
+        } else if (key == "drainTimeoutMs") {
+            ok = integer(0, 10 * 60 * 1000, merged.drainTimeoutMs);
+        } else if (key == "authThreads") {
+            ok = integer(0, 256, merged.authThreads);
+        } else if (key == "authCacheTtlMs") {
+            ok = integer(0, 24 * 60 * 60 * 1000, merged.authCacheTtlMs);
+        } else if (key == "logLevel") {
+            merged.logLevel = value.toString().trimmed().toLower();
+            ok = merged.logLevel == "debug" || merged.logLevel == "info" || merged.logLevel == "warning";
+            if (!ok) {
+                error = QString("logLevel must be debug, info or warning");
+            }
+        } else {
+            error = QString("Unknown setting %1").arg(key);
+            ok = false;
+        }
+
+        if (!ok) return false;
+    }
+
+    *this = merged;
+    return true;
+}
+
+bool ServerConfig::load(const QString& path, QString& error) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        error = QString("Cannot read %1: %2").arg(path, file.errorString());
+        return false;
+    }
+
+    QJsonParseError parseError;
+    QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &parseError);
+    if (parseError.error != QJsonParseError::NoError || !document.isObject()) {
+        error = QString("%1 is not a JSON object: %2").arg(path, parseError.errorString());
+        return false;
+    }
+
+    if (!merge(document.object(), error)) {
+        error = QString("%1: %2").arg(path, error);
+        return false;
+    }
+    return true;
+}
+
+bool ServerConfig::set(const QString& assignment, QString& error) {
+    qsizetype equals = assignment.indexOf('=');
+    if (equals <= 0) {
+        error = QString("Expected knob=value, got %1").arg(assignment);
+        return false;
+    }
+
+    QJsonObject values;
+    values[assignment.left(equals).trimmed()] = assignment.mid(equals + 1);
+    return merge(values, error);
+}
+
+QHostAddress ServerConfig::hostAddress() const {
+    if (listenAddress.isEmpty() || listenAddress == "any") {
+        return QHostAddress::Any;
+    }
+    return QHostAddress(listenAddress);
+}
+
+bool ServerConfig::sameBinding(const ServerConfig& other) const {
+    return listenAddress == other.listenAddress && port == other.port && workers == other.workers;
+}
+
+QJsonObject ServerConfig::toJson() const {
+    QJsonObject json;
+    json["listenAddress"] = listenAddress;
+    json["port"] = port.toInt();
+    json["workers"] = workers;
+    json["maxFrameSize"] = static_cast<qint64>(maxFrameSize);
+    json["socketHighWater"] = socketHighWater;
+    json["maxBatchEntries"] = maxBatchEntries;
+    json["maxUnackedPerClient"] = maxUnackedPerClient;
+    json["resumeWindowMs"] = resumeWindowMs;
+    json["idleReleaseMs"] = idleReleaseMs;
+    json["typingIntervalMs"] = typingIntervalMs;
+    json["drainTimeoutMs"] = drainTimeoutMs;
+    json["authThreads"] = authThreads;
+    json["authCacheTtlMs"] = authCacheTtlMs;
+    json["logLevel"] = logLevel;
+    return json;
+}
+
+bool ServerConfig::applyLogLevel(const QString& level) {
+    if (level == "debug") {
+        QLoggingCategory::setFilterRules(QString());
+    } else if (level == "info") {
+        QLoggingCategory::setFilterRules("*.debug=false");
+    } else if (level == "warning") {
+        QLoggingCategory::setFilterRules("*.debug=false\n*.info=false");
+    } else {
+        return false;
+    }
+    return true;
+}
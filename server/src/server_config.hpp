@@ -0,0 +1,43 @@
+#pragma once
+#include <QString>
+#include <QJsonObject>
+#include <QHostAddress>
+#include "server.hpp"
+#include "authenticator.hpp"
+
+// Tuning knobs of one server process. Defaults are the compiled-in values; a JSON file of
+// {"knob": value} pairs overrides them, and --set knob=value on the command line overrides the
+// file. The listen address, port and worker count are bound at start; everything else is
+// re-applied by Server::applyConfig when SIGHUP reloads the file.
+struct ServerConfig {
+    QString listenAddress = "any";
+    QString port = "5464";
+    int workers = 1;
+
+    // Also the ceiling: clients reject frames above the default.
+    quint32 maxFrameSize = FrameReader::kDefaultMaxFrameSize;
+    qint64 socketHighWater = Server::kSocketHighWater;
+    int maxBatchEntries = Server::kMaxBatchEntries;
+    int maxUnackedPerClient = Server::kMaxUnackedPerClient;
+    qint64 resumeWindowMs = Server::kResumeWindowMs;
+    qint64 idleReleaseMs = Server::kIdleReleaseMs;
+    qint64 typingIntervalMs = Server::kTypingIntervalMs;
+    int drainTimeoutMs = 10000;
+    // 0 sizes the credential check pool to the number of cores.
+    int authThreads = 0;
+    qint64 authCacheTtlMs = Authenticator::kDefaultCacheTtlMs;
+    QString logLevel = "debug";
+
+    // Values are checked before any is taken, so a bad file or override leaves the config as it was.
+    bool merge(const QJsonObject& values, QString& error);
+    bool load(const QString& path, QString& error);
+    bool set(const QString& assignment, QString& error);
+
+    QHostAddress hostAddress() const;
+    bool sameBinding(const ServerConfig& other) const;
+    QJsonObject toJson() const;
+
+    // "debug" logs everything; "info" keeps start-up, reload and drain events (qInfo) and problems
+    // (qWarning); "warning" keeps the problems only.
+    static bool applyLogLevel(const QString& level);
+};
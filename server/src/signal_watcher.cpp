@@ -0,0 +1,56 @@
+#include "signal_watcher.hpp"
+#include <QSocketNotifier>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <csignal>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+int SignalWatcher::s_fds[2] = {-1, -1};
+
+SignalWatcher::SignalWatcher(const QList<int>& signalNumbers, QObject* parent) : QObject(parent), m_notifier(nullptr) {
+#ifdef Q_OS_UNIX
+    if (s_fds[0] == -1 && ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s_fds) != 0) {
+        qWarning() << "Unable to create signal socket pair";
+        return;
+    }
+
+    m_notifier = new QSocketNotifier(s_fds[1], QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &SignalWatcher::onNotifierActivated);
+
+    for (int signalNumber : signalNumbers) {
+        struct sigaction action = {};
+        action.sa_handler = &SignalWatcher::handleSignal;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        if (sigaction(signalNumber, &action, nullptr) != 0) {
+            qWarning() << "Unable to install handler for signal" << signalNumber;
+        }
+    }
+#else
+    Q_UNUSED(signalNumbers);
+#endif
+}
+
+SignalWatcher::~SignalWatcher() = default;
+
+void SignalWatcher::handleSignal(int signalNumber) {
+#ifdef Q_OS_UNIX
+    char byte = static_cast<char>(signalNumber);
+    [[maybe_unused]] ssize_t written = ::write(s_fds[0], &byte, sizeof(byte));
+#else
+    Q_UNUSED(signalNumber);
+#endif
+}
+
+void SignalWatcher::onNotifierActivated() {
+#ifdef Q_OS_UNIX
+    char byte = 0;
+    if (::read(s_fds[1], &byte, sizeof(byte)) == sizeof(byte)) {
+        qInfo() << "Received signal" << static_cast<int>(byte);
+        emit signalReceived(static_cast<int>(byte));
+    }
+#endif
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <QObject>
+#include <QList>
+
+class QSocketNotifier;
+
+// Turns POSIX signals into a Qt signal delivered on the event loop (self-pipe trick),
+// so handlers can safely touch server state.
+class SignalWatcher : public QObject {
+    Q_OBJECT
+
+public:
+    explicit SignalWatcher(const QList<int>& signalNumbers, QObject* parent = nullptr);
+    ~SignalWatcher();
+
+signals:
+    void signalReceived(int signalNumber);
+
+private slots:
+    void onNotifierActivated();
+
+private:
+    static void handleSignal(int signalNumber);
+
+    static int s_fds[2];
+    QSocketNotifier* m_notifier;
+};
@@ -0,0 +1,145 @@
+#include "traffic_recorder.hpp"
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRandomGenerator>
+#include <QDebug>
+#include <cstring>
+
+static const char kMagic[] = {'M', 'S', 'G', 'C', 'A', 'P'};
+static const char* const kSecretFields[] = {"password", "sessionToken"};
+
+// Only frames that mention a secret field are parsed, so ordinary traffic is written untouched.
+static QByteArray redactSecrets(const QByteArray& frame) {
+    bool mentionsSecret = false;
+    for (const char* field : kSecretFields) {
+        mentionsSecret = mentionsSecret || frame.contains(QByteArray("\"") + field + '"');
+    }
+    if (!mentionsSecret) return frame;
+
+    QJsonObject obj = QJsonDocument::fromJson(frame).object();
+    bool redacted = false;
+    for (const char* field : kSecretFields) {
+        if (obj.contains(QLatin1String(field))) {
+            obj[QLatin1String(field)] = TrafficRecorder::kRedacted;
+            redacted = true;
+        }
+    }
+    return redacted ? QJsonDocument(obj).toJson(QJsonDocument::Compact) : frame;
+}
+
+bool TrafficRecorder::start(const QString& path, double sampleRate) {
+    stop();
+
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Cannot open capture file" << path << ":" << m_file.errorString();
+        return false;
+    }
+
+    m_stream.setDevice(&m_file);
+    m_stream.writeRawData(kMagic, sizeof(kMagic));
+    m_stream << kFormatVersion;
+
+    m_sampleRate = qBound(0.0, sampleRate, 1.0);
+    m_nextConnection = 1;
+    m_recordCount = 0;
+    m_clock.start();
+
+    qInfo() << "Capturing traffic to" << path << "at sample rate" << m_sampleRate;
+    return true;
+}
+
+void TrafficRecorder::stop() {
+    if (!m_file.isOpen()) return;
+
+    m_stream.setDevice(nullptr);
+    m_file.close();
+    qInfo() << "Capture stopped after" << m_recordCount << "records";
+}
+
+quint32 TrafficRecorder::openConnection() {
+    if (!isActive()) return 0;
+    if (m_sampleRate < 1.0 && QRandomGenerator::global()->generateDouble() >= m_sampleRate) return 0;
+
+    quint32 connection = m_nextConnection++;
+    writeRecordHeader(Open, connection);
+    return connection;
+}
+
+void TrafficRecorder::recordFrame(quint32 connection, const QByteArray& frame) {
+    if (!connection || !isActive()) return;
+
+    const QByteArray payload = redactSecrets(frame);
+    writeRecordHeader(Frame, connection);
+    m_stream << static_cast<quint32>(payload.size());
+    m_stream.writeRawData(payload.constData(), static_cast<int>(payload.size()));
+}
+
+void TrafficRecorder::recordClose(quint32 connection) {
+    if (!connection || !isActive()) return;
+
+    writeRecordHeader(Close, connection);
+}
+
+void TrafficRecorder::writeRecordHeader(Kind kind, quint32 connection) {
+    // QFile buffers the writes, so a record normally costs a memcpy rather than a syscall.
+    m_stream << static_cast<quint8>(kind) << connection << static_cast<quint64>(m_clock.nsecsElapsed() / 1000);
+    ++m_recordCount;
+}
+
+bool TrafficRecorder::readCapture(const QString& path, QList<Record>& records, QString& error) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        error = file.errorString();
+        return false;
+    }
+
+    QDataStream in(&file);
+    char magic[sizeof(kMagic)];
+    quint16 version = 0;
+    if (in.readRawData(magic, sizeof(magic)) != sizeof(magic) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+        error = "Not a capture file";
+        return false;
+    }
+    in >> version;
+    if (version != kFormatVersion) {
+        error = QString("Unsupported capture version %1").arg(version);
+        return false;
+    }
+
+    records.clear();
+    while (!in.atEnd()) {
+        quint8 kind = 0;
+        Record record;
+        in >> kind >> record.connection >> record.timestampUs;
+        if (in.status() != QDataStream::Ok) {
+            break;
+        }
+        record.kind = static_cast<Kind>(kind);
+
+        if (record.kind == Frame) {
+            quint32 size = 0;
+            in >> size;
+            if (size > file.bytesAvailable()) {
+                in.setStatus(QDataStream::ReadPastEnd);
+                break;
+            }
+            record.payload.resize(size);
+            in.readRawData(record.payload.data(), static_cast<int>(size));
+        } else if (record.kind != Open && record.kind != Close) {
+            error = QString("Unknown record kind %1").arg(kind);
+            return false;
+        }
+
+        if (in.status() != QDataStream::Ok) {
+            break;
+        }
+        records.append(record);
+    }
+
+    // A server that was killed mid-write leaves a partial last record; everything before it is kept.
+    if (in.status() != QDataStream::Ok) {
+        qWarning() << "Capture" << path << "ends in a truncated record, replaying" << records.size() << "records";
+    }
+    return true;
+}
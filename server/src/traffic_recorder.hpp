@@ -0,0 +1,57 @@
+#pragma once
+#include <QByteArray>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QString>
+
+// Records inbound client traffic so it can be replayed against another build. Whether a
+// connection is captured is decided once when it opens, so a sampled capture still holds whole
+// conversations and a skipped connection costs nothing after that.
+//
+// File layout (big-endian): the magic "MSGCAP", a quint16 version, then records of
+// quint8 kind, quint32 connection, quint64 microseconds since the capture started and, for
+// frames only, a quint32 size followed by the frame payload. Passwords and session tokens are
+// replaced with kRedacted, so a capture can be shared; replayed sign-ins then need a server
+// without authentication.
+class TrafficRecorder {
+public:
+    static constexpr quint16 kFormatVersion = 1;
+    static constexpr char kRedacted[] = "redacted";
+
+    enum Kind : quint8 {
+        Open = 1,
+        Frame = 2,
+        Close = 3
+    };
+
+    struct Record {
+        Kind kind;
+        quint32 connection;
+        quint64 timestampUs;
+        QByteArray payload;
+    };
+
+    bool start(const QString& path, double sampleRate = 1.0);
+    void stop();
+    bool isActive() const { return m_file.isOpen(); }
+    qint64 recordCount() const { return m_recordCount; }
+
+    // Returns the capture id for a new connection, or 0 if it is not being captured.
+    quint32 openConnection();
+    void recordFrame(quint32 connection, const QByteArray& frame);
+    void recordClose(quint32 connection);
+
+    static bool readCapture(const QString& path, QList<Record>& records, QString& error);
+
+private:
+    void writeRecordHeader(Kind kind, quint32 connection);
+
+    QFile m_file;
+    QDataStream m_stream;
+    QElapsedTimer m_clock;
+    double m_sampleRate = 1.0;
+    quint32 m_nextConnection = 1;
+    qint64 m_recordCount = 0;
+};
@@ -0,0 +1,353 @@
+#include "websocket_gateway.hpp"
+#include "server.hpp"
+#include "pipe_transport.hpp"
+#include "file_chunk.hpp"
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QCryptographicHash>
+#include <QRandomGenerator>
+#include <QtEndian>
+#include <QDebug>
+#include <cstring>
+
+static const char kHandshakeGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static QByteArray frameHeader(quint8 opcode, quint64 size) {
+    QByteArray header;
+    header.reserve(14);
+    header.append(static_cast<char>(0x80 | opcode));
+
+    if (size < 126) {
+        header.append(static_cast<char>(size));
+    } else if (size <= 0xFFFF) {
+        char length[sizeof(quint16)];
+        qToBigEndian(static_cast<quint16>(size), length);
+        header.append(static_cast<char>(126));
+        header.append(length, sizeof(length));
+    } else {
+        char length[sizeof(quint64)];
+        qToBigEndian(size, length);
+        header.append(static_cast<char>(127));
+        header.append(length, sizeof(length));
+    }
+    return header;
+}
+
+// XORs eight bytes at a time; the key repeats every four bytes, so whole words line up with it.
+static void applyMask(char* data, qsizetype size, const uchar* key) {
+    quint32 key32;
+    std::memcpy(&key32, key, sizeof(key32));
+    quint64 key64 = (static_cast<quint64>(key32) << 32) | key32;
+
+    qsizetype i = 0;
+    for (; i + 8 <= size; i += 8) {
+        quint64 word;
+        std::memcpy(&word, data + i, sizeof(word));
+        word ^= key64;
+        std::memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < size; ++i) {
+        data[i] ^= key[i & 3];
+    }
+}
+
+WebSocketGateway::WebSocketGateway(Server* server, QObject* parent) : QObject(parent), m_server(server), m_listener(nullptr) {
+    // A draining server takes no new clients on any of its ports; open connections are migrated with the rest.
+    connect(m_server, &Server::drainStarted, this, &WebSocketGateway::close);
+}
+
+WebSocketGateway::~WebSocketGateway() {
+    if (m_listener) {
+        m_listener->close();
+    }
+}
+
+bool WebSocketGateway::listen(const QHostAddress& address, quint16 port) {
+    if (!m_listener) {
+        m_listener = new QTcpServer(this);
+        connect(m_listener, &QTcpServer::newConnection, this, &WebSocketGateway::onNewConnection);
+    }
+
+    if (!m_listener->listen(address, port)) {
+        qWarning() << "WebSocket gateway cannot listen on port" << port << ":" << m_listener->errorString();
+        return false;
+    }
+    qInfo() << "WebSocket gateway listening on port" << m_listener->serverPort();
+    return true;
+}
+
+void WebSocketGateway::close() {
+    if (m_listener) {
+        m_listener->close();
+    }
+}
+
+quint16 WebSocketGateway::serverPort() const {
+    return m_listener ? m_listener->serverPort() : 0;
+}
+
+QByteArray WebSocketGateway::acceptKey(const QByteArray& key) {
+    return QCryptographicHash::hash(key + kHandshakeGuid, QCryptographicHash::Sha1).toBase64();
+}
+
+QByteArray WebSocketGateway::encodeFrame(quint8 opcode, const QByteArray& payload, bool masked) {
+    QByteArray frame = frameHeader(opcode, static_cast<quint64>(payload.size()));
+    if (!masked) {
+        return frame + payload;
+    }
+
+    uchar key[4];
+    quint32 random = QRandomGenerator::global()->generate();
+    std::memcpy(key, &random, sizeof(key));
+
+    frame[1] = static_cast<char>(frame[1] | 0x80);
+    frame.append(reinterpret_cast<const char*>(key), sizeof(key));
+    qsizetype start = frame.size();
+    frame.append(payload);
+    applyMask(frame.data() + start, payload.size(), key);
+    return frame;
+}
+
+WebSocketGateway::DecodeResult WebSocketGateway::decodeFrame(const QByteArray& data, qsizetype& offset, WireFrame& frame,
+                                                             quint64 maxPayload, bool requireMask) {
+    qsizetype available = data.size() - offset;
+    if (available < 2) return NeedMoreData;
+
+    const uchar* bytes = reinterpret_cast<const uchar*>(data.constData()) + offset;
+
+    // No extensions are negotiated, so the reserved bits must be clear.
+    if (bytes[0] & 0x70) return Malformed;
+
+    bool masked = bytes[1] & 0x80;
+    if (requireMask && !masked) return Malformed;
+
+    quint64 length = bytes[1] & 0x7F;
+    qsizetype headerSize = 2;
+    if (length == 126) {
+        if (available < 4) return NeedMoreData;
+        length = qFromBigEndian<quint16>(bytes + 2);
+        headerSize = 4;
+    } else if (length == 127) {
+        if (available < 10) return NeedMoreData;
+        length = qFromBigEndian<quint64>(bytes + 2);
+        headerSize = 10;
+    }
+
+    // Checked before waiting for the payload, so an absurd length is rejected without buffering it.
+    if (length > maxPayload) return TooLarge;
+
+    if (masked) headerSize += 4;
+    if (available < headerSize || static_cast<quint64>(available - headerSize) < length) return NeedMoreData;
+
+    frame.fin = bytes[0] & 0x80;
+    frame.opcode = bytes[0] & 0x0F;
+    frame.payload = QByteArray(reinterpret_cast<const char*>(bytes + headerSize), static_cast<qsizetype>(length));
+    if (masked) {
+        applyMask(frame.payload.data(), frame.payload.size(), bytes + headerSize - 4);
+    }
+
+    offset += headerSize + static_cast<qsizetype>(length);
+    return Decoded;
+}
+
+void WebSocketGateway::onNewConnection() {
+    while (QTcpSocket* socket = m_listener->nextPendingConnection()) {
+        m_connections.insert(socket, Connection());
+        connect(socket, &QTcpSocket::readyRead, this, &WebSocketGateway::onSocketReadyRead);
+        connect(socket, &QTcpSocket::disconnected, this, &WebSocketGateway::onSocketDisconnected);
+    }
+}
+
+void WebSocketGateway::onSocketReadyRead() {
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket || !m_connections.contains(socket) || socket->state() != QAbstractSocket::ConnectedState) return;
+
+    Connection& connection = m_connections[socket];
+    connection.inbound += socket->readAll();
+
+    if (!connection.upgraded && !completeHandshake(socket, connection)) return;
+    processFrames(socket, connection);
+}
+
+bool WebSocketGateway::completeHandshake(QTcpSocket* socket, Connection& connection) {
+    qsizetype end = connection.inbound.indexOf("\r\n\r\n");
+    if (end < 0 && connection.inbound.size() <= kMaxHandshakeSize) return false;
+
+    QByteArray key;
+    bool upgrade = false;
+    bool versionOk = false;
+
+    const QList<QByteArray> lines = connection.inbound.left(qMax<qsizetype>(end, 0)).split('\n');
+    bool isGet = end >= 0 && !lines.isEmpty() && lines.first().startsWith("GET ");
+    for (qsizetype i = 1; isGet && i < lines.size(); ++i) {
+        qsizetype colon = lines[i].indexOf(':');
+        if (colon <= 0) continue;
+
+        QByteArray name = lines[i].left(colon).trimmed().toLower();
+        QByteArray value = lines[i].mid(colon + 1).trimmed();
+        if (name == "upgrade") {
+            upgrade = value.toLower().contains("websocket");
+        } else if (name == "sec-websocket-key") {
+            key = value;
+        } else if (name == "sec-websocket-version") {
+            versionOk = value == "13";
+        }
+    }
+
+    if (!isGet || !upgrade || !versionOk || key.isEmpty()) {
+        qDebug() << "Rejecting WebSocket handshake from" << socket->peerAddress().toString();
+        socket->write("HTTP/1.1 400 Bad Request\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        socket->disconnectFromHost();
+        return false;
+    }
+
+    socket->write("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                  "Sec-WebSocket-Accept: " + acceptKey(key) + "\r\n\r\n");
+    connection.inbound.remove(0, end + 4);
+    connection.upgraded = true;
+
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair(this);
+    connection.pipe = pipe.first;
+    m_pipeToSocket[pipe.first] = socket;
+    connect(pipe.first, &QTcpSocket::readyRead, this, &WebSocketGateway::onPipeReadyRead);
+    connect(pipe.first, &QTcpSocket::disconnected, this, &WebSocketGateway::onPipeDisconnected);
+    connect(socket, &QTcpSocket::bytesWritten, this, &WebSocketGateway::onSocketBytesWritten);
+    // Sign-in throttling and the admin listings go by the browser's address, not the gateway's.
+    pipe.second->setPeerEndpoint(socket->peerAddress(), socket->peerPort());
+    m_server->acceptConnection(pipe.second);
+    return true;
+}
+
+void WebSocketGateway::processFrames(QTcpSocket* socket, Connection& connection) {
+    // Same limit as a TCP client gets, so a reload of maxFrameSize applies here too.
+    const quint64 maxMessage = m_server->maxFrameSize();
+    qsizetype offset = 0;
+
+    while (true) {
+        WireFrame frame;
+        DecodeResult result = decodeFrame(connection.inbound, offset, frame, maxMessage, true);
+        if (result == NeedMoreData) break;
+        if (result != Decoded) {
+            closeConnection(socket, result == TooLarge ? kCloseTooLarge : kCloseProtocolError);
+            return;
+        }
+
+        if (frame.opcode & 0x8) {
+            if (!frame.fin || frame.payload.size() > 125) {
+                closeConnection(socket, kCloseProtocolError);
+                return;
+            }
+            if (frame.opcode == Close) {
+                closeConnection(socket, kCloseNormal);
+                return;
+            }
+            if (frame.opcode == Ping) {
+                socket->write(encodeFrame(Pong, frame.payload));
+            }
+            continue;
+        }
+
+        if (frame.opcode == Continuation) {
+            if (connection.messageOpcode == 0 ||
+                static_cast<quint64>(connection.message.size() + frame.payload.size()) > maxMessage) {
+                closeConnection(socket, connection.messageOpcode == 0 ? kCloseProtocolError : kCloseTooLarge);
+                return;
+            }
+            connection.message += frame.payload;
+        } else if ((frame.opcode == Text || frame.opcode == Binary) && connection.messageOpcode == 0) {
+            connection.messageOpcode = frame.opcode;
+            connection.message = std::move(frame.payload);
+        } else {
+            closeConnection(socket, kCloseProtocolError);
+            return;
+        }
+
+        if (!frame.fin) continue;
+
+        // The message is the frame payload; it only needs the length prefix the server expects.
+        char prefix[sizeof(quint32)];
+        qToBigEndian(static_cast<quint32>(connection.message.size()), prefix);
+        connection.pipe->write(prefix, sizeof(prefix));
+        connection.pipe->write(connection.message);
+
+        connection.replyOpcode = connection.messageOpcode;
+        connection.messageOpcode = 0;
+        connection.message.clear();
+    }
+
+    connection.inbound.remove(0, offset);
+}
+
+void WebSocketGateway::onPipeReadyRead() {
+    QTcpSocket* pipe = qobject_cast<QTcpSocket*>(sender());
+    QTcpSocket* socket = m_pipeToSocket.value(pipe);
+    if (!socket || !m_connections.contains(socket)) return;
+
+    forwardFromPipe(socket, m_connections[socket]);
+}
+
+void WebSocketGateway::onSocketBytesWritten() {
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket || !m_connections.contains(socket)) return;
+
+    Connection& connection = m_connections[socket];
+    if (connection.pipe) {
+        forwardFromPipe(socket, connection);
+    }
+}
+
+void WebSocketGateway::forwardFromPipe(QTcpSocket* socket, Connection& connection) {
+    // Frames stay in the pipe while the client's socket is above the server's high-water mark;
+    // its bytesWritten picks them up again once the kernel has taken some. A frame already begun
+    // is always read to the end: the server only writes the rest of it once the pipe drains.
+    while (connection.expectedSize > 0 || socket->bytesToWrite() < m_server->socketHighWater()) {
+        if (connection.expectedSize == 0) {
+            char prefix[sizeof(quint32)];
+            if (connection.pipe->bytesAvailable() < static_cast<qint64>(sizeof(prefix))) break;
+            connection.pipe->read(prefix, sizeof(prefix));
+            // The other end is our own server, so its frames are not size-limited here.
+            connection.expectedSize = qFromBigEndian<quint32>(prefix);
+            connection.reply.reserve(connection.expectedSize);
+        }
+
+        connection.reply += connection.pipe->read(connection.expectedSize - connection.reply.size());
+        if (connection.reply.size() < static_cast<qsizetype>(connection.expectedSize)) break;
+
+        // File chunks are binary whatever the client last sent; a text frame must be valid UTF-8.
+        quint8 opcode = FileChunk::isChunk(connection.reply) ? quint8(Binary) : connection.replyOpcode;
+        socket->write(frameHeader(opcode, static_cast<quint64>(connection.reply.size())));
+        socket->write(connection.reply);
+        connection.reply.clear();
+        connection.expectedSize = 0;
+    }
+}
+
+void WebSocketGateway::onPipeDisconnected() {
+    QTcpSocket* socket = m_pipeToSocket.value(qobject_cast<QTcpSocket*>(sender()));
+    if (socket) {
+        closeConnection(socket, kCloseNormal);
+    }
+}
+
+void WebSocketGateway::closeConnection(QTcpSocket* socket, quint16 code) {
+    if (socket->state() != QAbstractSocket::ConnectedState) return;
+
+    char payload[sizeof(quint16)];
+    qToBigEndian(code, payload);
+    socket->write(encodeFrame(Close, QByteArray(payload, sizeof(payload))));
+    socket->disconnectFromHost();
+}
+
+void WebSocketGateway::onSocketDisconnected() {
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket) return;
+
+    Connection connection = m_connections.take(socket);
+    if (connection.pipe) {
+        m_pipeToSocket.remove(connection.pipe);
+        connection.pipe->disconnect(this);
+        connection.pipe->close();
+        connection.pipe->deleteLater();
+    }
+    socket->deleteLater();
+}
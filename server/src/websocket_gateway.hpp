@@ -0,0 +1,89 @@
+#pragma once
+#include <QObject>
+#include <QHash>
+#include <QByteArray>
+#include <QHostAddress>
+
+class QTcpServer;
+class QTcpSocket;
+class Server;
+
+// Accepts WebSocket clients (RFC 6455) and hands each one to the server as an ordinary
+// connection over an in-memory pipe, so they go through the same processClientMessage path as
+// TCP clients. Every WebSocket message is one protocol frame: its payload is forwarded as-is
+// behind a length prefix, and server frames go back out as one message each. Replies use the
+// opcode of the client's last message, so text-only clients such as browsers get text frames.
+class WebSocketGateway : public QObject {
+    Q_OBJECT
+
+public:
+    enum Opcode : quint8 {
+        Continuation = 0x0,
+        Text = 0x1,
+        Binary = 0x2,
+        Close = 0x8,
+        Ping = 0x9,
+        Pong = 0xA
+    };
+
+    enum DecodeResult {
+        NeedMoreData,
+        Decoded,
+        Malformed,
+        TooLarge
+    };
+
+    struct WireFrame {
+        bool fin = false;
+        quint8 opcode = 0;
+        QByteArray payload;
+    };
+
+    static constexpr int kMaxHandshakeSize = 8192;
+    static constexpr quint16 kCloseNormal = 1000;
+    static constexpr quint16 kCloseProtocolError = 1002;
+    static constexpr quint16 kCloseTooLarge = 1009;
+
+    explicit WebSocketGateway(Server* server, QObject* parent = nullptr);
+    ~WebSocketGateway();
+
+    bool listen(const QHostAddress& address, quint16 port);
+    void close();
+    quint16 serverPort() const;
+    int connectionCount() const { return m_connections.size(); }
+
+    static QByteArray acceptKey(const QByteArray& key);
+    static QByteArray encodeFrame(quint8 opcode, const QByteArray& payload, bool masked = false);
+    static DecodeResult decodeFrame(const QByteArray& data, qsizetype& offset, WireFrame& frame, quint64 maxPayload,
+                                    bool requireMask);
+
+private slots:
+    void onNewConnection();
+    void onSocketReadyRead();
+    void onSocketDisconnected();
+    void onSocketBytesWritten();
+    void onPipeReadyRead();
+    void onPipeDisconnected();
+
+private:
+    struct Connection {
+        QTcpSocket* pipe = nullptr;
+        bool upgraded = false;
+        QByteArray inbound;
+        QByteArray message;
+        quint8 messageOpcode = 0;
+        quint8 replyOpcode = Binary;
+        QByteArray reply;
+        quint32 expectedSize = 0;
+    };
+
+    bool completeHandshake(QTcpSocket* socket, Connection& connection);
+    void processFrames(QTcpSocket* socket, Connection& connection);
+    void forwardFromPipe(QTcpSocket* socket, Connection& connection);
+    void closeConnection(QTcpSocket* socket, quint16 code);
+
+    Server* m_server;
+    QTcpServer* m_listener;
+    QHash<QTcpSocket*, Connection> m_connections;
+    QHash<QTcpSocket*, QTcpSocket*> m_pipeToSocket;
+};
@@ -1,13 +1,28 @@
 #include "client_test.hpp"
 #include "testable_client.hpp"
 #include "ui/client_widget.hpp"
+#include "network/network_client.hpp"
+#include "network/e2e_session.hpp"
+#include "storage/message_cache.hpp"
+#include "storage/search_index.hpp"
+#include "pipe_transport.hpp"
+#include "file_chunk.hpp"
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QtEndian>
 #include <QTest>
 #include <QSignalSpy>
 #include <QMessageBox>
 #include <QTimer>
+#include <QTemporaryDir>
+#include <QStandardPaths>
+#include <QFile>
+#include <QDir>
 #include <QDebug>
 
 void ClientTest::init() {
+    // Keeps the message cache out of the real user's data directory.
+    QStandardPaths::setTestModeEnabled(true);
     client = new TestableClient();
     QVERIFY(client != nullptr);
     QVERIFY(client->clientWidget() != nullptr);
@@ -213,6 +228,615 @@ void ClientTest::testInterlocutorDisconnected() {
     QVERIFY(chatText.contains("testFriend disconnected"));
 }
 
+void ClientTest::testReconnectingKeepsChat() {
+    client->setTestClientName("testUser");
+    client->setTestInterlocutorName("testFriend");
+
+    client->simulateAuthSuccess("testUser", "testFriend", true);
+    QTest::qWait(100);
+
+    client->simulateReconnecting(1, 800);
+    QTest::qWait(100);
+
+    QVERIFY(client->getStatusLabel()->text().contains("reconnecting"));
+    QVERIFY(client->getChatGroup()->isEnabled());
+    QVERIFY(!client->getChatDisplay()->toPlainText().contains("Disconnected"));
+}
+
+void ClientTest::testSessionResumed() {
+    client->setTestClientName("testUser");
+    client->setTestInterlocutorName("testFriend");
+
+    client->simulateAuthSuccess("testUser", "testFriend", true);
+    client->simulateReconnecting(1, 800);
+    QTest::qWait(100);
+
+    client->simulateSessionResumed("testFriend", true);
+    QTest::qWait(100);
+
+    QVERIFY(client->getStatusLabel()->text().contains("Connected"));
+    QVERIFY(client->getMessageInput()->isEnabled());
+    QCOMPARE(client->getChatDisplay()->toPlainText().count("Successfully authenticated"), 1);
+}
+
+void ClientTest::testReconnectDelayBackoff() {
+    for (int attempt = 1; attempt <= 20; ++attempt) {
+        int cap = qMin(NetworkClient::kReconnectBaseDelayMs << qMin(attempt - 1, 6), NetworkClient::kReconnectMaxDelayMs);
+        int delay = NetworkClient::reconnectDelay(attempt);
+        QVERIFY(delay >= cap / 2);
+        QVERIFY(delay <= cap);
+    }
+}
+
+void ClientTest::testMessageShownAfterAck() {
+    client->setTestClientName("testUser");
+    client->setTestInterlocutorName("testFriend");
+
+    client->simulateAuthSuccess("testUser", "testFriend", true);
+    QTest::qWait(100);
+
+    client->setTestMessageInput("Pipelined message");
+    client->simulateSendButtonClick();
+
+    QVERIFY(!client->getChatDisplay()->toPlainText().contains("Pipelined message"));
+
+    client->simulateMessagesAcknowledged(1);
+    QTest::qWait(100);
+
+    QString chatText = client->getChatDisplay()->toPlainText();
+    QVERIFY(chatText.contains("You:"));
+    QVERIFY(chatText.contains("Pipelined message"));
+}
+
+void ClientTest::testMessageDelivered() {
+    client->simulateMessagesDelivered(1);
+    QTest::qWait(100);
+
+    QVERIFY(client->getDeliveryLabel()->text().contains("Delivered"));
+}
+
+void ClientTest::testConversationTabs() {
+    client->setTestClientName("testUser");
+    client->setTestInterlocutorName("testFriend");
+
+    client->simulateAuthSuccess("testUser", "testFriend", true);
+    QTest::qWait(100);
+
+    // A message from anyone but the interlocutor opens a tab of its own.
+    client->simulateMessageReceived("carol", "Hi from carol", "12:00:00");
+    QTextEdit* carolDisplay = client->getConversationDisplay("carol");
+    QVERIFY(carolDisplay != nullptr);
+    QVERIFY(carolDisplay->toPlainText().contains("Hi from carol"));
+    QVERIFY(!client->getChatDisplay()->toPlainText().contains("Hi from carol"));
+
+    client->clientWidget()->openConversationTab("carol");
+    QCOMPARE(client->clientWidget()->currentConversation(), QString("carol"));
+    QVERIFY(client->getMessageInput()->isEnabled());
+
+    client->setTestMessageInput("Hi carol");
+    client->simulateSendButtonClick();
+    client->simulateMessagesAcknowledged(1);
+    QVERIFY(carolDisplay->toPlainText().contains("Hi carol"));
+    QVERIFY(!client->getChatDisplay()->toPlainText().contains("Hi carol"));
+
+    // The paired conversation stays in the first tab.
+    client->clientWidget()->openConversationTab("testFriend");
+    QCOMPARE(client->clientWidget()->currentConversation(), QString("testFriend"));
+    client->simulateMessageReceived("testFriend", "Back here", "12:00:01");
+    QVERIFY(client->getChatDisplay()->toPlainText().contains("Back here"));
+}
+
+void ClientTest::testTypingIndicator() {
+    client->setTestClientName("testUser");
+    client->setTestInterlocutorName("testFriend");
+    client->simulateAuthSuccess("testUser", "testFriend", true);
+    QTest::qWait(100);
+
+    // Only the conversation on screen shows its notice; a message from the typist clears it.
+    client->clientWidget()->showTyping("carol");
+    QVERIFY(client->getTypingLabel()->text().isEmpty());
+    client->clientWidget()->showTyping("testFriend");
+    QCOMPARE(client->getTypingLabel()->text(), QString("testFriend is typing..."));
+
+    client->simulateMessageReceived("testFriend", "Hello", "12:00:00");
+    QVERIFY(client->getTypingLabel()->text().isEmpty());
+
+    client->clientWidget()->openConversationTab("carol");
+    QCOMPARE(client->getTypingLabel()->text(), QString("carol is typing..."));
+
+    // Edits are sent at most once per interval.
+    QTcpSocket* serverEnd = nullptr;
+    PipeTransport transport([&serverEnd](QTcpSocket* socket) {serverEnd = socket;});
+
+    NetworkClient networkClient;
+    networkClient.setTransport(&transport);
+    QVERIFY(networkClient.connectToServer("typing-host", 0));
+    QVERIFY(serverEnd != nullptr);
+
+    networkClient.sendTyping();
+    QTest::qWait(50);
+    QVERIFY(serverEnd->readAll().isEmpty());
+
+    QSignalSpy authSpy(&networkClient, &NetworkClient::authenticationSuccess);
+    QJsonObject authSuccess{{"type", "auth_success"}, {"clientName", "alice"}, {"interlocutorName", "bob"}};
+    QByteArray payload = QJsonDocument(authSuccess).toJson(QJsonDocument::Compact);
+    char prefix[sizeof(quint32)];
+    qToBigEndian(static_cast<quint32>(payload.size()), prefix);
+    serverEnd->write(prefix, sizeof(prefix));
+    serverEnd->write(payload);
+    QTRY_COMPARE(authSpy.count(), 1);
+
+    QByteArray received;
+    for (int i = 0; i < 5; ++i) {
+        networkClient.sendTyping();
+        networkClient.sendTyping("carol");
+    }
+    QTRY_COMPARE((received += serverEnd->readAll()).count("\"type\":\"typing\""), 2);
+    QTest::qWait(50);
+    received += serverEnd->readAll();
+    QCOMPARE(received.count("\"type\":\"typing\""), 2);
+    QCOMPARE(received.count("\"to\":\"carol\""), 1);
+}
+
+void ClientTest::testSendMessagesPacksBatch() {
+    QTcpSocket* serverEnd = nullptr;
+    PipeTransport transport([&serverEnd](QTcpSocket* socket) {serverEnd = socket;});
+
+    NetworkClient networkClient;
+    networkClient.setTransport(&transport);
+    QVERIFY(networkClient.connectToServer("bot-host", 0));
+    QVERIFY(serverEnd != nullptr);
+
+    // Two calls in the same event loop pass end up in one frame.
+    networkClient.sendMessages({{"alice", "Build passed"}, {"bob", "Build passed"}});
+    networkClient.sendMessages({{"carol", "Deploy started"}});
+
+    QByteArray received;
+    auto frameComplete = [&]() {
+        received += serverEnd->readAll();
+        return received.size() >= 4 && received.size() >= 4 + qFromBigEndian<quint32>(received.constData());
+    };
+    QTRY_VERIFY(frameComplete());
+    QTest::qWait(50);
+    received += serverEnd->readAll();
+    QCOMPARE(received.size(), 4 + static_cast<qsizetype>(qFromBigEndian<quint32>(received.constData())));
+
+    QJsonObject batch = QJsonDocument::fromJson(received.mid(4)).object();
+    QCOMPARE(batch["type"].toString(), QString("message_batch"));
+    QCOMPARE(batch["id"].toInteger(), qint64(1));
+    QJsonArray entries = batch["messages"].toArray();
+    QCOMPARE(entries.size(), 3);
+    QCOMPARE(entries[0].toObject()["to"].toString(), QString("alice"));
+    QCOMPARE(entries[2].toObject()["text"].toString(), QString("Deploy started"));
+
+    delete serverEnd;
+}
+
+void ClientTest::testSendMessagesSplitsLargeBatch() {
+    QTcpSocket* serverEnd = nullptr;
+    PipeTransport transport([&serverEnd](QTcpSocket* socket) {serverEnd = socket;});
+
+    NetworkClient networkClient;
+    networkClient.setTransport(&transport);
+    QVERIFY(networkClient.connectToServer("bot-host", 0));
+    QVERIFY(serverEnd != nullptr);
+    QSignalSpy rejectedSpy(&networkClient, &NetworkClient::messageBatchRejected);
+
+    // Three long reports fit no two to a frame; the log dump fits no frame at all.
+    QString report(NetworkClient::kMaxBatchBytes * 2 / 3, 'r');
+    QString dump(NetworkClient::kMaxFrameSize, 'd');
+    networkClient.sendMessages({{"alice", report}, {"bob", report}, {"carol", dump}, {"dave", report}});
+
+    QList<QJsonObject> batches;
+    QByteArray received;
+    quint32 largestFrame = 0;
+    QTRY_VERIFY([&]() {
+        received += serverEnd->readAll();
+        while (received.size() >= 4 && received.size() >= 4 + qFromBigEndian<quint32>(received.constData())) {
+            quint32 size = qFromBigEndian<quint32>(received.constData());
+            largestFrame = qMax(largestFrame, size);
+            batches.append(QJsonDocument::fromJson(received.mid(4, size)).object());
+            received.remove(0, 4 + size);
+        }
+        return batches.size() == 3;
+    }());
+    QVERIFY(largestFrame <= NetworkClient::kMaxFrameSize);
+
+    QStringList recipients;
+    for (const QJsonObject& batch : std::as_const(batches)) {
+        QCOMPARE(batch["type"].toString(), QString("message_batch"));
+        QCOMPARE(batch["messages"].toArray().size(), 1);
+        recipients << batch["messages"].toArray()[0].toObject()["to"].toString();
+    }
+    QCOMPARE(recipients, QStringList({"alice", "bob", "dave"}));
+
+    QCOMPARE(rejectedSpy.count(), 1);
+    QCOMPARE(rejectedSpy.first().at(1).toString(), QString("carol"));
+
+    delete serverEnd;
+}
+
+void ClientTest::testEndToEndEncryption() {
+    if (!E2eSession::isSupported()) {
+        QSKIP("Built without OpenSSL");
+    }
+
+    // The test plays the server: it relays frames between two clients and stamps the sender.
+    QTcpSocket* aliceEnd = nullptr;
+    QTcpSocket* bobEnd = nullptr;
+    PipeTransport aliceTransport([&aliceEnd](QTcpSocket* socket) {aliceEnd = socket;});
+    PipeTransport bobTransport([&bobEnd](QTcpSocket* socket) {bobEnd = socket;});
+
+    NetworkClient alice;
+    NetworkClient bob;
+    alice.setTransport(&aliceTransport);
+    bob.setTransport(&bobTransport);
+    QVERIFY(alice.connectToServer("e2e-host", 0));
+    QVERIFY(bob.connectToServer("e2e-host", 0));
+
+    auto writeFrame = [](QTcpSocket* socket, const QJsonObject& frame) {
+        QByteArray payload = QJsonDocument(frame).toJson(QJsonDocument::Compact);
+        char prefix[sizeof(quint32)];
+        qToBigEndian(static_cast<quint32>(payload.size()), prefix);
+        socket->write(prefix, sizeof(prefix));
+        socket->write(payload);
+    };
+    QHash<QTcpSocket*, QByteArray> pending;
+    auto nextFrame = [&](QTcpSocket* socket, const QString& type) {
+        QByteArray& buffer = pending[socket];
+        while (true) {
+            buffer += socket->readAll();
+            if (buffer.size() < 4) return QJsonObject();
+            quint32 size = qFromBigEndian<quint32>(buffer.constData());
+            if (buffer.size() < 4 + static_cast<qsizetype>(size)) return QJsonObject();
+            QJsonObject frame = QJsonDocument::fromJson(buffer.mid(4, size)).object();
+            buffer.remove(0, 4 + size);
+            if (frame["type"].toString() == type) return frame;
+        }
+    };
+    auto relayKey = [](QJsonObject frame, const QString& sender) {
+        frame.remove("to");
+        frame["sender"] = sender;
+        return frame;
+    };
+
+    alice.sendAuthRequest("alice", "bob");
+    bob.sendAuthRequest("bob", "alice");
+    writeFrame(aliceEnd, {{"type", "auth_success"}, {"clientName", "alice"}, {"interlocutorName", "bob"}});
+    writeFrame(bobEnd, {{"type", "auth_success"}, {"clientName", "bob"}, {"interlocutorName", "alice"},
+                        {"interlocutorConnected", true}});
+    writeFrame(aliceEnd, {{"type", "interlocutor_connected"}, {"interlocutorName", "bob"}});
+
+    QSignalSpy aliceSpy(&alice, &NetworkClient::encryptionEstablished);
+    QSignalSpy bobSpy(&bob, &NetworkClient::encryptionEstablished);
+    QJsonObject offer;
+    QTRY_VERIFY(!(offer = nextFrame(aliceEnd, "key_exchange")).isEmpty());
+    QCOMPARE(offer["ack"].toBool(), false);
+    writeFrame(bobEnd, relayKey(offer, "alice"));
+
+    // Until bob answers, what alice writes waits instead of going out in the clear.
+    alice.sendMessage("sent early");
+    QTest::qWait(50);
+    QVERIFY(nextFrame(aliceEnd, "message").isEmpty());
+
+    QJsonObject answer;
+    QTRY_VERIFY(!(answer = nextFrame(bobEnd, "key_exchange")).isEmpty());
+    QCOMPARE(answer["ack"].toBool(), true);
+    writeFrame(aliceEnd, relayKey(answer, "bob"));
+
+    QTRY_COMPARE(aliceSpy.count(), 1);
+    QCOMPARE(bobSpy.count(), 1);
+    QCOMPARE(aliceSpy[0][1].toString(), bobSpy[0][1].toString());
+    QVERIFY(alice.isEncryptedWith("bob"));
+
+    QJsonObject early;
+    QTRY_VERIFY(!(early = nextFrame(aliceEnd, "message")).isEmpty());
+    QVERIFY(early["encrypted"].toBool());
+    QCOMPARE(early["id"].toInteger(), qint64(1));
+
+    // What goes through the server is opaque, and only the right peer can open it.
+    QSignalSpy received(&bob, &NetworkClient::messageReceived);
+    alice.sendMessage("meet at noon");
+    QJsonObject sent;
+    QTRY_VERIFY(!(sent = nextFrame(aliceEnd, "message")).isEmpty());
+    QVERIFY(sent["encrypted"].toBool());
+    QVERIFY(!sent["text"].toString().contains("noon"));
+
+    QJsonObject relayed{{"type", "message"}, {"sender", "alice"}, {"text", sent.value("text")}, {"encrypted", true},
+                        {"timestamp", "12:00:00"}, {"seq", 1}};
+    writeFrame(bobEnd, relayed);
+    QTRY_COMPARE(received.count(), 1);
+    QCOMPARE(received[0][1].toString(), QString("meet at noon"));
+
+    // A message passed off as coming from someone else fails, as does a changed byte.
+    relayed["sender"] = "carol";
+    writeFrame(bobEnd, relayed);
+    QByteArray tampered = QByteArray::fromBase64(sent["text"].toString().toLatin1());
+    tampered[tampered.size() - 1] = static_cast<char>(tampered[tampered.size() - 1] ^ 1);
+    relayed["sender"] = "alice";
+    relayed["text"] = QString::fromLatin1(tampered.toBase64());
+    relayed["seq"] = 2;
+    writeFrame(bobEnd, relayed);
+    QTRY_COMPARE(received.count(), 3);
+    QVERIFY(!received[1][1].toString().contains("noon"));
+    QVERIFY(!received[2][1].toString().contains("noon"));
+
+    // Nor is plaintext shown as coming from a peer whose messages are sealed.
+    writeFrame(bobEnd, {{"type", "message"}, {"sender", "alice"}, {"text", "in the clear"}, {"timestamp", "12:00:01"},
+                        {"seq", 3}});
+    QTRY_COMPARE(received.count(), 4);
+    QVERIFY(!received[3][1].toString().contains("in the clear"));
+
+    delete aliceEnd;
+    delete bobEnd;
+}
+
+void ClientTest::testFileTransferOverPipe() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    QTcpSocket* serverEnd = nullptr;
+    PipeTransport transport([&serverEnd](QTcpSocket* socket) {serverEnd = socket;});
+
+    NetworkClient networkClient;
+    networkClient.setTransport(&transport);
+    networkClient.setDownloadDirectory(dir.path());
+    QVERIFY(networkClient.connectToServer("file-host", 0));
+    QVERIFY(serverEnd != nullptr);
+
+    auto writeFrame = [&serverEnd](const QByteArray& payload) {
+        char prefix[sizeof(quint32)];
+        qToBigEndian(static_cast<quint32>(payload.size()), prefix);
+        serverEnd->write(prefix, sizeof(prefix));
+        serverEnd->write(payload);
+    };
+    auto writeJson = [&writeFrame](const QJsonObject& obj) {
+        writeFrame(QJsonDocument(obj).toJson(QJsonDocument::Compact));
+    };
+
+    QSignalSpy authSpy(&networkClient, &NetworkClient::authenticationSuccess);
+    writeJson({{"type", "auth_success"}, {"clientName", "alice"}, {"interlocutorName", "bob"}, {"sessionToken", "token"}});
+    QTRY_COMPARE(authSpy.count(), 1);
+
+    // Sending: once the server assigns a transfer id the file goes out as chunk frames.
+    QByteArray content(100 * 1024, 'x');
+    QString sourcePath = dir.filePath("report.bin");
+    QFile source(sourcePath);
+    QVERIFY(source.open(QIODevice::WriteOnly));
+    source.write(content);
+    source.close();
+
+    quint64 ref = networkClient.sendFile(sourcePath);
+    QVERIFY(ref != 0);
+    writeJson({{"type", "file_ready"}, {"ref", static_cast<qint64>(ref)}, {"transferId", 7}, {"offset", 0},
+               {"window", FileChunk::kWindowBytes}});
+
+    QByteArray outbound;
+    QByteArray uploaded;
+    auto uploadComplete = [&]() {
+        outbound += serverEnd->readAll();
+        while (outbound.size() >= 4 && outbound.size() >= 4 + qFromBigEndian<quint32>(outbound.constData())) {
+            QByteArray frame = outbound.mid(4, qFromBigEndian<quint32>(outbound.constData()));
+            outbound.remove(0, 4 + frame.size());
+
+            FileChunk chunk;
+            if (FileChunk::parse(frame, chunk) && chunk.transferId == 7 && chunk.offset == uploaded.size()) {
+                uploaded += frame.mid(FileChunk::kHeaderSize);
+            }
+        }
+        return uploaded.size() == content.size();
+    };
+    QTRY_VERIFY(uploadComplete());
+    QCOMPARE(uploaded, content);
+
+    QSignalSpy sentSpy(&networkClient, &NetworkClient::fileSent);
+    writeJson({{"type", "file_progress"}, {"transferId", 7}, {"offset", content.size()}});
+    QTRY_COMPARE(sentSpy.count(), 1);
+    QCOMPARE(sentSpy.first().at(0).toULongLong(), ref);
+
+    // Receiving: once accepted, chunks go into a .part file that takes the offered name when complete.
+    QSignalSpy offeredSpy(&networkClient, &NetworkClient::fileOffered);
+    QSignalSpy receivedSpy(&networkClient, &NetworkClient::fileReceived);
+    writeJson({{"type", "file_offer"}, {"transferId", 8}, {"sender", "bob"}, {"name", "../photo.jpg"}, {"size", 6}});
+    QTRY_COMPARE(offeredSpy.count(), 1);
+    QCOMPARE(offeredSpy.first().at(2).toString(), QString("photo.jpg"));
+    QVERIFY(networkClient.acceptFile(8));
+    QTRY_VERIFY((outbound += serverEnd->readAll()).contains("\"type\":\"file_accept\""));
+
+    QByteArray chunk(FileChunk::kHeaderSize, Qt::Uninitialized);
+    FileChunk::writeHeader(chunk.data(), 8, 0);
+    writeFrame(chunk + "pixels");
+
+    QTRY_COMPARE(receivedSpy.count(), 1);
+    QString path = receivedSpy.first().at(1).toString();
+    QCOMPARE(path, dir.filePath("photo.jpg"));
+
+    QFile saved(path);
+    QVERIFY(saved.open(QIODevice::ReadOnly));
+    QCOMPARE(saved.readAll(), QByteArray("pixels"));
+
+    delete serverEnd;
+}
+
+void ClientTest::testFileOfferNeedsAcceptance() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    QTcpSocket* serverEnd = nullptr;
+    PipeTransport transport([&serverEnd](QTcpSocket* socket) {serverEnd = socket;});
+
+    NetworkClient networkClient;
+    networkClient.setTransport(&transport);
+    networkClient.setDownloadDirectory(dir.path());
+    networkClient.setMaxIncomingFileSize(1024);
+    QVERIFY(networkClient.connectToServer("file-host", 0));
+    QVERIFY(serverEnd != nullptr);
+
+    auto writeFrame = [&serverEnd](const QByteArray& payload) {
+        char prefix[sizeof(quint32)];
+        qToBigEndian(static_cast<quint32>(payload.size()), prefix);
+        serverEnd->write(prefix, sizeof(prefix));
+        serverEnd->write(payload);
+    };
+    auto writeJson = [&writeFrame](const QJsonObject& obj) {
+        writeFrame(QJsonDocument(obj).toJson(QJsonDocument::Compact));
+    };
+
+    // Nothing is written for an offer nobody accepted, not even for chunks that arrive anyway.
+    QSignalSpy offeredSpy(&networkClient, &NetworkClient::fileOffered);
+    writeJson({{"type", "file_offer"}, {"transferId", 3}, {"sender", "bob"}, {"name", "notes.txt"}, {"size", 5}});
+    QTRY_COMPARE(offeredSpy.count(), 1);
+    QByteArray chunk(FileChunk::kHeaderSize, Qt::Uninitialized);
+    FileChunk::writeHeader(chunk.data(), 3, 0);
+    writeFrame(chunk + "notes");
+    QTest::qWait(50);
+    QVERIFY(QDir(dir.path()).isEmpty());
+
+    networkClient.declineFile(3);
+    QByteArray outbound;
+    QTRY_VERIFY((outbound += serverEnd->readAll()).contains("\"type\":\"file_cancel\""));
+    QVERIFY(!networkClient.acceptFile(3));
+
+    // Offers over the limit are turned down without asking.
+    QSignalSpy failedSpy(&networkClient, &NetworkClient::fileReceiveFailed);
+    writeJson({{"type", "file_offer"}, {"transferId", 4}, {"sender", "bob"}, {"name", "disk.img"}, {"size", 4096}});
+    QTRY_COMPARE(failedSpy.count(), 1);
+    QCOMPARE(failedSpy.first().at(1).toString(), QString("File too large"));
+    QCOMPARE(offeredSpy.count(), 1);
+    QVERIFY(!networkClient.acceptFile(4));
+
+    delete serverEnd;
+}
+
+void ClientTest::testMessageCachePaging() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    MessageCache cache(dir.path());
+    QVERIFY(cache.open("alice", "bob/../carol"));
+    for (int i = 1; i <= 120; ++i) {
+        QVERIFY(cache.append({i % 2 ? "bob" : "alice", QString("message %1").arg(i), "12:00:00", quint64(i)}));
+    }
+    cache.close();
+
+    QVERIFY(cache.open("alice", "bob/../carol"));
+    QCOMPARE(cache.count(), qint64(120));
+    QCOMPARE(cache.lastSeq(), quint64(120));
+
+    QList<MessageCache::Entry> newest = cache.page(cache.count());
+    QCOMPARE(newest.size(), MessageCache::kPageSize);
+    QCOMPARE(newest.first().text, QString("message 71"));
+    QCOMPARE(newest.last().text, QString("message 120"));
+
+    QList<MessageCache::Entry> oldest = cache.page(20);
+    QCOMPARE(oldest.size(), 20);
+    QCOMPARE(oldest.first().text, QString("message 1"));
+    QCOMPARE(oldest.first().sender, QString("bob"));
+    QVERIFY(cache.page(0).isEmpty());
+
+    cache.setSessionToken("token");
+    QCOMPARE(cache.sessionToken(), QString("token"));
+#ifndef Q_OS_WIN
+    const QFileDevice::Permissions others = QFileDevice::ReadGroup | QFileDevice::WriteGroup | QFileDevice::ExeGroup
+                                          | QFileDevice::ReadOther | QFileDevice::WriteOther | QFileDevice::ExeOther;
+    QCOMPARE(QFile::permissions(dir.filePath("alice")) & others, QFileDevice::Permissions());
+    QCOMPARE(QFile::permissions(dir.filePath("alice/bob%2F..%2Fcarol.session")) & others, QFileDevice::Permissions());
+#endif
+    QVERIFY(cache.open("alice", "dave"));
+    QVERIFY(cache.sessionToken().isEmpty());
+}
+
+void ClientTest::testMessageCacheRecoversTail() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    MessageCache cache(dir.path());
+    QVERIFY(cache.open("alice", "bob"));
+    for (int i = 1; i <= 3; ++i) {
+        QVERIFY(cache.append({"bob", QString("message %1").arg(i), "12:00:00", quint64(i)}));
+    }
+    cache.close();
+
+    // A crash between the log and index writes, followed by one in the middle of a record.
+    QFile index(dir.filePath("alice/bob.idx"));
+    QVERIFY(index.resize(2 * sizeof(quint64) + 3));
+    QFile log(dir.filePath("alice/bob.log"));
+    QVERIFY(log.open(QIODevice::Append));
+    log.write(QByteArray("\0\0\0\x40{\"sender\"", 13));
+    log.close();
+
+    QVERIFY(cache.open("alice", "bob"));
+    QCOMPARE(cache.count(), qint64(3));
+    QCOMPARE(cache.lastSeq(), quint64(3));
+    QCOMPARE(cache.page(cache.count()).last().text, QString("message 3"));
+
+    QVERIFY(cache.append({"bob", "message 4", "12:00:01", 4}));
+    QCOMPARE(cache.page(cache.count()).last().text, QString("message 4"));
+}
+
+void ClientTest::testSearchIndexRanking() {
+    SearchIndex index;
+    QCOMPARE(index.add("Lunch at noon?"), quint32(0));
+    index.add("The deploy failed again");
+    index.add("Deploy, deploy, deploy! It failed");
+    index.add("Nothing to see here");
+    QCOMPARE(index.documentCount(), quint32(4));
+
+    QCOMPARE(SearchIndex::tokenize("Deploy, FAILED!"), QStringList({"deploy", "failed"}));
+
+    // Both documents have both words; the one repeating "deploy" ranks first.
+    QList<SearchIndex::Hit> hits = index.search("deploy failed", 0, 10);
+    QCOMPARE(hits.size(), 2);
+    QCOMPARE(hits[0].document, quint32(2));
+    QCOMPARE(hits[1].document, quint32(1));
+
+    QList<SearchIndex::Hit> second = index.search("deploy failed", 1, 1);
+    QCOMPARE(second.size(), 1);
+    QCOMPARE(second[0].document, quint32(1));
+    QVERIFY(index.search("deploy", 2, 10).isEmpty());
+    QVERIFY(index.search("dinner", 0, 10).isEmpty());
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QVERIFY(index.save(dir.filePath("index")));
+
+    SearchIndex loaded;
+    QVERIFY(loaded.load(dir.filePath("index")));
+    QCOMPARE(loaded.documentCount(), quint32(4));
+    QCOMPARE(loaded.search("noon", 0, 10).first().document, quint32(0));
+    QCOMPARE(loaded.add("deploy"), quint32(4));
+    QCOMPARE(loaded.search("deploy", 0, 10).size(), 3);
+}
+
+void ClientTest::testMessageCacheSearch() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    MessageCache cache(dir.path());
+    QVERIFY(cache.open("alice", "bob"));
+    for (int i = 0; i < 1000; ++i) {
+        QVERIFY(cache.append({"bob", i == 700 ? "the quarterly report is ready" : QString("status %1").arg(i), "12:00:00", quint64(i + 1)}));
+    }
+
+    // Indexing goes in slices; a search completes whatever is left.
+    QVERIFY(cache.indexPending(100));
+    QCOMPARE(cache.indexedCount(), qint64(100));
+
+    QList<MessageCache::SearchResult> results = cache.search("Quarterly report");
+    QCOMPARE(results.size(), 1);
+    QCOMPARE(results.first().index, qint64(700));
+    QCOMPARE(results.first().entry.text, QString("the quarterly report is ready"));
+    QCOMPARE(cache.indexedCount(), qint64(1000));
+    cache.close();
+
+    // The saved index is picked up again, and only new messages need indexing.
+    QVERIFY(cache.open("alice", "bob"));
+    QVERIFY(cache.append({"alice", "report received", "12:00:01", 1000}));
+    QVERIFY(!cache.indexPending());
+    QCOMPARE(cache.indexedCount(), qint64(1001));
+    QCOMPARE(cache.search("report").size(), 2);
+}
+
 void ClientTest::testInputValidation() {
     try {
         client->testValidateInput("user1", "user2");
@@ -250,3 +874,35 @@ void ClientTest::testEmptyFieldsValidation() {
         QVERIFY(error.contains("Fill in all fields"));
     }
 }
+
+void ClientTest::testServerAddressParsing() {
+    QString address;
+    quint16 port = 0;
+
+    client->testParseServerAddress("localhost", address, port);
+    QCOMPARE(address, QString("localhost"));
+    QCOMPARE(port, Client::kDefaultPort);
+
+    client->testParseServerAddress("tls:chat.example.com:7000", address, port);
+    QCOMPARE(address, QString("tls:chat.example.com"));
+    QCOMPARE(port, quint16(7000));
+
+    client->testParseServerAddress("[::1]:7001", address, port);
+    QCOMPARE(address, QString("::1"));
+    QCOMPARE(port, quint16(7001));
+
+    client->testParseServerAddress("::1", address, port);
+    QCOMPARE(address, QString("::1"));
+    QCOMPARE(port, Client::kDefaultPort);
+
+    client->testParseServerAddress("unix:/tmp/messenger.sock", address, port);
+    QCOMPARE(address, QString("unix:/tmp/messenger.sock"));
+
+    for (const QString& invalid : {QString("localhost:0"), QString("localhost:70000"), QString("localhost:"), QString(":5464")}) {
+        try {
+            client->testParseServerAddress(invalid, address, port);
+            QFAIL(qPrintable("Accepted " + invalid));
+        } catch (const std::exception&) {
+        }
+    }
+}
@@ -28,10 +28,27 @@ private slots:
     void testMessageReceived();
     void testInterlocutorConnected();
     void testInterlocutorDisconnected();
+    void testReconnectingKeepsChat();
+    void testSessionResumed();
+    void testReconnectDelayBackoff();
+    void testMessageShownAfterAck();
+    void testMessageDelivered();
+    void testConversationTabs();
+    void testTypingIndicator();
+    void testSendMessagesPacksBatch();
+    void testSendMessagesSplitsLargeBatch();
+    void testEndToEndEncryption();
+    void testFileTransferOverPipe();
+    void testFileOfferNeedsAcceptance();
+    void testMessageCachePaging();
+    void testMessageCacheRecoversTail();
+    void testSearchIndexRanking();
+    void testMessageCacheSearch();
 
     void testInputValidation();
     void testSelfInterlocutorValidation();
     void testEmptyFieldsValidation();
+    void testServerAddressParsing();
 
 private:
     TestableClient* client = nullptr;
@@ -66,6 +66,10 @@ QTextEdit* TestableClient::getChatDisplay() const {
     return m_widget->m_chatDisplay;
 }
 
+QTextEdit* TestableClient::getConversationDisplay(const QString& conversation) const {
+    return m_widget->m_conversationDisplays.value(conversation);
+}
+
 QLabel* TestableClient::getStatusLabel() const {
     return m_widget->m_statusLabel;
 }
@@ -82,6 +86,14 @@ QPushButton* TestableClient::getSendButton() const {
     return m_widget->m_sendButton;
 }
 
+QLabel* TestableClient::getDeliveryLabel() const {
+    return m_widget->m_deliveryLabel;
+}
+
+QLabel* TestableClient::getTypingLabel() const {
+    return m_widget->m_typingLabel;
+}
+
 void TestableClient::simulateNetworkConnected() {
     emit m_networkClient->connected();
 }
@@ -90,6 +102,14 @@ void TestableClient::simulateNetworkDisconnected() {
     emit m_networkClient->disconnected();
 }
 
+void TestableClient::simulateReconnecting(int attempt, int delayMs) {
+    emit m_networkClient->reconnecting(attempt, delayMs);
+}
+
+void TestableClient::simulateSessionResumed(const QString& interlocutorName, bool interlocutorConnected) {
+    emit m_networkClient->sessionResumed(interlocutorName, interlocutorConnected);
+}
+
 void TestableClient::simulateAuthSuccess(const QString& clientName, const QString& interlocutorName, bool interlocutorConnected) {
     emit m_networkClient->authenticationSuccess(clientName, interlocutorName, interlocutorConnected);
 }
@@ -102,6 +122,14 @@ void TestableClient::simulateMessageReceived(const QString& sender, const QStrin
     emit m_networkClient->messageReceived(sender, text, timestamp);
 }
 
+void TestableClient::simulateMessagesAcknowledged(quint64 upToId) {
+    emit m_networkClient->messagesAcknowledged(upToId);
+}
+
+void TestableClient::simulateMessagesDelivered(quint64 upToId) {
+    emit m_networkClient->messagesDelivered(upToId);
+}
+
 void TestableClient::simulateInterlocutorConnected(const QString& name) {
     emit m_networkClient->interlocutorConnected(name);
 }
@@ -113,3 +141,7 @@ void TestableClient::simulateInterlocutorDisconnected() {
 void TestableClient::testValidateInput(const QString& clientName, const QString& interlocutorName) {
     validateInput(clientName, interlocutorName);
 }
+
+void TestableClient::testParseServerAddress(const QString& serverAddress, QString& address, quint16& port) {
+    parseServerAddress(serverAddress, address, port);
+}
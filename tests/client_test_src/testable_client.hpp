@@ -27,18 +27,26 @@ public:
 
     QLineEdit* getMessageInput() const;
     QTextEdit* getChatDisplay() const;
+    QTextEdit* getConversationDisplay(const QString& conversation) const;
     QLabel* getStatusLabel() const;
     QGroupBox* getChatGroup() const;
     QLineEdit* getInterlocutorNameEdit() const;
     QPushButton* getSendButton() const;
+    QLabel* getDeliveryLabel() const;
+    QLabel* getTypingLabel() const;
 
     void simulateNetworkConnected();
     void simulateNetworkDisconnected();
+    void simulateReconnecting(int attempt, int delayMs);
+    void simulateSessionResumed(const QString& interlocutorName, bool interlocutorConnected);
     void simulateAuthSuccess(const QString& clientName,const QString& interlocutorName, bool interlocutorConnected);
     void simulateAuthError(const QString& error);
     void simulateMessageReceived(const QString& sender, const QString& text, const QString& timestamp);
+    void simulateMessagesAcknowledged(quint64 upToId);
+    void simulateMessagesDelivered(quint64 upToId);
     void simulateInterlocutorConnected(const QString& name);
     void simulateInterlocutorDisconnected();
 
     void testValidateInput(const QString& clientName, const QString& interlocutorName);
+    void testParseServerAddress(const QString& serverAddress, QString& address, quint16& port);
 };
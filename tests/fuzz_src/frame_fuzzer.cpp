@@ -0,0 +1,101 @@
+#include "server.hpp"
+#include "frame_reader.hpp"
+#include <QCoreApplication>
+#include <QBuffer>
+#include <QFile>
+#include <QLoggingCategory>
+#include <cstdint>
+#include <cstdio>
+
+// Feeds arbitrary bytes through the frame parser into Server::processClientMessage.
+// The first input byte picks the fragment size, so short reads and split prefixes are
+// exercised as well as whole frames. Built with -fsanitize=fuzzer for libFuzzer (and
+// AFL++'s libFuzzer driver); without it, main() replays the files given on the command
+// line or stdin, which also suits classic AFL.
+
+namespace {
+
+Server* fuzzServer() {
+    static int argc = 1;
+    static char name[] = "frame_fuzzer";
+    static char* argv[] = {name, nullptr};
+    static QCoreApplication app(argc, argv);
+    static Server* server = nullptr;
+
+    if (!server) {
+        qputenv("MESSENGER_SESSION_KEY", "frame-fuzzer");
+        QLoggingCategory::setFilterRules("*.debug=false");
+        server = new Server();
+    }
+    return server;
+}
+
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size == 0) return 0;
+
+    Server* server = fuzzServer();
+    QTcpSocket socket;
+
+    qsizetype fragment = data[0] == 0 ? static_cast<qsizetype>(size) : data[0];
+    QByteArray input(reinterpret_cast<const char*>(data + 1), static_cast<qsizetype>(size - 1));
+
+    QByteArray stream;
+    QBuffer device(&stream);
+    device.open(QIODevice::ReadOnly);
+
+    quint32 expectedSize = 0;
+    bool dropped = false;
+    for (qsizetype offset = 0; offset < input.size() && !dropped; offset += fragment) {
+        stream.append(input.mid(offset, fragment));
+
+        while (true) {
+            QByteArray frame;
+            FrameReader::Result result = FrameReader::readFrame(&device, expectedSize, server->m_maxFrameSize, frame,
+                                                                &server->m_framePool);
+            if (result == FrameReader::Incomplete) break;
+            if (result != FrameReader::Complete) {
+                dropped = true;
+                break;
+            }
+            server->processClientMessage(&socket, frame);
+            server->m_framePool.release(frame);
+        }
+    }
+
+    // Sessions created by this input must not leak into the next one.
+    for (const QString& name : server->m_clients.keys()) {
+        server->removeClient(name);
+    }
+    server->m_socketToName.clear();
+    server->m_pendingAcks.clear();
+    return 0;
+}
+
+#ifndef MESSENGER_LIBFUZZER
+int main(int argc, char** argv) {
+    auto runFile = [](FILE* file) {
+        QFile input;
+        input.open(file, QIODevice::ReadOnly);
+        QByteArray data = input.readAll();
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(data.constData()), static_cast<size_t>(data.size()));
+    };
+
+    if (argc < 2) {
+        runFile(stdin);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        FILE* file = std::fopen(argv[i], "rb");
+        if (!file) {
+            std::fprintf(stderr, "Cannot open %s\n", argv[i]);
+            return 1;
+        }
+        runFile(file);
+        std::fclose(file);
+    }
+    return 0;
+}
+#endif
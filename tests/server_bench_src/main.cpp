@@ -0,0 +1,4 @@
+#include <QtTest>
+#include "server_bench.hpp"
+
+QTEST_MAIN(ServerBench)
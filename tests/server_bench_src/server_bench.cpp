@@ -0,0 +1,437 @@
+#include "server_bench.hpp"
+#include "server.hpp"
+#include "frame_reader.hpp"
+#include "pipe_transport.hpp"
+#include "websocket_gateway.hpp"
+#include "local_transport.hpp"
+#include "conversation_sequencer.hpp"
+#include "network/e2e_session.hpp"
+#include <QDir>
+#include <QCoreApplication>
+#include <QBuffer>
+#include <QDataStream>
+#include <QJsonDocument>
+#include <QHostAddress>
+#include <QLoggingCategory>
+#include <QtEndian>
+#include <QThread>
+#include <QAtomicInt>
+
+#ifndef QT_NO_SSL
+#include <QSslSocket>
+#include <QSslConfiguration>
+#include <QSslCertificate>
+#endif
+
+void ServerBench::initTestCase() {
+    // The server logs every frame; that would dominate the measurements.
+    QLoggingCategory::setFilterRules("*.debug=false");
+}
+
+QByteArray ServerBench::createMessageData(const QJsonObject& obj, Transport transport) {
+    QByteArray jsonData = QJsonDocument(obj).toJson(QJsonDocument::Compact);
+    if (transport == WebSocket) {
+        return WebSocketGateway::encodeFrame(WebSocketGateway::Binary, jsonData, true);
+    }
+
+    QByteArray block;
+    QDataStream out(&block, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_15);
+    out << static_cast<quint32>(jsonData.size());
+    out.writeRawData(jsonData.constData(), jsonData.size());
+
+    return block;
+}
+
+int ServerBench::readFrames(QTcpSocket* socket, quint32& expectedSize) {
+    QDataStream in(socket);
+    in.setVersion(QDataStream::Qt_5_15);
+
+    int frames = 0;
+    while (true) {
+        if (expectedSize == 0) {
+            if (socket->bytesAvailable() < static_cast<qint64>(sizeof(quint32))) break;
+            in >> expectedSize;
+        }
+        if (socket->bytesAvailable() < expectedSize) break;
+
+        socket->skip(expectedSize);
+        expectedSize = 0;
+        ++frames;
+    }
+    return frames;
+}
+
+int ServerBench::readWebSocketFrames(QTcpSocket* socket, QByteArray& buffer) {
+    buffer += socket->readAll();
+
+    int frames = 0;
+    qsizetype offset = 0;
+    WebSocketGateway::WireFrame frame;
+    while (WebSocketGateway::decodeFrame(buffer, offset, frame, FrameReader::kDefaultMaxFrameSize, false) ==
+           WebSocketGateway::Decoded) {
+        ++frames;
+    }
+    buffer.remove(0, offset);
+    return frames;
+}
+
+bool ServerBench::setUpServer(Server& server, Transport transport) {
+    if (transport == Pipe) {
+        return true;
+    }
+    if (transport == UnixSocket) {
+        return server.openLocal(localSocketPath());
+    }
+    if (transport == WebSocket) {
+        WebSocketGateway* gateway = new WebSocketGateway(&server, &server);
+        return gateway->listen(QHostAddress::LocalHost, 0);
+    }
+    if (transport != Plaintext) {
+#ifndef QT_NO_SSL
+        if (!QSslSocket::supportsSsl() ||
+            !server.enableTls(TEST_CERTS_DIR "/localhost.crt", TEST_CERTS_DIR "/localhost.key")) {
+            return false;
+        }
+#else
+        return false;
+#endif
+    }
+    return server.listen(QHostAddress::LocalHost, 0);
+}
+
+std::unique_ptr<QTcpSocket> ServerBench::connectClient(Transport transport, quint16 port, QByteArray& sessionTicket) {
+    if (transport == Plaintext) {
+        auto socket = std::make_unique<QTcpSocket>();
+        socket->connectToHost(QHostAddress::LocalHost, port);
+        if (!QTest::qWaitFor([&]() {return socket->state() == QAbstractSocket::ConnectedState;}, 5000)) {
+            return nullptr;
+        }
+        return socket;
+    }
+
+#ifndef QT_NO_SSL
+    QSslConfiguration configuration = QSslConfiguration::defaultConfiguration();
+    configuration.setCaCertificates(QSslCertificate::fromPath(TEST_CERTS_DIR "/localhost.crt"));
+    configuration.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    if (transport == TlsResumed && !sessionTicket.isEmpty()) {
+        configuration.setSessionTicket(sessionTicket);
+    }
+
+    auto socket = std::make_unique<QSslSocket>();
+    socket->setSslConfiguration(configuration);
+    socket->connectToHostEncrypted("localhost", port);
+
+    // The server shares this thread, so both ends of the handshake are driven by the event loop.
+    if (!QTest::qWaitFor([&]() {return socket->isEncrypted();}, 5000)) {
+        return nullptr;
+    }
+    if (transport == TlsResumed && sessionTicket.isEmpty()) {
+        QTest::qWaitFor([&]() {return !socket->sslConfiguration().sessionTicket().isEmpty();}, 1000);
+        sessionTicket = socket->sslConfiguration().sessionTicket();
+    }
+    return socket;
+#else
+    Q_UNUSED(sessionTicket);
+    return nullptr;
+#endif
+}
+
+std::unique_ptr<QTcpSocket> ServerBench::connectPipe(Server& server) {
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    server.acceptConnection(pipe.second);
+    return std::unique_ptr<QTcpSocket>(pipe.first);
+}
+
+QString ServerBench::localSocketPath() const {
+    return QDir::temp().filePath(QString("messenger-bench-%1.sock").arg(QCoreApplication::applicationPid()));
+}
+
+std::unique_ptr<QTcpSocket> ServerBench::connectWebSocket(quint16 port) {
+    auto socket = std::make_unique<QTcpSocket>();
+    socket->connectToHost(QHostAddress::LocalHost, port);
+    socket->write("GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n");
+
+    // Read the response byte by byte so no frame that follows it is consumed.
+    QByteArray response;
+    if (!QTest::qWaitFor([&]() {
+            response += socket->read(1);
+            return response.endsWith("\r\n\r\n");
+        }, 5000) || !response.startsWith("HTTP/1.1 101")) {
+        return nullptr;
+    }
+    return socket;
+}
+
+bool ServerBench::authenticate(QTcpSocket* socket, const QString& clientName, const QString& interlocutorName,
+                               Transport transport) {
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = clientName;
+    authObj["interlocutorName"] = interlocutorName;
+    socket->write(createMessageData(authObj, transport));
+
+    return QTest::qWaitFor([socket]() {return socket->bytesAvailable() > 0;}, 5000);
+}
+
+void ServerBench::benchHandshake_data() {
+    QTest::addColumn<int>("transport");
+
+    QTest::newRow("plaintext") << static_cast<int>(Plaintext);
+    QTest::newRow("tls") << static_cast<int>(Tls);
+    QTest::newRow("tls-resumed") << static_cast<int>(TlsResumed);
+}
+
+void ServerBench::benchHandshake() {
+    QFETCH(int, transport);
+
+    Server server;
+    if (!setUpServer(server, static_cast<Transport>(transport))) {
+        QSKIP("Transport not available");
+    }
+
+    // Connection setup only: TCP connect, plus the TLS handshake where enabled. The first
+    // resumed connection is a full handshake that obtains the ticket.
+    QByteArray sessionTicket;
+    QBENCHMARK {
+        std::unique_ptr<QTcpSocket> socket = connectClient(static_cast<Transport>(transport), server.serverPort(), sessionTicket);
+        QVERIFY(socket);
+        socket->abort();
+    }
+}
+
+void ServerBench::benchRelayThroughput_data() {
+    QTest::addColumn<int>("transport");
+
+    QTest::newRow("plaintext") << static_cast<int>(Plaintext);
+    QTest::newRow("tls") << static_cast<int>(Tls);
+    QTest::newRow("pipe") << static_cast<int>(Pipe);
+    QTest::newRow("websocket") << static_cast<int>(WebSocket);
+    QTest::newRow("unix-socket") << static_cast<int>(UnixSocket);
+}
+
+void ServerBench::benchRelayThroughput() {
+    QFETCH(int, transport);
+
+    Server server;
+    if (!setUpServer(server, static_cast<Transport>(transport))) {
+        QSKIP("Transport not available");
+    }
+
+    QByteArray sessionTicket;
+    std::unique_ptr<QTcpSocket> sender;
+    std::unique_ptr<QTcpSocket> receiver;
+    if (transport == Pipe) {
+        sender = connectPipe(server);
+        receiver = connectPipe(server);
+    } else if (transport == UnixSocket) {
+        LocalTransport localTransport;
+        sender.reset(localTransport.connectTo(localSocketPath(), 0, nullptr));
+        receiver.reset(localTransport.connectTo(localSocketPath(), 0, nullptr));
+    } else if (transport == WebSocket) {
+        quint16 port = server.findChild<WebSocketGateway*>()->serverPort();
+        sender = connectWebSocket(port);
+        receiver = connectWebSocket(port);
+    } else {
+        sender = connectClient(static_cast<Transport>(transport), server.serverPort(), sessionTicket);
+        receiver = connectClient(static_cast<Transport>(transport), server.serverPort(), sessionTicket);
+    }
+    QVERIFY(sender && receiver);
+    QVERIFY(authenticate(sender.get(), "sender", "receiver", static_cast<Transport>(transport)));
+    QVERIFY(authenticate(receiver.get(), "receiver", "sender", static_cast<Transport>(transport)));
+
+    // Drop the auth responses and pairing notifications before measuring.
+    QTest::qWait(50);
+    sender->readAll();
+    receiver->readAll();
+
+    QString payload(kRelayPayloadSize, QChar('x'));
+    qint64 nextId = 0;
+    quint32 expectedSize = 0;
+    QByteArray webSocketBuffer;
+
+    // One iteration relays kRelayBatch messages from sender to receiver.
+    QBENCHMARK {
+        QByteArray block;
+        for (int i = 0; i < kRelayBatch; ++i) {
+            QJsonObject messageObj;
+            messageObj["type"] = "message";
+            messageObj["id"] = ++nextId;
+            messageObj["text"] = payload;
+            block += createMessageData(messageObj, static_cast<Transport>(transport));
+        }
+        sender->write(block);
+
+        int received = 0;
+        QVERIFY(QTest::qWaitFor([&]() {
+            sender->readAll();
+            received += transport == WebSocket ? readWebSocketFrames(receiver.get(), webSocketBuffer)
+                                               : readFrames(receiver.get(), expectedSize);
+            return received >= kRelayBatch;
+        }, 10000));
+    }
+}
+
+void ServerBench::benchParseHostile_data() {
+    QTest::addColumn<QByteArray>("input");
+    QTest::addColumn<int>("fragment");
+
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["id"] = 1;
+    messageObj["text"] = QString(kRelayPayloadSize, QChar('x'));
+    QByteArray frames = createMessageData(messageObj).repeated(kParseFrames);
+
+    // A prefix announcing the largest allowed frame, followed by a trickle that never completes it.
+    QByteArray maxPrefix(sizeof(quint32), Qt::Uninitialized);
+    qToBigEndian(FrameReader::kDefaultMaxFrameSize, maxPrefix.data());
+
+    QTest::newRow("whole-frames") << frames << static_cast<int>(frames.size());
+    QTest::newRow("1-byte-fragments") << frames << 1;
+    QTest::newRow("max-size-prefix") << maxPrefix + QByteArray(64 * 1024, 'x') << 1024;
+    QTest::newRow("garbage-json") << QByteArray("\0\0\0\x10{{{{{{{{{{{{{{{{", 20).repeated(kParseFrames) << 20;
+}
+
+void ServerBench::benchParseHostile() {
+    QFETCH(QByteArray, input);
+    QFETCH(int, fragment);
+
+    Server server;
+    QTcpSocket socket;
+
+    // Parsing plus processClientMessage, fed in fragments the way a hostile peer would send them.
+    QBENCHMARK {
+        QByteArray stream;
+        QBuffer device(&stream);
+        device.open(QIODevice::ReadOnly);
+        quint32 expectedSize = 0;
+
+        for (qsizetype offset = 0; offset < input.size(); offset += fragment) {
+            stream.append(input.constData() + offset, qMin<qsizetype>(fragment, input.size() - offset));
+
+            QByteArray frame;
+            while (FrameReader::readFrame(&device, expectedSize, server.m_maxFrameSize, frame, &server.m_framePool) ==
+                   FrameReader::Complete) {
+                server.processClientMessage(&socket, frame);
+                server.m_framePool.release(frame);
+            }
+        }
+    }
+}
+
+void ServerBench::benchE2eSeal_data() {
+    QTest::addColumn<int>("payloadSize");
+
+    QTest::newRow("64-bytes") << 64;
+    QTest::newRow("256-bytes") << kRelayPayloadSize;
+    QTest::newRow("4-KiB") << 4096;
+}
+
+// What sendMessage adds per message: seal plus the base64 that puts it into the JSON frame.
+void ServerBench::benchE2eSeal() {
+    if (!E2eSession::isSupported()) {
+        QSKIP("Built without OpenSSL");
+    }
+    QFETCH(int, payloadSize);
+
+    E2eKeyPair alice;
+    E2eKeyPair bob;
+    std::unique_ptr<E2eSession> session = E2eSession::establish(alice, bob.publicKey(), "alice", "bob");
+    QVERIFY(session);
+
+    QByteArray plaintext(payloadSize, 'x');
+    QByteArray associatedData("alice\nbob");
+    QBENCHMARK {
+        for (int i = 0; i < kSealBatch; ++i) {
+            QByteArray text = session->seal(plaintext, associatedData).toBase64();
+            Q_ASSERT(!text.isEmpty());
+        }
+    }
+}
+
+void ServerBench::benchE2eOpen_data() {
+    benchE2eSeal_data();
+}
+
+void ServerBench::benchE2eOpen() {
+    if (!E2eSession::isSupported()) {
+        QSKIP("Built without OpenSSL");
+    }
+    QFETCH(int, payloadSize);
+
+    E2eKeyPair alice;
+    E2eKeyPair bob;
+    std::unique_ptr<E2eSession> sender = E2eSession::establish(alice, bob.publicKey(), "alice", "bob");
+    std::unique_ptr<E2eSession> receiver = E2eSession::establish(bob, alice.publicKey(), "bob", "alice");
+    QVERIFY(sender && receiver);
+
+    QByteArray associatedData("alice\nbob");
+    QByteArray text = sender->seal(QByteArray(payloadSize, 'x'), associatedData).toBase64();
+    QByteArray plaintext;
+    QBENCHMARK {
+        for (int i = 0; i < kSealBatch; ++i) {
+            bool opened = receiver->open(QByteArray::fromBase64(text), associatedData, plaintext);
+            Q_ASSERT(opened);
+            Q_UNUSED(opened);
+        }
+    }
+    QCOMPARE(plaintext.size(), payloadSize);
+}
+
+void ServerBench::benchSequencer_data() {
+    QTest::addColumn<int>("threads");
+    QTest::addColumn<int>("conversations");
+
+    // No threads means the frames go straight to release, without the sequencer: the baseline.
+    QTest::newRow("direct") << 0 << 1;
+    QTest::newRow("1-thread/1-conversation") << 1 << 1;
+    QTest::newRow("1-thread/64-conversations") << 1 << 64;
+    QTest::newRow("4-threads/1-conversation") << 4 << 1;
+    QTest::newRow("4-threads/64-conversations") << 4 << 64;
+}
+
+// The price of ordering: admit and complete around each frame, with the threads contending on
+// one conversation or spread over many. The thread start-up is counted too, but is small next
+// to kSequencedMessages.
+void ServerBench::benchSequencer() {
+    QFETCH(int, threads);
+    QFETCH(int, conversations);
+
+    QAtomicInt released;
+    auto release = [&released](const int&, quint64, QByteArray& frame) {
+        if (!frame.isEmpty()) {
+            released.ref();
+        }
+    };
+    ConversationSequencer<int, QByteArray> sequencer(release);
+    QByteArray frame(kRelayPayloadSize, 'x');
+
+    QBENCHMARK {
+        released.storeRelaxed(0);
+        if (threads == 0) {
+            for (int i = 0; i < kSequencedMessages; ++i) {
+                QByteArray copy = frame;
+                release(i, 0, copy);
+            }
+        } else {
+            QList<QThread*> workers;
+            for (int t = 0; t < threads; ++t) {
+                workers.append(QThread::create([&, t]() {
+                    for (int i = t; i < kSequencedMessages; i += threads) {
+                        int conversation = i % conversations;
+                        quint64 ticket = sequencer.admit(conversation);
+                        sequencer.complete(conversation, ticket, frame);
+                    }
+                }));
+                workers.last()->start();
+            }
+            for (QThread* worker : std::as_const(workers)) {
+                worker->wait();
+                delete worker;
+            }
+        }
+    }
+    QCOMPARE(released.loadRelaxed(), kSequencedMessages);
+    QCOMPARE(sequencer.pendingCount(), qsizetype(0));
+}
@@ -0,0 +1,52 @@
+#include <QObject>
+#include <QTcpSocket>
+#include <QTest>
+#include <QJsonObject>
+#include <QByteArray>
+#include <memory>
+
+class Server;
+
+// Benchmarks for the relay path. Not part of ctest; run ./server_bench directly,
+// optionally with -tickcounter or -iterations N.
+class ServerBench : public QObject {
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void benchHandshake_data();
+    void benchHandshake();
+    void benchRelayThroughput_data();
+    void benchRelayThroughput();
+    void benchParseHostile_data();
+    void benchParseHostile();
+    void benchE2eSeal_data();
+    void benchE2eSeal();
+    void benchE2eOpen_data();
+    void benchE2eOpen();
+    void benchSequencer_data();
+    void benchSequencer();
+
+private:
+    // Pipe skips the kernel entirely, which isolates the server's own cost from socket syscalls.
+    enum Transport {Plaintext, Tls, TlsResumed, Pipe, WebSocket, UnixSocket};
+
+    static constexpr int kRelayBatch = 500;
+    static constexpr int kRelayPayloadSize = 256;
+    static constexpr int kParseFrames = 1000;
+    // Client-side end-to-end crypto, measured over this many messages per iteration; the
+    // per-message cost (result / kSealBatch) should stay well under 10 us.
+    static constexpr int kSealBatch = 1000;
+    static constexpr int kSequencedMessages = 100000;
+
+    bool setUpServer(Server& server, Transport transport);
+    std::unique_ptr<QTcpSocket> connectClient(Transport transport, quint16 port, QByteArray& sessionTicket);
+    std::unique_ptr<QTcpSocket> connectPipe(Server& server);
+    std::unique_ptr<QTcpSocket> connectWebSocket(quint16 port);
+    QString localSocketPath() const;
+    bool authenticate(QTcpSocket* socket, const QString& clientName, const QString& interlocutorName,
+                      Transport transport = Plaintext);
+    QByteArray createMessageData(const QJsonObject& obj, Transport transport = Plaintext);
+    int readFrames(QTcpSocket* socket, quint32& expectedSize);
+    int readWebSocketFrames(QTcpSocket* socket, QByteArray& buffer);
+};
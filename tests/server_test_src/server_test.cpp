@@ -1,11 +1,39 @@
 #include "server_test.hpp"
 #include "server.hpp"
+#include "cluster_router.hpp"
+#include "frame_pool.hpp"
+#include "frame_reader.hpp"
+#include "pipe_transport.hpp"
+#include "traffic_recorder.hpp"
+#include "websocket_gateway.hpp"
+#include "local_listener.hpp"
+#include "local_transport.hpp"
+#include "admin_channel.hpp"
+#include "server_config.hpp"
+#include "auth_provider.hpp"
+#include "conversation_sequencer.hpp"
+#include "authenticator.hpp"
+#include "file_chunk.hpp"
 #include <QCoreApplication>
 #include <QThread>
 #include <QSignalSpy>
 #include <QTimer>
+#include <QTemporaryDir>
+#include <QSslSocket>
+#include <QDateTime>
+#include <QBuffer>
+#include <QFile>
+#include <QJsonArray>
+#include <QtEndian>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QRandomGenerator>
 #include <QDebug>
 
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
 std::unique_ptr<QTcpSocket> ServerTest::createMockSocket() {return std::make_unique<QTcpSocket>();}
 
 QByteArray ServerTest::createMessageData(const QJsonObject& obj) {
@@ -23,8 +51,39 @@ QByteArray ServerTest::createMessageData(const QJsonObject& obj) {
 
 void ServerTest::simulateClientMessage(QTcpSocket* socket, const QJsonObject& message) {
     QByteArray data = createMessageData(message);
+    socket->write(data);
+}
+
+bool ServerTest::openWebSocket(QTcpSocket& socket, quint16 port) {
+    socket.connectToHost("localhost", port);
+    if (!socket.waitForConnected(1000)) return false;
+
+    socket.write("GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n");
+
+    QByteArray response;
+    bool complete = QTest::qWaitFor([&]() {
+        response += socket.read(1);
+        return response.endsWith("\r\n\r\n");
+    }, 1000);
+    return complete && response.startsWith("HTTP/1.1 101") && response.contains("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
 }
 
+QJsonObject ServerTest::readWebSocketMessage(QTcpSocket& socket, QByteArray& buffer, quint8* opcode) {
+    WebSocketGateway::WireFrame frame;
+    qsizetype offset = 0;
+    bool decoded = QTest::qWaitFor([&]() {
+        buffer += socket.readAll();
+        offset = 0;
+        return WebSocketGateway::decodeFrame(buffer, offset, frame, FrameReader::kDefaultMaxFrameSize, false) ==
+               WebSocketGateway::Decoded;
+    }, 2000);
+    if (!decoded) return QJsonObject();
+
+    buffer.remove(0, offset);
+    if (opcode) *opcode = frame.opcode;
+    return QJsonDocument::fromJson(frame.payload).object();
+}
 
 void ServerTest::testValidateConnection() {
     Server server;
@@ -106,268 +165,2631 @@ void ServerTest::testOpenServer() {
 }
 
 
-// Тесты для обработки аутентификации
-void ServerTest::testProcessAuth() {
+void ServerTest::testOpenReusePort() {
+#ifdef Q_OS_LINUX
+    Server first;
+    Server second;
+
+    QVERIFY(first.open("5481", true));
+    QVERIFY(second.open("5481", true));
+
+    first.close();
+    second.close();
+#else
+    QSKIP("SO_REUSEPORT is only exercised on Linux");
+#endif
+}
+
+void ServerTest::testDrainWithoutConnections() {
     Server server;
-    server.open("5466");
+    QVERIFY(server.open("5482"));
 
-    QTcpSocket* mockSocket = new QTcpSocket();
+    QSignalSpy drainedSpy(&server, &Server::drained);
+    server.drain(1000);
 
-    QJsonObject authObj;
-    authObj["type"] = "auth";
-    authObj["clientName"] = "testClient";
-    authObj["interlocutorName"] = "testInterlocutor";
+    QVERIFY(server.isDraining());
+    QVERIFY(!server.isListening());
+    QCOMPARE(drainedSpy.count(), 1);
+}
 
-    server.processAuth(mockSocket, authObj);
+void ServerTest::testDrainMigratesClients() {
+    Server server;
+    QVERIFY(server.open("5483"));
 
-    QVERIFY(server.m_clients.contains("testClient"));
-    QCOMPARE(server.m_clients["testClient"].interlocutor, QString("testInterlocutor"));
-    QVERIFY(server.m_clients["testClient"].isAuthenticated);
+    QTcpSocket client;
+    client.connectToHost("localhost", 5483);
+    QVERIFY(client.waitForConnected(1000));
+    QTRY_COMPARE(server.m_buffers.size(), 1);
 
-    delete mockSocket;
-    server.close();
+    QSignalSpy drainedSpy(&server, &Server::drained);
+    server.drain(5000);
+
+    QTRY_VERIFY(client.bytesAvailable() > static_cast<qint64>(sizeof(quint32)));
+
+    QDataStream in(&client);
+    in.setVersion(QDataStream::Qt_5_15);
+    quint32 size = 0;
+    in >> size;
+    QTRY_VERIFY(client.bytesAvailable() >= size);
+    QJsonObject migrate = QJsonDocument::fromJson(client.read(size)).object();
+
+    QCOMPARE(migrate["type"].toString(), QString("migrate"));
+    QVERIFY(migrate["retryAfterMs"].toInt() < Server::kMigrateSpreadMs);
+    QTRY_COMPARE(drainedSpy.count(), 1);
 }
 
-void ServerTest::testProcessAuthError() {
+void ServerTest::testDrainClosesWebSocketGateway() {
     Server server;
-    server.open("5467");
+    WebSocketGateway gateway(&server);
+    QVERIFY(gateway.listen(QHostAddress::LocalHost, 5492));
 
-    QTcpSocket* existingSocket = new QTcpSocket();
-    server.m_clients["existingClient"] = {existingSocket, "someone", true};
-    server.m_socketToName[existingSocket] = "existingClient";
+    server.drain(1000);
+    QCOMPARE(gateway.serverPort(), quint16(0));
 
-    QTcpSocket* mockSocket = new QTcpSocket();
+    // The port is free for the successor of a hand-over.
+    QTcpServer successor;
+    QVERIFY(successor.listen(QHostAddress::LocalHost, 5492));
+}
+
+void ServerTest::testEnableTlsMissingFiles() {
+    Server server;
+
+    QVERIFY(!server.enableTls("missing.crt", "missing.key"));
+    QVERIFY(!server.isTlsEnabled());
+}
+
+void ServerTest::testTlsHandshake() {
+    if (!QSslSocket::supportsSsl()) {
+        QSKIP("No TLS backend available");
+    }
+
+    Server server;
+    QVERIFY(server.enableTls(TEST_CERTS_DIR "/localhost.crt", TEST_CERTS_DIR "/localhost.key"));
+    QVERIFY(server.open("5485"));
+
+    QSslConfiguration configuration = QSslConfiguration::defaultConfiguration();
+    configuration.setCaCertificates(QSslCertificate::fromPath(TEST_CERTS_DIR "/localhost.crt"));
+
+    // The server runs on this thread, so the handshake has to be driven by the event loop.
+    QSslSocket client;
+    client.setSslConfiguration(configuration);
+    client.connectToHostEncrypted("localhost", 5485);
+    QTRY_VERIFY(client.isEncrypted());
 
     QJsonObject authObj;
     authObj["type"] = "auth";
-    authObj["clientName"] = "existingClient";
-    authObj["interlocutorName"] = "testInterlocutor";
+    authObj["clientName"] = "client1";
+    authObj["interlocutorName"] = "client2";
+    client.write(createMessageData(authObj));
 
-    server.processAuth(mockSocket, authObj);
+    QTRY_VERIFY(client.bytesAvailable() > static_cast<qint64>(sizeof(quint32)));
 
-    QVERIFY(!mockSocket->isOpen());
+    QDataStream in(&client);
+    in.setVersion(QDataStream::Qt_5_15);
+    quint32 size = 0;
+    in >> size;
+    QTRY_VERIFY(client.bytesAvailable() >= size);
+    QJsonObject response = QJsonDocument::fromJson(client.read(size)).object();
 
-    delete existingSocket;
-    delete mockSocket;
-    server.close();
+    QCOMPARE(response["type"].toString(), QString("auth_success"));
+    QVERIFY(server.m_clients.contains("client1"));
 }
 
-void ServerTest::testProcessMessage() {
-    Server server;
-    server.open("5468");
+void ServerTest::testFramePoolReusesBuffers() {
+    FramePool pool;
 
-    QTcpSocket* client1Socket = new QTcpSocket();
-    QTcpSocket* client2Socket = new QTcpSocket();
+    QByteArray first = pool.acquire(100);
+    QCOMPARE(first.size(), 100);
+    const char* storage = first.constData();
+    pool.release(first);
+    QVERIFY(first.isEmpty());
 
-    server.m_clients["client1"] = {client1Socket, "client2", true};
-    server.m_socketToName[client1Socket] = "client1";
-    server.m_clients["client2"] = {client2Socket, "client1", true};
-    server.m_socketToName[client2Socket] = "client2";
+    QByteArray second = pool.acquire(200);
+    QCOMPARE(second.size(), 200);
+    QCOMPARE(second.constData(), storage);
+    QCOMPARE(pool.hits(), 1);
+    QCOMPARE(pool.misses(), 1);
 
-    QJsonObject messageObj;
-    messageObj["type"] = "message";
-    messageObj["text"] = "Hello, World!";
+    QByteArray oversized = pool.acquire(FramePool::kSizeClasses[FramePool::kClassCount - 1] * 4);
+    pool.release(oversized);
+    QCOMPARE(pool.pooledBytes(), 0);
+}
 
-    server.processMessage(client1Socket, messageObj);
+void ServerTest::testFramePoolSkipsSharedBuffers() {
+    FramePool pool;
 
-    delete client1Socket;
-    delete client2Socket;
-    server.close();
+    QByteArray buffer = pool.acquire(100);
+    QByteArray copy = buffer;
+    pool.release(buffer);
+
+    QCOMPARE(pool.pooledBytes(), 0);
+    QCOMPARE(copy.size(), 100);
 }
 
-void ServerTest::testProcessMessageUnauthorized() {
+void ServerTest::testDeliveryQueueRecycled() {
     Server server;
-    server.open("5469");
+    QTcpSocket* client1Socket = new QTcpSocket();
 
-    QTcpSocket* mockSocket = new QTcpSocket();
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "client1";
+    authObj["interlocutorName"] = "client2";
+    server.processAuth(client1Socket, authObj);
 
-    QJsonObject messageObj;
-    messageObj["type"] = "message";
-    messageObj["text"] = "Test message";
+    for (int i = 0; i < 10; ++i) {
+        server.deliverToClient("client1", "client2", QJsonObject());
+    }
+    qsizetype capacity = server.m_clients["client1"].unacked.capacity();
 
-    server.processMessage(mockSocket, messageObj);
+    server.removeClient("client1");
+    QCOMPARE(server.m_spareQueues.size(), 1);
 
-    delete mockSocket;
-    server.close();
+    server.processAuth(client1Socket, authObj);
+    QVERIFY(server.m_spareQueues.isEmpty());
+    QVERIFY(server.m_clients["client1"].unacked.isEmpty());
+    QCOMPARE(server.m_clients["client1"].unacked.capacity(), capacity);
+
+    delete client1Socket;
 }
 
-void ServerTest::testProcessMessageNoInterlocutor() {
-    Server server;
-    server.open("5470");
+// Resident set of this process, or -1 where it cannot be read.
+static qint64 residentBytes() {
+#ifdef Q_OS_LINUX
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QIODevice::ReadOnly)) return -1;
+    QList<QByteArray> fields = statm.readAll().split(' ');
+    return fields.size() > 1 ? fields[1].toLongLong() * sysconf(_SC_PAGESIZE) : -1;
+#else
+    return -1;
+#endif
+}
 
-    QTcpSocket* clientSocket = new QTcpSocket();
-    server.m_clients["client1"] = {clientSocket, "", true};
-    server.m_socketToName[clientSocket] = "client1";
+void ServerTest::testMemoryReportIdleSessions() {
+    constexpr int kSessions = 200;
+    Server server;
+    server.setLowFootprint(true);
+    server.m_idleReleaseMs = 0;
+    QVERIFY(server.open("5491"));
+
+    // Real connections, so Qt's socket objects and buffers count along with the server's own state.
+    qint64 baseline = residentBytes();
+    QList<QTcpSocket*> clients;
+    for (int i = 0; i < kSessions; ++i) {
+        QTcpSocket* client = new QTcpSocket();
+        client->connectToHost("127.0.0.1", 5491);
+        QVERIFY(client->waitForConnected(3000));
+
+        QJsonObject authObj;
+        authObj["type"] = "auth";
+        authObj["clientName"] = QString("user%1").arg(i);
+        authObj["interlocutorName"] = QString("user%1").arg(i ^ 1);
+        simulateClientMessage(client, authObj);
+        clients.append(client);
+    }
+    QTRY_COMPARE_WITH_TIMEOUT(server.m_clients.size(), kSessions, 10000);
 
-    QJsonObject messageObj;
-    messageObj["type"] = "message";
-    messageObj["text"] = "Test message";
+    for (int i = 0; i < kSessions; i += 2) {
+        server.deliverToClient(QString("user%1").arg(i + 1), QString("user%1").arg(i), QJsonObject{{"type", "message"}});
+    }
+    QTest::qWait(200);
+    for (QTcpSocket* client : std::as_const(clients)) {
+        client->readAll();
+    }
+    server.releaseIdleBuffers();
+
+    QJsonObject report = server.memoryReport();
+    QCOMPARE(report["connections"].toInt(), kSessions);
+    QCOMPARE(report["sessions"].toInt(), kSessions);
+    QVERIFY(report["bytesPerSession"].toInteger() > 0);
+    QVERIFY(report["bytesPerSession"].toInteger() < 2048);
+
+    // Both ends of every connection live in this process, so this bounds the server side from above.
+    if (baseline > 0) {
+        qint64 perSession = (residentBytes() - baseline) / kSessions;
+        QVERIFY2(perSession < 32 * 1024, qPrintable(QString("%1 resident bytes per connected session").arg(perSession)));
+    }
 
-    server.processMessage(clientSocket, messageObj);
+    // Both ends of a pair share one copy of each name.
+    QVERIFY(server.m_clients["user1"].interlocutor.constData() == server.m_clients.find("user0").key().constData());
 
-    delete clientSocket;
+    qDeleteAll(clients);
     server.close();
 }
 
-void ServerTest::testProcessChangeInterlocutor() {
+void ServerTest::testLowFootprintReleasesIdleBuffers() {
     Server server;
-    server.open("5471");
-
+    server.setLowFootprint(true);
     QTcpSocket* clientSocket = new QTcpSocket();
-    server.m_clients["client1"] = {clientSocket, "oldInterlocutor", true};
-    server.m_socketToName[clientSocket] = "client1";
 
-    QJsonObject changeObj;
-    changeObj["type"] = "change_interlocutor";
-    changeObj["newInterlocutor"] = "newInterlocutor";
+    server.registerClient(clientSocket, "client1", "client2", "auth_success");
+    server.m_buffers[clientSocket] = {clientSocket, 0, 0};
+    server.deliverToClient("client1", "client2", QJsonObject());
+    server.m_clients["client1"].unacked.clear();
+    QVERIFY(server.m_clients["client1"].unacked.capacity() > 0);
 
-    server.processChangeInterlocutor(clientSocket, changeObj);
+    server.releaseIdleBuffers();
+    QCOMPARE(server.m_clients["client1"].unacked.capacity(), 0);
 
-    QCOMPARE(server.m_clients["client1"].interlocutor, QString("newInterlocutor"));
+    // Recently active connections keep their buffers.
+    server.deliverToClient("client1", "client2", QJsonObject());
+    server.m_clients["client1"].unacked.clear();
+    server.m_buffers[clientSocket].lastActivity = QDateTime::currentMSecsSinceEpoch();
+    server.releaseIdleBuffers();
+    QVERIFY(server.m_clients["client1"].unacked.capacity() > 0);
 
     delete clientSocket;
-    server.close();
 }
 
-void ServerTest::testProcessChangeInterlocutorUnauthorized() {
-    Server server;
-    server.open("5472");
-
-    QTcpSocket* mockSocket = new QTcpSocket();
+void ServerTest::testFrameReaderFragmented() {
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["text"] = "hello";
+    QByteArray input = createMessageData(messageObj) + createMessageData(messageObj);
+
+    QByteArray stream;
+    QBuffer device(&stream);
+    device.open(QIODevice::ReadOnly);
+
+    // One byte at a time: every prefix and payload arrives split.
+    quint32 expectedSize = 0;
+    int frames = 0;
+    for (char byte : input) {
+        stream.append(byte);
+
+        QByteArray frame;
+        while (FrameReader::readFrame(&device, expectedSize, FrameReader::kDefaultMaxFrameSize, frame) == FrameReader::Complete) {
+            QCOMPARE(QJsonDocument::fromJson(frame).object()["text"].toString(), QString("hello"));
+            ++frames;
+        }
+    }
 
-    QJsonObject changeObj;
-    changeObj["type"] = "change_interlocutor";
-    changeObj["newInterlocutor"] = "newInterlocutor";
+    QCOMPARE(frames, 2);
+    QCOMPARE(expectedSize, quint32(0));
+}
 
-    server.processChangeInterlocutor(mockSocket, changeObj);
+void ServerTest::testFrameReaderOversized() {
+    QByteArray stream("\xff\xff\xff\xff{}", 6);
+    QBuffer device(&stream);
+    device.open(QIODevice::ReadOnly);
 
-    delete mockSocket;
-    server.close();
+    quint32 expectedSize = 0;
+    QByteArray frame;
+    QCOMPARE(FrameReader::readFrame(&device, expectedSize, FrameReader::kDefaultMaxFrameSize, frame), FrameReader::Oversized);
+    QVERIFY(frame.isEmpty());
 }
 
-void ServerTest::testSendMessageWithSize() {
+void ServerTest::testOversizedFrameDropsConnection() {
     Server server;
-    server.open("5473");
+    QVERIFY(server.open("5486"));
 
-    QTcpServer testServer;
-    testServer.listen(QHostAddress::LocalHost, 5474);
+    QTcpSocket client;
+    client.connectToHost("localhost", 5486);
+    QVERIFY(client.waitForConnected(1000));
+    QTRY_COMPARE(server.m_buffers.size(), 1);
 
-    QTcpSocket* testSocket = new QTcpSocket();
-    testSocket->connectToHost("localhost", 5474);
+    client.write(QByteArray("\xff\xff\xff\xff", 4));
 
-    if (testServer.waitForNewConnection(1000)) {
-        QTcpSocket* serverSocket = testServer.nextPendingConnection();
+    QTRY_VERIFY(server.m_buffers.isEmpty());
+    QTRY_COMPARE(client.state(), QAbstractSocket::UnconnectedState);
+}
 
-        QJsonObject testObj;
-        testObj["type"] = "test";
-        testObj["message"] = "Test message";
+void ServerTest::testPipeRelaysMessage() {
+    Server server;
 
-        server.sendMessageWithSize(serverSocket, testObj);
+    QPair<PipeSocket*, PipeSocket*> pipe1 = PipeSocket::createPair();
+    QPair<PipeSocket*, PipeSocket*> pipe2 = PipeSocket::createPair();
+    server.acceptConnection(pipe1.second);
+    server.acceptConnection(pipe2.second);
+    QCOMPARE(server.m_buffers.size(), 2);
+
+    QJsonObject auth1;
+    auth1["type"] = "auth";
+    auth1["clientName"] = "client1";
+    auth1["interlocutorName"] = "client2";
+    simulateClientMessage(pipe1.first, auth1);
+
+    QJsonObject auth2;
+    auth2["type"] = "auth";
+    auth2["clientName"] = "client2";
+    auth2["interlocutorName"] = "client1";
+    simulateClientMessage(pipe2.first, auth2);
+    QTRY_VERIFY(server.m_clients.contains("client1") && server.m_clients.contains("client2"));
 
-        QVERIFY(serverSocket->bytesToWrite() > 0);
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["id"] = 1;
+    messageObj["text"] = "Through a pipe";
+    simulateClientMessage(pipe1.first, messageObj);
 
-        delete serverSocket;
-    }
+    QByteArray received;
+    QTRY_VERIFY((received += pipe2.first->readAll()).contains("Through a pipe"));
 
-    delete testSocket;
-    testServer.close();
-    server.close();
+    delete pipe1.first;
+    delete pipe2.first;
 }
 
-void ServerTest::testSendMessageWithSizeDisconnected() {
+void ServerTest::testPipeDisconnectDetachesSession() {
     Server server;
 
-    QTcpSocket* disconnectedSocket = new QTcpSocket();
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    server.acceptConnection(pipe.second);
 
-    QJsonObject testObj;
-    testObj["type"] = "test";
-    testObj["message"] = "Test message";
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "client1";
+    authObj["interlocutorName"] = "client2";
+    simulateClientMessage(pipe.first, authObj);
+    QTRY_VERIFY(server.m_clients.contains("client1"));
 
-    server.sendMessageWithSize(disconnectedSocket, testObj);
+    QSignalSpy disconnectedSpy(pipe.first, &QTcpSocket::disconnected);
+    pipe.first->disconnectFromHost();
 
+    QCOMPARE(disconnectedSpy.count(), 1);
+    QTRY_VERIFY(server.m_buffers.isEmpty());
+    QVERIFY(server.m_clients["client1"].detachedAt > 0);
+    QVERIFY(!server.m_clients["client1"].socket);
 
-    delete disconnectedSocket;
+    delete pipe.first;
 }
 
-void ServerTest::testRemoveClient() {
+void ServerTest::testCaptureRecordsInboundFrames() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString path = dir.filePath("traffic.cap");
+
     Server server;
-    server.open("5475");
+    QVERIFY(server.startCapture(path));
 
-    QTcpSocket* clientSocket = new QTcpSocket();
-    server.m_clients["client1"] = {clientSocket, "", true};
-    server.m_socketToName[clientSocket] = "client1";
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    server.acceptConnection(pipe.second);
 
-    server.removeClient("client1");
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "client1";
+    authObj["interlocutorName"] = "client2";
+    authObj["password"] = "hunter2";
+    simulateClientMessage(pipe.first, authObj);
 
-    QVERIFY(!server.m_clients.contains("client1"));
-    QVERIFY(!server.m_socketToName.contains(clientSocket));
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["id"] = 1;
+    messageObj["text"] = "Recorded";
+    simulateClientMessage(pipe.first, messageObj);
+    QTRY_COMPARE(server.m_recorder.recordCount(), 3);
 
-    delete clientSocket;
-    server.close();
+    pipe.first->disconnectFromHost();
+    QTRY_VERIFY(server.m_buffers.isEmpty());
+    server.stopCapture();
+
+    QList<TrafficRecorder::Record> records;
+    QString error;
+    QVERIFY2(TrafficRecorder::readCapture(path, records, error), qPrintable(error));
+    QCOMPARE(records.size(), 4);
+    QCOMPARE(records[0].kind, TrafficRecorder::Open);
+    QCOMPARE(records[1].kind, TrafficRecorder::Frame);
+    QCOMPARE(QJsonDocument::fromJson(records[1].payload).object()["type"].toString(), QString("auth"));
+    QCOMPARE(QJsonDocument::fromJson(records[1].payload).object()["password"].toString(), QString(TrafficRecorder::kRedacted));
+    QVERIFY(!records[1].payload.contains("hunter2"));
+    QCOMPARE(records[2].kind, TrafficRecorder::Frame);
+    QCOMPARE(QJsonDocument::fromJson(records[2].payload).object()["text"].toString(), QString("Recorded"));
+    QCOMPARE(records[3].kind, TrafficRecorder::Close);
+    for (const TrafficRecorder::Record& record : records) {
+        QCOMPARE(record.connection, records[0].connection);
+    }
+    QVERIFY(records[0].timestampUs <= records[3].timestampUs);
+
+    delete pipe.first;
 }
 
-void ServerTest::testRemoveClientWithInterlocutor() {
+void ServerTest::testCaptureSampledOut() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString path = dir.filePath("traffic.cap");
+
     Server server;
-    server.open("5476");
+    QVERIFY(server.startCapture(path, 0.0));
 
-    QTcpSocket* client1Socket = new QTcpSocket();
-    QTcpSocket* client2Socket = new QTcpSocket();
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    server.acceptConnection(pipe.second);
+    QCOMPARE(server.m_buffers[pipe.second].captureId, 0u);
 
-    server.m_clients["client1"] = {client1Socket, "client2", true};
-    server.m_socketToName[client1Socket] = "client1";
-    server.m_clients["client2"] = {client2Socket, "client1", true};
-    server.m_socketToName[client2Socket] = "client2";
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "client1";
+    authObj["interlocutorName"] = "client2";
+    simulateClientMessage(pipe.first, authObj);
+    QTRY_VERIFY(server.m_clients.contains("client1"));
+    server.stopCapture();
 
-    server.removeClient("client1");
+    QList<TrafficRecorder::Record> records;
+    QString error;
+    QVERIFY(TrafficRecorder::readCapture(path, records, error));
+    QVERIFY(records.isEmpty());
 
-    QVERIFY(!server.m_clients.contains("client1"));
-    QVERIFY(server.m_clients.contains("client2"));
-    QVERIFY(server.m_clients["client2"].interlocutor.isEmpty());
+    delete pipe.first;
+}
 
-    delete client1Socket;
-    delete client2Socket;
-    server.close();
+void ServerTest::testWebSocketFrameCodec() {
+    // Lengths on either side of the 7-bit, 16-bit and 64-bit encodings, and a tail that is not a multiple of the mask.
+    for (int size : {0, 5, 125, 126, 65535, 65536, 70001}) {
+        QByteArray payload(size, Qt::Uninitialized);
+        for (int i = 0; i < size; ++i) {
+            payload[i] = static_cast<char>(i * 7);
+        }
+
+        QByteArray wire = WebSocketGateway::encodeFrame(WebSocketGateway::Binary, payload, true);
+        WebSocketGateway::WireFrame frame;
+        qsizetype offset = 0;
+        QCOMPARE(WebSocketGateway::decodeFrame(wire.left(wire.size() - 1), offset, frame, 1 << 20, true),
+                 WebSocketGateway::NeedMoreData);
+
+        offset = 0;
+        QCOMPARE(WebSocketGateway::decodeFrame(wire, offset, frame, 1 << 20, true), WebSocketGateway::Decoded);
+        QCOMPARE(offset, wire.size());
+        QVERIFY(frame.fin);
+        QCOMPARE(frame.opcode, static_cast<quint8>(WebSocketGateway::Binary));
+        QCOMPARE(frame.payload, payload);
+    }
+
+    QByteArray unmasked = WebSocketGateway::encodeFrame(WebSocketGateway::Text, "hi");
+    qsizetype offset = 0;
+    WebSocketGateway::WireFrame frame;
+    QCOMPARE(WebSocketGateway::decodeFrame(unmasked, offset, frame, 1 << 20, true), WebSocketGateway::Malformed);
+
+    QByteArray huge = WebSocketGateway::encodeFrame(WebSocketGateway::Binary, QByteArray(1000, 'x'), true).left(10);
+    offset = 0;
+    QCOMPARE(WebSocketGateway::decodeFrame(huge, offset, frame, 100, true), WebSocketGateway::TooLarge);
 }
 
-void ServerTest::testSendToClient() {
+void ServerTest::testWebSocketRejectsPlainRequest() {
     Server server;
-    server.open("5477");
+    WebSocketGateway gateway(&server);
+    QVERIFY(gateway.listen(QHostAddress::LocalHost, 5487));
+
+    QTcpSocket client;
+    client.connectToHost("localhost", 5487);
+    QVERIFY(client.waitForConnected(1000));
+    client.write("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+
+    QByteArray response;
+    QTRY_VERIFY((response += client.readAll()).contains("\r\n\r\n"));
+    QVERIFY(response.startsWith("HTTP/1.1 400"));
+    QTRY_COMPARE(client.state(), QAbstractSocket::UnconnectedState);
+    QVERIFY(server.m_buffers.isEmpty());
+}
 
-    QTcpServer testServer;
-    testServer.listen(QHostAddress::LocalHost, 5478);
+void ServerTest::testWebSocketRelaysFrames() {
+    Server server;
+    QVERIFY(server.open("5488"));
+    WebSocketGateway gateway(&server);
+    QVERIFY(gateway.listen(QHostAddress::LocalHost, 5487));
+
+    QTcpSocket webClient;
+    QVERIFY(openWebSocket(webClient, 5487));
+    QTRY_COMPARE(server.m_buffers.size(), 1);
+
+    QTcpSocket tcpClient;
+    tcpClient.connectToHost("localhost", 5488);
+    QVERIFY(tcpClient.waitForConnected(1000));
+
+    QJsonObject auth1;
+    auth1["type"] = "auth";
+    auth1["clientName"] = "browser";
+    auth1["interlocutorName"] = "desktop";
+    webClient.write(WebSocketGateway::encodeFrame(WebSocketGateway::Text, QJsonDocument(auth1).toJson(QJsonDocument::Compact), true));
+
+    QByteArray webBuffer;
+    quint8 opcode = 0;
+    QCOMPARE(readWebSocketMessage(webClient, webBuffer, &opcode)["type"].toString(), QString("auth_success"));
+    QCOMPARE(opcode, static_cast<quint8>(WebSocketGateway::Text));
+
+    QJsonObject auth2;
+    auth2["type"] = "auth";
+    auth2["clientName"] = "desktop";
+    auth2["interlocutorName"] = "browser";
+    simulateClientMessage(&tcpClient, auth2);
+    QTRY_VERIFY(server.m_clients.contains("desktop"));
+
+    // A message split over two fragments arrives at the TCP client as one frame.
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["id"] = 1;
+    messageObj["text"] = "From the browser";
+    QByteArray json = QJsonDocument(messageObj).toJson(QJsonDocument::Compact);
+    QByteArray first = WebSocketGateway::encodeFrame(WebSocketGateway::Binary, json.left(10), true);
+    first[0] = static_cast<char>(first[0] & 0x7F);
+    webClient.write(first);
+    webClient.write(WebSocketGateway::encodeFrame(WebSocketGateway::Continuation, json.mid(10), true));
+
+    QByteArray tcpBuffer;
+    QTRY_VERIFY((tcpBuffer += tcpClient.readAll()).contains("From the browser"));
+
+    // Replies now use the opcode of the last message from the browser.
+    QJsonObject reply;
+    reply["type"] = "message";
+    reply["id"] = 1;
+    reply["text"] = "From the desktop";
+    simulateClientMessage(&tcpClient, reply);
+
+    QJsonObject received;
+    while (received["text"].toString() != "From the desktop") {
+        received = readWebSocketMessage(webClient, webBuffer, &opcode);
+        QVERIFY(!received.isEmpty());
+    }
+    QCOMPARE(opcode, static_cast<quint8>(WebSocketGateway::Binary));
+
+    webClient.disconnectFromHost();
+    QTRY_COMPARE(gateway.connectionCount(), 0);
+    QTRY_VERIFY(server.m_clients["browser"].detachedAt > 0);
+
+    // The gateway holds WebSocket messages to the server's configured frame limit.
+    server.setMaxFrameSize(1024);
+    QTcpSocket largeClient;
+    QVERIFY(openWebSocket(largeClient, 5487));
+    QTRY_COMPARE(gateway.connectionCount(), 1);
+    largeClient.write(WebSocketGateway::encodeFrame(WebSocketGateway::Binary, QByteArray(2048, 'x'), true));
+
+    QByteArray closeFrame = WebSocketGateway::encodeFrame(WebSocketGateway::Close, QByteArray("\x03\xF1", 2));
+    QByteArray largeBuffer;
+    QTRY_VERIFY((largeBuffer += largeClient.readAll()).endsWith(closeFrame));
+    QTRY_COMPARE(gateway.connectionCount(), 0);
+}
 
-    QTcpSocket* testSocket = new QTcpSocket();
-    testSocket->connectToHost("localhost", 5478);
+void ServerTest::testLocalSocketRelaysMessage() {
+#ifdef Q_OS_UNIX
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString path = dir.filePath("messenger.sock");
 
-    if (testServer.waitForNewConnection(1000)) {
-        QTcpSocket* serverSocket = testServer.nextPendingConnection();
+    Server server;
+    QVERIFY(server.openLocal(path));
+
+    LocalTransport transport;
+    std::unique_ptr<QTcpSocket> client1(transport.connectTo(path, 0, nullptr));
+    std::unique_ptr<QTcpSocket> client2(transport.connectTo(path, 0, nullptr));
+    QCOMPARE(client1->state(), QAbstractSocket::ConnectedState);
+    QCOMPARE(client2->state(), QAbstractSocket::ConnectedState);
+    QTRY_COMPARE(server.m_buffers.size(), 2);
+
+    QJsonObject auth1;
+    auth1["type"] = "auth";
+    auth1["clientName"] = "bot";
+    auth1["interlocutorName"] = "client2";
+    simulateClientMessage(client1.get(), auth1);
+
+    QJsonObject auth2;
+    auth2["type"] = "auth";
+    auth2["clientName"] = "client2";
+    auth2["interlocutorName"] = "bot";
+    simulateClientMessage(client2.get(), auth2);
+    QTRY_VERIFY(server.m_clients.contains("bot") && server.m_clients.contains("client2"));
 
-        server.m_clients["testClient"] = {serverSocket, "", true};
-        server.m_socketToName[serverSocket] = "testClient";
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["id"] = 1;
+    messageObj["text"] = "Over a Unix socket";
+    simulateClientMessage(client1.get(), messageObj);
+
+    QByteArray received;
+    QTRY_VERIFY((received += client2->readAll()).contains("Over a Unix socket"));
+
+    client1->disconnectFromHost();
+    QTRY_VERIFY(server.m_clients["bot"].detachedAt > 0);
+#else
+    QSKIP("Unix domain sockets are not available on this platform");
+#endif
+}
 
-        server.sendToClient("testClient", "Test message");
+void ServerTest::testLocalListenerKeepsSuccessorSocket() {
+#ifdef Q_OS_UNIX
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString path = dir.filePath("messenger.sock");
+
+    LocalListener previous;
+    QVERIFY(previous.listen(path));
+
+    // The successor of a hand-over takes the path over; the old process closing must not remove it.
+    LocalListener successor;
+    QVERIFY(successor.listen(path));
+    previous.close();
+    QVERIFY(QFile::exists(path));
+
+    successor.close();
+    QVERIFY(!QFile::exists(path));
+#else
+    QSKIP("Unix domain sockets are not available on this platform");
+#endif
+}
 
-        QVERIFY(serverSocket->bytesToWrite() > 0);
+void ServerTest::testMessageBatchFansOut() {
+    Server server;
 
-        delete serverSocket;
-    }
+    QTcpSocket* botSocket = new QTcpSocket();
+    QTcpSocket* aliceSocket = new QTcpSocket();
+    QTcpSocket* bobSocket = new QTcpSocket();
 
-    delete testSocket;
-    testServer.close();
-    server.close();
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "bot";
+    authObj["interlocutorName"] = "alice";
+    server.processAuth(botSocket, authObj);
+    authObj["clientName"] = "alice";
+    authObj["interlocutorName"] = "bot";
+    server.processAuth(aliceSocket, authObj);
+    authObj["clientName"] = "bob";
+    authObj["interlocutorName"] = "dave";
+    server.processAuth(bobSocket, authObj);
+    QVERIFY(server.m_clients.contains("bob"));
+
+    QJsonArray entries;
+    entries.append(QJsonObject{{"to", "alice"}, {"text", "Build passed"}});
+    entries.append(QJsonObject{{"to", "bob"}, {"text", "Build passed too"}});
+
+    QJsonObject batch;
+    batch["type"] = "message_batch";
+    batch["id"] = 1;
+    batch["messages"] = entries;
+    server.processClientMessage(botSocket, QJsonDocument(batch).toJson(QJsonDocument::Compact));
+
+    QCOMPARE(server.m_clients["alice"].unacked.size(), 1);
+    QCOMPARE(server.m_clients["alice"].unacked.first().frame["text"].toString(), QString("Build passed"));
+    QCOMPARE(server.m_clients["alice"].unacked.first().peer, QString("bot"));
+    QCOMPARE(server.m_clients["bob"].unacked.size(), 1);
+    QCOMPARE(server.m_clients["bob"].unacked.first().frame["sender"].toString(), QString("bot"));
+    QCOMPARE(server.m_clients["bot"].lastClientMessageId, quint64(1));
+
+    // A retransmitted batch is dropped as a whole.
+    server.processMessageBatch(botSocket, batch);
+    QCOMPARE(server.m_clients["alice"].unacked.size(), 1);
+    QCOMPARE(server.m_clients["bob"].unacked.size(), 1);
+
+    delete botSocket;
+    delete aliceSocket;
+    delete bobSocket;
 }
 
-void ServerTest::testSendToClientNotFound() {
+void ServerTest::testMessageBatchReportsRejections() {
     Server server;
 
-    server.sendToClient("nonExistentClient", "Test message");
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    server.acceptConnection(pipe.second);
 
-    QVERIFY(true);
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "bot";
+    authObj["interlocutorName"] = "alice";
+    simulateClientMessage(pipe.first, authObj);
+
+    QJsonArray entries;
+    entries.append(QJsonObject{{"to", "carol"}, {"text", "Nobody home"}});
+    entries.append(QJsonObject{{"to", "bot"}, {"text", "Talking to myself"}});
+
+    QJsonObject batch;
+    batch["type"] = "message_batch";
+    batch["id"] = 1;
+    batch["messages"] = entries;
+    simulateClientMessage(pipe.first, batch);
+
+    QByteArray received;
+    QTRY_VERIFY((received += pipe.first->readAll()).contains("batch_rejected"));
+    QTRY_VERIFY((received += pipe.first->readAll()).contains("\"ack\""));
+    QVERIFY(received.contains("Recipient is offline"));
+    QVERIFY(received.contains("Cannot send a message to yourself"));
+
+    QJsonArray tooMany;
+    for (int i = 0; i <= Server::kMaxBatchEntries; ++i) {
+        tooMany.append(QJsonObject{{"to", "alice"}, {"text", "spam"}});
+    }
+    batch["id"] = 2;
+    batch["messages"] = tooMany;
+    simulateClientMessage(pipe.first, batch);
+    QTRY_VERIFY((received += pipe.first->readAll()).contains("at most"));
+
+    delete pipe.first;
 }
 
-void ServerTest::testCompleteCommunicationFlow() {
+void ServerTest::testConversationMessageWithoutPairing() {
     Server server;
-    QVERIFY(server.open("5479"));
 
-    server.close();
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    server.acceptConnection(pipe.second);
+    QTcpSocket* carolSocket = new QTcpSocket();
+
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "alice";
+    authObj["interlocutorName"] = "bob";
+    simulateClientMessage(pipe.first, authObj);
+    QTRY_VERIFY(server.m_clients.contains("alice"));
+
+    authObj["clientName"] = "carol";
+    authObj["interlocutorName"] = "dave";
+    server.processAuth(carolSocket, authObj);
+
+    // Carol is paired with someone else, yet gets alice's message in a conversation of its own.
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["id"] = 1;
+    messageObj["to"] = "carol";
+    messageObj["text"] = "Side conversation";
+    simulateClientMessage(pipe.first, messageObj);
+    QTRY_COMPARE(server.m_clients["carol"].unacked.size(), 1);
+    QCOMPARE(server.m_clients["carol"].unacked.first().peer, QString("alice"));
+    QCOMPARE(server.m_clients["carol"].interlocutor, QString("dave"));
+    QCOMPARE(server.m_clients["alice"].interlocutor, QString("bob"));
+
+    messageObj["id"] = 2;
+    messageObj["to"] = "erin";
+    simulateClientMessage(pipe.first, messageObj);
+
+    QByteArray received;
+    QTRY_VERIFY((received += pipe.first->readAll()).contains("\"conversation\":\"erin\""));
+
+    delete pipe.first;
+    delete carolSocket;
+}
+
+void ServerTest::testServerConfigOverrides() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    QFile file(dir.filePath("server.json"));
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write(R"({"port": 6000, "listenAddress": "127.0.0.1", "maxFrameSize": 4096, "typingIntervalMs": 500})");
+    file.close();
+
+    ServerConfig config;
+    QString error;
+    QVERIFY2(config.load(file.fileName(), error), qPrintable(error));
+    QCOMPARE(config.port, QString("6000"));
+    QCOMPARE(config.hostAddress(), QHostAddress(QHostAddress::LocalHost));
+    QCOMPARE(config.maxFrameSize, quint32(4096));
+    QCOMPARE(config.maxBatchEntries, Server::kMaxBatchEntries);
+
+    // The command line wins over the file.
+    QVERIFY(config.set("maxFrameSize=8192", error));
+    QCOMPARE(config.maxFrameSize, quint32(8192));
+
+    // A bad value rejects the whole update, and so does a misspelt knob.
+    QVERIFY(!config.merge(QJsonObject{{"maxBatchEntries", 10}, {"maxFrameSize", -1}}, error));
+    QVERIFY(error.contains("maxFrameSize"));
+    QCOMPARE(config.maxBatchEntries, Server::kMaxBatchEntries);
+    QVERIFY(!config.set("maxFrameSise=1", error));
+    QVERIFY(!config.set("maxFrameSize=2097152", error));
+    QCOMPARE(config.maxFrameSize, quint32(8192));
+    QVERIFY(!config.set("listenAddress=nowhere", error));
+
+    Server server;
+    server.applyConfig(config);
+    QCOMPARE(server.m_maxFrameSize, quint32(8192));
+    QCOMPARE(server.m_typingIntervalMs, qint64(500));
+    QCOMPARE(server.m_socketHighWater, Server::kSocketHighWater);
+}
+
+void ServerTest::testAdminChannelRequiresToken() {
+    Server server;
+    AdminChannel admin(&server, "secret");
+
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    admin.acceptConnection(pipe.second);
+    QCOMPARE(admin.connectionCount(), 1);
+
+    QJsonObject command;
+    command["type"] = "list_sessions";
+    simulateClientMessage(pipe.first, command);
+
+    QByteArray received;
+    QTRY_VERIFY((received += pipe.first->readAll()).contains("\"auth_error\""));
+    QTRY_COMPARE(admin.connectionCount(), 0);
+    QVERIFY(!received.contains("\"sessions\""));
+
+    delete pipe.first;
+}
+
+void ServerTest::testAdminChannelPagesSessions() {
+    Server server;
+    AdminChannel admin(&server, "secret");
+
+    QList<QTcpSocket*> clientSockets;
+    for (int i = 0; i < 5; ++i) {
+        QTcpSocket* socket = new QTcpSocket();
+        server.m_clients[QString("user%1").arg(i)] = {socket, "", true};
+        server.m_socketToName[socket] = QString("user%1").arg(i);
+        clientSockets.append(socket);
+    }
+
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    admin.acceptConnection(pipe.second);
+
+    QList<QJsonObject> responses;
+    quint32 expectedSize = 0;
+    auto readResponses = [&]() {
+        QByteArray frame;
+        while (FrameReader::readFrame(pipe.first, expectedSize, FrameReader::kDefaultMaxFrameSize, frame) == FrameReader::Complete) {
+            responses.append(QJsonDocument::fromJson(frame).object());
+        }
+        return responses.size();
+    };
+
+    QJsonObject command;
+    command["type"] = "admin_auth";
+    command["token"] = "secret";
+    simulateClientMessage(pipe.first, command);
+    QTRY_COMPARE(readResponses(), 1);
+    QCOMPARE(responses[0]["type"].toString(), QString("auth_success"));
+
+    // Five sessions in pages of two, each page on its own pass through the event loop.
+    command = QJsonObject();
+    command["type"] = "list_sessions";
+    command["id"] = 7;
+    command["pageSize"] = 2;
+    simulateClientMessage(pipe.first, command);
+
+    QTRY_COMPARE(readResponses(), 4);
+    QStringList listed;
+    for (int i = 1; i < 4; ++i) {
+        QCOMPARE(responses[i]["type"].toString(), QString("sessions"));
+        QCOMPARE(responses[i]["id"].toInt(), 7);
+        QCOMPARE(responses[i]["total"].toInt(), 5);
+        QCOMPARE(responses[i]["done"].toBool(), i == 3);
+        for (const QJsonValue& entry : responses[i]["entries"].toArray()) {
+            listed.append(entry.toObject()["name"].toString());
+        }
+    }
+    listed.sort();
+    QCOMPARE(listed, QStringList({"user0", "user1", "user2", "user3", "user4"}));
+
+    command = QJsonObject();
+    command["type"] = "disconnect";
+    command["name"] = "user0";
+    simulateClientMessage(pipe.first, command);
+    QTRY_COMPARE(readResponses(), 5);
+    QCOMPARE(responses[4]["type"].toString(), QString("disconnected"));
+    QVERIFY(responses[4]["found"].toBool());
+    QVERIFY(!server.m_clients.contains("user0"));
+
+    command = QJsonObject();
+    command["type"] = "frobnicate";
+    simulateClientMessage(pipe.first, command);
+    QTRY_COMPARE(readResponses(), 6);
+    QCOMPARE(responses[5]["type"].toString(), QString("error"));
+
+    delete pipe.first;
+    qDeleteAll(clientSockets);
+}
+
+void ServerTest::testTypingCoalescedPerPair() {
+    Server server;
+    // Flushed by hand below, so the timer must not get there first.
+    server.m_typingTimer.setInterval(60 * 60 * 1000);
+
+    QPair<PipeSocket*, PipeSocket*> alicePipe = PipeSocket::createPair();
+    QPair<PipeSocket*, PipeSocket*> bobPipe = PipeSocket::createPair();
+    server.acceptConnection(alicePipe.second);
+    server.acceptConnection(bobPipe.second);
+
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "alice";
+    authObj["interlocutorName"] = "bob";
+    simulateClientMessage(alicePipe.first, authObj);
+    authObj["clientName"] = "bob";
+    authObj["interlocutorName"] = "alice";
+    simulateClientMessage(bobPipe.first, authObj);
+    QTRY_VERIFY(server.m_clients.contains("alice") && server.m_clients.contains("bob"));
+
+    const QPair<QString, QString> pair("alice", "bob");
+    QJsonObject typingObj;
+    typingObj["type"] = "typing";
+    for (int i = 0; i < 10; ++i) {
+        simulateClientMessage(alicePipe.first, typingObj);
+    }
+    QTRY_VERIFY(server.m_typing.value(pair).pending);
+    QVERIFY(server.m_typingTimer.isActive());
+
+    // Ten events, one frame.
+    QByteArray received;
+    server.flushTyping();
+    QTRY_COMPARE((received += bobPipe.first->readAll()).count("\"type\":\"typing\""), 1);
+    QVERIFY(received.contains("\"sender\":\"alice\""));
+
+    // More typing within the interval waits for it to pass.
+    simulateClientMessage(alicePipe.first, typingObj);
+    QTRY_VERIFY(server.m_typing.value(pair).pending);
+    server.flushTyping();
+    QVERIFY(server.m_typing.value(pair).pending);
+
+    server.m_typing[pair].lastForwarded -= Server::kTypingIntervalMs;
+    server.flushTyping();
+    QTRY_COMPARE((received += bobPipe.first->readAll()).count("\"type\":\"typing\""), 2);
+
+    // A message supersedes typing that has not gone out yet.
+    simulateClientMessage(alicePipe.first, typingObj);
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["id"] = 1;
+    messageObj["text"] = "Done";
+    simulateClientMessage(alicePipe.first, messageObj);
+    QTRY_COMPARE(server.m_clients["bob"].unacked.size(), 1);
+    QVERIFY(!server.m_typing.value(pair).pending);
+
+    // Idle pairs are dropped once their interval is over.
+    server.m_typing[pair].lastForwarded -= Server::kTypingIntervalMs;
+    server.flushTyping();
+    QVERIFY(server.m_typing.isEmpty());
+    QVERIFY(!server.m_typingTimer.isActive());
+
+    delete alicePipe.first;
+    delete bobPipe.first;
+}
+
+void ServerTest::testControlFramesOvertakeBulk() {
+    Server server;
+    QVERIFY(server.open("5489"));
+
+    QTcpSocket client;
+    client.connectToHost("localhost", 5489);
+    QVERIFY(client.waitForConnected(1000));
+    QTRY_COMPARE(server.m_buffers.size(), 1);
+    QTcpSocket* socket = server.m_buffers.constBegin().key();
+
+    // Far more bulk than the socket is given at once, so most of it has to wait.
+    const int bulkFrames = 32;
+    QByteArray chunk(FileChunk::kHeaderSize + FileChunk::kMaxDataSize, 'x');
+    FileChunk::writeHeader(chunk.data(), 1, 0);
+    for (int i = 0; i < bulkFrames; ++i) {
+        server.sendRawFrame(socket, chunk, Server::BulkLane);
+    }
+    QVERIFY(server.m_outbound.contains(socket));
+    QVERIFY(socket->bytesToWrite() >= Server::kSocketHighWater);
+
+    QJsonObject notice;
+    notice["type"] = "interlocutor_disconnected";
+    server.sendMessageWithSize(socket, notice);
+    QJsonObject message;
+    message["type"] = "message";
+    message["text"] = "Hello";
+    server.sendMessageWithSize(socket, message);
+
+    QList<QByteArray> frames;
+    quint32 expectedSize = 0;
+    auto readFrames = [&]() {
+        QByteArray frame;
+        while (FrameReader::readFrame(&client, expectedSize, FrameReader::kDefaultMaxFrameSize, frame) == FrameReader::Complete) {
+            frames.append(frame);
+        }
+        return frames.size();
+    };
+    QTRY_COMPARE_WITH_TIMEOUT(readFrames(), bulkFrames + 2, 10000);
+
+    // Only the bulk frame already part-written goes first; the rest wait behind both.
+    QVERIFY(FileChunk::isChunk(frames[0]));
+    QCOMPARE(QJsonDocument::fromJson(frames[1]).object()["type"].toString(), QString("interlocutor_disconnected"));
+    QCOMPARE(QJsonDocument::fromJson(frames[2]).object()["text"].toString(), QString("Hello"));
+    for (qsizetype i = 3; i < frames.size(); ++i) {
+        QCOMPARE(frames[i], chunk);
+    }
+    QVERIFY(server.m_outbound.isEmpty());
+}
+
+void ServerTest::testControlFramesOvertakeBulkOverWebSocket() {
+    Server server;
+    WebSocketGateway gateway(&server);
+    QVERIFY(gateway.listen(QHostAddress::LocalHost, 5493));
+
+    QTcpSocket webClient;
+    QVERIFY(openWebSocket(webClient, 5493));
+    QTRY_COMPARE(server.m_buffers.size(), 1);
+    QTcpSocket* socket = server.m_buffers.constBegin().key();
+
+    // The pipe counts what the gateway has not taken yet, so bulk waits in the lanes as over TCP.
+    const int bulkFrames = 32;
+    QByteArray chunk(FileChunk::kHeaderSize + FileChunk::kMaxDataSize, 'x');
+    FileChunk::writeHeader(chunk.data(), 1, 0);
+    for (int i = 0; i < bulkFrames; ++i) {
+        server.sendRawFrame(socket, chunk, Server::BulkLane);
+    }
+    QVERIFY(server.m_outbound.contains(socket));
+    QVERIFY(socket->bytesToWrite() >= Server::kSocketHighWater);
+
+    QJsonObject notice;
+    notice["type"] = "interlocutor_disconnected";
+    server.sendMessageWithSize(socket, notice);
+    QJsonObject message;
+    message["type"] = "message";
+    message["text"] = "Hello";
+    server.sendMessageWithSize(socket, message);
+
+    QList<QByteArray> frames;
+    QByteArray buffer;
+    auto readFrames = [&]() {
+        buffer += webClient.readAll();
+        qsizetype offset = 0;
+        WebSocketGateway::WireFrame frame;
+        while (WebSocketGateway::decodeFrame(buffer, offset, frame, FrameReader::kDefaultMaxFrameSize, false) ==
+               WebSocketGateway::Decoded) {
+            frames.append(frame.payload);
+        }
+        buffer.remove(0, offset);
+        return frames.size();
+    };
+    QTRY_COMPARE_WITH_TIMEOUT(readFrames(), bulkFrames + 2, 10000);
+
+    QVERIFY(FileChunk::isChunk(frames[0]));
+    QCOMPARE(QJsonDocument::fromJson(frames[1]).object()["type"].toString(), QString("interlocutor_disconnected"));
+    QCOMPARE(QJsonDocument::fromJson(frames[2]).object()["text"].toString(), QString("Hello"));
+    for (qsizetype i = 3; i < frames.size(); ++i) {
+        QCOMPARE(frames[i], chunk);
+    }
+    QVERIFY(server.m_outbound.isEmpty());
+}
+
+void ServerTest::testFileChunksRelayedUnchanged() {
+    Server server;
+
+    QPair<PipeSocket*, PipeSocket*> alicePipe = PipeSocket::createPair();
+    QPair<PipeSocket*, PipeSocket*> bobPipe = PipeSocket::createPair();
+    server.acceptConnection(alicePipe.second);
+    server.acceptConnection(bobPipe.second);
+
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "alice";
+    authObj["interlocutorName"] = "bob";
+    simulateClientMessage(alicePipe.first, authObj);
+    authObj["clientName"] = "bob";
+    authObj["interlocutorName"] = "alice";
+    simulateClientMessage(bobPipe.first, authObj);
+    QTRY_VERIFY(server.m_clients.contains("alice") && server.m_clients.contains("bob"));
+
+    QJsonObject offer;
+    offer["type"] = "file_offer";
+    offer["ref"] = 1;
+    offer["name"] = "../notes.txt";
+    offer["size"] = 10;
+    simulateClientMessage(alicePipe.first, offer);
+    QTRY_COMPARE(server.m_transfers.size(), 1);
+
+    quint64 transferId = server.m_transfers.constBegin().key();
+    QCOMPARE(server.m_transfers[transferId].name, QString("notes.txt"));
+
+    // The sender is only told to start once the receiver takes the file.
+    QByteArray senderReceived;
+    QTest::qWait(50);
+    QVERIFY(!(senderReceived += alicePipe.first->readAll()).contains("file_ready"));
+    QJsonObject accept;
+    accept["type"] = "file_accept";
+    accept["transferId"] = static_cast<qint64>(transferId);
+    simulateClientMessage(bobPipe.first, accept);
+    QTRY_VERIFY((senderReceived += alicePipe.first->readAll()).contains("file_ready"));
+    QVERIFY(senderReceived.contains("\"ref\":1"));
+
+    QByteArray payload(FileChunk::kHeaderSize, Qt::Uninitialized);
+    FileChunk::writeHeader(payload.data(), transferId, 0);
+    payload += "0123456789";
+    QByteArray frame(sizeof(quint32), Qt::Uninitialized);
+    qToBigEndian(static_cast<quint32>(payload.size()), frame.data());
+    frame += payload;
+    alicePipe.first->write(frame);
+
+    QByteArray received;
+    QTRY_VERIFY((received += bobPipe.first->readAll()).contains(frame));
+    QVERIFY(received.contains("\"name\":\"notes.txt\""));
+    QCOMPARE(server.m_transfers[transferId].relayed, qint64(10));
+
+    QJsonObject ack;
+    ack["type"] = "file_ack";
+    ack["transferId"] = static_cast<qint64>(transferId);
+    ack["offset"] = 10;
+    simulateClientMessage(bobPipe.first, ack);
+    QTRY_VERIFY(server.m_transfers.isEmpty());
+
+    QTRY_VERIFY((senderReceived += alicePipe.first->readAll()).contains("file_progress"));
+
+    delete alicePipe.first;
+    delete bobPipe.first;
+}
+
+void ServerTest::testFileChunkOutsideWindowFailsTransfer() {
+    Server server;
+
+    QTcpSocket* aliceSocket = new QTcpSocket();
+    QTcpSocket* bobSocket = new QTcpSocket();
+
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "alice";
+    authObj["interlocutorName"] = "bob";
+    server.processAuth(aliceSocket, authObj);
+    authObj["clientName"] = "bob";
+    authObj["interlocutorName"] = "alice";
+    server.processAuth(bobSocket, authObj);
+
+    QJsonObject offer;
+    offer["type"] = "file_offer";
+    offer["ref"] = 1;
+    offer["name"] = "video.mp4";
+    offer["size"] = 4 * FileChunk::kWindowBytes;
+    server.processFileOffer(aliceSocket, offer);
+    QCOMPARE(server.m_transfers.size(), 1);
+    quint64 transferId = server.m_transfers.constBegin().key();
+
+    QJsonObject accept;
+    accept["type"] = "file_accept";
+    accept["transferId"] = static_cast<qint64>(transferId);
+    server.processFileAccept(bobSocket, accept);
+    QVERIFY(server.m_transfers[transferId].accepted);
+
+    QByteArray chunk(FileChunk::kHeaderSize + 16, 'x');
+
+    // Only the sender may stream into a transfer.
+    FileChunk::writeHeader(chunk.data(), transferId, 0);
+    server.processClientMessage(bobSocket, chunk);
+    QCOMPARE(server.m_transfers.size(), 1);
+
+    // Nothing has been confirmed yet, so this chunk lies past the window.
+    FileChunk::writeHeader(chunk.data(), transferId, FileChunk::kWindowBytes);
+    server.processClientMessage(aliceSocket, chunk);
+    QVERIFY(server.m_transfers.isEmpty());
+
+    delete aliceSocket;
+    delete bobSocket;
+}
+
+void ServerTest::testFileTransferRewoundOnResume() {
+    Server server;
+
+    QTcpSocket* aliceSocket = new QTcpSocket();
+    QTcpSocket* bobSocket = new QTcpSocket();
+
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "alice";
+    authObj["interlocutorName"] = "bob";
+    server.processAuth(aliceSocket, authObj);
+    authObj["clientName"] = "bob";
+    authObj["interlocutorName"] = "alice";
+    server.processAuth(bobSocket, authObj);
+
+    Server::FileTransfer transfer;
+    transfer.sender = "alice";
+    transfer.receiver = "bob";
+    transfer.name = "archive.zip";
+    transfer.accepted = true;
+    transfer.size = 1000;
+    transfer.relayed = 600;
+    transfer.acked = 250;
+    server.m_transfers.insert(1, transfer);
+
+    // The receiver came back: everything past its last confirmed offset is sent again.
+    server.detachClient("bob");
+    QJsonObject resumeObj;
+    resumeObj["type"] = "resume";
+    resumeObj["sessionToken"] = server.issueSessionToken("bob", "alice");
+    server.processResume(bobSocket, resumeObj);
+    QCOMPARE(server.m_transfers[1].relayed, qint64(250));
+
+    // A chunk sent before the rewind no longer lines up and is dropped.
+    QByteArray chunk(FileChunk::kHeaderSize + 16, 'x');
+    FileChunk::writeHeader(chunk.data(), 1, 600);
+    server.processClientMessage(aliceSocket, chunk);
+    QCOMPARE(server.m_transfers[1].relayed, qint64(250));
+
+    // Logging out ends the transfer for both sides.
+    server.processLogout(aliceSocket);
+    QVERIFY(server.m_transfers.isEmpty());
+
+    delete aliceSocket;
+    delete bobSocket;
+}
+
+// Тесты для обработки аутентификации
+void ServerTest::testProcessAuth() {
+    Server server;
+    server.open("5466");
+
+    QTcpSocket* mockSocket = new QTcpSocket();
+
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "testClient";
+    authObj["interlocutorName"] = "testInterlocutor";
+
+    server.processAuth(mockSocket, authObj);
+
+    QVERIFY(server.m_clients.contains("testClient"));
+    QCOMPARE(server.m_clients["testClient"].interlocutor, QString("testInterlocutor"));
+    QVERIFY(server.m_clients["testClient"].isAuthenticated);
+
+    delete mockSocket;
+    server.close();
+}
+
+void ServerTest::testProcessAuthError() {
+    Server server;
+    server.open("5467");
+
+    QTcpSocket* existingSocket = new QTcpSocket();
+    server.m_clients["existingClient"] = {existingSocket, "someone", true};
+    server.m_socketToName[existingSocket] = "existingClient";
+
+    QTcpSocket* mockSocket = new QTcpSocket();
+
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "existingClient";
+    authObj["interlocutorName"] = "testInterlocutor";
+
+    server.processAuth(mockSocket, authObj);
+
+    QVERIFY(!mockSocket->isOpen());
+
+    delete existingSocket;
+    delete mockSocket;
+    server.close();
+}
+
+void ServerTest::testProcessMessage() {
+    Server server;
+    server.open("5468");
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+
+    server.m_clients["client1"] = {client1Socket, "client2", true};
+    server.m_socketToName[client1Socket] = "client1";
+    server.m_clients["client2"] = {client2Socket, "client1", true};
+    server.m_socketToName[client2Socket] = "client2";
+
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["text"] = "Hello, World!";
+
+    server.processMessage(client1Socket, messageObj);
+
+    delete client1Socket;
+    delete client2Socket;
+    server.close();
+}
+
+void ServerTest::testProcessMessageUnauthorized() {
+    Server server;
+    server.open("5469");
+
+    QTcpSocket* mockSocket = new QTcpSocket();
+
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["text"] = "Test message";
+
+    server.processMessage(mockSocket, messageObj);
+
+    delete mockSocket;
+    server.close();
+}
+
+void ServerTest::testProcessMessageNoInterlocutor() {
+    Server server;
+    server.open("5470");
+
+    QTcpSocket* clientSocket = new QTcpSocket();
+    server.m_clients["client1"] = {clientSocket, "", true};
+    server.m_socketToName[clientSocket] = "client1";
+
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["text"] = "Test message";
+
+    server.processMessage(clientSocket, messageObj);
+
+    delete clientSocket;
+    server.close();
+}
+
+void ServerTest::testProcessChangeInterlocutor() {
+    Server server;
+    server.open("5471");
+
+    QTcpSocket* clientSocket = new QTcpSocket();
+    server.m_clients["client1"] = {clientSocket, "oldInterlocutor", true};
+    server.m_socketToName[clientSocket] = "client1";
+
+    QJsonObject changeObj;
+    changeObj["type"] = "change_interlocutor";
+    changeObj["newInterlocutor"] = "newInterlocutor";
+
+    server.processChangeInterlocutor(clientSocket, changeObj);
+
+    QCOMPARE(server.m_clients["client1"].interlocutor, QString("newInterlocutor"));
+
+    delete clientSocket;
+    server.close();
+}
+
+void ServerTest::testProcessChangeInterlocutorUnauthorized() {
+    Server server;
+    server.open("5472");
+
+    QTcpSocket* mockSocket = new QTcpSocket();
+
+    QJsonObject changeObj;
+    changeObj["type"] = "change_interlocutor";
+    changeObj["newInterlocutor"] = "newInterlocutor";
+
+    server.processChangeInterlocutor(mockSocket, changeObj);
+
+    delete mockSocket;
+    server.close();
+}
+
+void ServerTest::testSendMessageWithSize() {
+    Server server;
+    server.open("5473");
+
+    QTcpServer testServer;
+    testServer.listen(QHostAddress::LocalHost, 5474);
+
+    QTcpSocket* testSocket = new QTcpSocket();
+    testSocket->connectToHost("localhost", 5474);
+
+    if (testServer.waitForNewConnection(1000)) {
+        QTcpSocket* serverSocket = testServer.nextPendingConnection();
+
+        QJsonObject testObj;
+        testObj["type"] = "test";
+        testObj["message"] = "Test message";
+
+        server.sendMessageWithSize(serverSocket, testObj);
+
+        QVERIFY(serverSocket->bytesToWrite() > 0);
+
+        delete serverSocket;
+    }
+
+    delete testSocket;
+    testServer.close();
+    server.close();
+}
+
+void ServerTest::testSendMessageWithSizeDisconnected() {
+    Server server;
+
+    QTcpSocket* disconnectedSocket = new QTcpSocket();
+
+    QJsonObject testObj;
+    testObj["type"] = "test";
+    testObj["message"] = "Test message";
+
+    server.sendMessageWithSize(disconnectedSocket, testObj);
+
+
+    delete disconnectedSocket;
+}
+
+void ServerTest::testRemoveClient() {
+    Server server;
+    server.open("5475");
+
+    QTcpSocket* clientSocket = new QTcpSocket();
+    server.m_clients["client1"] = {clientSocket, "", true};
+    server.m_socketToName[clientSocket] = "client1";
+
+    server.removeClient("client1");
+
+    QVERIFY(!server.m_clients.contains("client1"));
+    QVERIFY(!server.m_socketToName.contains(clientSocket));
+
+    delete clientSocket;
+    server.close();
+}
+
+void ServerTest::testRemoveClientWithInterlocutor() {
+    Server server;
+    server.open("5476");
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+
+    server.m_clients["client1"] = {client1Socket, "client2", true};
+    server.m_socketToName[client1Socket] = "client1";
+    server.m_clients["client2"] = {client2Socket, "client1", true};
+    server.m_socketToName[client2Socket] = "client2";
+
+    server.removeClient("client1");
+
+    QVERIFY(!server.m_clients.contains("client1"));
+    QVERIFY(server.m_clients.contains("client2"));
+    QVERIFY(server.m_clients["client2"].interlocutor.isEmpty());
+
+    delete client1Socket;
+    delete client2Socket;
+    server.close();
+}
+
+void ServerTest::testSendToClient() {
+    Server server;
+    server.open("5477");
+
+    QTcpServer testServer;
+    testServer.listen(QHostAddress::LocalHost, 5478);
+
+    QTcpSocket* testSocket = new QTcpSocket();
+    testSocket->connectToHost("localhost", 5478);
+
+    if (testServer.waitForNewConnection(1000)) {
+        QTcpSocket* serverSocket = testServer.nextPendingConnection();
+
+        server.m_clients["testClient"] = {serverSocket, "", true};
+        server.m_socketToName[serverSocket] = "testClient";
+
+        server.sendToClient("testClient", "Test message");
+
+        QVERIFY(serverSocket->bytesToWrite() > 0);
+
+        delete serverSocket;
+    }
+
+    delete testSocket;
+    testServer.close();
+    server.close();
+}
+
+void ServerTest::testSendToClientNotFound() {
+    Server server;
+
+    server.sendToClient("nonExistentClient", "Test message");
+
+    QVERIFY(true);
+}
+
+void ServerTest::testSessionTokenRoundTrip() {
+    Server server;
+    QString clientName;
+    QString interlocutorName;
+
+    QString token = server.issueSessionToken("client1", "client2");
+
+    QVERIFY(server.verifySessionToken(token, clientName, interlocutorName));
+    QCOMPARE(clientName, QString("client1"));
+    QCOMPARE(interlocutorName, QString("client2"));
+}
+
+void ServerTest::testSessionTokenTampered() {
+    Server server;
+    Server otherServer;
+    QString clientName;
+    QString interlocutorName;
+
+    QString token = server.issueSessionToken("client1", "client2");
+    QString tampered = token;
+    tampered[0] = tampered[0] == 'A' ? 'B' : 'A';
+
+    QVERIFY(!server.verifySessionToken(tampered, clientName, interlocutorName));
+    QVERIFY(!server.verifySessionToken("garbage", clientName, interlocutorName));
+    QVERIFY(!otherServer.verifySessionToken(token, clientName, interlocutorName));
+}
+
+void ServerTest::testLogoutRevokesSessionToken() {
+    Server server;
+    QString clientName;
+    QString interlocutorName;
+
+    QTcpSocket* clientSocket = new QTcpSocket();
+    server.registerClient(clientSocket, "client1", "client2", "auth_success");
+    QString token = server.issueSessionToken("client1", "client2");
+    QString otherToken = server.issueSessionToken("client3", "client2");
+
+    server.processLogout(clientSocket);
+    QVERIFY(!server.m_clients.contains("client1"));
+    QVERIFY(!server.verifySessionToken(token, clientName, interlocutorName));
+    QVERIFY(server.verifySessionToken(otherToken, clientName, interlocutorName));
+
+    // A resume with the old token is refused instead of rebuilding the session.
+    QTcpSocket* resumedSocket = new QTcpSocket();
+    QJsonObject resumeObj;
+    resumeObj["type"] = "resume";
+    resumeObj["sessionToken"] = token;
+    server.processResume(resumedSocket, resumeObj);
+    QVERIFY(!server.m_clients.contains("client1"));
+
+    // Signing in again gives a token of the new generation.
+    QVERIFY(server.verifySessionToken(server.issueSessionToken("client1", "client2"), clientName, interlocutorName));
+
+    // Revocations made on another node apply here too, and survive a hand-over.
+    ClusterRouter* router = new ClusterRouter("a", &server);
+    server.setRouter(router);
+    QJsonObject revoke;
+    revoke["op"] = "revoke";
+    revoke["name"] = "client3";
+    revoke["generation"] = 1;
+    router->handlePeerMessage(nullptr, revoke);
+    QVERIFY(!server.verifySessionToken(otherToken, clientName, interlocutorName));
+
+    Server successor;
+    successor.m_sessionKey = server.m_sessionKey;
+    successor.loadTokenState(server.saveTokenState());
+    QVERIFY(!successor.verifySessionToken(token, clientName, interlocutorName));
+    QVERIFY(!successor.verifySessionToken(otherToken, clientName, interlocutorName));
+
+    delete resumedSocket;
+    delete clientSocket;
+}
+
+void ServerTest::testDetachKeepsSession() {
+    Server server;
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+
+    server.m_clients["client1"] = {client1Socket, "client2", true};
+    server.m_socketToName[client1Socket] = "client1";
+    server.m_clients["client2"] = {client2Socket, "client1", true};
+    server.m_socketToName[client2Socket] = "client2";
+
+    server.detachClient("client1");
+
+    QVERIFY(server.m_clients.contains("client1"));
+    QVERIFY(server.m_clients["client1"].socket == nullptr);
+    QVERIFY(server.m_clients["client1"].detachedAt > 0);
+    QVERIFY(!server.m_socketToName.contains(client1Socket));
+    QCOMPARE(server.m_clients["client2"].interlocutor, QString("client1"));
+
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["text"] = "While you were away";
+    server.processMessage(client2Socket, messageObj);
+
+    QCOMPARE(server.m_clients["client1"].unacked.size(), 1);
+    QCOMPARE(server.m_clients["client1"].unacked.first().seq, quint64(1));
+
+    delete client1Socket;
+    delete client2Socket;
+}
+
+void ServerTest::testResumeReplaysUnacked() {
+    Server server;
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+
+    server.m_clients["client1"] = {client1Socket, "client2", true};
+    QString sessionToken = server.issueSessionToken("client1", "client2");
+    server.m_socketToName[client1Socket] = "client1";
+    server.m_clients["client2"] = {client2Socket, "client1", true};
+    server.m_socketToName[client2Socket] = "client2";
+
+    for (int i = 0; i < 3; ++i) {
+        QJsonObject messageObj;
+        messageObj["type"] = "message";
+        messageObj["text"] = QString("Message %1").arg(i);
+        server.processMessage(client2Socket, messageObj);
+    }
+
+    server.detachClient("client1");
+
+    QTcpSocket* resumedSocket = new QTcpSocket();
+    QJsonObject lastSeq;
+    lastSeq["client2"] = 1;
+
+    QJsonObject resumeObj;
+    resumeObj["type"] = "resume";
+    resumeObj["sessionToken"] = sessionToken;
+    resumeObj["lastSeq"] = lastSeq;
+
+    server.processResume(resumedSocket, resumeObj);
+
+    QCOMPARE(server.m_socketToName.value(resumedSocket), QString("client1"));
+    QVERIFY(server.m_clients["client1"].socket == resumedSocket);
+    QCOMPARE(server.m_clients["client1"].detachedAt, qint64(0));
+    QCOMPARE(server.m_clients["client1"].unacked.size(), 2);
+    QCOMPARE(server.m_clients["client1"].unacked.first().seq, quint64(2));
+
+    delete resumedSocket;
+    delete client1Socket;
+    delete client2Socket;
+}
+
+void ServerTest::testResumeReportsDroppedMessages() {
+    Server server;
+    server.m_maxUnackedPerClient = 3;
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+    server.m_clients["client1"] = {client1Socket, "client2", true};
+    server.m_socketToName[client1Socket] = "client1";
+    server.m_clients["client2"] = {client2Socket, "client1", true};
+    server.m_socketToName[client2Socket] = "client2";
+    QString sessionToken = server.issueSessionToken("client1", "client2");
+    server.detachClient("client1");
+
+    // Five messages for a list of three: the first two cannot be kept.
+    for (int i = 1; i <= 5; ++i) {
+        QJsonObject messageObj;
+        messageObj["type"] = "message";
+        messageObj["text"] = QString("Message %1").arg(i);
+        server.processMessage(client2Socket, messageObj);
+    }
+    QCOMPARE(server.m_clients["client1"].unacked.size(), 3);
+
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    server.acceptConnection(pipe.second);
+    QJsonObject resumeObj;
+    resumeObj["type"] = "resume";
+    resumeObj["sessionToken"] = sessionToken;
+    resumeObj["lastSeq"] = QJsonObject{{"client2", 1}};
+    simulateClientMessage(pipe.first, resumeObj);
+
+    // The client hears of the one it missed before the replay picks up after it.
+    QList<QJsonObject> frames;
+    quint32 expectedSize = 0;
+    auto readFrames = [&]() {
+        QByteArray frame;
+        while (FrameReader::readFrame(pipe.first, expectedSize, FrameReader::kDefaultMaxFrameSize, frame) == FrameReader::Complete) {
+            QJsonObject obj = QJsonDocument::fromJson(frame).object();
+            if (obj["type"].toString() == "gap" || obj["type"].toString() == "message") {
+                frames.append(obj);
+            }
+        }
+        return frames.size();
+    };
+    QTRY_COMPARE(readFrames(), 4);
+    QCOMPARE(frames[0]["type"].toString(), QString("gap"));
+    QCOMPARE(frames[0]["peer"].toString(), QString("client2"));
+    QCOMPARE(frames[0]["upTo"].toInteger(), qint64(2));
+    for (int i = 1; i < 4; ++i) {
+        QCOMPARE(frames[i]["seq"].toInteger(), qint64(i + 2));
+    }
+
+    // Once the client acknowledges past the gap, a later resume does not report it again.
+    QJsonObject received;
+    received["type"] = "received";
+    received["acks"] = QJsonObject{{"client2", 5}};
+    simulateClientMessage(pipe.first, received);
+    QTRY_VERIFY(server.m_clients["client1"].droppedUpTo.isEmpty());
+
+    delete pipe.first;
+    delete client1Socket;
+    delete client2Socket;
+}
+
+void ServerTest::testRebuiltSessionKeepsDedupMark() {
+    Server server;
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+    server.m_clients["client1"] = {client1Socket, "client2", true};
+    server.m_socketToName[client1Socket] = "client1";
+    server.m_clients["client2"] = {client2Socket, "client1", true};
+    server.m_socketToName[client2Socket] = "client2";
+    QString sessionToken = server.issueSessionToken("client1", "client2");
+
+    for (int id = 1; id <= 3; ++id) {
+        QJsonObject messageObj;
+        messageObj["type"] = "message";
+        messageObj["id"] = id;
+        messageObj["text"] = QString("Message %1").arg(id);
+        server.processMessage(client1Socket, messageObj);
+    }
+
+    // The session outlives its resume window and is gone by the time the client comes back.
+    server.detachClient("client1");
+    server.m_clients["client1"].detachedAt = 1;
+    server.expireDetachedSessions();
+    server.removeClient("client2");
+    QVERIFY(!server.m_clients.contains("client1"));
+
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    server.acceptConnection(pipe.second);
+    QJsonObject resumeObj;
+    resumeObj["type"] = "resume";
+    resumeObj["sessionToken"] = sessionToken;
+    simulateClientMessage(pipe.first, resumeObj);
+
+    QByteArray received;
+    QTRY_VERIFY((received += pipe.first->readAll()).contains("\"resume_success\""));
+    QVERIFY(received.contains("\"ackedUpTo\":3"));
+    QCOMPARE(server.m_clients["client1"].lastClientMessageId, quint64(3));
+    QVERIFY(server.m_retiredSessions.isEmpty());
+
+    // What the old session already relayed is not relayed again.
+    QVERIFY(server.isDuplicateMessage(pipe.second, "client1", 3));
+    QVERIFY(!server.isDuplicateMessage(pipe.second, "client1", 4));
+
+    delete pipe.first;
+    delete client1Socket;
+    delete client2Socket;
+}
+
+void ServerTest::testReceivedTrimsUnacked() {
+    Server server;
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+
+    server.m_clients["client1"] = {client1Socket, "client2", true};
+    server.m_socketToName[client1Socket] = "client1";
+    server.m_clients["client2"] = {client2Socket, "client1", true};
+    server.m_socketToName[client2Socket] = "client2";
+
+    for (int i = 0; i < 3; ++i) {
+        QJsonObject messageObj;
+        messageObj["type"] = "message";
+        messageObj["text"] = QString("Message %1").arg(i);
+        server.processMessage(client2Socket, messageObj);
+    }
+
+    QJsonObject acks;
+    acks["client2"] = 3;
+    QJsonObject receivedObj;
+    receivedObj["type"] = "received";
+    receivedObj["acks"] = acks;
+
+    server.processReceived(client1Socket, receivedObj);
+
+    QVERIFY(server.m_clients["client1"].unacked.isEmpty());
+
+    delete client1Socket;
+    delete client2Socket;
+}
+
+void ServerTest::testMessageAcksCoalesced() {
+    Server server;
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+
+    server.m_clients["client1"] = {client1Socket, "client2", true};
+    server.m_socketToName[client1Socket] = "client1";
+    server.m_clients["client2"] = {client2Socket, "client1", true};
+    server.m_socketToName[client2Socket] = "client2";
+
+    for (int id = 1; id <= 5; ++id) {
+        QJsonObject messageObj;
+        messageObj["type"] = "message";
+        messageObj["id"] = id;
+        messageObj["text"] = QString("Message %1").arg(id);
+        server.processMessage(client1Socket, messageObj);
+    }
+
+    QCOMPARE(server.m_pendingAcks.size(), 1);
+    QCOMPARE(server.m_clients["client1"].lastClientMessageId, quint64(5));
+
+    server.flushAcks();
+    QVERIFY(server.m_pendingAcks.isEmpty());
+
+    delete client1Socket;
+    delete client2Socket;
+}
+
+void ServerTest::testDuplicateMessageIgnored() {
+    Server server;
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+
+    server.m_clients["client1"] = {client1Socket, "client2", true};
+    server.m_socketToName[client1Socket] = "client1";
+    server.m_clients["client2"] = {client2Socket, "client1", true};
+    server.m_socketToName[client2Socket] = "client2";
+
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["id"] = 1;
+    messageObj["text"] = "Retransmitted";
+
+    server.processMessage(client1Socket, messageObj);
+    server.processMessage(client1Socket, messageObj);
+
+    QCOMPARE(server.m_clients["client2"].unacked.size(), 1);
+    QCOMPARE(server.m_clients["client2"].unacked.first().messageId, quint64(1));
+
+    delete client1Socket;
+    delete client2Socket;
+}
+
+void ServerTest::testReceivedSendsDeliveredReceipt() {
+    Server server;
+
+    QTcpServer testServer;
+    testServer.listen(QHostAddress::LocalHost, 5480);
+
+    QTcpSocket* testSocket = new QTcpSocket();
+    testSocket->connectToHost("localhost", 5480);
+
+    if (testServer.waitForNewConnection(1000)) {
+        QTcpSocket* senderSocket = testServer.nextPendingConnection();
+        QTcpSocket* recipientSocket = new QTcpSocket();
+
+        server.m_clients["client1"] = {senderSocket, "client2", true};
+        server.m_socketToName[senderSocket] = "client1";
+        server.m_clients["client2"] = {recipientSocket, "client1", true};
+        server.m_socketToName[recipientSocket] = "client2";
+
+        QJsonObject messageObj;
+        messageObj["type"] = "message";
+        messageObj["id"] = 7;
+        messageObj["text"] = "Hello";
+        server.processMessage(senderSocket, messageObj);
+
+        qint64 pendingBefore = senderSocket->bytesToWrite();
+
+        QJsonObject acks;
+        acks["client1"] = 1;
+        QJsonObject receivedObj;
+        receivedObj["type"] = "received";
+        receivedObj["acks"] = acks;
+        server.processReceived(recipientSocket, receivedObj);
+
+        QVERIFY(server.m_clients["client2"].unacked.isEmpty());
+        QVERIFY(senderSocket->bytesToWrite() > pendingBefore);
+
+        delete recipientSocket;
+        delete senderSocket;
+    }
+
+    delete testSocket;
+    testServer.close();
+}
+
+void ServerTest::testClusterSharesDirectory() {
+    QTemporaryDir clusterDir;
+    QVERIFY(clusterDir.isValid());
+
+    Server serverA;
+    Server serverB;
+    ClusterRouter* routerA = new ClusterRouter("a", &serverA);
+    ClusterRouter* routerB = new ClusterRouter("b", &serverB);
+    QVERIFY(routerA->listenLocal(clusterDir.path()));
+    QVERIFY(routerB->listenLocal(clusterDir.path()));
+    serverA.setRouter(routerA);
+    serverB.setRouter(routerB);
+
+    QTRY_COMPARE(routerA->peerCount(), 1);
+    QTRY_COMPARE(routerB->peerCount(), 1);
+
+    QTcpSocket* socket = new QTcpSocket();
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "client1";
+    authObj["interlocutorName"] = "client2";
+    serverA.processAuth(socket, authObj);
+
+    QTRY_VERIFY(routerB->isRemote("client1"));
+    QCOMPARE(routerB->remoteInterlocutor("client1"), QString("client2"));
+
+    QString error;
+    QVERIFY(!serverB.validateConnection("client1", "client3", error));
+    QVERIFY(error.contains("already taken"));
+
+    serverA.removeClient("client1");
+    QTRY_VERIFY(!routerB->isRemote("client1"));
+
+    delete socket;
+}
+
+void ServerTest::testClusterRefusesOpenDirectory() {
+#ifdef Q_OS_UNIX
+    QTemporaryDir clusterDir;
+    QVERIFY(clusterDir.isValid());
+
+    ClusterRouter router("a");
+    QVERIFY(QFile::setPermissions(clusterDir.path(), QFile::permissions(clusterDir.path()) | QFileDevice::WriteOther | QFileDevice::ExeOther));
+    QVERIFY(!router.listenLocal(clusterDir.path()));
+
+    // A directory the router creates itself is closed to others from the start.
+    QString created = clusterDir.filePath("nodes");
+    QVERIFY(router.listenLocal(created));
+    QVERIFY(!(QFile::permissions(created) & (QFileDevice::ReadGroup | QFileDevice::ReadOther)));
+#else
+    QSKIP("Directory ownership is only checked on Unix");
+#endif
+}
+
+void ServerTest::testClusterRoutesMessageToSibling() {
+    QTemporaryDir clusterDir;
+    QVERIFY(clusterDir.isValid());
+
+    Server serverA;
+    Server serverB;
+    ClusterRouter* routerA = new ClusterRouter("a", &serverA);
+    ClusterRouter* routerB = new ClusterRouter("b", &serverB);
+    QVERIFY(routerA->listenLocal(clusterDir.path()));
+    QVERIFY(routerB->listenLocal(clusterDir.path()));
+    serverA.setRouter(routerA);
+    serverB.setRouter(routerB);
+
+    QTRY_COMPARE(routerA->peerCount(), 1);
+    QTRY_COMPARE(routerB->peerCount(), 1);
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+
+    QJsonObject auth1;
+    auth1["type"] = "auth";
+    auth1["clientName"] = "client1";
+    auth1["interlocutorName"] = "client2";
+    serverA.processAuth(client1Socket, auth1);
+    QTRY_VERIFY(routerB->isRemote("client1"));
+
+    QJsonObject auth2;
+    auth2["type"] = "auth";
+    auth2["clientName"] = "client2";
+    auth2["interlocutorName"] = "client1";
+    serverB.processAuth(client2Socket, auth2);
+    QVERIFY(serverB.m_clients.contains("client2"));
+    QTRY_VERIFY(routerA->isRemote("client2"));
+
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["id"] = 1;
+    messageObj["text"] = "Across processes";
+    serverA.processMessage(client1Socket, messageObj);
+
+    QTRY_COMPARE(serverB.m_clients["client2"].unacked.size(), 1);
+    QCOMPARE(serverB.m_clients["client2"].unacked.first().frame["text"].toString(), QString("Across processes"));
+    QCOMPARE(serverB.m_clients["client2"].unacked.first().peer, QString("client1"));
+
+    delete client1Socket;
+    delete client2Socket;
+}
+
+void ServerTest::testClusterHandsOverDetachedSession() {
+    QTemporaryDir clusterDir;
+    QVERIFY(clusterDir.isValid());
+
+    Server serverA;
+    Server serverB;
+    serverB.m_sessionKey = serverA.m_sessionKey;
+    ClusterRouter* routerA = new ClusterRouter("a", &serverA);
+    ClusterRouter* routerB = new ClusterRouter("b", &serverB);
+    QVERIFY(routerA->listenLocal(clusterDir.path()));
+    QVERIFY(routerB->listenLocal(clusterDir.path()));
+    serverA.setRouter(routerA);
+    serverB.setRouter(routerB);
+
+    QTRY_COMPARE(routerA->peerCount(), 1);
+    QTRY_COMPARE(routerB->peerCount(), 1);
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+
+    QJsonObject auth1;
+    auth1["type"] = "auth";
+    auth1["clientName"] = "client1";
+    auth1["interlocutorName"] = "client2";
+    serverA.processAuth(client1Socket, auth1);
+    QTRY_VERIFY(routerB->isRemote("client1"));
+
+    QJsonObject auth2;
+    auth2["type"] = "auth";
+    auth2["clientName"] = "client2";
+    auth2["interlocutorName"] = "client1";
+    serverB.processAuth(client2Socket, auth2);
+    QTRY_VERIFY(routerA->isRemote("client2"));
+
+    QJsonObject helloObj;
+    helloObj["type"] = "message";
+    helloObj["id"] = 1;
+    helloObj["text"] = "Hello";
+    serverA.processMessage(client1Socket, helloObj);
+
+    for (int id = 1; id <= 3; ++id) {
+        QJsonObject messageObj;
+        messageObj["type"] = "message";
+        messageObj["id"] = id;
+        messageObj["text"] = QString("Reply %1").arg(id);
+        serverB.processMessage(client2Socket, messageObj);
+    }
+    QTRY_COMPARE(serverA.m_clients["client1"].unacked.size(), 3);
+
+    // client1 saw the first reply, then its connection to node a dropped and it came back on node b.
+    QString sessionToken = serverA.issueSessionToken("client1", "client2");
+    serverA.detachClient("client1");
+
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    serverB.acceptConnection(pipe.second);
+    QJsonObject resumeObj;
+    resumeObj["type"] = "resume";
+    resumeObj["sessionToken"] = sessionToken;
+    resumeObj["lastSeq"] = QJsonObject{{"client2", 1}};
+    simulateClientMessage(pipe.first, resumeObj);
+
+    QByteArray received;
+    QTRY_VERIFY((received += pipe.first->readAll()).contains("Reply 3"));
+    QVERIFY(received.contains("\"resume_success\""));
+    QVERIFY(received.contains("\"ackedUpTo\":1"));
+    QVERIFY(received.contains("Reply 2"));
+    QVERIFY(!received.contains("Reply 1"));
+
+    QVERIFY(!serverA.m_clients.contains("client1"));
+    QVERIFY(serverB.m_pendingResumes.isEmpty());
+    QCOMPARE(serverB.m_clients["client1"].lastClientMessageId, quint64(1));
+    QCOMPARE(serverB.m_clients["client1"].unacked.size(), 2);
+    QCOMPARE(serverB.m_clients["client1"].unacked.first().seq, quint64(2));
+    QCOMPARE(serverB.m_clients["client1"].unacked.last().seq, quint64(3));
+
+    delete pipe.first;
+    delete client1Socket;
+    delete client2Socket;
+}
+
+void ServerTest::testClusterNodesOverTcp() {
+    Server serverA;
+    Server serverB;
+    ClusterRouter* routerA = new ClusterRouter("a", &serverA);
+    ClusterRouter* routerB = new ClusterRouter("b", &serverB);
+    routerA->setNodeKey("cluster secret");
+    routerB->setNodeKey("cluster secret");
+    QVERIFY(routerA->listenNodes(QHostAddress::LocalHost, 5484));
+    routerB->connectToNode("127.0.0.1", 5484);
+    serverA.setRouter(routerA);
+    serverB.setRouter(routerB);
+
+    QTRY_COMPARE(routerA->peerCount(), 1);
+    QTRY_COMPARE(routerB->peerCount(), 1);
+
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+
+    QJsonObject auth1;
+    auth1["type"] = "auth";
+    auth1["clientName"] = "client1";
+    auth1["interlocutorName"] = "client2";
+    serverA.processAuth(client1Socket, auth1);
+
+    QJsonObject auth2;
+    auth2["type"] = "auth";
+    auth2["clientName"] = "client2";
+    auth2["interlocutorName"] = "client1";
+    serverB.processAuth(client2Socket, auth2);
+
+    QTRY_VERIFY(routerA->isRemote("client2"));
+    QTRY_VERIFY(routerB->isRemote("client1"));
+
+    for (int i = 1; i <= 3; ++i) {
+        QJsonObject messageObj;
+        messageObj["type"] = "message";
+        messageObj["id"] = i;
+        messageObj["text"] = QString("Across nodes %1").arg(i);
+        serverA.processMessage(client1Socket, messageObj);
+    }
+
+    QTRY_COMPARE(serverB.m_clients["client2"].unacked.size(), 3);
+    QCOMPARE(serverB.m_clients["client2"].unacked.last().frame["text"].toString(), QString("Across nodes 3"));
+
+    delete client1Socket;
+    delete client2Socket;
+}
+
+void ServerTest::testClusterRejectsUnauthenticatedNode() {
+    Server serverA;
+    ClusterRouter* routerA = new ClusterRouter("a", &serverA);
+    QVERIFY(!routerA->listenNodes(QHostAddress::LocalHost, 5490));
+    routerA->setNodeKey("cluster secret");
+    QVERIFY(routerA->listenNodes(QHostAddress::LocalHost, 5490));
+    serverA.setRouter(routerA);
+
+    // A stranger skips the handshake and claims a user straight away.
+    QTcpSocket stranger;
+    stranger.connectToHost("127.0.0.1", 5490);
+    QVERIFY(stranger.waitForConnected(3000));
+
+    QJsonObject user;
+    user["name"] = "mallory";
+    user["interlocutor"] = "client1";
+    QJsonObject hello;
+    hello["op"] = "hello";
+    hello["node"] = "x";
+    hello["users"] = QJsonArray{user};
+    QByteArray json = QJsonDocument(hello).toJson(QJsonDocument::Compact);
+    QByteArray frame(4, '\0');
+    qToBigEndian(static_cast<quint32>(json.size()), frame.data());
+    stranger.write(frame + json);
+
+    QTRY_COMPARE(stranger.state(), QAbstractSocket::UnconnectedState);
+    QVERIFY(!routerA->isRemote("mallory"));
+    QCOMPARE(routerA->peerCount(), 0);
+
+    // A node with the wrong key gets as far as the handshake and no further.
+    Server serverB;
+    ClusterRouter* routerB = new ClusterRouter("b", &serverB);
+    routerB->setNodeKey("guessed");
+    serverB.setRouter(routerB);
+    QTcpSocket* client2Socket = new QTcpSocket();
+    QJsonObject auth2;
+    auth2["type"] = "auth";
+    auth2["clientName"] = "client2";
+    auth2["interlocutorName"] = "client1";
+    serverB.processAuth(client2Socket, auth2);
+    routerB->connectToNode("127.0.0.1", 5490);
+
+    QTest::qWait(500);
+    QCOMPARE(routerA->peerCount(), 0);
+    QCOMPARE(routerB->peerCount(), 0);
+    QVERIFY(!routerA->isRemote("client2"));
+
+    delete client2Socket;
+}
+
+void ServerTest::testClusterIgnoresStaleWithdrawal() {
+    ClusterRouter router("a");
+    QBuffer predecessor;
+    QBuffer successor;
+
+    QJsonObject user;
+    user["op"] = "user";
+    user["name"] = "client1";
+    user["interlocutor"] = "client2";
+    router.handlePeerMessage(&predecessor, user);
+    router.handlePeerMessage(&successor, user);
+
+    // The drained process lets the session expire after it resumed on its successor.
+    QJsonObject gone;
+    gone["op"] = "user_gone";
+    gone["name"] = "client1";
+    router.handlePeerMessage(&predecessor, gone);
+    QVERIFY(router.isRemote("client1"));
+
+    router.handlePeerMessage(&successor, gone);
+    QVERIFY(!router.isRemote("client1"));
+}
+
+void ServerTest::testClusterBatchUnpacked() {
+    ClusterRouter router("a");
+
+    QJsonObject user1;
+    user1["op"] = "user";
+    user1["name"] = "client1";
+    user1["interlocutor"] = "client2";
+
+    QJsonObject user2;
+    user2["op"] = "user";
+    user2["name"] = "client2";
+    user2["interlocutor"] = "client1";
+
+    QJsonObject batch;
+    batch["op"] = "batch";
+    batch["items"] = QJsonArray{user1, user2};
+    router.handlePeerMessage(nullptr, batch);
+
+    QVERIFY(router.isRemote("client1"));
+    QVERIFY(router.isRemote("client2"));
+    QCOMPARE(router.remoteInterlocutor("client2"), QString("client1"));
+}
+
+void ServerTest::testCompleteCommunicationFlow() {
+    Server server;
+    QVERIFY(server.open("5479"));
+
+    server.close();
+}
+
+void ServerTest::testAdminDisconnectRevokesSession() {
+    Server server;
+    AdminChannel admin(&server, "secret");
+    QString clientName;
+    QString interlocutorName;
+
+    QTcpSocket* clientSocket = new QTcpSocket();
+    server.registerClient(clientSocket, "client1", "client2", "auth_success");
+    QString token = server.issueSessionToken("client1", "client2");
+
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    admin.acceptConnection(pipe.second);
+
+    QJsonObject command;
+    command["type"] = "admin_auth";
+    command["token"] = "secret";
+    simulateClientMessage(pipe.first, command);
+
+    command = QJsonObject();
+    command["type"] = "disconnect";
+    command["name"] = "client1";
+    simulateClientMessage(pipe.first, command);
+
+    QByteArray received;
+    QTRY_VERIFY((received += pipe.first->readAll()).contains("\"disconnected\""));
+    QVERIFY(!server.m_clients.contains("client1"));
+    QVERIFY(!server.verifySessionToken(token, clientName, interlocutorName));
+
+    // The disconnected client cannot come straight back with its token.
+    QTcpSocket* resumedSocket = new QTcpSocket();
+    QJsonObject resumeObj;
+    resumeObj["type"] = "resume";
+    resumeObj["sessionToken"] = token;
+    server.processResume(resumedSocket, resumeObj);
+    QVERIFY(!server.m_clients.contains("client1"));
+
+    delete resumedSocket;
+    delete clientSocket;
+    delete pipe.first;
+}
+
+void ServerTest::testPasswordAndTokenProviders() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    QFile file(dir.filePath("passwords"));
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write("# users\n\n");
+    file.write(PasswordFileProvider::entryFor("alice", "wonderland", PasswordFileProvider::kMinIterations).toUtf8() + "\n");
+    file.close();
+
+    PasswordFileProvider passwords;
+    QString error;
+    QVERIFY2(passwords.load(file.fileName(), error), qPrintable(error));
+    QCOMPARE(passwords.size(), qsizetype(1));
+    QVERIFY(passwords.verify("alice", "wonderland"));
+    QVERIFY(!passwords.verify("alice", "Wonderland"));
+    QVERIFY(!passwords.verify("bob", "wonderland"));
+
+    // A malformed line fails the load and leaves the loaded entries alone.
+    QVERIFY(file.open(QIODevice::Append));
+    file.write("bob:md5$1$x$y\n");
+    file.close();
+    QVERIFY(!passwords.load(file.fileName(), error));
+    QVERIFY(error.contains(":4:"));
+    QVERIFY(passwords.verify("alice", "wonderland"));
+
+    TokenProvider tokens("key");
+    qint64 later = QDateTime::currentSecsSinceEpoch() + 60;
+    QString token = TokenProvider::issue("key", "alice", later);
+    QVERIFY(tokens.verify("alice", token));
+    QVERIFY(!tokens.verify("bob", token));
+    QVERIFY(!TokenProvider("other").verify("alice", token));
+    QVERIFY(!tokens.verify("alice", TokenProvider::issue("key", "alice", later - 120)));
+    QVERIFY(!tokens.verify("alice", QString::number(later + 3600) + token.mid(token.indexOf('.'))));
+}
+
+void ServerTest::testResumeRechecksCredentials() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    // bob's line stays the same across reloads.
+    const QByteArray bobEntry = PasswordFileProvider::entryFor("bob", "builder", PasswordFileProvider::kMinIterations).toUtf8();
+    auto writePasswords = [&](const QString& alicePassword) {
+        QFile file(dir.filePath("passwords"));
+        auto passwords = std::make_shared<PasswordFileProvider>();
+        if (!file.open(QIODevice::WriteOnly)) return passwords;
+        file.write(PasswordFileProvider::entryFor("alice", alicePassword, PasswordFileProvider::kMinIterations).toUtf8() + "\n");
+        file.write(bobEntry + "\n");
+        file.close();
+
+        QString error;
+        passwords->load(file.fileName(), error);
+        return passwords;
+    };
+
+    Authenticator authenticator;
+    authenticator.setProviders({writePasswords("wonderland")});
+    Server server;
+    server.setAuthenticator(&authenticator);
+
+    QString clientName;
+    QString interlocutorName;
+    QString aliceToken = server.issueSessionToken("alice", "bob");
+    QString bobToken = server.issueSessionToken("bob", "alice");
+    QVERIFY(server.verifySessionToken(aliceToken, clientName, interlocutorName));
+
+    // A reload that changes alice's password ends her sessions; bob's entry is the same, so his go on.
+    authenticator.setProviders({writePasswords("looking-glass")});
+    QVERIFY(!server.verifySessionToken(aliceToken, clientName, interlocutorName));
+    QVERIFY(server.verifySessionToken(bobToken, clientName, interlocutorName));
+
+    QTcpSocket* resumedSocket = new QTcpSocket();
+    QJsonObject resumeObj;
+    resumeObj["type"] = "resume";
+    resumeObj["sessionToken"] = aliceToken;
+    server.processResume(resumedSocket, resumeObj);
+    QVERIFY(!server.m_clients.contains("alice"));
+
+    // Removing the password file altogether takes bob's sessions with it.
+    authenticator.setProviders({std::make_shared<TokenProvider>("key")});
+    QVERIFY(!server.verifySessionToken(bobToken, clientName, interlocutorName));
+
+    delete resumedSocket;
+}
+
+namespace {
+class CountingProvider : public AuthProvider {
+public:
+    bool verify(const QString&, const QString& credential) const override {
+        calls.ref();
+        QThread::msleep(20);
+        return credential == "secret";
+    }
+    mutable QAtomicInt calls;
+};
+}
+
+void ServerTest::testAuthenticatorCachesVerifiedCredentials() {
+    auto provider = std::make_shared<CountingProvider>();
+    Authenticator authenticator;
+    authenticator.setProviders({provider});
+
+    // Overlapping checks of one pair share a run, and the result is cached for the next ones.
+    int accepted = 0;
+    for (int i = 0; i < 5; ++i) {
+        authenticator.verify("alice", "secret", "10.0.0.1", [&](bool ok) { accepted += ok; });
+    }
+    QTRY_COMPARE(accepted, 5);
+    QCOMPARE(provider->calls.loadRelaxed(), 1);
+
+    bool answered = false;
+    authenticator.verify("alice", "secret", "10.0.0.1", [&](bool ok) { answered = ok; });
+    QVERIFY(!answered);
+    QTRY_VERIFY(answered);
+    QCOMPARE(authenticator.cacheHits(), qint64(1));
+    QCOMPARE(provider->calls.loadRelaxed(), 1);
+
+    // A failure is remembered for a while, so repeating a guess costs no hashing.
+    int rejected = 0;
+    authenticator.verify("alice", "guess", "10.0.0.1", [&](bool ok) { rejected += !ok; });
+    QTRY_COMPARE(rejected, 1);
+    authenticator.verify("alice", "guess", "10.0.0.1", [&](bool ok) { rejected += !ok; });
+    QTRY_COMPARE(rejected, 2);
+    QCOMPARE(provider->calls.loadRelaxed(), 2);
+
+    // Once the name has failed often enough from an address, new guesses from there are refused
+    // unchecked for the rest of the window, while the cached sign-in still goes through.
+    for (int i = 1; i < Authenticator::kMaxFailuresPerName; ++i) {
+        authenticator.verify("alice", QString("guess%1").arg(i), "10.0.0.1", [&](bool ok) { rejected += !ok; });
+        QTRY_COMPARE(rejected, 2 + i);
+    }
+    const int calls = 1 + Authenticator::kMaxFailuresPerName;
+    QCOMPARE(provider->calls.loadRelaxed(), calls);
+    authenticator.verify("alice", "one more", "10.0.0.1", [&](bool ok) { rejected += !ok; });
+    QTRY_COMPARE(rejected, 2 + Authenticator::kMaxFailuresPerName);
+    QCOMPARE(provider->calls.loadRelaxed(), calls);
+
+    answered = false;
+    authenticator.verify("alice", "secret", "10.0.0.1", [&](bool ok) { answered = ok; });
+    QTRY_VERIFY(answered);
+    QCOMPARE(authenticator.cacheHits(), qint64(2));
+
+    // The lockout is per address, so guessing from one does not shut the name out everywhere.
+    authenticator.verify("alice", "elsewhere", "10.0.0.2", [&](bool ok) { rejected += !ok; });
+    QTRY_COMPARE(rejected, 3 + Authenticator::kMaxFailuresPerName);
+    QCOMPARE(provider->calls.loadRelaxed(), calls + 1);
+
+    // A message right behind the auth request waits for the answer instead of being dropped.
+    Server server;
+    server.setAuthenticator(&authenticator);
+
+    QPair<PipeSocket*, PipeSocket*> pipe = PipeSocket::createPair();
+    server.acceptConnection(pipe.second);
+
+    QJsonObject auth;
+    auth["type"] = "auth";
+    auth["clientName"] = "alice";
+    auth["interlocutorName"] = "bob";
+    auth["password"] = "secret";
+    simulateClientMessage(pipe.first, auth);
+
+    QJsonObject message;
+    message["type"] = "message";
+    message["text"] = "hello";
+    message["id"] = 1;
+    simulateClientMessage(pipe.first, message);
+
+    QTRY_COMPARE(server.m_socketToName.value(pipe.second), QString("alice"));
+    QTRY_COMPARE(server.m_clients["alice"].lastClientMessageId, quint64(1));
+    QCOMPARE(authenticator.cacheHits(), qint64(3));
+    QCOMPARE(provider->calls.loadRelaxed(), calls + 1);
+
+    QPair<PipeSocket*, PipeSocket*> intruder = PipeSocket::createPair();
+    server.acceptConnection(intruder.second);
+    auth["clientName"] = "mallory";
+    auth["password"] = "guess";
+    simulateClientMessage(intruder.first, auth);
+
+    QByteArray received;
+    QTRY_VERIFY((received += intruder.first->readAll()).contains("\"auth_error\""));
+    QVERIFY(!server.m_clients.contains("mallory"));
+
+    delete pipe.first;
+    delete intruder.first;
+
+    // With the pool backed up, a new check is refused at once instead of joining the queue.
+    Authenticator busy;
+    busy.setProviders({provider});
+    busy.setMaxThreads(1);
+    for (int i = 0; i < Authenticator::kMaxPendingChecks; ++i) {
+        busy.verify(QString("user%1").arg(i), "secret", "10.0.0.1", [](bool) {});
+    }
+    bool refused = false;
+    busy.verify("late", "secret", "10.0.0.1", [&](bool ok) { refused = !ok; });
+    QTRY_VERIFY(refused);
+    QCOMPARE(busy.refusals(), qint64(1));
+
+    // A full failure table forgets its oldest entries; later lockouts stay in force.
+    auto checks = std::make_shared<CountingProvider>();
+    Authenticator crowded;
+    crowded.setProviders({checks});
+    crowded.setMaxTrackedFailures(4);
+    int failed = 0;
+    auto lockOut = [&](const QString& name) {
+        for (int i = 0; i < Authenticator::kMaxFailuresPerName; ++i) {
+            int before = failed;
+            crowded.verify(name, QString("guess%1").arg(i), "10.0.0.3", [&](bool ok) { failed += !ok; });
+            QTRY_COMPARE(failed, before + 1);
+        }
+    };
+    lockOut("bob");
+    lockOut("carol");
+    for (const QString& name : {QString("dave"), QString("erin"), QString("frank")}) {
+        int before = failed;
+        crowded.verify(name, "guess", "10.0.0.3", [&](bool ok) { failed += !ok; });
+        QTRY_COMPARE(failed, before + 1);
+    }
+    int checked = checks->calls.loadRelaxed();
+    crowded.verify("carol", "another", "10.0.0.3", [&](bool ok) { failed += !ok; });
+    QTRY_COMPARE(crowded.refusals(), qint64(1));
+    QCOMPARE(checks->calls.loadRelaxed(), checked);
+    crowded.verify("bob", "another", "10.0.0.3", [&](bool ok) { failed += !ok; });
+    QTRY_COMPARE(checks->calls.loadRelaxed(), checked + 1);
+    QCOMPARE(crowded.refusals(), qint64(1));
+}
+
+void ServerTest::testEncryptedMessagesRelayedOpaque() {
+    Server server;
+    QPair<PipeSocket*, PipeSocket*> alicePipe = PipeSocket::createPair();
+    QPair<PipeSocket*, PipeSocket*> bobPipe = PipeSocket::createPair();
+    server.acceptConnection(alicePipe.second);
+    server.acceptConnection(bobPipe.second);
+
+    QJsonObject authObj;
+    authObj["type"] = "auth";
+    authObj["clientName"] = "alice";
+    authObj["interlocutorName"] = "bob";
+    simulateClientMessage(alicePipe.first, authObj);
+    authObj["clientName"] = "bob";
+    authObj["interlocutorName"] = "alice";
+    simulateClientMessage(bobPipe.first, authObj);
+    QTRY_VERIFY(server.m_clients.contains("alice") && server.m_clients.contains("bob"));
+
+    // The key goes out under the name the server knows the sender by, whatever the frame claims.
+    QJsonObject keyObj;
+    keyObj["type"] = "key_exchange";
+    keyObj["publicKey"] = "cHVibGljIGtleSBieXRlcw==";
+    keyObj["sender"] = "mallory";
+    simulateClientMessage(alicePipe.first, keyObj);
+
+    QJsonObject messageObj;
+    messageObj["type"] = "message";
+    messageObj["id"] = 1;
+    messageObj["text"] = "c2VhbGVkIGJ5dGVz";
+    messageObj["encrypted"] = true;
+    simulateClientMessage(alicePipe.first, messageObj);
+
+    QList<QJsonObject> frames;
+    quint32 expectedSize = 0;
+    auto readFrames = [&]() {
+        QByteArray frame;
+        while (FrameReader::readFrame(bobPipe.first, expectedSize, FrameReader::kDefaultMaxFrameSize, frame) == FrameReader::Complete) {
+            QJsonObject object = QJsonDocument::fromJson(frame).object();
+            if (object["type"].toString() != "auth_success") {
+                frames.append(object);
+            }
+        }
+        return frames.size();
+    };
+    QTRY_COMPARE(readFrames(), 2);
+
+    QCOMPARE(frames[0]["type"].toString(), QString("key_exchange"));
+    QCOMPARE(frames[0]["sender"].toString(), QString("alice"));
+    QCOMPARE(frames[0]["publicKey"], keyObj["publicKey"]);
+    QCOMPARE(frames[1]["type"].toString(), QString("message"));
+    QCOMPARE(frames[1]["text"], messageObj["text"]);
+    QVERIFY(frames[1]["encrypted"].toBool());
+
+    delete alicePipe.first;
+    delete bobPipe.first;
+}
+
+void ServerTest::testSequencerOrdersUnderConcurrency() {
+    constexpr int kThreads = 8;
+    constexpr int kConversations = 16;
+    constexpr int kMessagesPerThread = 4000;
+
+    // A conversation's numbering starts over once it goes idle, so the payload carries an order
+    // of its own, taken together with the ticket. Released orders must only ever go up, with no
+    // conversation released by two threads at once and nothing but the cancelled ones missing.
+    QMutex admitMutex[kConversations];
+    quint64 admitted[kConversations] = {};
+    QAtomicInt inRelease[kConversations] = {};
+    QAtomicInt overlaps;
+    QList<quint64> released[kConversations];
+    ConversationSequencer<int, quint64> sequencer([&](const int& conversation, quint64, quint64& order) {
+        if (!inRelease[conversation].testAndSetAcquire(0, 1)) {
+            overlaps.ref();
+            return;
+        }
+        released[conversation].append(order);
+        inRelease[conversation].storeRelease(0);
+    });
+
+    QAtomicInt cancelled;
+    QList<QThread*> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.append(QThread::create([&, t]() {
+            QRandomGenerator random(t + 1);
+            for (int i = 0; i < kMessagesPerThread; ++i) {
+                int conversation = random.bounded(kConversations);
+                admitMutex[conversation].lock();
+                quint64 ticket = sequencer.admit(conversation);
+                quint64 order = ++admitted[conversation];
+                admitMutex[conversation].unlock();
+
+                // Holds the ticket for a while, so other threads overtake it.
+                for (int spin = random.bounded(200); spin > 0; --spin) {
+                    QThread::yieldCurrentThread();
+                }
+                if (random.bounded(50) == 0) {
+                    cancelled.ref();
+                    sequencer.cancel(conversation, ticket);
+                } else {
+                    sequencer.complete(conversation, ticket, order);
+                }
+            }
+        }));
+        threads.last()->start();
+    }
+    for (QThread* thread : std::as_const(threads)) {
+        QVERIFY(thread->wait(60000));
+        delete thread;
+    }
+
+    QCOMPARE(overlaps.loadRelaxed(), 0);
+    QCOMPARE(sequencer.pendingCount(), qsizetype(0));
+    QCOMPARE(sequencer.conversationCount(), qsizetype(0));
+
+    qsizetype total = 0;
+    for (int conversation = 0; conversation < kConversations; ++conversation) {
+        const QList<quint64>& orders = released[conversation];
+        for (qsizetype i = 1; i < orders.size(); ++i) {
+            QVERIFY2(orders[i] > orders[i - 1], qPrintable(QString("conversation %1 out of order").arg(conversation)));
+        }
+        total += orders.size();
+    }
+    QCOMPARE(total + cancelled.loadRelaxed(), qsizetype(kThreads * kMessagesPerThread));
+}
+
+void ServerTest::testSequencerDeliversOnServerThread() {
+    Server server;
+    QTcpSocket* client1Socket = new QTcpSocket();
+    QTcpSocket* client2Socket = new QTcpSocket();
+    server.m_clients["client1"] = {client1Socket, "client2", true};
+    server.m_socketToName[client1Socket] = "client1";
+    server.m_clients["client2"] = {client2Socket, "client1", true};
+    server.m_socketToName[client2Socket] = "client2";
+    server.detachClient("client1");
+
+    // A message completed on a worker reaches the session only once the server's thread runs it.
+    Server::ConversationKey conversation = Server::conversationKey("client1", "client2");
+    QThread* worker = QThread::create([&]() {
+        quint64 ticket = server.m_sequencer.admit(conversation);
+        QJsonObject frame{{"type", "message"}, {"text", "first"}};
+        server.m_sequencer.complete(conversation, ticket, {"client1", "client2", frame, 0});
+    });
+    worker->start();
+    QVERIFY(worker->wait(5000));
+    delete worker;
+    QCOMPARE(server.m_clients["client1"].unacked.size(), 0);
+
+    // One released here meanwhile waits its turn instead of overtaking it.
+    server.relayInOrder("client1", "client2", QJsonObject{{"type", "message"}, {"text", "second"}});
+    QCOMPARE(server.m_clients["client1"].unacked.size(), 0);
+
+    QTRY_COMPARE(server.m_clients["client1"].unacked.size(), 2);
+    QCOMPARE(server.m_clients["client1"].unacked[0].frame["text"].toString(), QString("first"));
+    QCOMPARE(server.m_clients["client1"].unacked[1].frame["text"].toString(), QString("second"));
+
+    // With nothing queued, releases on the server's thread go straight through again.
+    server.relayInOrder("client1", "client2", QJsonObject{{"type", "message"}, {"text", "third"}});
+    QCOMPARE(server.m_clients["client1"].unacked.size(), 3);
+
+    delete client1Socket;
+    delete client2Socket;
 }
@@ -36,7 +36,79 @@ private slots:
     void testSendToClient();
     void testSendToClientNotFound();
 
+    void testSessionTokenRoundTrip();
+    void testSessionTokenTampered();
+    void testLogoutRevokesSessionToken();
+    void testDetachKeepsSession();
+    void testResumeReplaysUnacked();
+    void testResumeReportsDroppedMessages();
+    void testRebuiltSessionKeepsDedupMark();
+    void testReceivedTrimsUnacked();
+    void testMessageAcksCoalesced();
+    void testDuplicateMessageIgnored();
+    void testReceivedSendsDeliveredReceipt();
+
+    void testClusterSharesDirectory();
+    void testClusterRefusesOpenDirectory();
+    void testClusterRoutesMessageToSibling();
+    void testClusterHandsOverDetachedSession();
+    void testClusterNodesOverTcp();
+    void testClusterRejectsUnauthenticatedNode();
+    void testClusterIgnoresStaleWithdrawal();
+    void testClusterBatchUnpacked();
+
     void testOpenServer();
+    void testOpenReusePort();
+    void testDrainWithoutConnections();
+    void testDrainMigratesClients();
+    void testDrainClosesWebSocketGateway();
+    void testEnableTlsMissingFiles();
+    void testTlsHandshake();
+
+    void testFramePoolReusesBuffers();
+    void testFramePoolSkipsSharedBuffers();
+    void testDeliveryQueueRecycled();
+    void testMemoryReportIdleSessions();
+    void testLowFootprintReleasesIdleBuffers();
+
+    void testFrameReaderFragmented();
+    void testFrameReaderOversized();
+    void testOversizedFrameDropsConnection();
+
+    void testPipeRelaysMessage();
+    void testPipeDisconnectDetachesSession();
+
+    void testCaptureRecordsInboundFrames();
+    void testCaptureSampledOut();
+
+    void testWebSocketFrameCodec();
+    void testWebSocketRejectsPlainRequest();
+    void testWebSocketRelaysFrames();
+
+    void testServerConfigOverrides();
+    void testAdminChannelRequiresToken();
+    void testAdminChannelPagesSessions();
+    void testAdminDisconnectRevokesSession();
+    void testPasswordAndTokenProviders();
+    void testResumeRechecksCredentials();
+    void testAuthenticatorCachesVerifiedCredentials();
+    void testEncryptedMessagesRelayedOpaque();
+    void testSequencerOrdersUnderConcurrency();
+    void testSequencerDeliversOnServerThread();
+
+    void testLocalSocketRelaysMessage();
+    void testLocalListenerKeepsSuccessorSocket();
+
+    void testMessageBatchFansOut();
+    void testMessageBatchReportsRejections();
+    void testConversationMessageWithoutPairing();
+    void testTypingCoalescedPerPair();
+    void testControlFramesOvertakeBulk();
+    void testControlFramesOvertakeBulkOverWebSocket();
+
+    void testFileChunksRelayedUnchanged();
+    void testFileChunkOutsideWindowFailsTransfer();
+    void testFileTransferRewoundOnResume();
 
     void testCompleteCommunicationFlow();
 
@@ -45,4 +117,6 @@ private:
     std::unique_ptr<QTcpSocket> createMockSocket();
     QByteArray createMessageData(const QJsonObject& obj);
     void simulateClientMessage(QTcpSocket* socket, const QJsonObject& message);
+    bool openWebSocket(QTcpSocket& socket, quint16 port);
+    QJsonObject readWebSocketMessage(QTcpSocket& socket, QByteArray& buffer, quint8* opcode = nullptr);
 };